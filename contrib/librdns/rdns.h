@@ -134,6 +134,8 @@ struct rdns_reply {
 	const char *requested_name;
 	enum dns_rcode code;
 	bool authenticated;
+	/* TTL of negative reply from SOA record of authority section or -1 */
+	int32_t negative_ttl;
 };
 
 typedef void (*rdns_periodic_callback)(void *user_data);
@@ -342,6 +344,26 @@ struct rdns_request* rdns_make_request_full (
 		...
 		);
 
+/**
+ * Make a reply that is not associated with any network request (e.g. restored
+ * from a cache). `reply->request` is a new request object with refcount 1 that
+ * owns the reply, so it should be freed by `rdns_request_release`. Entries
+ * appended to the reply and their data must be allocated by `malloc`
+ * @param resolver resolver object
+ * @param name requested name
+ * @param type requested type
+ * @param rcode code of reply
+ * @return new reply or NULL
+ */
+struct rdns_reply* rdns_make_stub_reply (struct rdns_resolver *resolver,
+		const char *name, enum rdns_request_type type, enum dns_rcode rcode);
+
+/**
+ * Free reply entry and its data (allocated by `malloc`)
+ * @param entry
+ */
+void rdns_reply_entry_free (struct rdns_reply_entry *entry);
+
 /**
  * Get textual presentation of DNS error code
  */
@@ -120,11 +120,59 @@ rdns_make_reply (struct rdns_request *req, enum dns_rcode rcode)
 		rep->code = rcode;
 		req->reply = rep;
 		rep->authenticated = false;
+		rep->negative_ttl = -1;
 	}
 
 	return rep;
 }
 
+/*
+ * Extracts TTL of negative reply from SOA record in authority section as
+ * defined in RFC 2308: min(SOA TTL, SOA MINIMUM)
+ */
+static void
+rdns_parse_negative_ttl (uint8_t *in, uint8_t **pos, struct rdns_reply *rep,
+		int *remain, int nscount)
+{
+	struct rdns_reply_entry *elt;
+	struct rdns_resolver *resolver = rep->resolver;
+	int i, t;
+
+	for (i = 0; i < nscount; i ++) {
+		elt = malloc (sizeof (struct rdns_reply_entry));
+
+		if (elt == NULL) {
+			break;
+		}
+
+		t = rdns_parse_rr (resolver, in, elt, pos, rep, remain);
+
+		if (t == -1) {
+			free (elt);
+			rdns_debug ("incomplete authority section");
+			break;
+		}
+		else if (t == 1) {
+			if (elt->type == RDNS_REQUEST_SOA) {
+				rep->negative_ttl = elt->ttl > 0 ? elt->ttl : 0;
+
+				if (elt->content.soa.minimum < (uint32_t)rep->negative_ttl) {
+					rep->negative_ttl = elt->content.soa.minimum;
+				}
+			}
+
+			rdns_reply_entry_free (elt);
+		}
+		else {
+			free (elt);
+		}
+
+		if (rep->negative_ttl != -1) {
+			break;
+		}
+	}
+}
+
 static struct rdns_request *
 rdns_find_dns_request (uint8_t *in, struct rdns_io_channel *ioc)
 {
@@ -154,7 +202,7 @@ rdns_parse_reply (uint8_t *in, int r, struct rdns_request *req,
 	struct rdns_resolver *resolver = req->resolver;
 	uint16_t qdcount;
 	int type;
-	bool found = false;
+	bool found = false, complete = true;
 
 	int i, t;
 
@@ -202,8 +250,9 @@ rdns_parse_reply (uint8_t *in, int r, struct rdns_request *req,
 
 	type = req->requested_names[0].type;
 
+	r -= pos - in;
+
 	if (rep->code == RDNS_RC_NOERROR) {
-		r -= pos - in;
 		/* Extract RR records */
 		for (i = 0; i < ntohs (header->ancount); i ++) {
 			elt = malloc (sizeof (struct rdns_reply_entry));
@@ -211,6 +260,7 @@ rdns_parse_reply (uint8_t *in, int r, struct rdns_request *req,
 			if (t == -1) {
 				free (elt);
 				rdns_debug ("incomplete reply");
+				complete = false;
 				break;
 			}
 			else if (t == 1) {
@@ -229,6 +279,12 @@ rdns_parse_reply (uint8_t *in, int r, struct rdns_request *req,
 
 	if (!found && type != RDNS_REQUEST_ANY) {
 		/* We have not found the requested RR type */
+		if (complete && (rep->code == RDNS_RC_NOERROR ||
+				rep->code == RDNS_RC_NXDOMAIN)) {
+			rdns_parse_negative_ttl (in, &pos, rep, &r,
+					ntohs (header->nscount));
+		}
+
 		rep->code = RDNS_RC_NOREC;
 	}
 
@@ -644,6 +700,50 @@ rdns_make_request_full (
 	return req;
 }
 
+struct rdns_reply*
+rdns_make_stub_reply (struct rdns_resolver *resolver,
+		const char *name, enum rdns_request_type type, enum dns_rcode rcode)
+{
+	struct rdns_request *req;
+	struct rdns_reply *rep;
+	size_t olen;
+
+	req = calloc (1, sizeof (struct rdns_request));
+	if (req == NULL) {
+		return NULL;
+	}
+
+	req->resolver = resolver;
+	req->async = resolver->async;
+	req->qcount = 1;
+	req->type = type;
+	req->state = RDNS_REQUEST_REPLIED;
+	req->requested_names = calloc (1, sizeof (struct rdns_request_name));
+	if (req->requested_names == NULL) {
+		free (req);
+		return NULL;
+	}
+
+	REF_INIT_RETAIN (req, rdns_request_free);
+
+	if (!rdns_format_dns_name (resolver, name, strlen (name),
+			&req->requested_names[0].name, &olen)) {
+		REF_RELEASE (req);
+		return NULL;
+	}
+
+	req->requested_names[0].type = type;
+	req->requested_names[0].len = olen;
+
+	rep = rdns_make_reply (req, rcode);
+	if (rep == NULL) {
+		REF_RELEASE (req);
+		return NULL;
+	}
+
+	return rep;
+}
+
 bool
 rdns_resolver_init (struct rdns_resolver *resolver)
 {
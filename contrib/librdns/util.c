@@ -348,38 +348,44 @@ rdns_permutor_generate_id (void)
 }
 
 
+void
+rdns_reply_entry_free (struct rdns_reply_entry *entry)
+{
+	switch (entry->type) {
+	case RDNS_REQUEST_PTR:
+		free (entry->content.ptr.name);
+		break;
+	case RDNS_REQUEST_NS:
+		free (entry->content.ns.name);
+		break;
+	case RDNS_REQUEST_MX:
+		free (entry->content.mx.name);
+		break;
+	case RDNS_REQUEST_TXT:
+	case RDNS_REQUEST_SPF:
+		free (entry->content.txt.data);
+		break;
+	case RDNS_REQUEST_SRV:
+		free (entry->content.srv.target);
+		break;
+	case RDNS_REQUEST_TLSA:
+		free (entry->content.tlsa.data);
+		break;
+	case RDNS_REQUEST_SOA:
+		free (entry->content.soa.mname);
+		free (entry->content.soa.admin);
+		break;
+	}
+	free (entry);
+}
+
 void
 rdns_reply_free (struct rdns_reply *rep)
 {
 	struct rdns_reply_entry *entry, *tmp;
 
 	LL_FOREACH_SAFE (rep->entries, entry, tmp) {
-		switch (entry->type) {
-		case RDNS_REQUEST_PTR:
-			free (entry->content.ptr.name);
-			break;
-		case RDNS_REQUEST_NS:
-			free (entry->content.ns.name);
-			break;
-		case RDNS_REQUEST_MX:
-			free (entry->content.mx.name);
-			break;
-		case RDNS_REQUEST_TXT:
-		case RDNS_REQUEST_SPF:
-			free (entry->content.txt.data);
-			break;
-		case RDNS_REQUEST_SRV:
-			free (entry->content.srv.target);
-			break;
-		case RDNS_REQUEST_TLSA:
-			free (entry->content.tlsa.data);
-			break;
-		case RDNS_REQUEST_SOA:
-			free (entry->content.soa.mname);
-			free (entry->content.soa.admin);
-			break;
-		}
-		free (entry);
+		rdns_reply_entry_free (entry);
 	}
 	free (rep);
 }
@@ -153,6 +153,7 @@ enum rspamd_metric_action {
 static void rspamc_symbols_output (FILE *out, ucl_object_t *obj);
 static void rspamc_uptime_output (FILE *out, ucl_object_t *obj);
 static void rspamc_counters_output (FILE *out, ucl_object_t *obj);
+static void rspamc_latency_output (FILE *out, ucl_object_t *obj);
 static void rspamc_stat_output (FILE *out, ucl_object_t *obj);
 
 enum rspamc_command_type {
@@ -165,6 +166,8 @@ enum rspamc_command_type {
 	RSPAMC_COMMAND_STAT,
 	RSPAMC_COMMAND_STAT_RESET,
 	RSPAMC_COMMAND_COUNTERS,
+	RSPAMC_COMMAND_LATENCY,
+	RSPAMC_COMMAND_LATENCY_RESET,
 	RSPAMC_COMMAND_UPTIME,
 	RSPAMC_COMMAND_ADD_SYMBOL,
 	RSPAMC_COMMAND_ADD_ACTION
@@ -262,6 +265,26 @@ struct rspamc_command {
 		.need_input = FALSE,
 		.command_output_func = rspamc_counters_output
 	},
+	{
+		.cmd = RSPAMC_COMMAND_LATENCY,
+		.name = "latency",
+		.path = "latency",
+		.description = "display latencies of processing stages and symbols groups",
+		.is_controller = TRUE,
+		.is_privileged = FALSE,
+		.need_input = FALSE,
+		.command_output_func = rspamc_latency_output
+	},
+	{
+		.cmd = RSPAMC_COMMAND_LATENCY_RESET,
+		.name = "latency_reset",
+		.path = "latencyreset",
+		.description = "display and reset latencies statistics",
+		.is_controller = TRUE,
+		.is_privileged = TRUE,
+		.need_input = FALSE,
+		.command_output_func = rspamc_latency_output
+	},
 	{
 		.cmd = RSPAMC_COMMAND_UPTIME,
 		.name = "uptime",
@@ -388,6 +411,12 @@ check_rspamc_command (const gchar *cmd)
 	else if (g_ascii_strcasecmp (cmd, "COUNTERS") == 0) {
 		ct = RSPAMC_COMMAND_COUNTERS;
 	}
+	else if (g_ascii_strcasecmp (cmd, "LATENCY") == 0) {
+		ct = RSPAMC_COMMAND_LATENCY;
+	}
+	else if (g_ascii_strcasecmp (cmd, "LATENCY_RESET") == 0) {
+		ct = RSPAMC_COMMAND_LATENCY_RESET;
+	}
 	else if (g_ascii_strcasecmp (cmd, "UPTIME") == 0) {
 		ct = RSPAMC_COMMAND_UPTIME;
 	}
@@ -820,6 +849,79 @@ rspamc_counters_output (FILE *out, ucl_object_t *obj)
 	printf (" %s \n", dash_buf);
 }
 
+static void
+rspamc_latency_table (const gchar *title, const ucl_object_t *obj)
+{
+	const ucl_object_t *cur, *elt;
+	ucl_object_iter_t iter = NULL;
+	static const gchar *fields[] = {"avg", "p50", "p90", "p99", "max"};
+	gchar fmt_buf[64], dash_buf[128];
+	gint l, max_len = 5;
+	guint i;
+
+	if (obj == NULL || ucl_object_type (obj) != UCL_OBJECT) {
+		return;
+	}
+
+	while ((cur = ucl_object_iterate (obj, &iter, true)) != NULL) {
+		l = strlen (ucl_object_key (cur));
+
+		if (l > max_len) {
+			max_len = MIN (40, l);
+		}
+	}
+
+	memset (dash_buf, '-', 62 + max_len);
+	dash_buf[62 + max_len] = '\0';
+
+	printf ("%s (ms)\n", title);
+	printf (" %s \n", dash_buf);
+	rspamd_snprintf (fmt_buf, sizeof (fmt_buf),
+			"| %%%ds | %%9s | %%7s | %%7s | %%7s | %%7s | %%7s |\n", max_len);
+
+	if (tty) {
+		printf ("\033[1m");
+	}
+
+	printf (fmt_buf, "Name", "Count", "Avg", "P50", "P90", "P99", "Max");
+
+	if (tty) {
+		printf ("\033[0m");
+	}
+
+	rspamd_snprintf (fmt_buf, sizeof (fmt_buf),
+			"| %%-%d.%ds | %%9" G_GINT64_FORMAT " |", max_len, max_len);
+	iter = NULL;
+
+	while ((cur = ucl_object_iterate (obj, &iter, true)) != NULL) {
+		printf (" %s \n", dash_buf);
+		elt = ucl_object_lookup (cur, "count");
+		printf (fmt_buf, ucl_object_key (cur),
+				elt ? ucl_object_toint (elt) : (gint64)0);
+
+		for (i = 0; i < G_N_ELEMENTS (fields); i ++) {
+			elt = ucl_object_lookup (cur, fields[i]);
+			printf (" %7.2f |", elt ? ucl_object_todouble (elt) : 0.0);
+		}
+
+		printf ("\n");
+	}
+
+	printf (" %s \n", dash_buf);
+}
+
+static void
+rspamc_latency_output (FILE *out, ucl_object_t *obj)
+{
+	if (obj->type != UCL_OBJECT) {
+		rspamd_printf ("Bad output\n");
+		return;
+	}
+
+	rspamc_latency_table ("Processing stages", ucl_object_lookup (obj, "stages"));
+	rspamc_latency_table ("Symbols groups", ucl_object_lookup (obj, "groups"));
+}
+
 static void
 rspamc_stat_actions (ucl_object_t *obj, GString *out, gint64 scanned)
 {
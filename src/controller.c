@@ -22,6 +22,8 @@
 #include "libstat/stat_api.h"
 #include "rspamd.h"
 #include "libserver/worker_util.h"
+#include "libserver/latency.h"
+#include "libserver/dns_cache.h"
 #include "cryptobox.h"
 #include "ottery.h"
 #include "fuzzy_wire.h"
@@ -55,6 +57,8 @@
 #define PATH_STAT "/stat"
 #define PATH_STAT_RESET "/statreset"
 #define PATH_COUNTERS "/counters"
+#define PATH_LATENCY "/latency"
+#define PATH_LATENCY_RESET "/latencyreset"
 
 
 #define msg_err_session(...) rspamd_default_log_function(G_LOG_LEVEL_CRITICAL, \
@@ -2071,7 +2075,10 @@ rspamd_controller_handle_stat_common (
 	ucl_object_t *top, *sub;
 	gint i;
 	guint64 spam = 0, ham = 0;
+	guint j, ntags;
+	gchar numbuf[32];
 	rspamd_mempool_stat_t mem_st;
+	rspamd_mempool_tag_stat_t *tags_st;
 	struct rspamd_stat *stat, stat_copy;
 	struct rspamd_controller_worker_ctx *ctx;
 	struct rspamd_task *task;
@@ -2160,6 +2167,52 @@ rspamd_controller_handle_stat_common (
 		ucl_object_fromint (
 			mem_st.oversized_chunks), "chunks_oversized", 0, false);
 
+	ucl_object_insert_key (top,
+		rspamd_dns_cache_stat_ucl (session->ctx->srv->dns_cache),
+		"dns_cache", 0, false);
+
+	tags_st = rspamd_mempool_alloc (session->pool,
+			sizeof (*tags_st) * MEMPOOL_TAGS_MAX);
+	ntags = rspamd_mempool_tags_stat (tags_st, MEMPOOL_TAGS_MAX);
+
+	if (ntags > 0) {
+		sub = ucl_object_typed_new (UCL_OBJECT);
+
+		for (i = 0; i < (gint)ntags; i ++) {
+			ucl_object_t *tag_obj, *hist;
+
+			tag_obj = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (tag_obj,
+				ucl_object_fromint (tags_st[i].pools), "pools", 0, false);
+			ucl_object_insert_key (tag_obj,
+				ucl_object_fromdouble (tags_st[i].avg_size), "avg_size", 0,
+				false);
+			ucl_object_insert_key (tag_obj,
+				ucl_object_fromdouble (tags_st[i].avg_chains), "avg_chains", 0,
+				false);
+			ucl_object_insert_key (tag_obj,
+				ucl_object_fromint (tags_st[i].suggested_size),
+				"suggested_size", 0, false);
+
+			hist = ucl_object_typed_new (UCL_OBJECT);
+
+			for (j = 0; j < MEMPOOL_HIST_BUCKETS; j ++) {
+				if (tags_st[i].hist[j] > 0) {
+					rspamd_snprintf (numbuf, sizeof (numbuf), "%z",
+							rspamd_mempool_hist_bucket_size (j));
+					ucl_object_insert_key (hist,
+						ucl_object_fromint (tags_st[i].hist[j]),
+						numbuf, 0, true);
+				}
+			}
+
+			ucl_object_insert_key (tag_obj, hist, "histogram", 0, false);
+			ucl_object_insert_key (sub, tag_obj, tags_st[i].tagname, 0, true);
+		}
+
+		ucl_object_insert_key (top, sub, "pools", 0, false);
+	}
+
 	if (do_reset) {
 		session->ctx->srv->stat->messages_scanned = 0;
 		session->ctx->srv->stat->messages_learned = 0;
@@ -2242,6 +2295,57 @@ rspamd_controller_handle_counters (
 	return 0;
 }
 
+/*
+ * Latency command handler:
+ * request: /latency
+ * headers: Password
+ * reply: json object with latency histograms of stages and symbols groups
+ */
+static int
+rspamd_controller_handle_latency (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	ucl_object_t *top;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	top = rspamd_latency_stat_ucl (session->ctx->srv->latency);
+	rspamd_controller_send_ucl (conn_ent, top);
+	ucl_object_unref (top);
+
+	return 0;
+}
+
+/*
+ * Latency reset command handler:
+ * request: /latencyreset
+ * headers: Password
+ * reply: json object with latency histograms before reset
+ */
+static int
+rspamd_controller_handle_latencyreset (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	ucl_object_t *top;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, TRUE)) {
+		return 0;
+	}
+
+	top = rspamd_latency_stat_ucl (session->ctx->srv->latency);
+	rspamd_latency_stat_reset (session->ctx->srv->latency);
+	rspamd_controller_send_ucl (conn_ent, top);
+	ucl_object_unref (top);
+
+	return 0;
+}
+
 static int
 rspamd_controller_handle_custom (struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
@@ -2808,6 +2912,12 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_COUNTERS,
 			rspamd_controller_handle_counters);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_LATENCY,
+			rspamd_controller_handle_latency);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_LATENCY_RESET,
+			rspamd_controller_handle_latencyreset);
 
 	if (ctx->key) {
 		rspamd_http_router_set_key (ctx->http, ctx->key);
@@ -2833,6 +2943,7 @@ start_controller_worker (struct rspamd_worker *worker)
 	ctx->resolver = dns_resolver_init (worker->srv->logger,
 			ctx->ev_base,
 			worker->srv->cfg);
+	rspamd_dns_resolver_set_cache (ctx->resolver, worker->srv->dns_cache);
 
 	rspamd_upstreams_library_config (worker->srv->cfg, worker->srv->cfg->ups_ctx,
 			ctx->ev_base, ctx->resolver->r);
@@ -2840,7 +2951,8 @@ start_controller_worker (struct rspamd_worker *worker)
 			worker->srv->cfg, ctx->ev_base);
 	/* Maps events */
 	rspamd_map_watch (worker->srv->cfg, ctx->ev_base, ctx->resolver);
-	rspamd_symbols_cache_start_refresh (worker->srv->cfg->cache, ctx->ev_base);
+	rspamd_symbols_cache_start_refresh (worker->srv->cfg->cache, ctx->ev_base,
+			worker);
 	rspamd_stat_init (worker->srv->cfg, ctx->ev_base);
 
 	event_base_loop (ctx->ev_base, 0);
@@ -40,6 +40,11 @@
 #define DEFAULT_SYNC_TIMEOUT 60.0
 #define DEFAULT_KEYPAIR_CACHE_SIZE 512
 #define DEFAULT_MASTER_TIMEOUT 10.0
+/* Maximum number of datagrams received or sent by a single syscall */
+#define FUZZY_BATCH_SIZE 64
+/* Number of sessions preallocated by each worker */
+#define FUZZY_SESSIONS_PREALLOC 1024
+#define FUZZY_INPUT_BUFLEN 512
 
 static const gchar *local_db_name = "local";
 
@@ -135,6 +140,13 @@ struct rspamd_fuzzy_storage_ctx {
 	GQueue *updates_pending;
 	struct rspamd_dns_resolver *resolver;
 	struct rspamd_config *cfg;
+	/* Preallocated sessions and the list of unused ones */
+	struct fuzzy_session *sessions;
+	struct fuzzy_session *free_sessions;
+	/* Replies postponed until the end of the current input batch */
+	struct fuzzy_session *pending_replies[FUZZY_BATCH_SIZE];
+	guint npending_replies;
+	gboolean batch_replies;
 };
 
 enum fuzzy_cmd_type {
@@ -166,6 +178,8 @@ struct fuzzy_session {
 	struct event io;
 	ref_entry_t ref;
 	struct fuzzy_key_stat *key_stat;
+	struct fuzzy_session *next_free;
+	gboolean preallocated;
 	guchar nm[rspamd_cryptobox_MAX_NMBYTES];
 };
 
@@ -191,6 +205,7 @@ struct fuzzy_master_update_session {
 	rspamd_inet_addr_t *addr;
 	gboolean replied;
 	gint sock;
+	guint nrequests;
 };
 
 static void rspamd_fuzzy_write_reply (struct fuzzy_session *session);
@@ -253,18 +268,30 @@ struct fuzzy_slave_connection {
 	struct rspamd_http_connection *http_conn;
 	struct rspamd_fuzzy_mirror *mirror;
 	gint sock;
+	guint nrequests;
+	gboolean replied;
 };
 
 static void
 fuzzy_mirror_close_connection (struct fuzzy_slave_connection *conn)
 {
+	gboolean keepalive = FALSE;
+
 	if (conn) {
 		if (conn->http_conn) {
+			keepalive = conn->replied &&
+					rspamd_http_connection_is_keepalive (conn->http_conn);
 			rspamd_http_connection_reset (conn->http_conn);
 			rspamd_http_connection_unref (conn->http_conn);
 		}
 
-		close (conn->sock);
+		if (keepalive) {
+			rspamd_upstream_keepalive_put (conn->up, conn->mirror->key,
+					conn->sock, conn->nrequests + 1);
+		}
+		else {
+			close (conn->sock);
+		}
 
 		g_slice_free1 (sizeof (*conn), conn);
 	}
@@ -385,6 +412,7 @@ fuzzy_mirror_finish_handler (struct rspamd_http_connection *conn,
 	struct fuzzy_slave_connection *bk_conn = conn->ud;
 
 	msg_info ("finished mirror connection to %s", bk_conn->mirror->name);
+	bk_conn->replied = TRUE;
 	fuzzy_mirror_close_connection (bk_conn);
 
 	return 0;
@@ -407,9 +435,14 @@ rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
 		return;
 	}
 
-	conn->sock = rspamd_inet_address_connect (
-			rspamd_upstream_addr (conn->up),
-			SOCK_STREAM, TRUE);
+	conn->sock = rspamd_upstream_keepalive_get (conn->up, m->key,
+			&conn->nrequests);
+
+	if (conn->sock == -1) {
+		conn->sock = rspamd_inet_address_connect (
+				rspamd_upstream_addr (conn->up),
+				SOCK_STREAM, TRUE);
+	}
 
 	if (conn->sock == -1) {
 		msg_err ("cannot connect upstream for %s", m->name);
@@ -423,7 +456,7 @@ rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
 	conn->http_conn = rspamd_http_connection_new (NULL,
 			fuzzy_mirror_error_handler,
 			fuzzy_mirror_finish_handler,
-			RSPAMD_HTTP_CLIENT_SIMPLE,
+			RSPAMD_HTTP_CLIENT_SIMPLE|RSPAMD_HTTP_CLIENT_KEEP_ALIVE,
 			RSPAMD_HTTP_CLIENT,
 			ctx->keypair_cache,
 			NULL);
@@ -528,24 +561,40 @@ rspamd_fuzzy_reply_io (gint fd, gshort what, gpointer d)
 	REF_RELEASE (session);
 }
 
+static gconstpointer
+rspamd_fuzzy_reply_data (struct fuzzy_session *session, gsize *len)
+{
+	if (session->cmd_type == CMD_ENCRYPTED_NORMAL ||
+				session->cmd_type == CMD_ENCRYPTED_SHINGLE) {
+		/* Encrypted reply */
+		*len = sizeof (session->reply);
+
+		return &session->reply;
+	}
+
+	*len = sizeof (session->reply.rep);
+
+	return &session->reply.rep;
+}
+
 static void
 rspamd_fuzzy_write_reply (struct fuzzy_session *session)
 {
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
 	gssize r;
 	gsize len;
 	gconstpointer data;
 
-	if (session->cmd_type == CMD_ENCRYPTED_NORMAL ||
-				session->cmd_type == CMD_ENCRYPTED_SHINGLE) {
-		/* Encrypted reply */
-		data = &session->reply;
-		len = sizeof (session->reply);
-	}
-	else {
-		data = &session->reply.rep;
-		len = sizeof (session->reply.rep);
+	if (ctx->batch_replies &&
+			ctx->npending_replies < G_N_ELEMENTS (ctx->pending_replies)) {
+		/* Reply is sent with the whole batch */
+		REF_RETAIN (session);
+		ctx->pending_replies[ctx->npending_replies++] = session;
+
+		return;
 	}
 
+	data = rspamd_fuzzy_reply_data (session, &len);
 	r = rspamd_inet_address_sendto (session->fd, data, len, 0,
 			session->addr);
 
@@ -564,6 +613,72 @@ rspamd_fuzzy_write_reply (struct fuzzy_session *session)
 	}
 }
 
+/*
+ * Sends all replies postponed during the batch processing
+ */
+static void
+rspamd_fuzzy_flush_replies (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct fuzzy_session *session;
+	guint i, sent = 0, npending;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[FUZZY_BATCH_SIZE];
+	struct iovec iov[FUZZY_BATCH_SIZE];
+	socklen_t slen;
+	gsize len;
+	gint r;
+#endif
+
+	npending = ctx->npending_replies;
+	ctx->npending_replies = 0;
+
+	if (npending == 0) {
+		return;
+	}
+
+#ifdef HAVE_SENDMMSG
+	memset (msgs, 0, sizeof (*msgs) * npending);
+
+	for (i = 0; i < npending; i ++) {
+		session = ctx->pending_replies[i];
+		iov[i].iov_base = (void *)rspamd_fuzzy_reply_data (session, &len);
+		iov[i].iov_len = len;
+		msgs[i].msg_hdr.msg_name = (void *)rspamd_inet_address_get_sa (
+				session->addr, &slen);
+		msgs[i].msg_hdr.msg_namelen = slen;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	/* All sessions in a batch share the same socket */
+	while (sent < npending) {
+		r = sendmmsg (ctx->pending_replies[0]->fd, msgs + sent,
+				npending - sent, 0);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			/* Send the rest one by one to handle errors properly */
+			break;
+		}
+
+		sent += r;
+	}
+#endif
+
+	for (i = 0; i < npending; i ++) {
+		session = ctx->pending_replies[i];
+
+		if (i >= sent) {
+			rspamd_fuzzy_write_reply (session);
+		}
+
+		REF_RELEASE (session);
+	}
+}
+
 static void
 fuzzy_peer_send_io (gint fd, gshort what, gpointer d)
 {
@@ -1177,7 +1292,32 @@ fuzzy_session_destroy (gpointer d)
 	rspamd_inet_address_destroy (session->addr);
 	rspamd_explicit_memzero (session->nm, sizeof (session->nm));
 	session->worker->nconns--;
-	g_slice_free1 (sizeof (*session), session);
+
+	if (session->preallocated) {
+		session->next_free = session->ctx->free_sessions;
+		session->ctx->free_sessions = session;
+	}
+	else {
+		g_slice_free1 (sizeof (*session), session);
+	}
+}
+
+static struct fuzzy_session *
+fuzzy_session_new (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct fuzzy_session *session;
+
+	if (ctx->free_sessions != NULL) {
+		session = ctx->free_sessions;
+		ctx->free_sessions = session->next_free;
+		memset (session, 0, sizeof (*session));
+		session->preallocated = TRUE;
+	}
+	else {
+		session = g_slice_alloc0 (sizeof (*session));
+	}
+
+	return session;
 }
 
 static void
@@ -1201,8 +1341,18 @@ rspamd_fuzzy_mirror_error_handler (struct rspamd_http_connection *conn, GError *
 {
 	struct fuzzy_master_update_session *session = conn->ud;
 
-	msg_err_fuzzy_update ("abnormally closing connection from: %s, error: %e",
-		rspamd_inet_address_to_string (session->addr), err);
+	if (session->nrequests > 0 && !session->replied && session->msg == NULL) {
+		/* Master has closed idle connection or it has timed out */
+		msg_debug_fuzzy_update ("closing keep-alive connection from: %s, "
+				"error: %e",
+				rspamd_inet_address_to_string (session->addr), err);
+	}
+	else {
+		msg_err_fuzzy_update ("abnormally closing connection from: %s, "
+				"error: %e",
+				rspamd_inet_address_to_string (session->addr), err);
+	}
+
 	/* Terminate session immediately */
 	rspamd_fuzzy_mirror_session_destroy (session);
 }
@@ -1245,7 +1395,28 @@ rspamd_fuzzy_mirror_finish_handler (struct rspamd_http_connection *conn,
 	gsize remain;
 
 	if (session->replied) {
-		rspamd_fuzzy_mirror_session_destroy (session);
+		if (rspamd_http_connection_is_keepalive (conn)) {
+			/* Wait for the next update over the same connection */
+			if (session->psrc) {
+				g_free (session->psrc);
+				session->psrc = NULL;
+			}
+
+			session->src = NULL;
+			session->msg = NULL;
+			session->replied = FALSE;
+			session->nrequests ++;
+
+			rspamd_http_connection_reset (conn);
+			rspamd_http_connection_read_message (conn,
+					session,
+					session->sock,
+					&session->ctx->master_io_tv,
+					session->ctx->ev_base);
+		}
+		else {
+			rspamd_fuzzy_mirror_session_destroy (session);
+		}
 
 		return 0;
 	}
@@ -1363,7 +1534,7 @@ accept_fuzzy_mirror_socket (gint fd, short what, void *arg)
 	http_conn = rspamd_http_connection_new (NULL,
 			rspamd_fuzzy_mirror_error_handler,
 			rspamd_fuzzy_mirror_finish_handler,
-			0,
+			RSPAMD_HTTP_CLIENT_KEEP_ALIVE,
 			RSPAMD_HTTP_SERVER,
 			ctx->keypair_cache,
 			NULL);
@@ -1381,6 +1552,50 @@ accept_fuzzy_mirror_socket (gint fd, short what, void *arg)
 			ctx->ev_base);
 }
 
+static void
+rspamd_fuzzy_process_datagram (struct rspamd_worker *worker, gint fd,
+		guchar *buf, gsize len, rspamd_inet_addr_t *addr)
+{
+	struct fuzzy_session *session;
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+	guint64 *nerrors;
+
+	worker->nconns++;
+	session = fuzzy_session_new (ctx);
+	REF_INIT_RETAIN (session, fuzzy_session_destroy);
+	session->worker = worker;
+	session->fd = fd;
+	session->ctx = ctx;
+	session->time = (guint64) time (NULL);
+	session->addr = addr;
+
+	if (rspamd_fuzzy_cmd_from_wire (buf, len, session)) {
+		/* Check shingles count sanity */
+		rspamd_fuzzy_process_command (session);
+	}
+	else {
+		/* Discard input */
+		ctx->stat.invalid_requests ++;
+		msg_debug ("invalid fuzzy command of size %z received", len);
+
+		nerrors = rspamd_lru_hash_lookup (ctx->errors_ips,
+				addr, -1);
+
+		if (nerrors == NULL) {
+			nerrors = g_malloc (sizeof (*nerrors));
+			*nerrors = 1;
+			rspamd_lru_hash_insert (ctx->errors_ips,
+					rspamd_inet_address_copy (addr),
+					nerrors, -1, -1);
+		}
+		else {
+			*nerrors = *nerrors + 1;
+		}
+	}
+
+	REF_RELEASE (session);
+}
+
 /*
  * Accept new connection and construct task
  */
@@ -1388,23 +1603,43 @@ static void
 accept_fuzzy_socket (gint fd, short what, void *arg)
 {
 	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
-	struct fuzzy_session *session;
 	rspamd_inet_addr_t *addr;
 	gssize r;
-	guint8 buf[512];
-	guint64 *nerrors;
+#ifdef HAVE_RECVMMSG
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+	struct mmsghdr msgs[FUZZY_BATCH_SIZE];
+	struct iovec iov[FUZZY_BATCH_SIZE];
+	struct sockaddr_storage peers[FUZZY_BATCH_SIZE];
+	guint8 bufs[FUZZY_BATCH_SIZE][FUZZY_INPUT_BUFLEN];
+	gint i;
+#else
+	guint8 buf[FUZZY_INPUT_BUFLEN];
+#endif
 
 	/* Got some data */
 	if (what == EV_READ) {
 
 		for (;;) {
-			worker->nconns++;
+#ifdef HAVE_RECVMMSG
+			memset (msgs, 0, sizeof (msgs));
+
+			for (i = 0; i < FUZZY_BATCH_SIZE; i ++) {
+				iov[i].iov_base = bufs[i];
+				iov[i].iov_len = sizeof (bufs[i]);
+				msgs[i].msg_hdr.msg_name = &peers[i];
+				msgs[i].msg_hdr.msg_namelen = sizeof (peers[i]);
+				msgs[i].msg_hdr.msg_iov = &iov[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
 
+			r = recvmmsg (fd, msgs, FUZZY_BATCH_SIZE, 0, NULL);
+#else
 			r = rspamd_inet_address_recvfrom (fd,
 					buf,
 					sizeof (buf),
 					0,
 					&addr);
+#endif
 
 			if (r == -1) {
 				if (errno == EINTR) {
@@ -1421,39 +1656,35 @@ accept_fuzzy_socket (gint fd, short what, void *arg)
 				return;
 			}
 
-			session = g_slice_alloc0 (sizeof (*session));
-			REF_INIT_RETAIN (session, fuzzy_session_destroy);
-			session->worker = worker;
-			session->fd = fd;
-			session->ctx = worker->ctx;
-			session->time = (guint64) time (NULL);
-			session->addr = addr;
-
-			if (rspamd_fuzzy_cmd_from_wire (buf, r, session)) {
-				/* Check shingles count sanity */
-				rspamd_fuzzy_process_command (session);
-			}
-			else {
-				/* Discard input */
-				session->ctx->stat.invalid_requests ++;
-				msg_debug ("invalid fuzzy command of size %z received", r);
-
-				nerrors = rspamd_lru_hash_lookup (session->ctx->errors_ips,
-						addr, -1);
-
-				if (nerrors == NULL) {
-					nerrors = g_malloc (sizeof (*nerrors));
-					*nerrors = 1;
-					rspamd_lru_hash_insert (session->ctx->errors_ips,
-							rspamd_inet_address_copy (addr),
-							nerrors, -1, -1);
-				}
-				else {
-					*nerrors = *nerrors + 1;
+#ifdef HAVE_RECVMMSG
+			/* Replies are sent by a single syscall after the batch is processed */
+			ctx->batch_replies = TRUE;
+
+			for (i = 0; i < r; i ++) {
+				if (peers[i].ss_family != AF_INET &&
+						peers[i].ss_family != AF_INET6) {
+					continue;
 				}
+
+				addr = rspamd_inet_address_from_sa (
+						(struct sockaddr *)&peers[i],
+						msgs[i].msg_hdr.msg_namelen);
+				rspamd_fuzzy_process_datagram (worker, fd, bufs[i],
+						msgs[i].msg_len, addr);
 			}
 
-			REF_RELEASE (session);
+			/* Resolve all checks of the batch at once */
+			rspamd_fuzzy_backend_flush (ctx->backend);
+			ctx->batch_replies = FALSE;
+			rspamd_fuzzy_flush_replies (ctx);
+
+			if (r < FUZZY_BATCH_SIZE) {
+				/* Socket is drained, the event is level triggered anyway */
+				return;
+			}
+#else
+			rspamd_fuzzy_process_datagram (worker, fd, buf, r, addr);
+#endif
 		}
 	}
 }
@@ -1567,14 +1798,12 @@ rspamd_fuzzy_storage_stat_key (struct fuzzy_key_stat *key_stat)
 static ucl_object_t *
 rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat)
 {
-	GHashTableIter it, ip_it;
-	GHashTable *ip_hash;
+	GHashTableIter it;
 	struct fuzzy_key_stat *key_stat;
 	struct fuzzy_key *key;
-	rspamd_lru_element_t *lru_elt;
 	ucl_object_t *obj, *keys_obj, *elt, *ip_elt, *ip_cur;
 	gpointer k, v;
-	gint i;
+	gint i, ip_it;
 	gchar keyname[17];
 
 	obj = ucl_object_typed_new (UCL_OBJECT);
@@ -1592,21 +1821,17 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 			elt = rspamd_fuzzy_storage_stat_key (key_stat);
 
 			if (key_stat->last_ips && ip_stat) {
-				ip_hash = rspamd_lru_hash_get_htable (key_stat->last_ips);
-
-				if (ip_hash) {
-					g_hash_table_iter_init (&ip_it, ip_hash);
-					ip_elt = ucl_object_typed_new (UCL_OBJECT);
-
-					while (g_hash_table_iter_next (&ip_it, &k, &v)) {
-						lru_elt = v;
-						ip_cur = rspamd_fuzzy_storage_stat_key (lru_elt->data);
-						ucl_object_insert_key (ip_elt, ip_cur,
-								rspamd_inet_address_to_string (k), 0, true);
-					}
-
-					ucl_object_insert_key (elt, ip_elt, "ips", 0, false);
+				ip_it = 0;
+				ip_elt = ucl_object_typed_new (UCL_OBJECT);
+
+				while ((ip_it = rspamd_lru_hash_foreach (key_stat->last_ips,
+						ip_it, &k, &v)) != -1) {
+					ip_cur = rspamd_fuzzy_storage_stat_key (v);
+					ucl_object_insert_key (ip_elt, ip_cur,
+							rspamd_inet_address_to_string (k), 0, true);
 				}
+
+				ucl_object_insert_key (elt, ip_elt, "ips", 0, false);
 			}
 
 			ucl_object_insert_key (keys_obj, elt, keyname, 0, true);
@@ -1633,26 +1858,21 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 			false);
 
 	if (ctx->errors_ips && ip_stat) {
-		ip_hash = rspamd_lru_hash_get_htable (ctx->errors_ips);
-
-		if (ip_hash) {
-			g_hash_table_iter_init (&ip_it, ip_hash);
-			ip_elt = ucl_object_typed_new (UCL_OBJECT);
-
-			while (g_hash_table_iter_next (&ip_it, &k, &v)) {
-				lru_elt = v;
-
-				ucl_object_insert_key (ip_elt,
-						ucl_object_fromint (*(guint64 *)lru_elt->data),
-						rspamd_inet_address_to_string (k), 0, true);
-			}
-
-			ucl_object_insert_key (obj,
-					ip_elt,
-					"errors_ips",
-					0,
-					false);
+		ip_it = 0;
+		ip_elt = ucl_object_typed_new (UCL_OBJECT);
+
+		while ((ip_it = rspamd_lru_hash_foreach (ctx->errors_ips,
+				ip_it, &k, &v)) != -1) {
+			ucl_object_insert_key (ip_elt,
+					ucl_object_fromint (*(guint64 *)v),
+					rspamd_inet_address_to_string (k), 0, true);
 		}
+
+		ucl_object_insert_key (obj,
+				ip_elt,
+				"errors_ips",
+				0,
+				false);
 	}
 
 	/* Checked by epoch */
@@ -1685,6 +1905,12 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 
 	ucl_object_insert_key (obj, elt, "fuzzy_found", 0, false);
 
+	/* Backend specific statistics */
+	elt = rspamd_fuzzy_backend_stat (ctx->backend);
+
+	if (elt) {
+		ucl_object_insert_key (obj, elt, "backend", 0, false);
+	}
 
 	return obj;
 }
@@ -2247,6 +2473,7 @@ start_fuzzy (struct rspamd_worker *worker)
 	GError *err = NULL;
 	struct rspamd_srv_command srv_cmd;
 	struct rspamd_config *cfg = worker->srv->cfg;
+	guint i;
 
 	ctx->ev_base = rspamd_prepare_worker (worker,
 			"fuzzy",
@@ -2254,6 +2481,14 @@ start_fuzzy (struct rspamd_worker *worker)
 	ctx->peer_fd = -1;
 	double_to_tv (ctx->master_timeout, &ctx->master_io_tv);
 
+	ctx->sessions = g_malloc0 (sizeof (*ctx->sessions) *
+			FUZZY_SESSIONS_PREALLOC);
+
+	for (i = 0; i < FUZZY_SESSIONS_PREALLOC; i ++) {
+		ctx->sessions[i].next_free = ctx->free_sessions;
+		ctx->free_sessions = &ctx->sessions[i];
+	}
+
 	/*
 	 * Open DB and perform VACUUM
 	 */
@@ -2315,6 +2550,8 @@ start_fuzzy (struct rspamd_worker *worker)
 				ctx->ev_base,
 				worker->srv->cfg);
 	rspamd_map_watch (worker->srv->cfg, ctx->ev_base, ctx->resolver);
+	rspamd_upstreams_library_config (worker->srv->cfg, ctx->cfg->ups_ctx,
+			ctx->ev_base, ctx->resolver->r);
 
 	/* Get peer pipe */
 	memset (&srv_cmd, 0, sizeof (srv_cmd));
@@ -2346,6 +2583,7 @@ start_fuzzy (struct rspamd_worker *worker)
 	}
 
 	rspamd_lru_hash_destroy (ctx->errors_ips);
+	g_free (ctx->sessions);
 
 	g_hash_table_unref (ctx->keys);
 
@@ -40,6 +40,8 @@ worker_t hs_helper_worker = {
 static const gdouble default_max_time = 1.0;
 static const gdouble default_recompile_time = 60.0;
 static const guint64 rspamd_hs_helper_magic = 0x22d310157a2288a0ULL;
+/* Regexp maps databases that are not used by workers for this time are removed */
+static const gdouble default_map_cache_lifetime = 86400.0;
 
 /*
  * Worker's context
@@ -106,6 +108,77 @@ init_hs_helper (struct rspamd_config *cfg)
 	return ctx;
 }
 
+/*
+ * Workers hold a shared lock on the databases they have loaded, so if we can
+ * lock a database exclusively, then no process uses it
+ */
+static gboolean
+rspamd_hs_helper_map_unused (const gchar *path)
+{
+	gint fd;
+	gboolean ret;
+
+	if ((fd = rspamd_file_xopen (path, O_RDWR, 0)) == -1) {
+		return FALSE;
+	}
+
+	ret = rspamd_file_lock (fd, TRUE);
+	close (fd);
+
+	return ret;
+}
+
+/**
+ * Remove outdated databases compiled for regexp maps
+ */
+static gboolean
+rspamd_hs_helper_cleanup_maps (struct hs_helper_ctx *ctx, const gchar *suffix,
+		gdouble lifetime, gboolean forced, gboolean check_used)
+{
+	struct stat st;
+	glob_t globbuf;
+	guint len, i;
+	gint rc;
+	gchar *pattern;
+	gboolean ret = TRUE;
+	gdouble now = rspamd_get_calendar_ticks ();
+
+	memset (&globbuf, 0, sizeof (globbuf));
+	len = strlen (ctx->hs_dir) + 1 + strlen (suffix) + 2;
+	pattern = g_malloc (len);
+	rspamd_snprintf (pattern, len, "%s%c*%s", ctx->hs_dir, G_DIR_SEPARATOR,
+			suffix);
+
+	if ((rc = glob (pattern, 0, NULL, &globbuf)) == 0) {
+		for (i = 0; i < globbuf.gl_pathc; i++) {
+			if (forced || (stat (globbuf.gl_pathv[i], &st) != -1 &&
+					now - st.st_mtime > lifetime)) {
+				if (check_used &&
+						!rspamd_hs_helper_map_unused (globbuf.gl_pathv[i])) {
+					msg_debug ("skip %s: it is used by workers",
+							globbuf.gl_pathv[i]);
+					continue;
+				}
+
+				if (unlink (globbuf.gl_pathv[i]) == -1) {
+					msg_err ("cannot unlink %s: %s", globbuf.gl_pathv[i],
+							strerror (errno));
+					ret = FALSE;
+				}
+			}
+		}
+	}
+	else if (rc != GLOB_NOMATCH) {
+		msg_err ("glob %s failed: %s", pattern, strerror (errno));
+		ret = FALSE;
+	}
+
+	globfree (&globbuf);
+	g_free (pattern);
+
+	return ret;
+}
+
 /**
  * Clean
  */
@@ -170,6 +243,22 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
 	globfree (&globbuf);
 	g_free (pattern);
 
+	/*
+	 * Workers load maps after they are started, so we do not touch regexp
+	 * maps databases until the initial compilation is done
+	 */
+	if (ctx->loaded) {
+		if (!rspamd_hs_helper_cleanup_maps (ctx, ".hsmap",
+				default_map_cache_lifetime, forced, TRUE)) {
+			ret = FALSE;
+		}
+		/* Unfinished compilations are always removed after the lifetime */
+		if (!rspamd_hs_helper_cleanup_maps (ctx, ".hsmap.tmp",
+				default_map_cache_lifetime, FALSE, FALSE)) {
+			ret = FALSE;
+		}
+	}
+
 	return ret;
 }
 
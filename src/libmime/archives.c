@@ -553,11 +553,13 @@ end:
 }
 
 static gboolean
-rspamd_archive_cheat_detect (struct rspamd_mime_part *part, const gchar *str,
+rspamd_archive_cheat_detect (struct rspamd_task *task,
+		struct rspamd_mime_part *part, const gchar *str,
 		const guchar *magic_start, gsize magic_len)
 {
 	GMimeContentType *ct;
 	const gchar *fname, *p;
+	guchar magic_buf[16];
 
 	ct = part->type;
 
@@ -582,8 +584,11 @@ rspamd_archive_cheat_detect (struct rspamd_mime_part *part, const gchar *str,
 	}
 
 	if (magic_start != NULL) {
-		if (part->content->len > magic_len && memcmp (part->content->data,
-				magic_start, magic_len) == 0) {
+		g_assert (magic_len < sizeof (magic_buf));
+
+		/* Avoid decoding of the whole part merely to check its magic */
+		if (rspamd_mime_part_peek (task, part, magic_buf, magic_len + 1) >
+				magic_len && memcmp (magic_buf, magic_start, magic_len) == 0) {
 			return TRUE;
 		}
 	}
@@ -602,13 +607,15 @@ rspamd_archives_process (struct rspamd_task *task)
 	for (i = 0; i < task->parts->len; i ++) {
 		part = g_ptr_array_index (task->parts, i);
 
-		if (part->content->len > 0) {
-			if (rspamd_archive_cheat_detect (part, "zip",
-					zip_magic, sizeof (zip_magic))) {
+		if (rspamd_archive_cheat_detect (task, part, "zip",
+				zip_magic, sizeof (zip_magic))) {
+			if (rspamd_mime_part_get_content (task, part)->len > 0) {
 				rspamd_archive_process_zip (task, part);
 			}
-			else if (rspamd_archive_cheat_detect (part, "rar",
-					rar_magic, sizeof (rar_magic))) {
+		}
+		else if (rspamd_archive_cheat_detect (task, part, "rar",
+				rar_magic, sizeof (rar_magic))) {
+			if (rspamd_mime_part_get_content (task, part)->len > 0) {
 				rspamd_archive_process_rar (task, part);
 			}
 		}
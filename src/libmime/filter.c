@@ -80,7 +80,7 @@ insert_metric_result (struct rspamd_task *task,
 {
 	struct metric_result *metric_res;
 	struct symbol *s;
-	gdouble w, *gr_score = NULL;
+	gdouble w, lim = 0.0, prev, *gr_score = NULL;
 	struct rspamd_symbol_def *sdef;
 	struct rspamd_symbols_group *gr = NULL;
 	const ucl_object_t *mobj, *sobj;
@@ -93,6 +93,7 @@ insert_metric_result (struct rspamd_task *task,
 	}
 	else {
 		w = (*sdef->weight_ptr) * flag;
+		lim = fabs (*sdef->weight_ptr);
 		gr = sdef->gr;
 
 		if (gr != NULL) {
@@ -115,6 +116,33 @@ insert_metric_result (struct rspamd_task *task,
 			msg_debug ("settings: changed weight of symbol %s from %.2f to %.2f",
 					symbol, w, corr);
 			w = corr * flag;
+			lim = fabs (corr);
+		}
+	}
+
+	s = g_hash_table_lookup (metric_res->symbols, symbol);
+
+	if (s != NULL && sdef && (sdef->flags & RSPAMD_SYMBOL_FLAG_ONESHOT)) {
+		/*
+		 * For one shot symbols we do not need to add them again, so
+		 * we just force single behaviour here
+		 */
+		single = TRUE;
+	}
+
+	if (task->cfg->max_symbol_mult > 0 && sdef != NULL) {
+		/*
+		 * Limit the total score of symbol by its weight, so the score that
+		 * could be added by the unfinished checks is bounded
+		 */
+		lim *= MAX (task->cfg->max_symbol_mult, 1.0);
+		prev = (s != NULL && !single) ? s->score : 0.0;
+
+		if (prev + w > lim) {
+			w = lim - prev;
+		}
+		else if (prev + w < -lim) {
+			w = -lim - prev;
 		}
 	}
 
@@ -134,14 +162,7 @@ insert_metric_result (struct rspamd_task *task,
 	}
 
 	/* Add metric score */
-	if ((s = g_hash_table_lookup (metric_res->symbols, symbol)) != NULL) {
-		if (sdef && (sdef->flags & RSPAMD_SYMBOL_FLAG_ONESHOT)) {
-			/*
-			 * For one shot symbols we do not need to add them again, so
-			 * we just force single behaviour here
-			 */
-			single = TRUE;
-		}
+	if (s != NULL) {
 		if (s->options && opts && opts != s->options) {
 			/* Append new options */
 			s->options = g_list_concat (s->options, g_list_copy (opts));
@@ -240,6 +261,10 @@ insert_result_common (struct rspamd_task *task,
 	/* Process cache item */
 	if (task->cfg->cache) {
 		rspamd_symbols_cache_inc_frequency (task->cfg->cache, symbol);
+
+		if (fabs (flag) > 1.0) {
+			rspamd_symbols_cache_set_scaled (task->cfg->cache, symbol);
+		}
 	}
 
 	if (opts != NULL) {
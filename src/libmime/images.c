@@ -38,7 +38,7 @@ rspamd_images_process (struct rspamd_task *task)
 	for (i = 0; i < task->parts->len; i ++) {
 		part = g_ptr_array_index (task->parts, i);
 		if (g_mime_content_type_is_type (part->type, "image", "*") &&
-				part->content->len > 0) {
+				rspamd_mime_part_get_content (task, part)->len > 0) {
 			process_image (task, part);
 		}
 	}
@@ -231,7 +231,7 @@ process_image (struct rspamd_task *task, struct rspamd_mime_part *part)
 		part->specific_data = img;
 
 		/* Check Content-Id */
-		rh = g_hash_table_lookup (part->raw_headers, "Content-Id");
+		rh = rspamd_pool_hash_lookup (part->raw_headers, "Content-Id");
 
 		if (rh != NULL) {
 			cid = rh->decoded;
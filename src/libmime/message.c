@@ -54,25 +54,25 @@ rspamd_message_quark (void)
 
 static void
 append_raw_header (struct rspamd_task *task,
-		GHashTable *target, struct raw_header *rh)
+		rspamd_pool_hash_t *target, struct raw_header *rh)
 {
 	struct raw_header *lp;
 
 	rh->next = NULL;
 	rh->prev = rh;
 	if ((lp =
-			g_hash_table_lookup (target, rh->name)) != NULL) {
+			rspamd_pool_hash_lookup (target, rh->name)) != NULL) {
 		DL_APPEND (lp, rh);
 	}
 	else {
-		g_hash_table_insert (target, rh->name, rh);
+		rspamd_pool_hash_insert (target, rh->name, rh);
 	}
 	msg_debug_task ("add raw header %s: %s", rh->name, rh->value);
 }
 
 /* Convert raw headers to a list of struct raw_header * */
 static void
-process_raw_headers (struct rspamd_task *task, GHashTable *target,
+process_raw_headers (struct rspamd_task *task, rspamd_pool_hash_t *target,
 		const gchar *in, gsize len)
 {
 	struct raw_header *new = NULL;
@@ -1046,6 +1046,310 @@ struct mime_foreach_data {
 	GMimeObject *parent;
 };
 
+/* Blake2b applied to string 'rspamd' */
+static const guchar rspamd_mime_part_hash_key[] = {
+		0xef,0x43,0xae,0x80,0xcc,0x8d,0xc3,0x4c,
+		0x6f,0x1b,0xd6,0x18,0x1b,0xae,0x87,0x74,
+		0x0c,0xca,0xf7,0x8e,0x5f,0x2e,0x54,0x32,
+		0xf6,0x79,0xb9,0x27,0x26,0x96,0x20,0x92,
+		0x70,0x07,0x85,0xeb,0x83,0xf7,0x89,0xe0,
+		0xd7,0x32,0x2a,0xd2,0x1a,0x64,0x41,0xef,
+		0x49,0xff,0xc3,0x8c,0x54,0xf9,0x67,0x74,
+		0x30,0x1e,0x70,0x2e,0xb7,0x12,0x09,0xfe,
+};
+
+static GByteArray *
+rspamd_mime_part_decode (struct rspamd_task *task,
+		struct rspamd_mime_part *mime_part)
+{
+	GMimeDataWrapper *wrapper;
+	GMimeStream *part_stream;
+	GByteArray *part_content = NULL;
+
+	wrapper = g_mime_part_get_content_object (GMIME_PART (mime_part->mime));
+
+	if (wrapper != NULL) {
+		part_stream = g_mime_stream_mem_new ();
+
+		if (g_mime_data_wrapper_write_to_stream (wrapper,
+				part_stream) != -1) {
+			g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (
+					part_stream), FALSE);
+			part_content = g_mime_stream_mem_get_byte_array (GMIME_STREAM_MEM (
+					part_stream));
+		}
+		else if (task != NULL) {
+			msg_warn_task ("write to stream failed: %d, %s", errno,
+					strerror (errno));
+		}
+		else {
+			msg_warn ("write to stream failed: %d, %s", errno,
+					strerror (errno));
+		}
+
+		g_object_unref (part_stream);
+#ifndef GMIME24
+		g_object_unref (wrapper);
+#endif
+	}
+
+	if (part_content == NULL) {
+		part_content = g_byte_array_new ();
+	}
+
+	return part_content;
+}
+
+GByteArray *
+rspamd_mime_part_get_content (struct rspamd_task *task,
+		struct rspamd_mime_part *part)
+{
+	if (part->content == NULL) {
+		if (GMIME_IS_PART (part->mime)) {
+			part->content = rspamd_mime_part_decode (task, part);
+		}
+		else {
+			part->content = g_byte_array_new ();
+		}
+	}
+
+	return part->content;
+}
+
+typedef gboolean (*rspamd_mime_part_chunk_cb) (const guchar *data, gsize len,
+		gpointer ud);
+
+/*
+ * Feeds decoded content of the part to `cb` by chunks without keeping the
+ * whole decoded part in memory, at most `limit` bytes are read (0 means no
+ * limit). Callback can stop reading by returning FALSE. Truncated content is
+ * bypassed to read the whole part.
+ */
+static gsize
+rspamd_mime_part_read (struct rspamd_task *task,
+		struct rspamd_mime_part *part,
+		gsize limit,
+		rspamd_mime_part_chunk_cb cb,
+		gpointer ud)
+{
+	GByteArray *content;
+	gsize total = 0;
+
+	if ((part->content == NULL || (part->flags & RSPAMD_MIME_PART_TRUNCATED)) &&
+			GMIME_IS_PART (part->mime)) {
+#ifdef GMIME24
+		GMimeDataWrapper *wrapper;
+		GMimeStream *raw, *stream;
+		GMimeFilter *filter;
+		GMimeContentEncoding enc;
+		guchar chunk[8192];
+		gsize toread;
+		gssize nr;
+
+		wrapper = g_mime_part_get_content_object (GMIME_PART (part->mime));
+
+		if (wrapper == NULL || !GMIME_IS_DATA_WRAPPER (wrapper) ||
+				(raw = g_mime_data_wrapper_get_stream (wrapper)) == NULL) {
+			return 0;
+		}
+
+		enc = g_mime_data_wrapper_get_encoding (wrapper);
+		g_mime_stream_reset (raw);
+
+		if (enc == GMIME_CONTENT_ENCODING_BASE64 ||
+				enc == GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE ||
+				enc == GMIME_CONTENT_ENCODING_UUENCODE) {
+			stream = g_mime_stream_filter_new (raw);
+			filter = g_mime_filter_basic_new (enc, FALSE);
+			g_mime_stream_filter_add (GMIME_STREAM_FILTER (stream), filter);
+			g_object_unref (filter);
+		}
+		else {
+			stream = g_object_ref (raw);
+		}
+
+		for (;;) {
+			toread = sizeof (chunk);
+
+			if (limit > 0) {
+				toread = MIN (toread, limit - total);
+
+				if (toread == 0) {
+					break;
+				}
+			}
+
+			nr = g_mime_stream_read (stream, (gchar *)chunk, toread);
+
+			if (nr <= 0) {
+				break;
+			}
+
+			total += nr;
+
+			if (!cb (chunk, nr, ud)) {
+				break;
+			}
+		}
+
+		g_object_unref (stream);
+		g_mime_stream_reset (raw);
+
+		return total;
+#endif
+	}
+
+	content = rspamd_mime_part_get_content (task, part);
+	total = content->len;
+
+	if (limit > 0) {
+		total = MIN (total, limit);
+	}
+
+	if (total > 0) {
+		cb (content->data, total, ud);
+	}
+
+	return total;
+}
+
+static gboolean
+rspamd_mime_part_hash_chunk (const guchar *data, gsize len, gpointer ud)
+{
+	rspamd_cryptobox_hash_update (ud, data, len);
+
+	return TRUE;
+}
+
+const guchar *
+rspamd_mime_part_get_digest (struct rspamd_task *task,
+		struct rspamd_mime_part *part)
+{
+	GByteArray *content;
+	rspamd_cryptobox_hash_state_t st;
+
+	if (!(part->flags & RSPAMD_MIME_PART_HAS_DIGEST)) {
+		if (part->content == NULL ||
+				(part->flags & RSPAMD_MIME_PART_TRUNCATED)) {
+			/*
+			 * Digests of all parts are needed for the message checksum, so
+			 * hash attachments without keeping their decoded content
+			 */
+			rspamd_cryptobox_hash_init (&st, rspamd_mime_part_hash_key,
+					sizeof (rspamd_mime_part_hash_key));
+			part->decoded_len = rspamd_mime_part_read (task, part, 0,
+					rspamd_mime_part_hash_chunk, &st);
+
+			if (part->decoded_len > 0) {
+				rspamd_cryptobox_hash_final (&st, part->digest);
+			}
+		}
+		else {
+			content = rspamd_mime_part_get_content (task, part);
+			part->decoded_len = content->len;
+
+			if (content->len > 0) {
+				rspamd_cryptobox_hash (part->digest,
+						content->data, content->len,
+						rspamd_mime_part_hash_key,
+						sizeof (rspamd_mime_part_hash_key));
+			}
+		}
+
+		part->flags |= RSPAMD_MIME_PART_HAS_DIGEST;
+	}
+
+	return part->digest;
+}
+
+gsize
+rspamd_mime_part_get_length (struct rspamd_task *task,
+		struct rspamd_mime_part *part)
+{
+	if (part->content != NULL && !(part->flags & RSPAMD_MIME_PART_TRUNCATED)) {
+		return part->content->len;
+	}
+
+	/* Length is obtained as a side effect of the streaming digest */
+	rspamd_mime_part_get_digest (task, part);
+
+	return part->decoded_len;
+}
+
+struct rspamd_mime_part_peek_cbdata {
+	guchar *buf;
+	gsize pos;
+};
+
+static gboolean
+rspamd_mime_part_peek_chunk (const guchar *data, gsize len, gpointer ud)
+{
+	struct rspamd_mime_part_peek_cbdata *cbd = ud;
+
+	memcpy (cbd->buf + cbd->pos, data, len);
+	cbd->pos += len;
+
+	return TRUE;
+}
+
+gsize
+rspamd_mime_part_peek (struct rspamd_task *task,
+		struct rspamd_mime_part *part,
+		guchar *buf, gsize len)
+{
+	struct rspamd_mime_part_peek_cbdata cbd;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	cbd.buf = buf;
+	cbd.pos = 0;
+
+	return rspamd_mime_part_read (task, part, len,
+			rspamd_mime_part_peek_chunk, &cbd);
+}
+
+static gboolean
+rspamd_mime_part_append_chunk (const guchar *data, gsize len, gpointer ud)
+{
+	g_byte_array_append (ud, data, len);
+
+	return TRUE;
+}
+
+/*
+ * Text parts of large messages are decoded up to the configured limit only
+ */
+static GByteArray *
+rspamd_mime_part_get_text_content (struct rspamd_task *task,
+		struct rspamd_mime_part *part)
+{
+	GByteArray *content;
+	gsize limit;
+
+	if (part->content == NULL && RSPAMD_TASK_IS_LARGE (task)) {
+		limit = task->cfg->large_message_text;
+
+		if (limit > 0) {
+			/* Part must have no content whilst it is being read */
+			content = g_byte_array_new ();
+
+			if (rspamd_mime_part_read (task, part, limit + 1,
+					rspamd_mime_part_append_chunk, content) > limit) {
+				g_byte_array_set_size (content, limit);
+				msg_info_task ("truncated text part %s/%s to %z bytes",
+						part->type->type, part->type->subtype, limit);
+				part->flags |= RSPAMD_MIME_PART_TRUNCATED;
+			}
+
+			part->content = content;
+		}
+	}
+
+	return rspamd_mime_part_get_content (task, part);
+}
+
 #ifdef GMIME24
 static void
 mime_foreach_callback (GMimeObject * parent,
@@ -1061,20 +1365,8 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 	struct rspamd_mime_part *mime_part;
 	GMimeContentType *type;
 	GMimeDataWrapper *wrapper;
-	GMimeStream *part_stream;
 	GByteArray *part_content;
 	gchar *hdrs;
-	/* Blake2b applied to string 'rspamd' */
-	static const guchar hash_key[] = {
-			0xef,0x43,0xae,0x80,0xcc,0x8d,0xc3,0x4c,
-			0x6f,0x1b,0xd6,0x18,0x1b,0xae,0x87,0x74,
-			0x0c,0xca,0xf7,0x8e,0x5f,0x2e,0x54,0x32,
-			0xf6,0x79,0xb9,0x27,0x26,0x96,0x20,0x92,
-			0x70,0x07,0x85,0xeb,0x83,0xf7,0x89,0xe0,
-			0xd7,0x32,0x2a,0xd2,0x1a,0x64,0x41,0xef,
-			0x49,0xff,0xc3,0x8c,0x54,0xf9,0x67,0x74,
-			0x30,0x1e,0x70,0x2e,0xb7,0x12,0x09,0xfe,
-	};
 
 	task = md->task;
 	/* 'part' points to the current part node that g_mime_message_foreach_part() is iterating over */
@@ -1134,10 +1426,11 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 				part));
 		mime_part = rspamd_mempool_alloc0 (task->task_pool,
 				sizeof (struct rspamd_mime_part));
+		mime_part->task = task;
 
 		hdrs = g_mime_object_get_headers (GMIME_OBJECT (part));
-		mime_part->raw_headers = g_hash_table_new (rspamd_strcase_hash,
-				rspamd_strcase_equal);
+		mime_part->raw_headers = rspamd_pool_hash_new_strcase (task->task_pool,
+				8);
 
 		if (hdrs != NULL) {
 			process_raw_headers (task, mime_part->raw_headers,
@@ -1155,9 +1448,12 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 
 		if (mime_part->boundary) {
 			rspamd_cryptobox_hash (mime_part->digest, mime_part->boundary,
-					strlen (mime_part->boundary), hash_key, sizeof (hash_key));
+					strlen (mime_part->boundary), rspamd_mime_part_hash_key,
+					sizeof (rspamd_mime_part_hash_key));
 		}
 
+		mime_part->flags |= RSPAMD_MIME_PART_HAS_DIGEST;
+
 		debug_task ("found part with content-type: %s/%s",
 				type->type,
 				type->subtype);
@@ -1192,46 +1488,39 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 #else
 		if (wrapper != NULL) {
 #endif
-			part_stream = g_mime_stream_mem_new ();
-			if (g_mime_data_wrapper_write_to_stream (wrapper,
-				part_stream) != -1) {
-
-				g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (
-						part_stream), FALSE);
-				part_content = g_mime_stream_mem_get_byte_array (GMIME_STREAM_MEM (
-							part_stream));
-				g_object_unref (part_stream);
-				mime_part =
-					rspamd_mempool_alloc0 (task->task_pool,
-						sizeof (struct rspamd_mime_part));
-
-				hdrs = g_mime_object_get_headers (GMIME_OBJECT (part));
-				mime_part->raw_headers = g_hash_table_new (rspamd_strcase_hash,
-						rspamd_strcase_equal);
+			mime_part =
+				rspamd_mempool_alloc0 (task->task_pool,
+					sizeof (struct rspamd_mime_part));
+			mime_part->task = task;
+
+			hdrs = g_mime_object_get_headers (GMIME_OBJECT (part));
+			mime_part->raw_headers = rspamd_pool_hash_new_strcase (
+					task->task_pool, 8);
+
+			if (hdrs != NULL) {
+				process_raw_headers (task, mime_part->raw_headers,
+						hdrs, strlen (hdrs));
+				mime_part->raw_headers_str = hdrs;
+			}
 
-				if (hdrs != NULL) {
-					process_raw_headers (task, mime_part->raw_headers,
-							hdrs, strlen (hdrs));
-					mime_part->raw_headers_str = hdrs;
-				}
+			mime_part->type = type;
+			mime_part->parent = md->parent;
+			mime_part->filename = g_mime_part_get_filename (GMIME_PART (
+						part));
+			mime_part->mime = part;
 
-				mime_part->type = type;
-				mime_part->content = part_content;
-				mime_part->parent = md->parent;
-				mime_part->filename = g_mime_part_get_filename (GMIME_PART (
-							part));
-				mime_part->mime = part;
-
-				if (mime_part->content->len > 0) {
-					rspamd_cryptobox_hash (mime_part->digest,
-							mime_part->content->data, mime_part->content->len,
-							hash_key, sizeof (hash_key));
-				}
+			debug_task ("found part with content-type: %s/%s",
+				type->type,
+				type->subtype);
+			g_ptr_array_add (task->parts, mime_part);
 
-				debug_task ("found part with content-type: %s/%s",
-					type->type,
-					type->subtype);
-				g_ptr_array_add (task->parts, mime_part);
+			/*
+			 * Attachments are decoded on demand only (e.g. by images,
+			 * archives or fuzzy check), whilst text parts are always needed
+			 */
+			if (g_mime_content_type_is_type (type, "text", "*")) {
+				part_content = rspamd_mime_part_get_text_content (task,
+						mime_part);
 				/* Skip empty parts */
 				process_text_part (task,
 					part_content,
@@ -1240,10 +1529,6 @@ mime_foreach_callback (GMimeObject * part, gpointer user_data)
 					md->parent,
 					(part_content->len <= 0));
 			}
-			else {
-				msg_warn_task ("write to stream failed: %d, %s", errno,
-					strerror (errno));
-			}
 #ifndef GMIME24
 			g_object_unref (wrapper);
 #endif
@@ -1430,6 +1715,14 @@ rspamd_message_parse (struct rspamd_task *task)
 	task->msg.begin = p;
 	task->msg.len = len;
 
+	if (task->cfg && task->cfg->large_message > 0 &&
+			len > task->cfg->large_message) {
+		msg_info_task ("message is too large: %z bytes (limit: %z), "
+				"process it in bounded memory mode", len,
+				task->cfg->large_message);
+		task->flags |= RSPAMD_TASK_FLAG_LARGE;
+	}
+
 	stream = g_mime_stream_mem_new_with_byte_array (tmp);
 	/*
 	 * This causes g_mime_stream not to free memory by itself as it is memory allocated by
@@ -1525,8 +1818,14 @@ rspamd_message_parse (struct rspamd_task *task)
 		task->queue_id = "undef";
 	}
 
-	rspamd_images_process (task);
-	rspamd_archives_process (task);
+	if (RSPAMD_TASK_IS_LARGE (task)) {
+		/* Attachments of large messages are not decoded for inspection */
+		msg_info_task ("skip images and archives processing for large message");
+	}
+	else {
+		rspamd_images_process (task);
+		rspamd_archives_process (task);
+	}
 
 	/* Parse received headers */
 	first = rspamd_message_get_header (task, "Received", FALSE);
@@ -1724,7 +2023,9 @@ rspamd_message_parse (struct rspamd_task *task)
 		struct rspamd_mime_part *part;
 
 		part = g_ptr_array_index (task->parts, i);
-		rspamd_cryptobox_hash_update (&st, part->digest, sizeof (part->digest));
+		rspamd_cryptobox_hash_update (&st,
+				rspamd_mime_part_get_digest (task, part),
+				sizeof (part->digest));
 	}
 
 	rspamd_cryptobox_hash_final (&st, digest_out);
@@ -1754,7 +2055,7 @@ rspamd_message_get_header (struct rspamd_task *task,
 	GList *gret = NULL;
 	struct raw_header *rh;
 
-	rh = g_hash_table_lookup (task->raw_headers, field);
+	rh = rspamd_pool_hash_lookup (task->raw_headers, field);
 
 	if (rh == NULL) {
 		return NULL;
@@ -1790,7 +2091,7 @@ rspamd_message_get_header_array (struct rspamd_task *task,
 	struct raw_header *rh, *cur;
 	guint nelems = 0;
 
-	rh = g_hash_table_lookup (task->raw_headers, field);
+	rh = rspamd_pool_hash_lookup (task->raw_headers, field);
 
 	if (rh == NULL) {
 		return NULL;
@@ -1830,7 +2131,7 @@ rspamd_message_get_mime_header_array (struct rspamd_task *task,
 
 	for (i = 0; i < task->parts->len; i ++) {
 		mp = g_ptr_array_index (task->parts, i);
-		rh = g_hash_table_lookup (mp->raw_headers, field);
+		rh = rspamd_pool_hash_lookup (mp->raw_headers, field);
 
 		if (rh == NULL) {
 			continue;
@@ -1849,7 +2150,7 @@ rspamd_message_get_mime_header_array (struct rspamd_task *task,
 
 	for (i = 0; i < task->parts->len; i ++) {
 		mp = g_ptr_array_index (task->parts, i);
-		rh = g_hash_table_lookup (mp->raw_headers, field);
+		rh = rspamd_pool_hash_lookup (mp->raw_headers, field);
 
 		LL_FOREACH (rh, cur) {
 			if (strong) {
@@ -1881,7 +2182,7 @@ rspamd_message_get_headers_array (struct rspamd_task *task, ...)
 
 	for (hname = va_arg (ap, const char *); hname != NULL;
 			hname = va_arg (ap, const char *)) {
-		rh = g_hash_table_lookup (task->raw_headers, hname);
+		rh = rspamd_pool_hash_lookup (task->raw_headers, hname);
 
 		if (rh == NULL) {
 			continue;
@@ -1904,7 +2205,7 @@ rspamd_message_get_headers_array (struct rspamd_task *task, ...)
 
 	for (hname = va_arg (ap, const char *); hname != NULL;
 			hname = va_arg (ap, const char *)) {
-		rh = g_hash_table_lookup (task->raw_headers, hname);
+		rh = rspamd_pool_hash_lookup (task->raw_headers, hname);
 
 		if (rh == NULL) {
 			continue;
@@ -1931,7 +2232,7 @@ rspamd_message_get_header_array_str (struct rspamd_task *task,
 	struct raw_header *rh, *cur;
 	guint nelems = 0;
 
-	rh = g_hash_table_lookup (task->raw_headers, field);
+	rh = rspamd_pool_hash_lookup (task->raw_headers, field);
 
 	if (rh == NULL) {
 		return NULL;
@@ -1974,7 +2275,7 @@ rspamd_message_get_headers_array_str (struct rspamd_task *task, ...)
 
 	for (hname = va_arg (ap, const char *); hname != NULL;
 			hname = va_arg (ap, const char *)) {
-		rh = g_hash_table_lookup (task->raw_headers, hname);
+		rh = rspamd_pool_hash_lookup (task->raw_headers, hname);
 
 		if (rh == NULL) {
 			continue;
@@ -1997,7 +2298,7 @@ rspamd_message_get_headers_array_str (struct rspamd_task *task, ...)
 
 	for (hname = va_arg (ap, const char *); hname != NULL;
 			hname = va_arg (ap, const char *)) {
-		rh = g_hash_table_lookup (task->raw_headers, hname);
+		rh = rspamd_pool_hash_lookup (task->raw_headers, hname);
 
 		if (rh == NULL) {
 			continue;
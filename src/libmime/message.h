@@ -10,6 +10,7 @@
 #include "email_addr.h"
 #include "addr.h"
 #include "cryptobox.h"
+#include "pool_hash.h"
 #include <gmime/gmime.h>
 
 struct rspamd_task;
@@ -20,20 +21,24 @@ enum rspamd_mime_part_flags {
 	RSPAMD_MIME_PART_TEXT = (1 << 0),
 	RSPAMD_MIME_PART_ATTACHEMENT = (1 << 1),
 	RSPAMD_MIME_PART_IMAGE = (1 << 2),
-	RSPAMD_MIME_PART_ARCHIVE = (1 << 3)
+	RSPAMD_MIME_PART_ARCHIVE = (1 << 3),
+	RSPAMD_MIME_PART_HAS_DIGEST = (1 << 4),
+	RSPAMD_MIME_PART_TRUNCATED = (1 << 5)
 };
 
 struct rspamd_mime_part {
 	GMimeContentType *type;
-	GByteArray *content;
+	GByteArray *content; /**< decoded lazily, use rspamd_mime_part_get_content */
 	GMimeObject *parent;
 	GMimeObject *mime;
-	GHashTable *raw_headers;
+	rspamd_pool_hash_t *raw_headers;
 	gchar *raw_headers_str;
-	guchar digest[rspamd_cryptobox_HASHBYTES];
+	guchar digest[rspamd_cryptobox_HASHBYTES]; /**< use rspamd_mime_part_get_digest */
+	gsize decoded_len; /**< use rspamd_mime_part_get_length */
 	const gchar *filename;
 	const gchar *boundary;
 	gpointer specific_data;
+	struct rspamd_task *task; /**< task that owns this part */
 	enum rspamd_mime_part_flags flags;
 };
 
@@ -167,4 +172,46 @@ GPtrArray *rspamd_message_get_header_array_str (struct rspamd_task *task,
  */
 GPtrArray *rspamd_message_get_headers_array_str (struct rspamd_task *task, ...);
 
+/**
+ * Returns decoded content of the mime part, non-text parts are decoded on the
+ * first call only
+ * @param task worker task structure (may be NULL)
+ * @param part mime part
+ * @return decoded content (never NULL), it is owned by the part
+ */
+GByteArray *rspamd_mime_part_get_content (struct rspamd_task *task,
+		struct rspamd_mime_part *part);
+
+/**
+ * Returns digest of the decoded content of the mime part calculating it if needed
+ * @param task worker task structure (may be NULL)
+ * @param part mime part
+ * @return digest of rspamd_cryptobox_HASHBYTES length
+ */
+const guchar *rspamd_mime_part_get_digest (struct rspamd_task *task,
+		struct rspamd_mime_part *part);
+
+/**
+ * Returns length of the decoded content of the mime part, for large messages
+ * it is calculated without keeping the decoded content in memory
+ * @param task worker task structure (may be NULL)
+ * @param part mime part
+ * @return length of the decoded content
+ */
+gsize rspamd_mime_part_get_length (struct rspamd_task *task,
+		struct rspamd_mime_part *part);
+
+/**
+ * Decodes up to `len` bytes from the beginning of the mime part without
+ * decoding the whole part
+ * @param task worker task structure (may be NULL)
+ * @param part mime part
+ * @param buf output buffer
+ * @param len length of the buffer
+ * @return number of bytes written to `buf`
+ */
+gsize rspamd_mime_part_peek (struct rspamd_task *task,
+		struct rspamd_mime_part *part,
+		guchar *buf, gsize len);
+
 #endif
@@ -1475,7 +1475,7 @@ rspamd_has_fake_html (struct rspamd_task * task, GArray * args, void *unused)
 	for (i = 0; i < task->text_parts->len; i ++) {
 		p = g_ptr_array_index (task->text_parts, i);
 
-		if (!IS_PART_EMPTY (p) && IS_PART_HTML (p) && p->html->html_tags == NULL) {
+		if (!IS_PART_EMPTY (p) && IS_PART_HTML (p) && p->html->ntags == 0) {
 			res = TRUE;
 		}
 
@@ -1503,7 +1503,7 @@ rspamd_raw_header_exists (struct rspamd_task *task, GArray * args, void *unused)
 		return FALSE;
 	}
 
-	return g_hash_table_lookup (task->raw_headers, arg->data) != NULL;
+	return rspamd_pool_hash_lookup (task->raw_headers, arg->data) != NULL;
 }
 
 static gboolean
@@ -1912,20 +1912,25 @@ compare_subtype (struct rspamd_task *task, GMimeContentType * ct,
 }
 
 static gboolean
-compare_len (struct rspamd_mime_part *part, guint min, guint max)
+compare_len (struct rspamd_task *task, struct rspamd_mime_part *part,
+		guint min, guint max)
 {
+	guint len;
+
 	if (min == 0 && max == 0) {
 		return TRUE;
 	}
 
+	len = rspamd_mime_part_get_length (task, part);
+
 	if (min == 0) {
-		return part->content->len <= max;
+		return len <= max;
 	}
 	else if (max == 0) {
-		return part->content->len >= min;
+		return len >= min;
 	}
 	else {
-		return part->content->len >= min && part->content->len <= max;
+		return len >= min && len <= max;
 	}
 }
 
@@ -1957,7 +1962,7 @@ common_has_content_part (struct rspamd_task * task,
 					NULL, NULL, FALSE, NULL);
 			/* Also check subtype and length of the part */
 			if (r && param_subtype) {
-				r = compare_len (part, min_len, max_len) &&
+				r = compare_len (task, part, min_len, max_len) &&
 						compare_subtype (task, ct, param_subtype);
 
 				return r;
@@ -1968,13 +1973,13 @@ common_has_content_part (struct rspamd_task * task,
 			if (ct->type && g_ascii_strcasecmp (ct->type, param_type->data) == 0) {
 				if (param_subtype) {
 					if (compare_subtype (task, ct, param_subtype)) {
-						if (compare_len (part, min_len, max_len)) {
+						if (compare_len (task, part, min_len, max_len)) {
 							return TRUE;
 						}
 					}
 				}
 				else {
-					if (compare_len (part, min_len, max_len)) {
+					if (compare_len (task, part, min_len, max_len)) {
 						return TRUE;
 					}
 				}
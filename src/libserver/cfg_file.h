@@ -293,9 +293,11 @@ struct rspamd_config {
 	gboolean convert_config;                        /**< convert config to XML format						*/
 	gboolean strict_protocol_headers;               /**< strictly check protocol headers					*/
 	gboolean check_all_filters;                     /**< check all filters									*/
+	gboolean early_exit;                            /**< stop checks when action cannot change				*/
 	gboolean allow_raw_input;                       /**< scan messages with invalid mime					*/
 	gboolean disable_hyperscan;                     /**< disable hyperscan usage							*/
 	gboolean vectorized_hyperscan;                  /**< use vectorized hyperscan matching					*/
+	gboolean fused_hyperscan;                       /**< scan shared inputs once for several re classes		*/
 	gboolean enable_shutdown_workaround;            /**< enable workaround for legacy SA clients (exim)		*/
 	gboolean ignore_received;                       /**< Ignore data from the first received header			*/
 
@@ -304,6 +306,8 @@ struct rspamd_config {
 	gsize max_cores_count;                          /**< maximum number of core files						*/
 	gchar *cores_dir;                               /**< directory for core files							*/
 	gsize max_message;                              /**< maximum size for messages							*/
+	gsize large_message;                            /**< size of messages that are analysed partially		*/
+	gsize large_message_text;                       /**< maximum size of a text part in a large message		*/
 
 	enum rspamd_log_type log_type;                  /**< log type											*/
 	gint log_facility;                              /**< log facility in case of syslog						*/
@@ -311,6 +315,7 @@ struct rspamd_config {
 	gchar *log_file;                                /**< path to logfile in case of file logging			*/
 	gboolean log_buffered;                          /**< whether logging is buffered						*/
 	guint32 log_buf_size;                           /**< length of log buffer								*/
+	gsize log_ring_size;                            /**< size of workers' shared log rings (0 - disabled)	*/
 	const ucl_object_t *debug_ip_map;               /**< turn on debugging for specified ip addresses       */
 	gboolean log_urls;                              /**< whether we should log URLs                         */
 	GList *debug_symbols;                           /**< symbols to debug									*/
@@ -361,6 +366,7 @@ struct rspamd_config {
 	gdouble map_timeout;                            /**< maps watch timeout									*/
 
 	struct symbols_cache *cache;                    /**< symbols cache object								*/
+	gdouble max_symbol_mult;                        /**< maximum score of symbol in its weights				*/
 	gchar *cache_filename;                          /**< filename of cache file								*/
 	struct metric *default_metric;                  /**< default metric										*/
 
@@ -386,10 +392,15 @@ struct rspamd_config {
 	const ucl_object_t *nameservers;                /**< list of nameservers or NULL to parse resolv.conf	*/
 	guint32 dns_max_requests;                       /**< limit of DNS requests per task 					*/
 	gboolean enable_dnssec;                         /**< enable dnssec stub resolver						*/
+	gsize dns_cache_size;                           /**< size of shared DNS cache (0 to disable)			*/
+	gdouble dns_cache_max_ttl;                      /**< maximum time to cache DNS replies					*/
 
 	guint upstream_max_errors;						/**< upstream max errors before shutting off			*/
 	gdouble upstream_error_time;					/**< rate of upstream errors							*/
 	gdouble upstream_revive_time;					/**< revive timeout for upstreams						*/
+	gdouble upstream_keepalive_timeout;				/**< idle timeout for keep-alive connections			*/
+	guint upstream_keepalive_requests;				/**< maximum requests per keep-alive connection			*/
+	guint upstream_keepalive_connections;			/**< maximum idle connections per upstream				*/
 	struct upstream_ctx *ups_ctx;					/**< upstream context									*/
 
 	guint min_word_len;								/**< minimum length of the word to be considered		*/
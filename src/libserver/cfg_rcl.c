@@ -1618,6 +1618,13 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, log_buf_size),
 			0,
 			"Size of log buffer in bytes (for file logging)");
+	rspamd_rcl_add_default_handler (sub,
+			"log_ring",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, log_ring_size),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Size of shared memory ring per worker: workers' log lines are written "
+			"by the main process, lines are dropped if the ring is full (0 to disable)");
 	rspamd_rcl_add_default_handler (sub,
 			"log_urls",
 			rspamd_rcl_parse_struct_boolean,
@@ -1848,6 +1855,20 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, check_all_filters),
 			0,
 			"Always check all filters");
+	rspamd_rcl_add_default_handler (sub,
+			"early_exit",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, early_exit),
+			0,
+			"Stop checks when the remaining symbols cannot change action "
+			"(default: true)");
+	rspamd_rcl_add_default_handler (sub,
+			"max_symbol_mult",
+			rspamd_rcl_parse_struct_double,
+			G_STRUCT_OFFSET (struct rspamd_config, max_symbol_mult),
+			0,
+			"Maximum score of a symbol in its weights, 0 means no limit "
+			"(default: 4)");
 	rspamd_rcl_add_default_handler (sub,
 			"min_word_len",
 			rspamd_rcl_parse_struct_integer,
@@ -1902,6 +1923,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, vectorized_hyperscan),
 			0,
 			"Use hyperscan in vectorized mode (experimental)");
+	rspamd_rcl_add_default_handler (sub,
+			"fused_hyperscan",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, fused_hyperscan),
+			0,
+			"Scan inputs shared by several regexp classes only once (experimental)");
 	rspamd_rcl_add_default_handler (sub,
 			"cores_dir",
 			rspamd_rcl_parse_struct_string,
@@ -1974,6 +2001,18 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, max_message),
 			RSPAMD_CL_FLAG_INT_SIZE,
 			"Maximum size of the message to be scanned");
+	rspamd_rcl_add_default_handler (sub,
+			"large_message",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, large_message),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Messages larger than this size are analysed partially (0 to disable)");
+	rspamd_rcl_add_default_handler (sub,
+			"large_message_text",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, large_message_text),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Maximum size of each text part analysed in large messages");
 	/* New DNS configuration */
 	ssub = rspamd_rcl_add_section_doc (&sub->subsections, "dns", NULL, NULL,
 			UCL_OBJECT, FALSE, TRUE,
@@ -2021,6 +2060,19 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, enable_dnssec),
 			0,
 			"Enable DNSSEC support in Rspamd");
+	rspamd_rcl_add_default_handler (ssub,
+			"cache_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_size),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Size of DNS replies cache shared by all workers (0 to disable, "
+			"requires restart to be changed)");
+	rspamd_rcl_add_default_handler (ssub,
+			"cache_max_ttl",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_max_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Maximum time to store DNS replies in cache");
 
 
 	/* New upstreams configuration */
@@ -2046,6 +2098,24 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, upstream_revive_time),
 			RSPAMD_CL_FLAG_TIME_FLOAT,
 			"Time before attempting to recover upstream after an error");
+	rspamd_rcl_add_default_handler (ssub,
+			"keepalive_timeout",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, upstream_keepalive_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to keep idle connections to upstreams open");
+	rspamd_rcl_add_default_handler (ssub,
+			"keepalive_requests",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, upstream_keepalive_requests),
+			RSPAMD_CL_FLAG_UINT,
+			"Maximum number of requests sent over a single keep-alive connection");
+	rspamd_rcl_add_default_handler (ssub,
+			"keepalive_connections",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, upstream_keepalive_connections),
+			RSPAMD_CL_FLAG_UINT,
+			"Maximum number of idle keep-alive connections per upstream");
 
 	/**
 	 * Metric section
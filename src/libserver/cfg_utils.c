@@ -39,6 +39,8 @@
 #define DEFAULT_MAX_WORD 40
 #define DEFAULT_WORDS_DECAY 200
 #define DEFAULT_MAX_MESSAGE (50 * 1024 * 1024)
+#define DEFAULT_LARGE_MESSAGE_TEXT (256 * 1024)
+#define DEFAULT_MAX_SYMBOL_MULT 4.0
 
 struct rspamd_ucl_map_cbdata {
 	struct rspamd_config *cfg;
@@ -113,6 +115,7 @@ rspamd_config_new (void)
 	cfg->dns_throttling_time = 10000;
 	/* 16 sockets per DNS server */
 	cfg->dns_io_per_server = 16;
+	cfg->dns_cache_max_ttl = 86400.0;
 
 	/* 20 Kb */
 	cfg->max_diff = 20480;
@@ -152,6 +155,9 @@ rspamd_config_new (void)
 	cfg->words_decay = DEFAULT_WORDS_DECAY;
 	cfg->min_word_len = DEFAULT_MIN_WORD;
 	cfg->max_word_len = DEFAULT_MAX_WORD;
+	/* Stop checks when the remaining symbols cannot change action */
+	cfg->early_exit = TRUE;
+	cfg->max_symbol_mult = DEFAULT_MAX_SYMBOL_MULT;
 
 	cfg->lua_state = rspamd_lua_init ();
 	cfg->cache = rspamd_symbols_cache_new (cfg);
@@ -165,6 +171,7 @@ rspamd_config_new (void)
 
 	cfg->ssl_ciphers = "HIGH:!aNULL:!kRSA:!PSK:!SRP:!MD5:!RC4";
 	cfg->max_message = DEFAULT_MAX_MESSAGE;
+	cfg->large_message_text = DEFAULT_LARGE_MESSAGE_TEXT;
 	cfg->monitored_ctx = rspamd_monitored_ctx_init ();
 	cfg->redis_pool = rspamd_redis_pool_init ();
 
@@ -1694,7 +1694,7 @@ rspamd_dkim_canonize_header (struct rspamd_dkim_common_ctx *ctx,
 	GPtrArray *sign_headers;
 
 	if (dkim_header == NULL) {
-		rh = g_hash_table_lookup (task->raw_headers, header_name);
+		rh = rspamd_pool_hash_lookup (task->raw_headers, header_name);
 
 		if (rh) {
 			LL_FOREACH (rh, rh_iter) {
@@ -1749,7 +1749,7 @@ rspamd_dkim_canonize_header (struct rspamd_dkim_common_ctx *ctx,
 		/* For signature check just use the saved dkim header */
 		if (ctx->header_canon_type == DKIM_CANON_SIMPLE) {
 			/* We need to find our own signature and use it */
-			rh = g_hash_table_lookup (task->raw_headers, DKIM_SIGNHEADER);
+			rh = rspamd_pool_hash_lookup (task->raw_headers, DKIM_SIGNHEADER);
 
 			if (rh) {
 				/* We need to find our own signature */
@@ -2103,7 +2103,7 @@ rspamd_dkim_sign (struct rspamd_task *task,
 	for (i = 0; i < ctx->common.hlist->len; i++) {
 		dh = g_ptr_array_index (ctx->common.hlist, i);
 
-		if (g_hash_table_lookup (task->raw_headers, dh->name)) {
+		if (rspamd_pool_hash_lookup (task->raw_headers, dh->name)) {
 			rspamd_dkim_canonize_header (&ctx->common, task, dh->name, dh->count,
 					NULL, NULL);
 
@@ -20,6 +20,7 @@
 #include "utlist.h"
 #include "uthash.h"
 #include "rdns_event.h"
+#include "dns_cache.h"
 
 static struct rdns_upstream_elt* rspamd_dns_select_upstream (const char *name,
 		size_t len, void *ups_data);
@@ -39,43 +40,134 @@ static struct rdns_upstream_context rspamd_ups_ctx = {
 		.data = NULL
 };
 
+struct rspamd_dns_inflight;
+
 struct rspamd_dns_request_ud {
 	struct rspamd_async_session *session;
 	dns_callback_type cb;
 	gpointer ud;
 	rspamd_mempool_t *pool;
 	struct rdns_request *req;
+	struct rspamd_dns_inflight *inflight;
+	struct rdns_reply *cached;
+	struct event ev;
+	struct rspamd_dns_request_ud *prev, *next;
+};
+
+/*
+ * Identical requests within a worker share the same rdns request
+ */
+struct rspamd_dns_inflight {
+	gchar *key;
+	struct rdns_request *req;
+	struct rspamd_dns_resolver *resolver;
+	struct rspamd_dns_request_ud *waiters;
+	enum rdns_request_type type;
+	gchar *name;
+	gboolean replied;
 };
 
 static void
-rspamd_dns_fin_cb (gpointer arg)
+rspamd_dns_inflight_free (struct rspamd_dns_inflight *inflight)
 {
-	struct rspamd_dns_request_ud *reqdata = (struct rspamd_dns_request_ud *)arg;
+	g_free (inflight->key);
+	g_free (inflight->name);
+	g_slice_free1 (sizeof (*inflight), inflight);
+}
 
-	rdns_request_release (reqdata->req);
+static void
+rspamd_dns_free_reqdata (struct rspamd_dns_request_ud *reqdata)
+{
 	if (reqdata->pool == NULL) {
 		g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
 	}
 }
 
 static void
-rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
+rspamd_dns_fin_cb (gpointer arg)
 {
-	struct rspamd_dns_request_ud *reqdata = ud;
+	struct rspamd_dns_request_ud *reqdata = (struct rspamd_dns_request_ud *)arg;
+	struct rspamd_dns_inflight *inflight = reqdata->inflight;
+
+	if (inflight) {
+		/* Session is destroyed before reply is received */
+		DL_DELETE (inflight->waiters, reqdata);
+		reqdata->inflight = NULL;
+
+		if (inflight->waiters == NULL && !inflight->replied) {
+			/* Nobody else waits for this request, so cancel it */
+			g_hash_table_remove (inflight->resolver->inflight, inflight->key);
+			rdns_request_release (inflight->req);
+			rspamd_dns_inflight_free (inflight);
+		}
+	}
+
+	if (reqdata->cached) {
+		/* Reply from cache has not been delivered yet */
+		event_del (&reqdata->ev);
+		reqdata->cached = NULL;
+	}
+
+	if (reqdata->req) {
+		rdns_request_release (reqdata->req);
+	}
+
+	rspamd_dns_free_reqdata (reqdata);
+}
 
+static void
+rspamd_dns_deliver_reply (struct rspamd_dns_request_ud *reqdata,
+	struct rdns_reply *reply)
+{
 	reqdata->cb (reply, reqdata->ud);
 
 	if (reqdata->session) {
+		rspamd_session_remove_event (reqdata->session, rspamd_dns_fin_cb,
+				reqdata);
+	}
+	else {
+		rdns_request_release (reqdata->req);
+		rspamd_dns_free_reqdata (reqdata);
+	}
+}
+
+static void
+rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
+{
+	struct rspamd_dns_inflight *inflight = ud;
+	struct rspamd_dns_request_ud *reqdata;
+
+	inflight->replied = TRUE;
+	g_hash_table_remove (inflight->resolver->inflight, inflight->key);
+	rspamd_dns_cache_insert (inflight->resolver->cache, inflight->type,
+			inflight->name, reply);
+
+	/*
+	 * Callbacks might destroy sessions of other waiters, so we always
+	 * take the first waiter from the list
+	 */
+	while ((reqdata = inflight->waiters) != NULL) {
+		DL_DELETE (inflight->waiters, reqdata);
+		reqdata->inflight = NULL;
 		/*
-		 * Ref event to avoid double unref by
+		 * Ref request to avoid double unref by
 		 * event removing
 		 */
-		rdns_request_retain (reply->request);
-		rspamd_session_remove_event (reqdata->session, rspamd_dns_fin_cb, reqdata);
-	}
-	else if (reqdata->pool == NULL) {
-		g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+		reqdata->req = rdns_request_retain (reply->request);
+		rspamd_dns_deliver_reply (reqdata, reply);
 	}
+
+	rspamd_dns_inflight_free (inflight);
+}
+
+static void
+rspamd_dns_cached_callback (gint fd, short what, gpointer ud)
+{
+	struct rspamd_dns_request_ud *reqdata = ud;
+	struct rdns_reply *reply = reqdata->cached;
+
+	reqdata->cached = NULL;
+	rspamd_dns_deliver_reply (reqdata, reply);
 }
 
 gboolean
@@ -88,50 +180,102 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 	const char *name)
 {
 	struct rdns_request *req;
+	struct rdns_reply *reply;
 	struct rspamd_dns_request_ud *reqdata = NULL;
+	struct rspamd_dns_inflight *inflight;
+	struct timeval tv;
+	gchar *key;
 
 	g_assert (resolver != NULL);
 
-	if (resolver->r == NULL) {
+	if (resolver->r == NULL || name == NULL) {
 		return FALSE;
 	}
 
+	key = g_strdup_printf ("%d:%s", (gint)type, name);
+	rspamd_str_lc (key, strlen (key));
+	inflight = g_hash_table_lookup (resolver->inflight, key);
+	reply = NULL;
+	req = NULL;
+
+	if (inflight != NULL) {
+		g_free (key);
+		rspamd_dns_cache_inc_coalesced (resolver->cache);
+	}
+	else {
+		reply = rspamd_dns_cache_lookup (resolver->cache, resolver->r, type,
+				name);
+
+		if (reply == NULL) {
+			inflight = g_slice_alloc0 (sizeof (*inflight));
+			inflight->key = key;
+			inflight->resolver = resolver;
+			inflight->type = type;
+			inflight->name = g_strdup (name);
+
+			req = rdns_make_request_full (resolver->r, rspamd_dns_callback,
+					inflight, resolver->request_timeout,
+					resolver->max_retransmits, 1, name, type);
+
+			if (req == NULL) {
+				rspamd_dns_inflight_free (inflight);
+				return FALSE;
+			}
+
+			inflight->req = req;
+			g_hash_table_insert (resolver->inflight, inflight->key, inflight);
+		}
+		else {
+			g_free (key);
+		}
+	}
+
 	if (pool != NULL) {
 		reqdata =
-			rspamd_mempool_alloc (pool, sizeof (struct rspamd_dns_request_ud));
+			rspamd_mempool_alloc0 (pool, sizeof (struct rspamd_dns_request_ud));
 	}
 	else {
-		reqdata = g_slice_alloc (sizeof (struct rspamd_dns_request_ud));
+		reqdata = g_slice_alloc0 (sizeof (struct rspamd_dns_request_ud));
 	}
 	reqdata->pool = pool;
 	reqdata->session = session;
 	reqdata->cb = cb;
 	reqdata->ud = ud;
 
-	req = rdns_make_request_full (resolver->r, rspamd_dns_callback, reqdata,
-			resolver->request_timeout, resolver->max_retransmits, 1, name,
-			type);
-	reqdata->req = req;
-
-	if (session) {
-		if (req != NULL) {
-			rspamd_session_add_event (session,
-					(event_finalizer_t)rspamd_dns_fin_cb,
-					reqdata,
-					g_quark_from_static_string ("dns resolver"));
-		}
+	if (reply != NULL) {
+		/* Deliver cached reply asynchronously as callers expect */
+		reqdata->req = reply->request;
+		reqdata->cached = reply;
+		event_set (&reqdata->ev, -1, EV_TIMEOUT, rspamd_dns_cached_callback,
+				reqdata);
+		event_base_set (resolver->ev_base, &reqdata->ev);
+		double_to_tv (0.0, &tv);
+		event_add (&reqdata->ev, &tv);
+	}
+	else {
+		reqdata->inflight = inflight;
+		DL_APPEND (inflight->waiters, reqdata);
 	}
 
-	if (req == NULL) {
-		if (pool == NULL) {
-			g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
-		}
-		return FALSE;
+	if (session) {
+		rspamd_session_add_event (session,
+				(event_finalizer_t)rspamd_dns_fin_cb,
+				reqdata,
+				g_quark_from_static_string ("dns resolver"));
 	}
 
 	return TRUE;
 }
 
+void
+rspamd_dns_resolver_set_cache (struct rspamd_dns_resolver *resolver,
+	struct rspamd_dns_cache *cache)
+{
+	if (resolver) {
+		resolver->cache = cache;
+	}
+}
+
 static gboolean
 make_dns_request_task_common (struct rspamd_task *task,
 	dns_callback_type cb,
@@ -229,6 +373,7 @@ dns_resolver_init (rspamd_logger_t *logger,
 
 	dns_resolver = g_slice_alloc0 (sizeof (struct rspamd_dns_resolver));
 	dns_resolver->ev_base = ev_base;
+	dns_resolver->inflight = g_hash_table_new (g_str_hash, g_str_equal);
 	if (cfg != NULL) {
 		dns_resolver->request_timeout = cfg->dns_timeout;
 		dns_resolver->max_retransmits = cfg->dns_retransmits;
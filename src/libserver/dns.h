@@ -25,12 +25,15 @@
 #include "upstream.h"
 
 struct rspamd_config;
+struct rspamd_dns_cache;
 
 struct rspamd_dns_resolver {
 	struct rdns_resolver *r;
 	struct event_base *ev_base;
 	struct upstream_list *ups;
 	struct rspamd_config *cfg;
+	struct rspamd_dns_cache *cache;
+	GHashTable *inflight;
 	gdouble request_timeout;
 	guint max_retransmits;
 };
@@ -43,6 +46,14 @@ struct rspamd_dns_resolver {
 struct rspamd_dns_resolver * dns_resolver_init (rspamd_logger_t *logger,
 	struct event_base *ev_base, struct rspamd_config *cfg);
 
+/**
+ * Attach shared replies cache to the resolver
+ * @param resolver resolver object
+ * @param cache cache object (allocated by the main process)
+ */
+void rspamd_dns_resolver_set_cache (struct rspamd_dns_resolver *resolver,
+	struct rspamd_dns_cache *cache);
+
 /**
  * Make a DNS request
  * @param resolver resolver object
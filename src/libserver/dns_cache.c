@@ -0,0 +1,584 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "dns_cache.h"
+#include "util.h"
+#include "str_util.h"
+#include "utlist.h"
+#include "cryptobox.h"
+
+#define RSPAMD_DNS_CACHE_SLOT_SIZE 1024
+#define RSPAMD_DNS_CACHE_SET_SLOTS 4
+#define RSPAMD_DNS_CACHE_LOCKS 256
+#define RSPAMD_DNS_CACHE_MAX_NAME 255
+
+struct rspamd_dns_cache_slot {
+	guint64 hash;                   /**< hash of name and type						*/
+	gdouble expire;                 /**< monotonic time of expiration (0 if empty)	*/
+	gdouble stored;                 /**< monotonic time when reply was stored		*/
+	guint16 type;                   /**< requested type								*/
+	guint16 rcode;                  /**< code of reply								*/
+	guint16 nentries;               /**< number of entries in reply					*/
+	guint16 namelen;                /**< length of name at the beginning of data	*/
+	guint16 datalen;                /**< length of name and entries					*/
+	guint16 authenticated;          /**< reply is authenticated by DNSSEC			*/
+	guint32 unused;
+	guchar data[RSPAMD_DNS_CACHE_SLOT_SIZE - 40];
+};
+
+struct rspamd_dns_cache_counters {
+	guint64 hits;
+	guint64 misses;
+	guint64 coalesced;
+	guint64 stored;
+	guint64 too_large;
+};
+
+struct rspamd_dns_cache {
+	struct rspamd_dns_cache_counters *counters;
+	struct rspamd_dns_cache_slot *slots;
+	rspamd_mempool_mutex_t *locks[RSPAMD_DNS_CACHE_LOCKS];
+	guint nsets;
+	gdouble max_ttl;
+};
+
+#ifdef HAVE_ATOMIC_BUILTINS
+#define DNS_CACHE_INC(ptr) __atomic_add_fetch ((ptr), 1, __ATOMIC_RELAXED)
+#else
+#define DNS_CACHE_INC(ptr) (*(ptr) += 1)
+#endif
+
+struct rspamd_dns_cache *
+rspamd_dns_cache_new (rspamd_mempool_t *pool, gsize size, gdouble max_ttl)
+{
+	struct rspamd_dns_cache *cache;
+	guint nsets = 1, i;
+
+	cache = g_slice_alloc0 (sizeof (*cache));
+	cache->counters = rspamd_mempool_alloc0_shared (pool,
+			sizeof (*cache->counters));
+	cache->max_ttl = max_ttl;
+
+	if (size >= sizeof (struct rspamd_dns_cache_slot) *
+			RSPAMD_DNS_CACHE_SET_SLOTS) {
+		/* Use power of two sets */
+		while ((gsize)nsets * 2 * RSPAMD_DNS_CACHE_SET_SLOTS *
+				sizeof (struct rspamd_dns_cache_slot) <= size) {
+			nsets *= 2;
+		}
+
+		cache->nsets = nsets;
+		cache->slots = rspamd_mempool_alloc0_shared (pool,
+				(gsize)nsets * RSPAMD_DNS_CACHE_SET_SLOTS *
+				sizeof (struct rspamd_dns_cache_slot));
+
+		for (i = 0; i < RSPAMD_DNS_CACHE_LOCKS; i ++) {
+			cache->locks[i] = rspamd_mempool_get_mutex (pool);
+		}
+	}
+
+	return cache;
+}
+
+static guint64
+rspamd_dns_cache_key (enum rdns_request_type type, const gchar *name,
+		gchar *lc, gsize *len)
+{
+	gsize nlen;
+
+	nlen = strlen (name);
+
+	/* Ignore trailing dot */
+	if (nlen > 0 && name[nlen - 1] == '.') {
+		nlen --;
+	}
+
+	if (nlen == 0 || nlen > RSPAMD_DNS_CACHE_MAX_NAME) {
+		return 0;
+	}
+
+	memcpy (lc, name, nlen);
+	rspamd_str_lc (lc, nlen);
+	*len = nlen;
+
+	return rspamd_cryptobox_fast_hash (lc, nlen, type);
+}
+
+static inline gboolean
+rspamd_dns_cache_put (guchar **p, const guchar *end, const void *data,
+		gsize len)
+{
+	if (*p + len > end) {
+		return FALSE;
+	}
+
+	memcpy (*p, data, len);
+	*p += len;
+
+	return TRUE;
+}
+
+static inline gboolean
+rspamd_dns_cache_put_str (guchar **p, const guchar *end, const gchar *str)
+{
+	guint16 len;
+	gsize slen = str ? strlen (str) : 0;
+
+	if (slen > G_MAXUINT16) {
+		return FALSE;
+	}
+
+	len = slen;
+
+	return rspamd_dns_cache_put (p, end, &len, sizeof (len)) &&
+			rspamd_dns_cache_put (p, end, str, len);
+}
+
+static inline gboolean
+rspamd_dns_cache_get (const guchar **p, const guchar *end, void *data,
+		gsize len)
+{
+	if (*p + len > end) {
+		return FALSE;
+	}
+
+	memcpy (data, *p, len);
+	*p += len;
+
+	return TRUE;
+}
+
+/* Strings are allocated by malloc as they are freed by librdns */
+static inline gboolean
+rspamd_dns_cache_get_str (const guchar **p, const guchar *end, gchar **str)
+{
+	guint16 len;
+
+	if (!rspamd_dns_cache_get (p, end, &len, sizeof (len)) ||
+			*p + len > end) {
+		return FALSE;
+	}
+
+	*str = malloc (len + 1);
+
+	if (*str == NULL) {
+		return FALSE;
+	}
+
+	memcpy (*str, *p, len);
+	(*str)[len] = '\0';
+	*p += len;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_dns_cache_serialize_entry (struct rdns_reply_entry *elt,
+		guchar **p, const guchar *end)
+{
+	union rdns_reply_element_un *c = &elt->content;
+	gboolean ret;
+
+	if (!rspamd_dns_cache_put (p, end, &elt->type, sizeof (elt->type)) ||
+			!rspamd_dns_cache_put (p, end, &elt->ttl, sizeof (elt->ttl))) {
+		return FALSE;
+	}
+
+	switch (elt->type) {
+	case RDNS_REQUEST_A:
+		ret = rspamd_dns_cache_put (p, end, &c->a.addr, sizeof (c->a.addr));
+		break;
+	case RDNS_REQUEST_AAAA:
+		ret = rspamd_dns_cache_put (p, end, &c->aaa.addr,
+				sizeof (c->aaa.addr));
+		break;
+	case RDNS_REQUEST_PTR:
+		ret = rspamd_dns_cache_put_str (p, end, c->ptr.name);
+		break;
+	case RDNS_REQUEST_NS:
+		ret = rspamd_dns_cache_put_str (p, end, c->ns.name);
+		break;
+	case RDNS_REQUEST_MX:
+		ret = rspamd_dns_cache_put (p, end, &c->mx.priority,
+				sizeof (c->mx.priority)) &&
+				rspamd_dns_cache_put_str (p, end, c->mx.name);
+		break;
+	case RDNS_REQUEST_TXT:
+	case RDNS_REQUEST_SPF:
+		ret = rspamd_dns_cache_put_str (p, end, c->txt.data);
+		break;
+	case RDNS_REQUEST_SRV:
+		ret = rspamd_dns_cache_put (p, end, &c->srv.priority,
+				sizeof (c->srv.priority)) &&
+				rspamd_dns_cache_put (p, end, &c->srv.weight,
+						sizeof (c->srv.weight)) &&
+				rspamd_dns_cache_put (p, end, &c->srv.port,
+						sizeof (c->srv.port)) &&
+				rspamd_dns_cache_put_str (p, end, c->srv.target);
+		break;
+	case RDNS_REQUEST_SOA:
+		ret = rspamd_dns_cache_put_str (p, end, c->soa.mname) &&
+				rspamd_dns_cache_put_str (p, end, c->soa.admin) &&
+				rspamd_dns_cache_put (p, end, &c->soa.serial,
+						sizeof (c->soa.serial)) &&
+				rspamd_dns_cache_put (p, end, &c->soa.refresh,
+						sizeof (c->soa.refresh)) &&
+				rspamd_dns_cache_put (p, end, &c->soa.retry,
+						sizeof (c->soa.retry)) &&
+				rspamd_dns_cache_put (p, end, &c->soa.expire,
+						sizeof (c->soa.expire)) &&
+				rspamd_dns_cache_put (p, end, &c->soa.minimum,
+						sizeof (c->soa.minimum));
+		break;
+	case RDNS_REQUEST_TLSA:
+		ret = rspamd_dns_cache_put (p, end, &c->tlsa.usage,
+				sizeof (c->tlsa.usage)) &&
+				rspamd_dns_cache_put (p, end, &c->tlsa.selector,
+						sizeof (c->tlsa.selector)) &&
+				rspamd_dns_cache_put (p, end, &c->tlsa.match_type,
+						sizeof (c->tlsa.match_type)) &&
+				rspamd_dns_cache_put (p, end, &c->tlsa.datalen,
+						sizeof (c->tlsa.datalen)) &&
+				rspamd_dns_cache_put (p, end, c->tlsa.data,
+						c->tlsa.datalen);
+		break;
+	default:
+		/* Unknown record, do not cache the whole reply */
+		ret = FALSE;
+		break;
+	}
+
+	return ret;
+}
+
+static struct rdns_reply_entry *
+rspamd_dns_cache_deserialize_entry (const guchar **p, const guchar *end,
+		gint32 elapsed)
+{
+	struct rdns_reply_entry *elt;
+	union rdns_reply_element_un *c;
+	gboolean ret;
+
+	elt = calloc (1, sizeof (*elt));
+
+	if (elt == NULL) {
+		return NULL;
+	}
+
+	c = &elt->content;
+
+	if (!rspamd_dns_cache_get (p, end, &elt->type, sizeof (elt->type)) ||
+			!rspamd_dns_cache_get (p, end, &elt->ttl, sizeof (elt->ttl))) {
+		free (elt);
+		return NULL;
+	}
+
+	elt->ttl = MAX (elt->ttl - elapsed, 0);
+
+	switch (elt->type) {
+	case RDNS_REQUEST_A:
+		ret = rspamd_dns_cache_get (p, end, &c->a.addr, sizeof (c->a.addr));
+		break;
+	case RDNS_REQUEST_AAAA:
+		ret = rspamd_dns_cache_get (p, end, &c->aaa.addr,
+				sizeof (c->aaa.addr));
+		break;
+	case RDNS_REQUEST_PTR:
+		ret = rspamd_dns_cache_get_str (p, end, &c->ptr.name);
+		break;
+	case RDNS_REQUEST_NS:
+		ret = rspamd_dns_cache_get_str (p, end, &c->ns.name);
+		break;
+	case RDNS_REQUEST_MX:
+		ret = rspamd_dns_cache_get (p, end, &c->mx.priority,
+				sizeof (c->mx.priority)) &&
+				rspamd_dns_cache_get_str (p, end, &c->mx.name);
+		break;
+	case RDNS_REQUEST_TXT:
+	case RDNS_REQUEST_SPF:
+		ret = rspamd_dns_cache_get_str (p, end, &c->txt.data);
+		break;
+	case RDNS_REQUEST_SRV:
+		ret = rspamd_dns_cache_get (p, end, &c->srv.priority,
+				sizeof (c->srv.priority)) &&
+				rspamd_dns_cache_get (p, end, &c->srv.weight,
+						sizeof (c->srv.weight)) &&
+				rspamd_dns_cache_get (p, end, &c->srv.port,
+						sizeof (c->srv.port)) &&
+				rspamd_dns_cache_get_str (p, end, &c->srv.target);
+		break;
+	case RDNS_REQUEST_SOA:
+		ret = rspamd_dns_cache_get_str (p, end, &c->soa.mname) &&
+				rspamd_dns_cache_get_str (p, end, &c->soa.admin) &&
+				rspamd_dns_cache_get (p, end, &c->soa.serial,
+						sizeof (c->soa.serial)) &&
+				rspamd_dns_cache_get (p, end, &c->soa.refresh,
+						sizeof (c->soa.refresh)) &&
+				rspamd_dns_cache_get (p, end, &c->soa.retry,
+						sizeof (c->soa.retry)) &&
+				rspamd_dns_cache_get (p, end, &c->soa.expire,
+						sizeof (c->soa.expire)) &&
+				rspamd_dns_cache_get (p, end, &c->soa.minimum,
+						sizeof (c->soa.minimum));
+		break;
+	case RDNS_REQUEST_TLSA:
+		ret = rspamd_dns_cache_get (p, end, &c->tlsa.usage,
+				sizeof (c->tlsa.usage)) &&
+				rspamd_dns_cache_get (p, end, &c->tlsa.selector,
+						sizeof (c->tlsa.selector)) &&
+				rspamd_dns_cache_get (p, end, &c->tlsa.match_type,
+						sizeof (c->tlsa.match_type)) &&
+				rspamd_dns_cache_get (p, end, &c->tlsa.datalen,
+						sizeof (c->tlsa.datalen));
+
+		if (ret) {
+			c->tlsa.data = malloc (MAX (c->tlsa.datalen, 1));
+			ret = c->tlsa.data != NULL &&
+					rspamd_dns_cache_get (p, end, c->tlsa.data,
+							c->tlsa.datalen);
+		}
+		break;
+	default:
+		ret = FALSE;
+		break;
+	}
+
+	if (!ret) {
+		/* Partially filled strings are NULL or allocated, so it is safe */
+		rdns_reply_entry_free (elt);
+
+		return NULL;
+	}
+
+	return elt;
+}
+
+struct rdns_reply *
+rspamd_dns_cache_lookup (struct rspamd_dns_cache *cache,
+		struct rdns_resolver *resolver,
+		enum rdns_request_type type,
+		const gchar *name)
+{
+	struct rspamd_dns_cache_slot *set, copy;
+	struct rdns_reply *rep;
+	struct rdns_reply_entry *elt;
+	rspamd_mempool_mutex_t *lock;
+	gchar lc[RSPAMD_DNS_CACHE_MAX_NAME];
+	const guchar *p, *end;
+	gboolean found = FALSE;
+	gdouble now;
+	guint64 h;
+	gsize len;
+	guint i;
+
+	if (cache == NULL || cache->nsets == 0) {
+		return NULL;
+	}
+
+	h = rspamd_dns_cache_key (type, name, lc, &len);
+
+	if (h == 0) {
+		return NULL;
+	}
+
+	set = &cache->slots[(h & (cache->nsets - 1)) * RSPAMD_DNS_CACHE_SET_SLOTS];
+	lock = cache->locks[(h & (cache->nsets - 1)) % RSPAMD_DNS_CACHE_LOCKS];
+	now = rspamd_get_ticks ();
+
+	rspamd_mempool_lock_mutex (lock);
+
+	for (i = 0; i < RSPAMD_DNS_CACHE_SET_SLOTS; i ++) {
+		if (set[i].hash == h && set[i].type == type && set[i].expire > now &&
+				set[i].namelen == len && memcmp (set[i].data, lc, len) == 0) {
+			memcpy (&copy, &set[i], G_STRUCT_OFFSET (struct rspamd_dns_cache_slot,
+					data) + set[i].datalen);
+			found = TRUE;
+			break;
+		}
+	}
+
+	rspamd_mempool_unlock_mutex (lock);
+
+	if (!found) {
+		DNS_CACHE_INC (&cache->counters->misses);
+
+		return NULL;
+	}
+
+	rep = rdns_make_stub_reply (resolver, name, type, copy.rcode);
+
+	if (rep == NULL) {
+		return NULL;
+	}
+
+	rep->authenticated = copy.authenticated;
+	p = copy.data + copy.namelen;
+	end = copy.data + copy.datalen;
+
+	for (i = 0; i < copy.nentries; i ++) {
+		elt = rspamd_dns_cache_deserialize_entry (&p, end,
+				(gint32)(now - copy.stored));
+
+		if (elt == NULL) {
+			rdns_request_release (rep->request);
+			DNS_CACHE_INC (&cache->counters->misses);
+
+			return NULL;
+		}
+
+		DL_APPEND (rep->entries, elt);
+	}
+
+	DNS_CACHE_INC (&cache->counters->hits);
+
+	return rep;
+}
+
+void
+rspamd_dns_cache_insert (struct rspamd_dns_cache *cache,
+		enum rdns_request_type type,
+		const gchar *name,
+		struct rdns_reply *reply)
+{
+	struct rspamd_dns_cache_slot *set, *victim, slot;
+	struct rdns_reply_entry *elt;
+	rspamd_mempool_mutex_t *lock;
+	gdouble ttl = G_MAXDOUBLE, now;
+	guchar *p, *end;
+	guint64 h;
+	gsize len;
+	guint i;
+
+	if (cache == NULL || cache->nsets == 0) {
+		return;
+	}
+
+	if (reply->code == RDNS_RC_NOERROR && reply->entries != NULL) {
+		DL_FOREACH (reply->entries, elt) {
+			ttl = MIN (ttl, elt->ttl);
+		}
+	}
+	else if ((reply->code == RDNS_RC_NXDOMAIN ||
+			reply->code == RDNS_RC_NOREC) && reply->entries == NULL) {
+		/* Negative caching requires SOA record */
+		ttl = reply->negative_ttl;
+	}
+	else {
+		return;
+	}
+
+	ttl = MIN (ttl, cache->max_ttl);
+
+	if (ttl <= 0) {
+		return;
+	}
+
+	h = rspamd_dns_cache_key (type, name, (gchar *)slot.data, &len);
+
+	if (h == 0) {
+		return;
+	}
+
+	now = rspamd_get_ticks ();
+	slot.hash = h;
+	slot.type = type;
+	slot.rcode = reply->code;
+	slot.authenticated = reply->authenticated;
+	slot.namelen = len;
+	slot.nentries = 0;
+	slot.stored = now;
+	slot.expire = now + ttl;
+	slot.unused = 0;
+	p = slot.data + len;
+	end = slot.data + sizeof (slot.data);
+
+	DL_FOREACH (reply->entries, elt) {
+		if (!rspamd_dns_cache_serialize_entry (elt, &p, end)) {
+			DNS_CACHE_INC (&cache->counters->too_large);
+
+			return;
+		}
+
+		slot.nentries ++;
+	}
+
+	slot.datalen = p - slot.data;
+
+	set = &cache->slots[(h & (cache->nsets - 1)) * RSPAMD_DNS_CACHE_SET_SLOTS];
+	lock = cache->locks[(h & (cache->nsets - 1)) % RSPAMD_DNS_CACHE_LOCKS];
+
+	rspamd_mempool_lock_mutex (lock);
+	victim = &set[0];
+
+	for (i = 0; i < RSPAMD_DNS_CACHE_SET_SLOTS; i ++) {
+		if (set[i].hash == h && set[i].type == type) {
+			/* Replace the same element */
+			victim = &set[i];
+			break;
+		}
+
+		/* Otherwise select empty, expired or the oldest one */
+		if (set[i].expire < victim->expire) {
+			victim = &set[i];
+		}
+	}
+
+	memcpy (victim, &slot, G_STRUCT_OFFSET (struct rspamd_dns_cache_slot, data) +
+			slot.datalen);
+	rspamd_mempool_unlock_mutex (lock);
+
+	DNS_CACHE_INC (&cache->counters->stored);
+}
+
+void
+rspamd_dns_cache_inc_coalesced (struct rspamd_dns_cache *cache)
+{
+	if (cache) {
+		DNS_CACHE_INC (&cache->counters->coalesced);
+	}
+}
+
+ucl_object_t *
+rspamd_dns_cache_stat_ucl (struct rspamd_dns_cache *cache)
+{
+	ucl_object_t *obj;
+	struct rspamd_dns_cache_counters cnt;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+
+	if (cache == NULL) {
+		return obj;
+	}
+
+	memcpy (&cnt, cache->counters, sizeof (cnt));
+	ucl_object_insert_key (obj, ucl_object_frombool (cache->nsets > 0),
+			"enabled", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromint (cache->nsets * RSPAMD_DNS_CACHE_SET_SLOTS),
+			"slots", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (cnt.hits),
+			"hits", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (cnt.misses),
+			"misses", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (cnt.coalesced),
+			"coalesced", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (cnt.stored),
+			"stored", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (cnt.too_large),
+			"too_large", 0, false);
+
+	return obj;
+}
@@ -0,0 +1,81 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_DNS_CACHE_H_
+#define SRC_LIBSERVER_DNS_CACHE_H_
+
+#include "config.h"
+#include "mem_pool.h"
+#include "rdns.h"
+#include "ucl.h"
+
+/*
+ * Cache of DNS replies shared between all workers. It is allocated by the
+ * main process before spawning workers and consists of sets of fixed size
+ * slots, each set is protected by a shared mutex. Replies that are too large
+ * to fit in a slot are not cached
+ */
+struct rspamd_dns_cache;
+
+/**
+ * Create new cache in the shared memory
+ * @param pool shared pool used to allocate locks
+ * @param size size of cache in bytes (0 disables caching but counters are
+ * still available)
+ * @param max_ttl maximum time to store replies
+ * @return new cache
+ */
+struct rspamd_dns_cache * rspamd_dns_cache_new (rspamd_mempool_t *pool,
+		gsize size, gdouble max_ttl);
+
+/**
+ * Lookup reply in the cache
+ * @param cache cache object
+ * @param resolver resolver used to create a reply
+ * @param type requested type
+ * @param name requested name
+ * @return new reply (that should be released with
+ * `rdns_request_release (reply->request)`) or NULL if nothing is found
+ */
+struct rdns_reply * rspamd_dns_cache_lookup (struct rspamd_dns_cache *cache,
+		struct rdns_resolver *resolver,
+		enum rdns_request_type type,
+		const gchar *name);
+
+/**
+ * Store reply in the cache if it is cacheable: positive replies are stored
+ * for the minimum TTL of their records and negative replies are stored for
+ * the TTL derived from SOA record
+ * @param cache cache object
+ * @param type requested type
+ * @param name requested name
+ * @param reply reply
+ */
+void rspamd_dns_cache_insert (struct rspamd_dns_cache *cache,
+		enum rdns_request_type type,
+		const gchar *name,
+		struct rdns_reply *reply);
+
+/**
+ * Account request that has been attached to an identical pending request
+ */
+void rspamd_dns_cache_inc_coalesced (struct rspamd_dns_cache *cache);
+
+/**
+ * Export cache counters to UCL
+ */
+ucl_object_t * rspamd_dns_cache_stat_ucl (struct rspamd_dns_cache *cache);
+
+#endif /* SRC_LIBSERVER_DNS_CACHE_H_ */
@@ -18,13 +18,17 @@
 #include "fuzzy_backend.h"
 #include "fuzzy_backend_sqlite.h"
 #include "fuzzy_backend_redis.h"
+#include "fuzzy_backend_memory.h"
 #include "cfg_file.h"
 
 #define DEFAULT_EXPIRE 172800L
+/* Maximum number of checks deferred before they are processed */
+#define MAX_PENDING_CHECKS 128
 
 enum rspamd_fuzzy_backend_type {
 	RSPAMD_FUZZY_BACKEND_SQLITE = 0,
 	RSPAMD_FUZZY_BACKEND_REDIS = 1,
+	RSPAMD_FUZZY_BACKEND_MEMORY = 2,
 };
 
 static void* rspamd_fuzzy_backend_init_sqlite (struct rspamd_fuzzy_backend *bk,
@@ -46,6 +50,8 @@ static void rspamd_fuzzy_backend_version_sqlite (struct rspamd_fuzzy_backend *bk
 		void *subr_ud);
 static const gchar* rspamd_fuzzy_backend_id_sqlite (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
+static void rspamd_fuzzy_backend_flush_sqlite (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud);
 static void rspamd_fuzzy_backend_expire_sqlite (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
 static void rspamd_fuzzy_backend_close_sqlite (struct rspamd_fuzzy_backend *bk,
@@ -73,6 +79,10 @@ struct rspamd_fuzzy_backend_subr {
 	const gchar* (*id) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
 	void (*periodic) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
 	void (*close) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
+	/* Optional: processes checks deferred by the backend */
+	void (*flush) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
+	/* Optional: returns backend specific statistics */
+	ucl_object_t* (*stat) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
 };
 
 static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
@@ -85,6 +95,29 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 		.id = rspamd_fuzzy_backend_id_sqlite,
 		.periodic = rspamd_fuzzy_backend_expire_sqlite,
 		.close = rspamd_fuzzy_backend_close_sqlite,
+		.flush = rspamd_fuzzy_backend_flush_sqlite,
+	},
+	[RSPAMD_FUZZY_BACKEND_REDIS] = {
+		.init = rspamd_fuzzy_backend_init_redis,
+		.check = rspamd_fuzzy_backend_check_redis,
+		.update = rspamd_fuzzy_backend_update_redis,
+		.count = rspamd_fuzzy_backend_count_redis,
+		.version = rspamd_fuzzy_backend_version_redis,
+		.id = rspamd_fuzzy_backend_id_redis,
+		.periodic = rspamd_fuzzy_backend_expire_redis,
+		.close = rspamd_fuzzy_backend_close_redis,
+		.flush = rspamd_fuzzy_backend_flush_redis,
+		.stat = rspamd_fuzzy_backend_stat_redis,
+	},
+	[RSPAMD_FUZZY_BACKEND_MEMORY] = {
+		.init = rspamd_fuzzy_backend_init_memory,
+		.check = rspamd_fuzzy_backend_check_memory,
+		.update = rspamd_fuzzy_backend_update_memory,
+		.count = rspamd_fuzzy_backend_count_memory,
+		.version = rspamd_fuzzy_backend_version_memory,
+		.id = rspamd_fuzzy_backend_id_memory,
+		.periodic = rspamd_fuzzy_backend_expire_memory,
+		.close = rspamd_fuzzy_backend_close_memory,
 	}
 };
 
@@ -98,6 +131,15 @@ struct rspamd_fuzzy_backend {
 	const struct rspamd_fuzzy_backend_subr *subr;
 	void *subr_ud;
 	struct event periodic_event;
+	GArray *pending_checks;
+	struct event flush_event;
+	gboolean flush_scheduled;
+};
+
+struct rspamd_fuzzy_pending_check {
+	struct rspamd_fuzzy_shingle_cmd cmd;
+	rspamd_fuzzy_check_cb cb;
+	void *ud;
 };
 
 static GQuark
@@ -125,19 +167,103 @@ rspamd_fuzzy_backend_init_sqlite (struct rspamd_fuzzy_backend *bk,
 			FALSE, err);
 }
 
+static void
+rspamd_fuzzy_backend_flush_sqlite (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
+	struct rspamd_fuzzy_pending_check *pending;
+	const struct rspamd_fuzzy_cmd **cmds;
+	struct rspamd_fuzzy_reply *reps;
+	GArray *checks;
+	guint i;
+
+	if (bk->flush_scheduled) {
+		event_del (&bk->flush_event);
+		bk->flush_scheduled = FALSE;
+	}
+
+	checks = bk->pending_checks;
+
+	if (checks == NULL || checks->len == 0) {
+		return;
+	}
+
+	/* Callbacks might queue new checks */
+	bk->pending_checks = g_array_sized_new (FALSE, FALSE,
+			sizeof (*pending), MAX_PENDING_CHECKS);
+	cmds = g_malloc (sizeof (*cmds) * checks->len);
+	reps = g_malloc (sizeof (*reps) * checks->len);
+
+	for (i = 0; i < checks->len; i ++) {
+		pending = &g_array_index (checks, struct rspamd_fuzzy_pending_check, i);
+		cmds[i] = &pending->cmd.basic;
+	}
+
+	rspamd_fuzzy_backend_sqlite_check_batch (sq, cmds, reps, checks->len,
+			bk->expire);
+
+	for (i = 0; i < checks->len; i ++) {
+		pending = &g_array_index (checks, struct rspamd_fuzzy_pending_check, i);
+
+		if (pending->cb) {
+			pending->cb (&reps[i], pending->ud);
+		}
+	}
+
+	g_free (cmds);
+	g_free (reps);
+	g_array_free (checks, TRUE);
+}
+
+static void
+rspamd_fuzzy_backend_flush_cb (gint fd, short what, void *ud)
+{
+	struct rspamd_fuzzy_backend *bk = ud;
+
+	bk->flush_scheduled = FALSE;
+	rspamd_fuzzy_backend_flush (bk);
+}
+
 static void
 rspamd_fuzzy_backend_check_sqlite (struct rspamd_fuzzy_backend *bk,
 		const struct rspamd_fuzzy_cmd *cmd,
 		rspamd_fuzzy_check_cb cb, void *ud,
 		void *subr_ud)
 {
-	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
-	struct rspamd_fuzzy_reply rep;
+	struct rspamd_fuzzy_pending_check *pending;
+	struct timeval tv;
 
-	rep = rspamd_fuzzy_backend_sqlite_check (sq, cmd, bk->expire);
+	/*
+	 * Checks are deferred to the end of the current event loop iteration
+	 * (or to an explicit flush), so they are resolved by a single batch
+	 */
+	if (bk->pending_checks == NULL) {
+		bk->pending_checks = g_array_sized_new (FALSE, FALSE,
+				sizeof (*pending), MAX_PENDING_CHECKS);
+	}
 
-	if (cb) {
-		cb (&rep, ud);
+	g_array_set_size (bk->pending_checks, bk->pending_checks->len + 1);
+	pending = &g_array_index (bk->pending_checks,
+			struct rspamd_fuzzy_pending_check,
+			bk->pending_checks->len - 1);
+	memset (&pending->cmd, 0, sizeof (pending->cmd));
+	memcpy (&pending->cmd, cmd, cmd->shingles_count > 0 ?
+			sizeof (pending->cmd) : sizeof (pending->cmd.basic));
+	pending->cb = cb;
+	pending->ud = ud;
+
+	if (bk->pending_checks->len >= MAX_PENDING_CHECKS) {
+		rspamd_fuzzy_backend_flush_sqlite (bk, subr_ud);
+	}
+	else if (!bk->flush_scheduled) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		event_set (&bk->flush_event, -1, EV_TIMEOUT,
+				rspamd_fuzzy_backend_flush_cb, bk);
+		event_base_set (bk->ev_base, &bk->flush_event);
+		event_add (&bk->flush_event, &tv);
+		bk->flush_scheduled = TRUE;
 	}
 }
 
@@ -271,6 +397,9 @@ rspamd_fuzzy_backend_create (struct event_base *ev_base,
 			else if (strcmp (ucl_object_tostring (elt), "redis") == 0) {
 				type = RSPAMD_FUZZY_BACKEND_REDIS;
 			}
+			else if (strcmp (ucl_object_tostring (elt), "memory") == 0) {
+				type = RSPAMD_FUZZY_BACKEND_MEMORY;
+			}
 			else {
 				g_set_error (err, rspamd_fuzzy_backend_quark (),
 						EINVAL, "invalid backend type: %s",
@@ -294,6 +423,8 @@ rspamd_fuzzy_backend_create (struct event_base *ev_base,
 
 	if ((bk->subr_ud = bk->subr->init (bk, config, cfg, err)) == NULL) {
 		g_slice_free1 (sizeof (*bk), bk);
+
+		return NULL;
 	}
 
 	return bk;
@@ -327,6 +458,28 @@ rspamd_fuzzy_backend_process_updates (struct rspamd_fuzzy_backend *bk,
 }
 
 
+void
+rspamd_fuzzy_backend_flush (struct rspamd_fuzzy_backend *bk)
+{
+	g_assert (bk != NULL);
+
+	if (bk->subr->flush) {
+		bk->subr->flush (bk, bk->subr_ud);
+	}
+}
+
+ucl_object_t *
+rspamd_fuzzy_backend_stat (struct rspamd_fuzzy_backend *bk)
+{
+	g_assert (bk != NULL);
+
+	if (bk->subr->stat) {
+		return bk->subr->stat (bk, bk->subr_ud);
+	}
+
+	return NULL;
+}
+
 void
 rspamd_fuzzy_backend_count (struct rspamd_fuzzy_backend *bk,
 		rspamd_fuzzy_count_cb cb, void *ud)
@@ -432,6 +585,13 @@ rspamd_fuzzy_backend_close (struct rspamd_fuzzy_backend *bk)
 		event_del (&bk->periodic_event);
 	}
 
+	/* Answer all deferred checks */
+	rspamd_fuzzy_backend_flush (bk);
+
+	if (bk->pending_checks) {
+		g_array_free (bk->pending_checks, TRUE);
+	}
+
 	bk->subr->close (bk, bk->subr_ud);
 
 	g_slice_free1 (sizeof (*bk), bk);
@@ -442,3 +602,9 @@ rspamd_fuzzy_backend_event_base (struct rspamd_fuzzy_backend *backend)
 {
 	return backend->ev_base;
 }
+
+gdouble
+rspamd_fuzzy_backend_get_expire (struct rspamd_fuzzy_backend *backend)
+{
+	return backend->expire;
+}
@@ -55,6 +55,14 @@ void rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *bk,
 		const struct rspamd_fuzzy_cmd *cmd,
 		rspamd_fuzzy_check_cb cb, void *ud);
 
+/**
+ * Process checks that are deferred by a backend to be resolved in batch,
+ * callbacks for such checks are called before this function returns. Deferred
+ * checks are processed at the end of the event loop iteration anyway.
+ * @param bk
+ */
+void rspamd_fuzzy_backend_flush (struct rspamd_fuzzy_backend *bk);
+
 /**
  * Process updates for a specific queue
  * @param bk
@@ -85,6 +93,14 @@ void rspamd_fuzzy_backend_version (struct rspamd_fuzzy_backend *bk,
 		const gchar *src,
 		rspamd_fuzzy_version_cb cb, void *ud);
 
+/**
+ * Returns backend specific statistics (e.g. latencies of requests) or NULL
+ * if a backend does not support it
+ * @param bk
+ * @return new ucl object
+ */
+ucl_object_t * rspamd_fuzzy_backend_stat (struct rspamd_fuzzy_backend *bk);
+
 /**
  * Returns unique id for backend
  * @param backend
@@ -103,6 +119,13 @@ void rspamd_fuzzy_backend_start_update (struct rspamd_fuzzy_backend *backend,
 
 struct event_base* rspamd_fuzzy_backend_event_base (struct rspamd_fuzzy_backend *backend);
 
+/**
+ * Returns expire time for hashes in seconds
+ * @param backend
+ * @return
+ */
+gdouble rspamd_fuzzy_backend_get_expire (struct rspamd_fuzzy_backend *backend);
+
 /**
  * Closes backend
  * @param backend
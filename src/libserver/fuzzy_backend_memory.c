@@ -0,0 +1,1715 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "fuzzy_backend.h"
+#include "fuzzy_backend_memory.h"
+#include "cryptobox.h"
+#include "str_util.h"
+#include "util.h"
+#include "unix-std.h"
+#include <sys/mman.h>
+
+/*
+ * Storage layout:
+ *
+ * - `path` is a snapshot: header, shards descriptors and then raw arrays of
+ *   digests, digests index slots and shingles index slots. These arrays are
+ *   used directly from the private mapping of the file.
+ * - `path`.journal is an append only file of fixed size records. Each update
+ *   is appended to the journal and then applied to the memory by replaying
+ *   the journal, so all processes that share the same files apply updates in
+ *   the same order.
+ * - `path`.lock is used to serialize writers, compaction and reloading.
+ *
+ * Compaction writes a new snapshot with the next generation and a new empty
+ * journal of the same generation. Other processes detect that the journal has
+ * been replaced and reload the snapshot.
+ */
+
+#define RSPAMD_FUZZY_MEM_DEFAULT_SHARDS 16
+#define RSPAMD_FUZZY_MEM_MAX_SHARDS 256
+#define RSPAMD_FUZZY_MEM_DEFAULT_POLL 1.0
+#define RSPAMD_FUZZY_MEM_MIN_COMPACT 1024
+#define RSPAMD_FUZZY_MEM_MIN_SLOTS 16
+#define RSPAMD_FUZZY_MEM_REPLAY_BATCH 32
+#define RSPAMD_FUZZY_MEM_EMPTY ((guint32)-1)
+#define RSPAMD_FUZZY_MEM_REC_MAGIC 0x314a4652U
+
+static const guchar rspamd_fuzzy_mem_snap_magic[8] = {
+		'r', 's', 'f', 'z', 's', 'n', 'p', '1'
+};
+static const guchar rspamd_fuzzy_mem_journal_magic[8] = {
+		'r', 's', 'f', 'z', 'j', 'r', 'n', '1'
+};
+
+enum rspamd_fuzzy_mem_op {
+	RSPAMD_FUZZY_MEM_OP_ADD = 1,
+	RSPAMD_FUZZY_MEM_OP_DEL,
+	RSPAMD_FUZZY_MEM_OP_VERSION,
+};
+
+enum rspamd_fuzzy_mem_shard_flags {
+	RSPAMD_FUZZY_MEM_DIGESTS_MAPPED = (1 << 0),
+	RSPAMD_FUZZY_MEM_SLOTS_MAPPED = (1 << 1),
+	RSPAMD_FUZZY_MEM_SHINGLES_MAPPED = (1 << 2),
+};
+
+/* All on-disk structures have sizes aligned to 8 bytes */
+struct rspamd_fuzzy_mem_digest {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	gint64 time;
+	gint32 value;
+	guint32 flag;
+	guint32 deleted;
+	guint32 unused;
+};
+
+struct rspamd_fuzzy_mem_shingle {
+	guint64 value;
+	guint32 idx; /* index of digest in its shard */
+	guint16 shard;
+	guint16 number;
+};
+
+struct rspamd_fuzzy_mem_snap_hdr {
+	guchar magic[8];
+	guint64 generation;
+	guint32 nshards;
+	guint32 nsources;
+	guint64 sources_off;
+};
+
+struct rspamd_fuzzy_mem_snap_shard {
+	guint64 digests_off;
+	guint64 slots_off;
+	guint64 shingles_off;
+	guint32 ndigests;
+	guint32 nslots;
+	guint32 nshingles;
+	guint32 shingles_size;
+};
+
+struct rspamd_fuzzy_mem_snap_source {
+	gchar name[64];
+	gint64 version;
+};
+
+struct rspamd_fuzzy_mem_journal_hdr {
+	guchar magic[8];
+	guint64 generation;
+};
+
+struct rspamd_fuzzy_mem_journal_rec {
+	guint32 magic;
+	guint32 op;
+	gint64 time;
+	gint64 value; /* value for digests and version for sources */
+	guint32 flag;
+	guint32 nshingles;
+	guchar key[rspamd_cryptobox_HASHBYTES]; /* digest or source name */
+	guint64 shingles[RSPAMD_SHINGLE_SIZE];
+};
+
+struct rspamd_fuzzy_mem_shard {
+	struct rspamd_fuzzy_mem_digest *digests;
+	guint32 *slots;
+	struct rspamd_fuzzy_mem_shingle *shingles;
+	guint32 ndigests;
+	guint32 digests_size;
+	guint32 nslots;
+	guint32 nshingles;
+	guint32 shingles_size;
+	guint flags;
+};
+
+struct rspamd_fuzzy_backend_memory {
+	gchar *path;
+	gchar *journal_path;
+	gchar *lock_path;
+	gint lock_fd;
+	gint journal_fd;
+	dev_t journal_dev;
+	ino_t journal_ino;
+	goffset journal_off;
+	guint64 journal_records;
+	guint64 generation;
+	guchar *map;
+	gsize map_len;
+	struct rspamd_fuzzy_mem_shard *shards;
+	guint nshards;
+	guint64 count;
+	guint64 deleted;
+	GHashTable *sources;
+	gboolean fsync;
+	gdouble poll_interval;
+	struct event poll_ev;
+	struct rspamd_fuzzy_backend *bk;
+	gchar id[MEMPOOL_UID_LEN];
+	rspamd_mempool_t *pool;
+};
+
+#define msg_err_fuzzy_backend(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_warn_fuzzy_backend(...)   rspamd_default_log_function (G_LOG_LEVEL_WARNING, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_info_fuzzy_backend(...)   rspamd_default_log_function (G_LOG_LEVEL_INFO, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_debug_fuzzy_backend(...)  rspamd_default_log_function (G_LOG_LEVEL_DEBUG, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+
+static GQuark
+rspamd_fuzzy_backend_memory_quark (void)
+{
+	return g_quark_from_static_string ("fuzzy-backend-memory");
+}
+
+static inline guint32
+rspamd_fuzzy_mem_table_size (guint32 n)
+{
+	guint32 size = RSPAMD_FUZZY_MEM_MIN_SLOTS;
+
+	/* Keep load factor below 3/4 */
+	while ((guint64)n * 4 >= (guint64)size * 3) {
+		size <<= 1;
+	}
+
+	return size;
+}
+
+static inline guint64
+rspamd_fuzzy_mem_shingle_hash (guint64 value, guint number)
+{
+	guint64 h = value ^ ((guint64)(number + 1) * 0x9E3779B97F4A7C15ULL);
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static inline struct rspamd_fuzzy_mem_shard *
+rspamd_fuzzy_mem_digest_shard (struct rspamd_fuzzy_backend_memory *backend,
+		const guchar *digest)
+{
+	return &backend->shards[digest[0] & (backend->nshards - 1)];
+}
+
+/*
+ * Returns slot that either points to the specified digest or is empty
+ */
+static guint32 *
+rspamd_fuzzy_mem_digest_slot (const struct rspamd_fuzzy_mem_digest *digests,
+		guint32 *slots, guint32 nslots, const guchar *digest)
+{
+	guint64 h;
+	guint32 mask = nslots - 1, pos;
+
+	memcpy (&h, digest + sizeof (h), sizeof (h));
+	pos = h & mask;
+
+	for (;;) {
+		if (slots[pos] == RSPAMD_FUZZY_MEM_EMPTY ||
+				memcmp (digests[slots[pos]].digest, digest,
+						rspamd_cryptobox_HASHBYTES) == 0) {
+			return &slots[pos];
+		}
+
+		pos = (pos + 1) & mask;
+	}
+}
+
+static struct rspamd_fuzzy_mem_shingle *
+rspamd_fuzzy_mem_shingle_slot (struct rspamd_fuzzy_mem_shingle *shingles,
+		guint32 size, guint64 value, guint number)
+{
+	guint32 mask = size - 1, pos;
+
+	pos = (rspamd_fuzzy_mem_shingle_hash (value, number) >> 8) & mask;
+
+	for (;;) {
+		if (shingles[pos].idx == RSPAMD_FUZZY_MEM_EMPTY ||
+				(shingles[pos].value == value &&
+						shingles[pos].number == number)) {
+			return &shingles[pos];
+		}
+
+		pos = (pos + 1) & mask;
+	}
+}
+
+static inline struct rspamd_fuzzy_mem_shard *
+rspamd_fuzzy_mem_shingle_shard (struct rspamd_fuzzy_backend_memory *backend,
+		guint64 value, guint number)
+{
+	return &backend->shards[
+			(rspamd_fuzzy_mem_shingle_hash (value, number) >> 56) &
+			(backend->nshards - 1)];
+}
+
+static void
+rspamd_fuzzy_mem_grow_digests (struct rspamd_fuzzy_mem_shard *shard)
+{
+	struct rspamd_fuzzy_mem_digest *ndigests;
+	guint32 nsize, *nslots, i, *slot;
+
+	if (shard->ndigests == shard->digests_size) {
+		nsize = MAX (RSPAMD_FUZZY_MEM_MIN_SLOTS, shard->digests_size * 2);
+
+		if (shard->flags & RSPAMD_FUZZY_MEM_DIGESTS_MAPPED) {
+			ndigests = g_malloc (nsize * sizeof (*ndigests));
+			memcpy (ndigests, shard->digests,
+					shard->ndigests * sizeof (*ndigests));
+			shard->flags &= ~RSPAMD_FUZZY_MEM_DIGESTS_MAPPED;
+		}
+		else {
+			ndigests = g_realloc (shard->digests, nsize * sizeof (*ndigests));
+		}
+
+		shard->digests = ndigests;
+		shard->digests_size = nsize;
+	}
+
+	if ((guint64)(shard->ndigests + 1) * 4 >= (guint64)shard->nslots * 3) {
+		nsize = shard->nslots * 2;
+		nslots = g_malloc (nsize * sizeof (*nslots));
+		memset (nslots, 0xff, nsize * sizeof (*nslots));
+
+		for (i = 0; i < shard->ndigests; i ++) {
+			slot = rspamd_fuzzy_mem_digest_slot (shard->digests, nslots, nsize,
+					shard->digests[i].digest);
+			*slot = i;
+		}
+
+		if (!(shard->flags & RSPAMD_FUZZY_MEM_SLOTS_MAPPED)) {
+			g_free (shard->slots);
+		}
+
+		shard->flags &= ~RSPAMD_FUZZY_MEM_SLOTS_MAPPED;
+		shard->slots = nslots;
+		shard->nslots = nsize;
+	}
+}
+
+static void
+rspamd_fuzzy_mem_grow_shingles (struct rspamd_fuzzy_mem_shard *shard)
+{
+	struct rspamd_fuzzy_mem_shingle *nshingles, *elt;
+	guint32 nsize, i;
+
+	if ((guint64)(shard->nshingles + 1) * 4 >= (guint64)shard->shingles_size * 3) {
+		nsize = shard->shingles_size * 2;
+		nshingles = g_malloc (nsize * sizeof (*nshingles));
+		memset (nshingles, 0xff, nsize * sizeof (*nshingles));
+
+		for (i = 0; i < shard->shingles_size; i ++) {
+			if (shard->shingles[i].idx != RSPAMD_FUZZY_MEM_EMPTY) {
+				elt = rspamd_fuzzy_mem_shingle_slot (nshingles, nsize,
+						shard->shingles[i].value, shard->shingles[i].number);
+				*elt = shard->shingles[i];
+			}
+		}
+
+		if (!(shard->flags & RSPAMD_FUZZY_MEM_SHINGLES_MAPPED)) {
+			g_free (shard->shingles);
+		}
+
+		shard->flags &= ~RSPAMD_FUZZY_MEM_SHINGLES_MAPPED;
+		shard->shingles = nshingles;
+		shard->shingles_size = nsize;
+	}
+}
+
+static void
+rspamd_fuzzy_mem_apply_add (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_mem_journal_rec *rec)
+{
+	struct rspamd_fuzzy_mem_shard *shard, *sh_shard;
+	struct rspamd_fuzzy_mem_digest *dig;
+	struct rspamd_fuzzy_mem_shingle *elt;
+	guint32 *slot, idx, i;
+
+	shard = rspamd_fuzzy_mem_digest_shard (backend, rec->key);
+	slot = rspamd_fuzzy_mem_digest_slot (shard->digests, shard->slots,
+			shard->nslots, rec->key);
+
+	if (*slot != RSPAMD_FUZZY_MEM_EMPTY) {
+		dig = &shard->digests[*slot];
+
+		if (!dig->deleted) {
+			if (dig->flag == rec->flag) {
+				/* We need to increase weight */
+				dig->value += rec->value;
+			}
+			else {
+				/* We need to relearn actually */
+				dig->value = rec->value;
+				dig->flag = rec->flag;
+			}
+
+			dig->time = rec->time;
+
+			return;
+		}
+
+		/*
+		 * Do not revive deleted element in place: its old shingles still
+		 * point to its index and would match the new digest. Deleted element
+		 * is left as garbage for compaction, whilst the slot is moved to the
+		 * new element (rehashing also keeps the latest duplicate)
+		 */
+	}
+
+	rspamd_fuzzy_mem_grow_digests (shard);
+	/* Table might be rehashed */
+	slot = rspamd_fuzzy_mem_digest_slot (shard->digests, shard->slots,
+			shard->nslots, rec->key);
+	idx = shard->ndigests ++;
+	*slot = idx;
+	dig = &shard->digests[idx];
+	memcpy (dig->digest, rec->key, sizeof (dig->digest));
+	dig->deleted = 0;
+	dig->unused = 0;
+
+	dig->value = rec->value;
+	dig->flag = rec->flag;
+	dig->time = rec->time;
+	backend->count ++;
+
+	for (i = 0; i < rec->nshingles && i < RSPAMD_SHINGLE_SIZE; i ++) {
+		sh_shard = rspamd_fuzzy_mem_shingle_shard (backend, rec->shingles[i], i);
+		rspamd_fuzzy_mem_grow_shingles (sh_shard);
+		elt = rspamd_fuzzy_mem_shingle_slot (sh_shard->shingles,
+				sh_shard->shingles_size, rec->shingles[i], i);
+
+		if (elt->idx == RSPAMD_FUZZY_MEM_EMPTY) {
+			sh_shard->nshingles ++;
+		}
+
+		elt->value = rec->shingles[i];
+		elt->number = i;
+		elt->shard = shard - backend->shards;
+		elt->idx = idx;
+	}
+}
+
+static void
+rspamd_fuzzy_mem_apply_del (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_mem_journal_rec *rec)
+{
+	struct rspamd_fuzzy_mem_shard *shard;
+	struct rspamd_fuzzy_mem_digest *dig;
+	guint32 *slot;
+
+	shard = rspamd_fuzzy_mem_digest_shard (backend, rec->key);
+	slot = rspamd_fuzzy_mem_digest_slot (shard->digests, shard->slots,
+			shard->nslots, rec->key);
+
+	if (*slot != RSPAMD_FUZZY_MEM_EMPTY) {
+		dig = &shard->digests[*slot];
+
+		if (!dig->deleted) {
+			/* Shingles are cleaned on compaction */
+			dig->deleted = 1;
+			backend->count --;
+			backend->deleted ++;
+		}
+	}
+}
+
+static gint64
+rspamd_fuzzy_mem_source_version (struct rspamd_fuzzy_backend_memory *backend,
+		const gchar *src)
+{
+	gint64 *pver;
+
+	pver = g_hash_table_lookup (backend->sources, src);
+
+	return pver != NULL ? *pver : -1;
+}
+
+static void
+rspamd_fuzzy_mem_set_version (struct rspamd_fuzzy_backend_memory *backend,
+		const gchar *src, gint64 version)
+{
+	gint64 *pver;
+
+	pver = g_hash_table_lookup (backend->sources, src);
+
+	if (pver == NULL) {
+		pver = g_malloc (sizeof (*pver));
+		g_hash_table_insert (backend->sources, g_strdup (src), pver);
+	}
+
+	*pver = version;
+}
+
+static void
+rspamd_fuzzy_mem_apply (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_mem_journal_rec *rec)
+{
+	gchar name[sizeof (rec->key) + 1];
+
+	switch (rec->op) {
+	case RSPAMD_FUZZY_MEM_OP_ADD:
+		rspamd_fuzzy_mem_apply_add (backend, rec);
+		break;
+	case RSPAMD_FUZZY_MEM_OP_DEL:
+		rspamd_fuzzy_mem_apply_del (backend, rec);
+		break;
+	case RSPAMD_FUZZY_MEM_OP_VERSION:
+		rspamd_strlcpy (name, (const gchar *)rec->key, sizeof (name));
+		rspamd_fuzzy_mem_set_version (backend, name, rec->value);
+		break;
+	default:
+		msg_warn_fuzzy_backend ("unknown journal operation: %ud", rec->op);
+		break;
+	}
+}
+
+static void
+rspamd_fuzzy_mem_free_state (struct rspamd_fuzzy_backend_memory *backend)
+{
+	struct rspamd_fuzzy_mem_shard *shard;
+	guint i;
+
+	if (backend->shards) {
+		for (i = 0; i < backend->nshards; i ++) {
+			shard = &backend->shards[i];
+
+			if (!(shard->flags & RSPAMD_FUZZY_MEM_DIGESTS_MAPPED)) {
+				g_free (shard->digests);
+			}
+			if (!(shard->flags & RSPAMD_FUZZY_MEM_SLOTS_MAPPED)) {
+				g_free (shard->slots);
+			}
+			if (!(shard->flags & RSPAMD_FUZZY_MEM_SHINGLES_MAPPED)) {
+				g_free (shard->shingles);
+			}
+		}
+
+		g_free (backend->shards);
+		backend->shards = NULL;
+	}
+
+	if (backend->map) {
+		munmap (backend->map, backend->map_len);
+		backend->map = NULL;
+		backend->map_len = 0;
+	}
+
+	g_hash_table_remove_all (backend->sources);
+	backend->count = 0;
+	backend->deleted = 0;
+}
+
+static void
+rspamd_fuzzy_mem_init_empty (struct rspamd_fuzzy_backend_memory *backend,
+		guint nshards)
+{
+	struct rspamd_fuzzy_mem_shard *shard;
+	guint i;
+
+	backend->nshards = nshards;
+	backend->shards = g_malloc0 (nshards * sizeof (*backend->shards));
+	backend->generation = 0;
+
+	for (i = 0; i < nshards; i ++) {
+		shard = &backend->shards[i];
+		shard->nslots = RSPAMD_FUZZY_MEM_MIN_SLOTS;
+		shard->slots = g_malloc (shard->nslots * sizeof (*shard->slots));
+		memset (shard->slots, 0xff, shard->nslots * sizeof (*shard->slots));
+		shard->shingles_size = RSPAMD_FUZZY_MEM_MIN_SLOTS;
+		shard->shingles = g_malloc (shard->shingles_size *
+				sizeof (*shard->shingles));
+		memset (shard->shingles, 0xff, shard->shingles_size *
+				sizeof (*shard->shingles));
+	}
+}
+
+static gint
+rspamd_fuzzy_mem_int64_cmp (const void *a, const void *b)
+{
+	gint64 ia = *(gint64 *)a, ib = *(gint64 *)b;
+
+	return ia < ib ? -1 : (ia > ib ? 1 : 0);
+}
+
+static inline gboolean
+rspamd_fuzzy_mem_check_region (gsize len, guint64 off, guint64 size)
+{
+	return off <= len && size <= len - off && (off & 7) == 0;
+}
+
+/*
+ * Indices stored in the snapshot are used without checks on lookups, so they
+ * are validated once on load: every digest slot must be empty or point to a
+ * digest of the same shard, every shingle must be empty or point to an
+ * existing digest and have a valid number. Both tables must have at least
+ * one empty slot as probing stops only on empty slots
+ */
+static gboolean
+rspamd_fuzzy_mem_check_indices (const guchar *map,
+		const struct rspamd_fuzzy_mem_snap_shard *shdrs, guint nshards)
+{
+	const struct rspamd_fuzzy_mem_snap_shard *sh;
+	const struct rspamd_fuzzy_mem_digest *digests;
+	const struct rspamd_fuzzy_mem_shingle *shingles;
+	const guint32 *slots;
+	guint32 j, nempty, nused;
+	guint i;
+
+	for (i = 0; i < nshards; i ++) {
+		sh = &shdrs[i];
+		digests = (const struct rspamd_fuzzy_mem_digest *)
+				(map + sh->digests_off);
+		slots = (const guint32 *)(map + sh->slots_off);
+		nempty = 0;
+
+		for (j = 0; j < sh->nslots; j ++) {
+			if (slots[j] == RSPAMD_FUZZY_MEM_EMPTY) {
+				nempty ++;
+			}
+			else if (slots[j] >= sh->ndigests ||
+					(digests[slots[j]].digest[0] & (nshards - 1)) != i) {
+				return FALSE;
+			}
+		}
+
+		if (nempty == 0 || sh->nslots - nempty != sh->ndigests) {
+			return FALSE;
+		}
+
+		shingles = (const struct rspamd_fuzzy_mem_shingle *)
+				(map + sh->shingles_off);
+		nused = 0;
+
+		for (j = 0; j < sh->shingles_size; j ++) {
+			if (shingles[j].idx == RSPAMD_FUZZY_MEM_EMPTY) {
+				continue;
+			}
+
+			if (shingles[j].shard >= nshards ||
+					shingles[j].idx >= shdrs[shingles[j].shard].ndigests ||
+					shingles[j].number >= RSPAMD_SHINGLE_SIZE) {
+				return FALSE;
+			}
+
+			nused ++;
+		}
+
+		if (nused != sh->nshingles || nused == sh->shingles_size) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Maps snapshot and replaces the current state with it, returns FALSE and
+ * keeps the current state if snapshot is broken
+ */
+static gboolean
+rspamd_fuzzy_mem_load_snapshot (struct rspamd_fuzzy_backend_memory *backend,
+		guint nshards, GError **err)
+{
+	gint fd;
+	struct stat st;
+	guchar *map;
+	struct rspamd_fuzzy_mem_snap_hdr *hdr;
+	struct rspamd_fuzzy_mem_snap_shard *shdrs;
+	struct rspamd_fuzzy_mem_snap_source *src;
+	struct rspamd_fuzzy_mem_shard *shard;
+	gchar name[sizeof (src->name) + 1];
+	guint i;
+
+	fd = open (backend->path, O_RDONLY);
+
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			rspamd_fuzzy_mem_free_state (backend);
+			rspamd_fuzzy_mem_init_empty (backend, nshards);
+
+			return TRUE;
+		}
+
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+				"cannot open snapshot %s: %s", backend->path, strerror (errno));
+
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1 || st.st_size < (gint64)sizeof (*hdr)) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), EINVAL,
+				"cannot use snapshot %s: truncated file", backend->path);
+		close (fd);
+
+		return FALSE;
+	}
+
+	/* Private mapping allows to modify data in place */
+	map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+				"cannot mmap snapshot %s: %s", backend->path, strerror (errno));
+
+		return FALSE;
+	}
+
+	hdr = (struct rspamd_fuzzy_mem_snap_hdr *)map;
+	shdrs = (struct rspamd_fuzzy_mem_snap_shard *)(map + sizeof (*hdr));
+
+	if (memcmp (hdr->magic, rspamd_fuzzy_mem_snap_magic,
+			sizeof (hdr->magic)) != 0 ||
+			hdr->nshards == 0 || hdr->nshards > RSPAMD_FUZZY_MEM_MAX_SHARDS ||
+			(hdr->nshards & (hdr->nshards - 1)) != 0 ||
+			!rspamd_fuzzy_mem_check_region (st.st_size, sizeof (*hdr),
+					(guint64)hdr->nshards * sizeof (*shdrs)) ||
+			!rspamd_fuzzy_mem_check_region (st.st_size, hdr->sources_off,
+					(guint64)hdr->nsources * sizeof (*src))) {
+		goto invalid;
+	}
+
+	for (i = 0; i < hdr->nshards; i ++) {
+		if (shdrs[i].nslots < RSPAMD_FUZZY_MEM_MIN_SLOTS ||
+				(shdrs[i].nslots & (shdrs[i].nslots - 1)) != 0 ||
+				shdrs[i].shingles_size < RSPAMD_FUZZY_MEM_MIN_SLOTS ||
+				(shdrs[i].shingles_size & (shdrs[i].shingles_size - 1)) != 0 ||
+				shdrs[i].ndigests >= shdrs[i].nslots ||
+				shdrs[i].nshingles >= shdrs[i].shingles_size ||
+				!rspamd_fuzzy_mem_check_region (st.st_size, shdrs[i].digests_off,
+						(guint64)shdrs[i].ndigests *
+						sizeof (struct rspamd_fuzzy_mem_digest)) ||
+				!rspamd_fuzzy_mem_check_region (st.st_size, shdrs[i].slots_off,
+						(guint64)shdrs[i].nslots * sizeof (guint32)) ||
+				!rspamd_fuzzy_mem_check_region (st.st_size, shdrs[i].shingles_off,
+						(guint64)shdrs[i].shingles_size *
+						sizeof (struct rspamd_fuzzy_mem_shingle))) {
+			goto invalid;
+		}
+	}
+
+	if (!rspamd_fuzzy_mem_check_indices (map, shdrs, hdr->nshards)) {
+		goto invalid;
+	}
+
+	if (hdr->nshards != nshards) {
+		msg_info_fuzzy_backend ("snapshot %s has %ud shards, ignore configured "
+				"value: %ud", backend->path, hdr->nshards, nshards);
+	}
+
+	rspamd_fuzzy_mem_free_state (backend);
+	backend->map = map;
+	backend->map_len = st.st_size;
+	backend->generation = hdr->generation;
+	backend->nshards = hdr->nshards;
+	backend->shards = g_malloc0 (hdr->nshards * sizeof (*backend->shards));
+
+	for (i = 0; i < hdr->nshards; i ++) {
+		shard = &backend->shards[i];
+		shard->digests = (struct rspamd_fuzzy_mem_digest *)
+				(map + shdrs[i].digests_off);
+		shard->ndigests = shdrs[i].ndigests;
+		shard->digests_size = shdrs[i].ndigests;
+		shard->slots = (guint32 *)(map + shdrs[i].slots_off);
+		shard->nslots = shdrs[i].nslots;
+		shard->shingles = (struct rspamd_fuzzy_mem_shingle *)
+				(map + shdrs[i].shingles_off);
+		shard->nshingles = shdrs[i].nshingles;
+		shard->shingles_size = shdrs[i].shingles_size;
+		shard->flags = RSPAMD_FUZZY_MEM_DIGESTS_MAPPED |
+				RSPAMD_FUZZY_MEM_SLOTS_MAPPED |
+				RSPAMD_FUZZY_MEM_SHINGLES_MAPPED;
+		/* Snapshot contains merely live digests */
+		backend->count += shard->ndigests;
+	}
+
+	src = (struct rspamd_fuzzy_mem_snap_source *)(map + hdr->sources_off);
+
+	for (i = 0; i < hdr->nsources; i ++) {
+		rspamd_strlcpy (name, src[i].name, sizeof (name));
+		rspamd_fuzzy_mem_set_version (backend, name, src[i].version);
+	}
+
+	msg_info_fuzzy_backend ("loaded snapshot %s, generation %uL: %uL hashes",
+			backend->path, backend->generation, backend->count);
+
+	return TRUE;
+
+invalid:
+	munmap (map, st.st_size);
+	g_set_error (err, rspamd_fuzzy_backend_memory_quark (), EINVAL,
+			"cannot use snapshot %s: invalid format", backend->path);
+
+	return FALSE;
+}
+
+static gboolean
+rspamd_fuzzy_mem_write_full (gint fd, const void *data, gsize len)
+{
+	const guchar *p = data;
+	gssize r;
+
+	while (len > 0) {
+		r = write (fd, p, len);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return FALSE;
+		}
+
+		p += r;
+		len -= r;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_fuzzy_mem_create_journal (struct rspamd_fuzzy_backend_memory *backend,
+		GError **err)
+{
+	struct rspamd_fuzzy_mem_journal_hdr hdr;
+	gchar *tmp;
+	gint fd;
+
+	tmp = g_strconcat (backend->journal_path, ".new", NULL);
+	fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+				"cannot create journal %s: %s", tmp, strerror (errno));
+		g_free (tmp);
+
+		return FALSE;
+	}
+
+	memcpy (hdr.magic, rspamd_fuzzy_mem_journal_magic, sizeof (hdr.magic));
+	hdr.generation = backend->generation;
+
+	if (!rspamd_fuzzy_mem_write_full (fd, &hdr, sizeof (hdr)) ||
+			fsync (fd) == -1 || rename (tmp, backend->journal_path) == -1) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+				"cannot write journal %s: %s", tmp, strerror (errno));
+		close (fd);
+		unlink (tmp);
+		g_free (tmp);
+
+		return FALSE;
+	}
+
+	close (fd);
+	g_free (tmp);
+
+	return TRUE;
+}
+
+/*
+ * Opens the journal matching the current snapshot, must be called with lock held
+ */
+static gboolean
+rspamd_fuzzy_mem_open_journal (struct rspamd_fuzzy_backend_memory *backend,
+		GError **err)
+{
+	struct rspamd_fuzzy_mem_journal_hdr hdr;
+	struct stat st;
+	goffset tail;
+	gint fd, attempt;
+
+	if (backend->journal_fd != -1) {
+		close (backend->journal_fd);
+		backend->journal_fd = -1;
+	}
+
+	for (attempt = 0; attempt < 2; attempt ++) {
+		fd = open (backend->journal_path, O_RDWR | O_APPEND);
+
+		if (fd == -1) {
+			if (errno == ENOENT && attempt == 0) {
+				if (!rspamd_fuzzy_mem_create_journal (backend, err)) {
+					return FALSE;
+				}
+
+				continue;
+			}
+
+			g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+					"cannot open journal %s: %s", backend->journal_path,
+					strerror (errno));
+
+			return FALSE;
+		}
+
+		if (pread (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr) ||
+				memcmp (hdr.magic, rspamd_fuzzy_mem_journal_magic,
+						sizeof (hdr.magic)) != 0) {
+			g_set_error (err, rspamd_fuzzy_backend_memory_quark (), EINVAL,
+					"cannot use journal %s: invalid format",
+					backend->journal_path);
+			close (fd);
+
+			return FALSE;
+		}
+
+		if (hdr.generation < backend->generation && attempt == 0) {
+			/* Compaction has been interrupted, journal is in the snapshot */
+			close (fd);
+
+			if (!rspamd_fuzzy_mem_create_journal (backend, err)) {
+				return FALSE;
+			}
+
+			continue;
+		}
+
+		if (hdr.generation != backend->generation) {
+			msg_warn_fuzzy_backend ("journal %s generation %uL does not match "
+					"snapshot generation %uL", backend->journal_path,
+					hdr.generation, backend->generation);
+		}
+
+		if (fstat (fd, &st) == -1) {
+			g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+					"cannot stat journal %s: %s", backend->journal_path,
+					strerror (errno));
+			close (fd);
+
+			return FALSE;
+		}
+
+		/*
+		 * Writers append under the same lock, so an incomplete tail here is
+		 * a leftover of a crashed writer: drop it, otherwise all subsequent
+		 * records would be misaligned
+		 */
+		tail = (st.st_size - sizeof (hdr)) % sizeof (struct rspamd_fuzzy_mem_journal_rec);
+
+		if (st.st_size > (goffset)sizeof (hdr) && tail != 0) {
+			if (ftruncate (fd, st.st_size - tail) == -1) {
+				g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+						"cannot truncate journal %s: %s", backend->journal_path,
+						strerror (errno));
+				close (fd);
+
+				return FALSE;
+			}
+
+			msg_warn_fuzzy_backend ("dropped incomplete record of %z bytes "
+					"at the end of journal %s", (gsize)tail,
+					backend->journal_path);
+		}
+
+		backend->journal_fd = fd;
+		backend->journal_dev = st.st_dev;
+		backend->journal_ino = st.st_ino;
+		backend->journal_off = sizeof (hdr);
+		backend->journal_records = 0;
+
+		return TRUE;
+	}
+
+	g_set_error (err, rspamd_fuzzy_backend_memory_quark (), EINVAL,
+			"cannot open journal %s", backend->journal_path);
+
+	return FALSE;
+}
+
+/*
+ * Applies all complete records appended to the journal since the last call
+ */
+static void
+rspamd_fuzzy_mem_replay (struct rspamd_fuzzy_backend_memory *backend)
+{
+	struct rspamd_fuzzy_mem_journal_rec recs[RSPAMD_FUZZY_MEM_REPLAY_BATCH];
+	struct stat st;
+	gssize r;
+	guint i, nrecs;
+
+	if (backend->journal_fd == -1 || fstat (backend->journal_fd, &st) == -1) {
+		return;
+	}
+
+	while (st.st_size - backend->journal_off >= (goffset)sizeof (recs[0])) {
+		nrecs = MIN (RSPAMD_FUZZY_MEM_REPLAY_BATCH,
+				(st.st_size - backend->journal_off) / sizeof (recs[0]));
+		r = pread (backend->journal_fd, recs, nrecs * sizeof (recs[0]),
+				backend->journal_off);
+
+		if (r < (gssize)sizeof (recs[0])) {
+			if (r == -1) {
+				msg_err_fuzzy_backend ("cannot read journal %s: %s",
+						backend->journal_path, strerror (errno));
+			}
+
+			return;
+		}
+
+		nrecs = r / sizeof (recs[0]);
+
+		for (i = 0; i < nrecs; i ++) {
+			if (recs[i].magic != RSPAMD_FUZZY_MEM_REC_MAGIC) {
+				/* Wait until the record is completed or journal is compacted */
+				msg_warn_fuzzy_backend ("bad record in journal %s at offset %z",
+						backend->journal_path, (gsize)backend->journal_off);
+
+				return;
+			}
+
+			rspamd_fuzzy_mem_apply (backend, &recs[i]);
+			backend->journal_off += sizeof (recs[0]);
+			backend->journal_records ++;
+		}
+	}
+}
+
+/*
+ * Loads snapshot and journal, must be called with lock held
+ */
+static gboolean
+rspamd_fuzzy_mem_reload (struct rspamd_fuzzy_backend_memory *backend,
+		guint nshards, GError **err)
+{
+	if (!rspamd_fuzzy_mem_load_snapshot (backend, nshards, err)) {
+		return FALSE;
+	}
+
+	if (!rspamd_fuzzy_mem_open_journal (backend, err)) {
+		return FALSE;
+	}
+
+	rspamd_fuzzy_mem_replay (backend);
+
+	return TRUE;
+}
+
+/*
+ * Checks whether journal has been replaced by compaction in another process
+ */
+static gboolean
+rspamd_fuzzy_mem_journal_rotated (struct rspamd_fuzzy_backend_memory *backend)
+{
+	struct stat st;
+
+	if (stat (backend->journal_path, &st) == -1) {
+		return TRUE;
+	}
+
+	return st.st_ino != backend->journal_ino || st.st_dev != backend->journal_dev;
+}
+
+/*
+ * Catches up with other processes, must be called with lock held
+ */
+static gboolean
+rspamd_fuzzy_mem_sync_locked (struct rspamd_fuzzy_backend_memory *backend)
+{
+	GError *err = NULL;
+
+	if (rspamd_fuzzy_mem_journal_rotated (backend)) {
+		if (!rspamd_fuzzy_mem_reload (backend, backend->nshards, &err)) {
+			msg_err_fuzzy_backend ("cannot reload storage: %e", err);
+			g_error_free (err);
+
+			return FALSE;
+		}
+	}
+	else {
+		rspamd_fuzzy_mem_replay (backend);
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_mem_poll_cb (gint fd, short what, void *ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = ud;
+	struct timeval tv;
+
+	if (rspamd_fuzzy_mem_journal_rotated (backend)) {
+		/* Do not block here, compaction might be in progress */
+		if (rspamd_file_lock (backend->lock_fd, TRUE)) {
+			rspamd_fuzzy_mem_sync_locked (backend);
+			rspamd_file_unlock (backend->lock_fd, FALSE);
+		}
+	}
+	else {
+		rspamd_fuzzy_mem_replay (backend);
+	}
+
+	double_to_tv (backend->poll_interval, &tv);
+	event_add (&backend->poll_ev, &tv);
+}
+
+static void
+rspamd_fuzzy_mem_fill_record (struct rspamd_fuzzy_mem_journal_rec *rec,
+		enum rspamd_fuzzy_mem_op op, gint64 now)
+{
+	memset (rec, 0, sizeof (*rec));
+	rec->magic = RSPAMD_FUZZY_MEM_REC_MAGIC;
+	rec->op = op;
+	rec->time = now;
+}
+
+void*
+rspamd_fuzzy_backend_init_memory (struct rspamd_fuzzy_backend *bk,
+		const ucl_object_t *obj, struct rspamd_config *cfg, GError **err)
+{
+	struct rspamd_fuzzy_backend_memory *backend;
+	const ucl_object_t *elt;
+	rspamd_cryptobox_hash_state_t st;
+	guchar hash_out[rspamd_cryptobox_HASHBYTES];
+	guint nshards = RSPAMD_FUZZY_MEM_DEFAULT_SHARDS;
+	const gchar *path;
+	struct timeval tv;
+
+	elt = ucl_object_lookup_any (obj, "hashfile", "hash_file", "file",
+			"database", NULL);
+
+	if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (),
+				EINVAL, "missing storage path");
+		return NULL;
+	}
+
+	path = ucl_object_tostring (elt);
+
+	elt = ucl_object_lookup (obj, "shards");
+
+	if (elt != NULL) {
+		nshards = ucl_object_toint (elt);
+
+		if (nshards == 0 || nshards > RSPAMD_FUZZY_MEM_MAX_SHARDS ||
+				(nshards & (nshards - 1)) != 0) {
+			g_set_error (err, rspamd_fuzzy_backend_memory_quark (),
+					EINVAL, "shards must be a power of two not more than %d",
+					RSPAMD_FUZZY_MEM_MAX_SHARDS);
+			return NULL;
+		}
+	}
+
+	backend = g_malloc0 (sizeof (*backend));
+	backend->bk = bk;
+	backend->path = g_strdup (path);
+	backend->journal_path = g_strconcat (path, ".journal", NULL);
+	backend->lock_path = g_strconcat (path, ".lock", NULL);
+	backend->journal_fd = -1;
+	backend->lock_fd = -1;
+	backend->fsync = TRUE;
+	backend->poll_interval = RSPAMD_FUZZY_MEM_DEFAULT_POLL;
+	backend->sources = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			g_free, g_free);
+	backend->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			"fuzzy_backend");
+
+	elt = ucl_object_lookup (obj, "fsync");
+
+	if (elt != NULL) {
+		backend->fsync = ucl_object_toboolean (elt);
+	}
+
+	elt = ucl_object_lookup (obj, "journal_poll");
+
+	if (elt != NULL && ucl_object_todouble (elt) > 0) {
+		backend->poll_interval = ucl_object_todouble (elt);
+	}
+
+	/* Set id for the backend */
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, path, strlen (path));
+	rspamd_cryptobox_hash_final (&st, hash_out);
+	rspamd_snprintf (backend->id, sizeof (backend->id), "%xs", hash_out);
+	memcpy (backend->pool->tag.uid, backend->id, sizeof (backend->pool->tag.uid));
+
+	backend->lock_fd = open (backend->lock_path, O_RDWR | O_CREAT, 00644);
+
+	if (backend->lock_fd == -1) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+				"cannot open lock file %s: %s", backend->lock_path,
+				strerror (errno));
+		rspamd_fuzzy_backend_close_memory (bk, backend);
+
+		return NULL;
+	}
+
+	rspamd_file_lock (backend->lock_fd, FALSE);
+
+	if (!rspamd_fuzzy_mem_reload (backend, nshards, err)) {
+		rspamd_file_unlock (backend->lock_fd, FALSE);
+		rspamd_fuzzy_backend_close_memory (bk, backend);
+
+		return NULL;
+	}
+
+	rspamd_file_unlock (backend->lock_fd, FALSE);
+
+	/* Follow updates written by other processes */
+	event_set (&backend->poll_ev, -1, EV_TIMEOUT, rspamd_fuzzy_mem_poll_cb,
+			backend);
+	event_base_set (rspamd_fuzzy_backend_event_base (bk), &backend->poll_ev);
+	double_to_tv (backend->poll_interval, &tv);
+	event_add (&backend->poll_ev, &tv);
+
+	return backend;
+}
+
+void
+rspamd_fuzzy_backend_check_memory (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd *cmd,
+		rspamd_fuzzy_check_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_mem_shard *shard, *sh_shard;
+	struct rspamd_fuzzy_mem_digest *dig = NULL;
+	struct rspamd_fuzzy_mem_shingle *elt;
+	gint64 refs[RSPAMD_SHINGLE_SIZE], sel_id = -1, expire;
+	guint32 *slot;
+	guint i, j, max_cnt = 0;
+	time_t now = time (NULL);
+
+	expire = rspamd_fuzzy_backend_get_expire (bk);
+	shard = rspamd_fuzzy_mem_digest_shard (backend, cmd->digest);
+	slot = rspamd_fuzzy_mem_digest_slot (shard->digests, shard->slots,
+			shard->nslots, cmd->digest);
+
+	if (*slot != RSPAMD_FUZZY_MEM_EMPTY && !shard->digests[*slot].deleted) {
+		dig = &shard->digests[*slot];
+
+		if (now - dig->time > expire) {
+			msg_debug_fuzzy_backend ("requested hash has been expired");
+		}
+		else {
+			rep.value = dig->value;
+			rep.prob = 1.0;
+			rep.flag = dig->flag;
+		}
+	}
+	else if (cmd->shingles_count > 0) {
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			refs[i] = -1;
+			sh_shard = rspamd_fuzzy_mem_shingle_shard (backend,
+					shcmd->sgl.hashes[i], i);
+			elt = rspamd_fuzzy_mem_shingle_slot (sh_shard->shingles,
+					sh_shard->shingles_size, shcmd->sgl.hashes[i], i);
+
+			if (elt->idx != RSPAMD_FUZZY_MEM_EMPTY &&
+					!backend->shards[elt->shard].digests[elt->idx].deleted) {
+				refs[i] = ((gint64)elt->shard << 32) | elt->idx;
+			}
+		}
+
+		qsort (refs, RSPAMD_SHINGLE_SIZE, sizeof (gint64),
+				rspamd_fuzzy_mem_int64_cmp);
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i = j) {
+			for (j = i + 1; j < RSPAMD_SHINGLE_SIZE && refs[j] == refs[i]; j ++);
+
+			if (refs[i] != -1 && j - i > max_cnt) {
+				max_cnt = j - i;
+				sel_id = refs[i];
+			}
+		}
+
+		if (sel_id != -1) {
+			/* Like sqlite backend: repeats after the first match are counted */
+			rep.prob = (float)(max_cnt - 1) / (float)RSPAMD_SHINGLE_SIZE;
+
+			if (rep.prob > 0.5) {
+				msg_debug_fuzzy_backend (
+						"found fuzzy hash with probability %.2f",
+						rep.prob);
+				dig = &backend->shards[sel_id >> 32].digests[sel_id & 0xffffffff];
+
+				if (now - dig->time > expire) {
+					msg_debug_fuzzy_backend ("requested hash has been expired");
+					rep.prob = 0.0;
+				}
+				else {
+					rep.value = dig->value;
+					rep.flag = dig->flag;
+				}
+			}
+		}
+	}
+
+	if (cb) {
+		cb (&rep, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_update_memory (struct rspamd_fuzzy_backend *bk,
+		GQueue *updates, const gchar *src,
+		rspamd_fuzzy_update_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+	struct rspamd_fuzzy_mem_journal_rec *recs, *rec;
+	struct fuzzy_peer_cmd *io_cmd;
+	struct rspamd_fuzzy_cmd *cmd;
+	gboolean success = FALSE;
+	struct stat st;
+	GList *cur;
+	guint nrecs = 0;
+	gint64 now = time (NULL);
+
+	recs = g_malloc ((g_queue_get_length (updates) + 1) * sizeof (*recs));
+
+	for (cur = updates->head; cur != NULL; cur = g_list_next (cur)) {
+		io_cmd = cur->data;
+		rec = &recs[nrecs ++];
+
+		if (io_cmd->is_shingle) {
+			cmd = &io_cmd->cmd.shingle.basic;
+		}
+		else {
+			cmd = &io_cmd->cmd.normal;
+		}
+
+		rspamd_fuzzy_mem_fill_record (rec, cmd->cmd == FUZZY_WRITE ?
+				RSPAMD_FUZZY_MEM_OP_ADD : RSPAMD_FUZZY_MEM_OP_DEL, now);
+		memcpy (rec->key, cmd->digest, sizeof (rec->key));
+		rec->value = cmd->value;
+		rec->flag = cmd->flag;
+
+		if (io_cmd->is_shingle && cmd->cmd == FUZZY_WRITE) {
+			rec->nshingles = RSPAMD_SHINGLE_SIZE;
+			memcpy (rec->shingles, io_cmd->cmd.shingle.sgl.hashes,
+					sizeof (rec->shingles));
+		}
+	}
+
+	rspamd_file_lock (backend->lock_fd, FALSE);
+
+	if (rspamd_fuzzy_mem_sync_locked (backend)) {
+		if (nrecs > 0) {
+			rec = &recs[nrecs ++];
+			rspamd_fuzzy_mem_fill_record (rec, RSPAMD_FUZZY_MEM_OP_VERSION, now);
+			rspamd_strlcpy ((gchar *)rec->key, src, sizeof (rec->key));
+			rec->value = rspamd_fuzzy_mem_source_version (backend, src) + 1;
+		}
+
+		if (fstat (backend->journal_fd, &st) == -1) {
+			msg_err_fuzzy_backend ("cannot stat journal %s: %s",
+					backend->journal_path, strerror (errno));
+		}
+		else if (!rspamd_fuzzy_mem_write_full (backend->journal_fd, recs,
+						nrecs * sizeof (*recs)) ||
+				(backend->fsync && fsync (backend->journal_fd) == -1)) {
+			msg_err_fuzzy_backend ("cannot write journal %s: %s",
+					backend->journal_path, strerror (errno));
+
+			/* Drop partial records */
+			if (ftruncate (backend->journal_fd, st.st_size) == -1) {
+				msg_err_fuzzy_backend ("cannot truncate journal %s: %s",
+						backend->journal_path, strerror (errno));
+			}
+		}
+		else {
+			success = TRUE;
+		}
+
+		/* Our own records are applied here as well */
+		rspamd_fuzzy_mem_replay (backend);
+	}
+
+	rspamd_file_unlock (backend->lock_fd, FALSE);
+	g_free (recs);
+
+	if (cb) {
+		cb (success, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_count_memory (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_count_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+
+	if (cb) {
+		cb (backend->count, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_version_memory (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		rspamd_fuzzy_version_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+
+	if (cb) {
+		cb (rspamd_fuzzy_mem_source_version (backend, src), ud);
+	}
+}
+
+const gchar*
+rspamd_fuzzy_backend_id_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+
+	return backend->id;
+}
+
+struct rspamd_fuzzy_mem_writer {
+	gint fd;
+	gboolean error;
+	gsize len;
+	guchar buf[65536];
+};
+
+static void
+rspamd_fuzzy_mem_writer_flush (struct rspamd_fuzzy_mem_writer *w)
+{
+	if (!w->error && w->len > 0) {
+		w->error = !rspamd_fuzzy_mem_write_full (w->fd, w->buf, w->len);
+	}
+
+	w->len = 0;
+}
+
+static void
+rspamd_fuzzy_mem_writer_append (struct rspamd_fuzzy_mem_writer *w,
+		const void *data, gsize len)
+{
+	if (w->len + len > sizeof (w->buf)) {
+		rspamd_fuzzy_mem_writer_flush (w);
+
+		if (len > sizeof (w->buf)) {
+			if (!w->error) {
+				w->error = !rspamd_fuzzy_mem_write_full (w->fd, data, len);
+			}
+
+			return;
+		}
+	}
+
+	memcpy (w->buf + w->len, data, len);
+	w->len += len;
+}
+
+/*
+ * Writes live digests and referenced shingles to a new snapshot and starts
+ * a new journal, must be called with lock held
+ */
+static gboolean
+rspamd_fuzzy_mem_compact (struct rspamd_fuzzy_backend_memory *backend,
+		gint64 expire)
+{
+	struct rspamd_fuzzy_mem_snap_hdr hdr;
+	struct rspamd_fuzzy_mem_snap_shard *shdrs;
+	struct rspamd_fuzzy_mem_snap_source ssrc;
+	struct rspamd_fuzzy_mem_shard *shard;
+	struct rspamd_fuzzy_mem_digest *dig;
+	struct rspamd_fuzzy_mem_shingle *elt, *nelt, *nshingles;
+	struct rspamd_fuzzy_mem_writer *w;
+	guint32 **remap, *nslots, nlive, pos, mask, i, j;
+	GHashTableIter it;
+	gpointer k, v;
+	guint64 off, h;
+	gchar *tmp;
+	gboolean ret = FALSE;
+	GError *err = NULL;
+	time_t now = time (NULL);
+
+	remap = g_malloc0 (backend->nshards * sizeof (*remap));
+	shdrs = g_malloc0 (backend->nshards * sizeof (*shdrs));
+
+	/* Assign new indices to the live digests */
+	for (i = 0; i < backend->nshards; i ++) {
+		shard = &backend->shards[i];
+		remap[i] = g_malloc (MAX (shard->ndigests, 1) * sizeof (guint32));
+		nlive = 0;
+
+		for (j = 0; j < shard->ndigests; j ++) {
+			dig = &shard->digests[j];
+
+			if (!dig->deleted && now - dig->time <= expire) {
+				remap[i][j] = nlive ++;
+			}
+			else {
+				remap[i][j] = RSPAMD_FUZZY_MEM_EMPTY;
+			}
+		}
+
+		shdrs[i].ndigests = nlive;
+		shdrs[i].nslots = rspamd_fuzzy_mem_table_size (nlive);
+	}
+
+	for (i = 0; i < backend->nshards; i ++) {
+		shard = &backend->shards[i];
+		nlive = 0;
+
+		for (j = 0; j < shard->shingles_size; j ++) {
+			elt = &shard->shingles[j];
+
+			if (elt->idx != RSPAMD_FUZZY_MEM_EMPTY &&
+					remap[elt->shard][elt->idx] != RSPAMD_FUZZY_MEM_EMPTY) {
+				nlive ++;
+			}
+		}
+
+		shdrs[i].nshingles = nlive;
+		shdrs[i].shingles_size = rspamd_fuzzy_mem_table_size (nlive);
+	}
+
+	off = sizeof (hdr) + backend->nshards * sizeof (*shdrs);
+
+	for (i = 0; i < backend->nshards; i ++) {
+		shdrs[i].digests_off = off;
+		off += (guint64)shdrs[i].ndigests * sizeof (*dig);
+		shdrs[i].slots_off = off;
+		off += (guint64)shdrs[i].nslots * sizeof (guint32);
+	}
+
+	for (i = 0; i < backend->nshards; i ++) {
+		shdrs[i].shingles_off = off;
+		off += (guint64)shdrs[i].shingles_size * sizeof (*elt);
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, rspamd_fuzzy_mem_snap_magic, sizeof (hdr.magic));
+	hdr.generation = backend->generation + 1;
+	hdr.nshards = backend->nshards;
+	hdr.nsources = g_hash_table_size (backend->sources);
+	hdr.sources_off = off;
+
+	tmp = g_strconcat (backend->path, ".new", NULL);
+	w = g_malloc (sizeof (*w));
+	w->error = FALSE;
+	w->len = 0;
+	w->fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+
+	if (w->fd == -1) {
+		msg_err_fuzzy_backend ("cannot create snapshot %s: %s", tmp,
+				strerror (errno));
+		goto end;
+	}
+
+	rspamd_fuzzy_mem_writer_append (w, &hdr, sizeof (hdr));
+	rspamd_fuzzy_mem_writer_append (w, shdrs,
+			backend->nshards * sizeof (*shdrs));
+
+	for (i = 0; i < backend->nshards; i ++) {
+		shard = &backend->shards[i];
+		nslots = g_malloc (shdrs[i].nslots * sizeof (*nslots));
+		memset (nslots, 0xff, shdrs[i].nslots * sizeof (*nslots));
+
+		for (j = 0; j < shard->ndigests; j ++) {
+			if (remap[i][j] != RSPAMD_FUZZY_MEM_EMPTY) {
+				rspamd_fuzzy_mem_writer_append (w, &shard->digests[j],
+						sizeof (*dig));
+			}
+		}
+
+		/* Index refers to the digests by their new positions */
+		for (j = 0; j < shard->ndigests; j ++) {
+			if (remap[i][j] != RSPAMD_FUZZY_MEM_EMPTY) {
+				mask = shdrs[i].nslots - 1;
+				memcpy (&h, shard->digests[j].digest + sizeof (h), sizeof (h));
+
+				for (pos = h & mask; nslots[pos] != RSPAMD_FUZZY_MEM_EMPTY;
+						pos = (pos + 1) & mask);
+
+				nslots[pos] = remap[i][j];
+			}
+		}
+
+		rspamd_fuzzy_mem_writer_append (w, nslots,
+				shdrs[i].nslots * sizeof (*nslots));
+		g_free (nslots);
+	}
+
+	for (i = 0; i < backend->nshards; i ++) {
+		shard = &backend->shards[i];
+		nshingles = g_malloc (shdrs[i].shingles_size * sizeof (*nshingles));
+		memset (nshingles, 0xff, shdrs[i].shingles_size * sizeof (*nshingles));
+
+		for (j = 0; j < shard->shingles_size; j ++) {
+			elt = &shard->shingles[j];
+
+			if (elt->idx != RSPAMD_FUZZY_MEM_EMPTY &&
+					remap[elt->shard][elt->idx] != RSPAMD_FUZZY_MEM_EMPTY) {
+				nelt = rspamd_fuzzy_mem_shingle_slot (nshingles,
+						shdrs[i].shingles_size, elt->value, elt->number);
+				*nelt = *elt;
+				nelt->idx = remap[elt->shard][elt->idx];
+			}
+		}
+
+		rspamd_fuzzy_mem_writer_append (w, nshingles,
+				shdrs[i].shingles_size * sizeof (*nshingles));
+		g_free (nshingles);
+	}
+
+	g_hash_table_iter_init (&it, backend->sources);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		memset (&ssrc, 0, sizeof (ssrc));
+		rspamd_strlcpy (ssrc.name, k, sizeof (ssrc.name));
+		ssrc.version = *(gint64 *)v;
+		rspamd_fuzzy_mem_writer_append (w, &ssrc, sizeof (ssrc));
+	}
+
+	rspamd_fuzzy_mem_writer_flush (w);
+
+	if (w->error || fsync (w->fd) == -1) {
+		msg_err_fuzzy_backend ("cannot write snapshot %s: %s", tmp,
+				strerror (errno));
+		unlink (tmp);
+		goto end;
+	}
+
+	if (rename (tmp, backend->path) == -1) {
+		msg_err_fuzzy_backend ("cannot rename snapshot %s: %s", tmp,
+				strerror (errno));
+		unlink (tmp);
+		goto end;
+	}
+
+	/* Now switch to the new snapshot and the empty journal */
+	backend->generation = hdr.generation;
+
+	if (!rspamd_fuzzy_mem_create_journal (backend, &err) ||
+			!rspamd_fuzzy_mem_reload (backend, backend->nshards, &err)) {
+		msg_err_fuzzy_backend ("cannot switch to the new snapshot: %e", err);
+		g_error_free (err);
+		goto end;
+	}
+
+	msg_info_fuzzy_backend ("compacted storage to %s, generation %uL: %uL hashes",
+			backend->path, backend->generation, backend->count);
+	ret = TRUE;
+
+end:
+	if (w->fd != -1) {
+		close (w->fd);
+	}
+
+	for (i = 0; i < backend->nshards; i ++) {
+		g_free (remap[i]);
+	}
+
+	g_free (remap);
+	g_free (shdrs);
+	g_free (w);
+	g_free (tmp);
+
+	return ret;
+}
+
+void
+rspamd_fuzzy_backend_expire_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+	struct rspamd_fuzzy_mem_shard *shard;
+	struct rspamd_fuzzy_mem_digest *dig;
+	gint64 expire;
+	guint64 expired = 0;
+	time_t now = time (NULL);
+	guint i, j;
+
+	expire = rspamd_fuzzy_backend_get_expire (bk);
+	rspamd_file_lock (backend->lock_fd, FALSE);
+
+	if (!rspamd_fuzzy_mem_sync_locked (backend)) {
+		rspamd_file_unlock (backend->lock_fd, FALSE);
+
+		return;
+	}
+
+	for (i = 0; i < backend->nshards; i ++) {
+		shard = &backend->shards[i];
+
+		for (j = 0; j < shard->ndigests; j ++) {
+			dig = &shard->digests[j];
+
+			if (!dig->deleted && now - dig->time > expire) {
+				dig->deleted = 1;
+				expired ++;
+			}
+		}
+	}
+
+	backend->count -= expired;
+	backend->deleted += expired;
+
+	if (expired > 0) {
+		msg_info_fuzzy_backend ("expired %uL hashes", expired);
+	}
+
+	if (backend->journal_records >= MAX (RSPAMD_FUZZY_MEM_MIN_COMPACT,
+			backend->count / 8) ||
+			backend->deleted > MAX (RSPAMD_FUZZY_MEM_MIN_COMPACT,
+					backend->count / 4)) {
+		rspamd_fuzzy_mem_compact (backend, expire);
+	}
+
+	rspamd_file_unlock (backend->lock_fd, FALSE);
+}
+
+void
+rspamd_fuzzy_backend_close_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+
+	if (event_get_base (&backend->poll_ev) != NULL) {
+		event_del (&backend->poll_ev);
+	}
+
+	rspamd_fuzzy_mem_free_state (backend);
+
+	if (backend->journal_fd != -1) {
+		close (backend->journal_fd);
+	}
+
+	if (backend->lock_fd != -1) {
+		close (backend->lock_fd);
+	}
+
+	g_hash_table_unref (backend->sources);
+	rspamd_mempool_delete (backend->pool);
+	g_free (backend->path);
+	g_free (backend->journal_path);
+	g_free (backend->lock_path);
+	g_free (backend);
+}
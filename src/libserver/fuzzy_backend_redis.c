@@ -22,12 +22,63 @@
 #include "cryptobox.h"
 #include "str_util.h"
 #include "upstream.h"
+#include "util.h"
 #include "contrib/hiredis/hiredis.h"
 #include "contrib/hiredis/async.h"
 
+/*
+ * Storage layout:
+ *
+ * - <prefix><digest> is a hash with fields `V` (value), `F` (flag) and
+ *   `C` (creation time), it expires after `expire` seconds;
+ * - <prefix>_<n>_<shingle> contains the digest for the n-th shingle and
+ *   expires after `expire` seconds as well;
+ * - <prefix><source> is the revision of the source;
+ * - <prefix>_count is an approximate number of digests stored.
+ *
+ * Checks queued during an event loop iteration are sent as a single pipeline
+ * over one connection: HMGET for each digest and MGET for all shingles of each
+ * query. Only the digest selected by shingles requires another round trip.
+ * Updates are sent as MULTI/EXEC blocks of `updates_batch` commands that are
+ * pipelined over one connection as well. Digests are added by a script that
+ * is loaded once by SCRIPT LOAD and then called by EVALSHA.
+ */
+
 #define REDIS_DEFAULT_PORT 6379
 #define REDIS_DEFAULT_OBJECT "fuzzy"
 #define REDIS_DEFAULT_TIMEOUT 2.0
+#define REDIS_DEFAULT_UPDATES_BATCH 128
+/* Maximum number of checks sent in a single pipeline */
+#define REDIS_MAX_PENDING_CHECKS 512
+/* Latency buckets are powers of two starting from 0.1 millisecond */
+#define REDIS_LATENCY_BUCKETS 16
+#define REDIS_LATENCY_MIN 0.0001
+
+enum rspamd_fuzzy_redis_command {
+	RSPAMD_FUZZY_REDIS_COMMAND_COUNT = 0,
+	RSPAMD_FUZZY_REDIS_COMMAND_VERSION,
+	RSPAMD_FUZZY_REDIS_COMMAND_UPDATES,
+	RSPAMD_FUZZY_REDIS_COMMAND_CHECK,
+	RSPAMD_FUZZY_REDIS_COMMAND_SHINGLES,
+	RSPAMD_FUZZY_REDIS_COMMAND_MAX
+};
+
+static const gchar *rspamd_fuzzy_redis_command_names[] = {
+	[RSPAMD_FUZZY_REDIS_COMMAND_COUNT] = "count",
+	[RSPAMD_FUZZY_REDIS_COMMAND_VERSION] = "version",
+	[RSPAMD_FUZZY_REDIS_COMMAND_UPDATES] = "updates",
+	[RSPAMD_FUZZY_REDIS_COMMAND_CHECK] = "check",
+	[RSPAMD_FUZZY_REDIS_COMMAND_SHINGLES] = "check_shingles",
+};
+
+struct rspamd_fuzzy_redis_latency {
+	guint64 hist[REDIS_LATENCY_BUCKETS];
+	guint64 count;
+	gdouble total;
+	gdouble max;
+};
+
+struct rspamd_fuzzy_redis_session;
 
 struct rspamd_fuzzy_backend_redis {
 	struct upstream_list *read_servers;
@@ -38,20 +89,62 @@ struct rspamd_fuzzy_backend_redis {
 	gchar *id;
 	struct rspamd_redis_pool *pool;
 	gdouble timeout;
+	guint updates_batch;
+	/* SHA1 of the add script that is called by EVALSHA */
+	gchar *add_sha;
+	/* Whether the add script is believed to be loaded to servers */
+	gboolean add_loaded;
+	/* Collects checks issued during the current event loop iteration */
+	struct rspamd_fuzzy_redis_session *pending;
+	struct event flush_event;
+	gboolean flush_scheduled;
+	struct rspamd_fuzzy_redis_latency latency[RSPAMD_FUZZY_REDIS_COMMAND_MAX];
 	ref_entry_t ref;
 };
 
+struct rspamd_fuzzy_redis_check {
+	struct rspamd_fuzzy_redis_session *session;
+	struct rspamd_fuzzy_shingle_cmd cmd;
+	struct rspamd_fuzzy_reply rep;
+	rspamd_fuzzy_check_cb cb;
+	void *ud;
+	gdouble start;
+	gboolean replied;
+};
+
+struct rspamd_fuzzy_redis_batch {
+	struct rspamd_fuzzy_redis_session *session;
+	/* Commands queued in this MULTI block */
+	guint nqueued;
+	/*
+	 * Positions (starting from 1) of replies that tell if a digest has been
+	 * added or removed, negative for removals
+	 */
+	GArray *counted;
+	/* Array of struct rspamd_fuzzy_redis_add to repeat them on NOSCRIPT */
+	GArray *adds;
+};
+
+struct rspamd_fuzzy_redis_add {
+	/* Position of reply in the MULTI block */
+	guint pos;
+	GString *key;
+	gchar time[32];
+	gchar flag[32];
+	gchar value[32];
+	gchar expire[32];
+};
+
 struct rspamd_fuzzy_redis_session {
 	struct rspamd_fuzzy_backend_redis *backend;
+	struct rspamd_fuzzy_backend *bk;
 	redisAsyncContext *ctx;
 	struct event timeout;
-	enum {
-		RSPAMD_FUZZY_REDIS_COMMAND_COUNT,
-		RSPAMD_FUZZY_REDIS_COMMAND_VERSION,
-		RSPAMD_FUZZY_REDIS_COMMAND_UPDATES,
-		RSPAMD_FUZZY_REDIS_COMMAND_CHECK
-	} command;
-	guint nargs;
+	enum rspamd_fuzzy_redis_command command;
+	/* Number of replies we are still waiting for */
+	guint nreplies;
+	gboolean failed;
+	gdouble start;
 
 	union {
 		rspamd_fuzzy_check_cb cb_check;
@@ -61,15 +154,36 @@ struct rspamd_fuzzy_redis_session {
 	} callback;
 	void *cbdata;
 
-	gchar **argv;
+	/* Integer result of count and version commands */
+	guint64 ival;
+	/* Change of the digests count caused by updates */
+	gint64 count_delta;
+	/* Array of struct rspamd_fuzzy_redis_check */
+	GArray *checks;
 	struct upstream *up;
 };
 
+/*
+ * Adds weight to the digest if it has the same flag, otherwise the digest is
+ * relearned with the new flag and weight. This must be atomic as other
+ * storages could update the same digest concurrently.
+ * KEYS[1]: digest key, ARGV: time, flag, value, expire
+ */
+static const gchar rspamd_fuzzy_redis_add_script[] =
+		"local created = redis.call('HSETNX', KEYS[1], 'C', ARGV[1]);"
+		"local flag = redis.call('HGET', KEYS[1], 'F');"
+		"if created == 0 and flag == ARGV[2] then "
+		"redis.call('HINCRBY', KEYS[1], 'V', ARGV[3]);"
+		"else "
+		"redis.call('HMSET', KEYS[1], 'F', ARGV[2], 'V', ARGV[3]);"
+		"end;"
+		"redis.call('EXPIRE', KEYS[1], ARGV[4]);"
+		"return created;";
+
 static void
 rspamd_fuzzy_redis_session_dtor (struct rspamd_fuzzy_redis_session *session)
 {
 	redisAsyncContext *ac;
-	guint i;
 
 	if (session->ctx) {
 		ac = session->ctx;
@@ -82,18 +196,31 @@ rspamd_fuzzy_redis_session_dtor (struct rspamd_fuzzy_redis_session *session)
 		event_del (&session->timeout);
 	}
 
-	if (session->argv) {
-		for (i = 0; i < session->nargs; i ++) {
-			g_free (session->argv[i]);
-		}
-
-		g_free (session->argv);
+	if (session->checks) {
+		g_array_free (session->checks, TRUE);
 	}
 
 	REF_RELEASE (session->backend);
 	g_slice_free1 (sizeof (*session), session);
 }
 
+static struct rspamd_fuzzy_redis_session *
+rspamd_fuzzy_redis_session_new (struct rspamd_fuzzy_backend_redis *backend,
+		struct rspamd_fuzzy_backend *bk,
+		enum rspamd_fuzzy_redis_command command)
+{
+	struct rspamd_fuzzy_redis_session *session;
+
+	session = g_slice_alloc0 (sizeof (*session));
+	session->backend = backend;
+	REF_RETAIN (session->backend);
+	session->bk = bk;
+	session->command = command;
+	session->start = rspamd_get_ticks ();
+
+	return session;
+}
+
 static gboolean
 rspamd_fuzzy_backend_redis_try_ucl (struct rspamd_fuzzy_backend_redis *backend,
 		const ucl_object_t *obj,
@@ -169,6 +296,14 @@ rspamd_fuzzy_backend_redis_try_ucl (struct rspamd_fuzzy_backend_redis *backend,
 		backend->dbname = NULL;
 	}
 
+	elt = ucl_object_lookup (obj, "updates_batch");
+	if (elt && ucl_object_toint (elt) > 0) {
+		backend->updates_batch = ucl_object_toint (elt);
+	}
+	else {
+		backend->updates_batch = REDIS_DEFAULT_UPDATES_BATCH;
+	}
+
 	return TRUE;
 }
 
@@ -179,13 +314,17 @@ rspamd_fuzzy_backend_redis_dtor (struct rspamd_fuzzy_backend_redis *backend)
 		rspamd_upstreams_destroy (backend->read_servers);
 	}
 	if (backend->write_servers) {
-		rspamd_upstreams_destroy (backend->read_servers);
+		rspamd_upstreams_destroy (backend->write_servers);
 	}
 
 	if (backend->id) {
 		g_free (backend->id);
 	}
 
+	if (backend->add_sha) {
+		g_free (backend->add_sha);
+	}
+
 	g_slice_free1 (sizeof (*backend), backend);
 }
 
@@ -203,6 +342,7 @@ rspamd_fuzzy_backend_init_redis (struct rspamd_fuzzy_backend *bk,
 
 	backend->timeout = REDIS_DEFAULT_TIMEOUT;
 	backend->redis_object = REDIS_DEFAULT_OBJECT;
+	backend->updates_batch = REDIS_DEFAULT_UPDATES_BATCH;
 
 	ret = rspamd_fuzzy_backend_redis_try_ucl (backend, obj, cfg);
 
@@ -250,10 +390,126 @@ rspamd_fuzzy_backend_init_redis (struct rspamd_fuzzy_backend *bk,
 
 	rspamd_cryptobox_hash_final (&st, id_hash);
 	backend->id = rspamd_encode_base32 (id_hash, sizeof (id_hash));
+	/* Redis identifies scripts by lowercase hex SHA1 of their bodies */
+	backend->add_sha = g_compute_checksum_for_string (G_CHECKSUM_SHA1,
+			rspamd_fuzzy_redis_add_script, -1);
 
 	return backend;
 }
 
+static void
+rspamd_fuzzy_redis_latency_add (struct rspamd_fuzzy_backend_redis *backend,
+		enum rspamd_fuzzy_redis_command command,
+		gdouble start)
+{
+	struct rspamd_fuzzy_redis_latency *lat = &backend->latency[command];
+	gdouble elapsed, lim = REDIS_LATENCY_MIN;
+	guint i;
+
+	elapsed = rspamd_get_ticks () - start;
+
+	for (i = 0; i < REDIS_LATENCY_BUCKETS - 1 && elapsed >= lim; i ++) {
+		lim *= 2.0;
+	}
+
+	lat->hist[i] ++;
+	lat->count ++;
+	lat->total += elapsed;
+
+	if (elapsed > lat->max) {
+		lat->max = elapsed;
+	}
+}
+
+static void
+rspamd_fuzzy_redis_check_reply (struct rspamd_fuzzy_redis_check *chk)
+{
+	if (!chk->replied) {
+		chk->replied = TRUE;
+		rspamd_fuzzy_redis_latency_add (chk->session->backend,
+				chk->cmd.basic.shingles_count > 0 ?
+						RSPAMD_FUZZY_REDIS_COMMAND_SHINGLES :
+						RSPAMD_FUZZY_REDIS_COMMAND_CHECK,
+				chk->start);
+
+		if (chk->cb) {
+			chk->cb (&chk->rep, chk->ud);
+		}
+	}
+}
+
+/*
+ * Called when all replies for the session are received or when it has failed
+ */
+static void
+rspamd_fuzzy_redis_session_fin (struct rspamd_fuzzy_redis_session *session)
+{
+	struct rspamd_fuzzy_redis_check *chk;
+	guint i;
+
+	if (session->up) {
+		if (session->failed) {
+			rspamd_upstream_fail (session->up);
+		}
+		else {
+			rspamd_upstream_ok (session->up);
+		}
+	}
+
+	switch (session->command) {
+	case RSPAMD_FUZZY_REDIS_COMMAND_CHECK:
+	case RSPAMD_FUZZY_REDIS_COMMAND_SHINGLES:
+		for (i = 0; i < session->checks->len; i ++) {
+			chk = &g_array_index (session->checks,
+					struct rspamd_fuzzy_redis_check, i);
+			chk->session = session;
+			rspamd_fuzzy_redis_check_reply (chk);
+		}
+		break;
+	case RSPAMD_FUZZY_REDIS_COMMAND_UPDATES:
+		rspamd_fuzzy_redis_latency_add (session->backend, session->command,
+				session->start);
+
+		if (session->callback.cb_update) {
+			session->callback.cb_update (!session->failed, session->cbdata);
+		}
+		break;
+	case RSPAMD_FUZZY_REDIS_COMMAND_COUNT:
+		rspamd_fuzzy_redis_latency_add (session->backend, session->command,
+				session->start);
+
+		if (session->callback.cb_count) {
+			session->callback.cb_count (session->failed ? 0 : session->ival,
+					session->cbdata);
+		}
+		break;
+	case RSPAMD_FUZZY_REDIS_COMMAND_VERSION:
+		rspamd_fuzzy_redis_latency_add (session->backend, session->command,
+				session->start);
+
+		if (session->callback.cb_version) {
+			session->callback.cb_version (session->failed ? 0 : session->ival,
+					session->cbdata);
+		}
+		break;
+	default:
+		break;
+	}
+
+	rspamd_fuzzy_redis_session_dtor (session);
+}
+
+static void
+rspamd_fuzzy_redis_reply_done (struct rspamd_fuzzy_redis_session *session)
+{
+	g_assert (session->nreplies > 0);
+	session->nreplies --;
+
+	if (session->nreplies == 0) {
+		rspamd_fuzzy_redis_session_fin (session);
+	}
+}
+
 static void
 rspamd_fuzzy_redis_timeout (gint fd, short what, gpointer priv)
 {
@@ -264,13 +520,362 @@ rspamd_fuzzy_redis_timeout (gint fd, short what, gpointer priv)
 		ac = session->ctx;
 		session->ctx = NULL;
 		ac->err = REDIS_ERR_IO;
+		session->failed = TRUE;
 
-		/* This will cause session closing */
+		/* This will call all pending callbacks and close the session */
 		rspamd_redis_pool_release_connection (session->backend->pool,
 				ac, TRUE);
 	}
 }
 
+static gboolean
+rspamd_fuzzy_redis_session_connect (struct rspamd_fuzzy_redis_session *session,
+		struct upstream_list *ups)
+{
+	struct rspamd_fuzzy_backend_redis *backend = session->backend;
+	struct upstream *up;
+	rspamd_inet_addr_t *addr;
+
+	up = rspamd_upstream_get (ups, RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+
+	if (up == NULL) {
+		return FALSE;
+	}
+
+	session->up = up;
+	addr = rspamd_upstream_addr (up);
+	g_assert (addr != NULL);
+	session->ctx = rspamd_redis_pool_connect (backend->pool,
+			backend->dbname, backend->password,
+			rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+
+	return session->ctx != NULL;
+}
+
+static void
+rspamd_fuzzy_redis_session_arm (struct rspamd_fuzzy_redis_session *session)
+{
+	struct timeval tv;
+
+	event_set (&session->timeout, -1, EV_TIMEOUT, rspamd_fuzzy_redis_timeout,
+			session);
+	event_base_set (rspamd_fuzzy_backend_event_base (session->bk),
+			&session->timeout);
+	double_to_tv (session->backend->timeout, &tv);
+	event_add (&session->timeout, &tv);
+}
+
+/*
+ * Appends a command to the output buffer of the session's connection, the
+ * arguments are copied, so they could be freed as soon as this function
+ * returns. Replies of commands without callbacks are ignored.
+ */
+static gboolean
+rspamd_fuzzy_redis_send (struct rspamd_fuzzy_redis_session *session,
+		redisCallbackFn *fn, gpointer priv,
+		gint argc, const gchar **argv, const gsize *argv_len)
+{
+	if (session->ctx == NULL || redisAsyncCommandArgv (session->ctx, fn, priv,
+			argc, argv, argv_len) != REDIS_OK) {
+		session->failed = TRUE;
+
+		return FALSE;
+	}
+
+	if (fn != NULL) {
+		session->nreplies ++;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Sends a command where all arguments are strings except `argv[bin_idx]`,
+ * that is `bin_len` bytes long (e.g. a key or a value containing a digest)
+ */
+static gboolean
+rspamd_fuzzy_redis_send_bin (struct rspamd_fuzzy_redis_session *session,
+		redisCallbackFn *fn, gpointer priv,
+		gint argc, const gchar **argv, gint bin_idx, gsize bin_len)
+{
+	gsize argv_len[RSPAMD_SHINGLE_SIZE + 1];
+	gint i;
+
+	g_assert (argc <= (gint)G_N_ELEMENTS (argv_len));
+
+	for (i = 0; i < argc; i ++) {
+		argv_len[i] = i == bin_idx ? bin_len : strlen (argv[i]);
+	}
+
+	return rspamd_fuzzy_redis_send (session, fn, priv, argc, argv, argv_len);
+}
+
+static gboolean
+rspamd_fuzzy_redis_send_digest (struct rspamd_fuzzy_redis_session *session,
+		redisCallbackFn *fn, struct rspamd_fuzzy_redis_check *chk,
+		const gchar *digest)
+{
+	const gchar *argv[4];
+	GString *key;
+	gboolean ret;
+
+	key = g_string_new (session->backend->redis_object);
+	g_string_append_len (key, digest, rspamd_cryptobox_HASHBYTES);
+	argv[0] = "HMGET";
+	argv[1] = key->str;
+	argv[2] = "V";
+	argv[3] = "F";
+
+	ret = rspamd_fuzzy_redis_send_bin (session, fn, chk, G_N_ELEMENTS (argv),
+			argv, 1, key->len);
+	g_string_free (key, TRUE);
+
+	return ret;
+}
+
+/*
+ * Fills `argv` starting from `offset` with shingle keys allocated in a single
+ * chunk that should be freed by a caller
+ */
+static gchar *
+rspamd_fuzzy_redis_shingle_keys (struct rspamd_fuzzy_backend_redis *backend,
+		const struct rspamd_shingle *sgl, const gchar **argv, guint offset)
+{
+	gchar *buf;
+	gsize stride;
+	guint i;
+
+	stride = strlen (backend->redis_object) + sizeof ("_00_") + 20;
+	buf = g_malloc (stride * RSPAMD_SHINGLE_SIZE);
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		rspamd_snprintf (buf + stride * i, stride, "%s_%d_%uL",
+				backend->redis_object, i, sgl->hashes[i]);
+		argv[offset + i] = buf + stride * i;
+	}
+
+	return buf;
+}
+
+static gboolean
+rspamd_fuzzy_redis_parse_digest (redisReply *reply,
+		struct rspamd_fuzzy_reply *rep)
+{
+	redisReply *value, *flag;
+
+	if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 2) {
+		value = reply->element[0];
+		flag = reply->element[1];
+
+		if (value->type == REDIS_REPLY_STRING &&
+				flag->type == REDIS_REPLY_STRING) {
+			rep->value = strtol (value->str, NULL, 10);
+			rep->flag = strtoul (flag->str, NULL, 10);
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_check *chk = priv;
+	struct rspamd_fuzzy_redis_session *session = chk->session;
+	redisReply *reply = r;
+
+	if (c->err == 0 && reply != NULL) {
+		if (rspamd_fuzzy_redis_parse_digest (reply, &chk->rep)) {
+			chk->rep.prob = 1.0;
+			rspamd_fuzzy_redis_check_reply (chk);
+		}
+		else if (chk->cmd.basic.shingles_count == 0) {
+			rspamd_fuzzy_redis_check_reply (chk);
+		}
+		/* Otherwise wait for shingles that are pipelined after this reply */
+	}
+	else {
+		session->failed = TRUE;
+	}
+
+	rspamd_fuzzy_redis_reply_done (session);
+}
+
+static void
+rspamd_fuzzy_redis_selected_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_check *chk = priv;
+	struct rspamd_fuzzy_redis_session *session = chk->session;
+	redisReply *reply = r;
+
+	if (c->err == 0 && reply != NULL) {
+		if (!rspamd_fuzzy_redis_parse_digest (reply, &chk->rep)) {
+			/* Digest has been expired or removed */
+			chk->rep.prob = 0.0;
+		}
+
+		rspamd_fuzzy_redis_check_reply (chk);
+	}
+	else {
+		chk->rep.prob = 0.0;
+		session->failed = TRUE;
+	}
+
+	rspamd_fuzzy_redis_reply_done (session);
+}
+
+static gint
+rspamd_fuzzy_redis_digest_cmp (const void *a, const void *b)
+{
+	const gchar *d1 = *(const gchar **)a, *d2 = *(const gchar **)b;
+
+	return memcmp (d1, d2, rspamd_cryptobox_HASHBYTES);
+}
+
+static void
+rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_check *chk = priv;
+	struct rspamd_fuzzy_redis_session *session = chk->session;
+	redisReply *reply = r, *cur;
+	const gchar *digests[RSPAMD_SHINGLE_SIZE], *sel = NULL;
+	guint i, j, found = 0, max_found = 0;
+
+	if (c->err == 0 && reply != NULL) {
+		if (!chk->replied && reply->type == REDIS_REPLY_ARRAY &&
+				reply->elements == RSPAMD_SHINGLE_SIZE) {
+			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+				cur = reply->element[i];
+
+				if (cur->type == REDIS_REPLY_STRING &&
+						cur->len == rspamd_cryptobox_HASHBYTES) {
+					digests[found ++] = cur->str;
+				}
+			}
+
+			if (found > RSPAMD_SHINGLE_SIZE / 2) {
+				/* Find the most frequent digest */
+				qsort (digests, found, sizeof (digests[0]),
+						rspamd_fuzzy_redis_digest_cmp);
+
+				for (i = 0; i < found; i = j) {
+					for (j = i + 1; j < found &&
+							rspamd_fuzzy_redis_digest_cmp (&digests[i],
+									&digests[j]) == 0; j ++);
+
+					if (j - i > max_found) {
+						max_found = j - i;
+						sel = digests[i];
+					}
+				}
+
+				/* Like sqlite backend: repeats after the first match */
+				chk->rep.prob = (float)(max_found - 1) /
+						(float)RSPAMD_SHINGLE_SIZE;
+			}
+
+			if (sel != NULL && chk->rep.prob > 0.5) {
+				if (!rspamd_fuzzy_redis_send_digest (session,
+						rspamd_fuzzy_redis_selected_callback, chk, sel)) {
+					chk->rep.prob = 0.0;
+					rspamd_fuzzy_redis_check_reply (chk);
+				}
+			}
+			else {
+				chk->rep.prob = 0.0;
+				rspamd_fuzzy_redis_check_reply (chk);
+			}
+		}
+	}
+	else {
+		session->failed = TRUE;
+	}
+
+	rspamd_fuzzy_redis_reply_done (session);
+}
+
+static void
+rspamd_fuzzy_redis_flush_checks (struct rspamd_fuzzy_backend_redis *backend)
+{
+	struct rspamd_fuzzy_redis_session *session;
+	struct rspamd_fuzzy_redis_check *chk;
+	const gchar *argv[RSPAMD_SHINGLE_SIZE + 1];
+	gchar *keys;
+	gboolean ret;
+	guint i;
+
+	if (backend->flush_scheduled) {
+		event_del (&backend->flush_event);
+		backend->flush_scheduled = FALSE;
+	}
+
+	session = backend->pending;
+
+	if (session == NULL) {
+		return;
+	}
+
+	/* Callbacks might queue new checks */
+	backend->pending = NULL;
+
+	if (!rspamd_fuzzy_redis_session_connect (session,
+			backend->read_servers)) {
+		session->failed = TRUE;
+		rspamd_fuzzy_redis_session_fin (session);
+
+		return;
+	}
+
+	/* The checks array is not modified any longer */
+	for (i = 0; i < session->checks->len; i ++) {
+		chk = &g_array_index (session->checks,
+				struct rspamd_fuzzy_redis_check, i);
+		chk->session = session;
+
+		if (!rspamd_fuzzy_redis_send_digest (session,
+				rspamd_fuzzy_redis_check_callback, chk,
+				chk->cmd.basic.digest)) {
+			break;
+		}
+
+		if (chk->cmd.basic.shingles_count > 0) {
+			argv[0] = "MGET";
+			keys = rspamd_fuzzy_redis_shingle_keys (backend, &chk->cmd.sgl,
+					argv, 1);
+			ret = rspamd_fuzzy_redis_send (session,
+					rspamd_fuzzy_redis_shingles_callback, chk,
+					G_N_ELEMENTS (argv), argv, NULL);
+			g_free (keys);
+
+			if (!ret) {
+				break;
+			}
+		}
+	}
+
+	if (session->nreplies == 0) {
+		rspamd_fuzzy_redis_session_fin (session);
+	}
+	else {
+		rspamd_fuzzy_redis_session_arm (session);
+	}
+}
+
+static void
+rspamd_fuzzy_redis_flush_cb (gint fd, short what, gpointer ud)
+{
+	struct rspamd_fuzzy_backend_redis *backend = ud;
+
+	backend->flush_scheduled = FALSE;
+	rspamd_fuzzy_redis_flush_checks (backend);
+}
+
 void
 rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 		const struct rspamd_fuzzy_cmd *cmd,
@@ -278,119 +883,548 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud)
 {
 	struct rspamd_fuzzy_backend_redis *backend = subr_ud;
+	struct rspamd_fuzzy_redis_session *session;
+	struct rspamd_fuzzy_redis_check *chk;
+	struct timeval tv;
 
 	g_assert (backend != NULL);
 
+	/*
+	 * Checks are coalesced until the end of the current event loop iteration
+	 * (or an explicit flush) and then sent as a single pipeline
+	 */
+	if (backend->pending == NULL) {
+		session = rspamd_fuzzy_redis_session_new (backend, bk,
+				RSPAMD_FUZZY_REDIS_COMMAND_CHECK);
+		session->checks = g_array_sized_new (FALSE, TRUE, sizeof (*chk), 32);
+		backend->pending = session;
+	}
+
+	session = backend->pending;
+	g_array_set_size (session->checks, session->checks->len + 1);
+	chk = &g_array_index (session->checks, struct rspamd_fuzzy_redis_check,
+			session->checks->len - 1);
+	memcpy (&chk->cmd, cmd, cmd->shingles_count > 0 ?
+			sizeof (chk->cmd) : sizeof (chk->cmd.basic));
+	chk->cb = cb;
+	chk->ud = ud;
+	chk->start = rspamd_get_ticks ();
+
+	if (session->checks->len >= REDIS_MAX_PENDING_CHECKS) {
+		rspamd_fuzzy_redis_flush_checks (backend);
+	}
+	else if (!backend->flush_scheduled) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		event_set (&backend->flush_event, -1, EV_TIMEOUT,
+				rspamd_fuzzy_redis_flush_cb, backend);
+		event_base_set (rspamd_fuzzy_backend_event_base (bk),
+				&backend->flush_event);
+		event_add (&backend->flush_event, &tv);
+		backend->flush_scheduled = TRUE;
+	}
 }
 
 void
-rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
-		GQueue *updates, const gchar *src,
-		rspamd_fuzzy_update_cb cb, void *ud,
+rspamd_fuzzy_backend_flush_redis (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud)
 {
 	struct rspamd_fuzzy_backend_redis *backend = subr_ud;
+
+	g_assert (backend != NULL);
+
+	rspamd_fuzzy_redis_flush_checks (backend);
 }
 
 static void
-rspamd_fuzzy_redis_count_callback (redisAsyncContext *c, gpointer r,
+rspamd_fuzzy_redis_count_update_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_session *session = priv;
+
+	/* Failure here does not affect updates themselves */
+	rspamd_fuzzy_redis_reply_done (session);
+}
+
+/*
+ * Called for the replies of updates, adjusts the number of digests when the
+ * last one is received
+ */
+static void
+rspamd_fuzzy_redis_updates_done (struct rspamd_fuzzy_redis_session *session)
+{
+	const gchar *argv[3];
+	gchar numbuf[32];
+	GString *key;
+
+	if (session->nreplies == 1 && !session->failed &&
+			session->count_delta != 0) {
+		/* All transactions are applied, so adjust the number of digests */
+		key = g_string_new (session->backend->redis_object);
+		g_string_append (key, "_count");
+		rspamd_snprintf (numbuf, sizeof (numbuf), "%L", session->count_delta);
+		argv[0] = "INCRBY";
+		argv[1] = key->str;
+		argv[2] = numbuf;
+
+		if (!rspamd_fuzzy_redis_send (session,
+				rspamd_fuzzy_redis_count_update_callback, session,
+				G_N_ELEMENTS (argv), argv, NULL)) {
+			/* Updates themselves are applied */
+			session->failed = FALSE;
+		}
+
+		g_string_free (key, TRUE);
+	}
+
+	rspamd_fuzzy_redis_reply_done (session);
+}
+
+static void
+rspamd_fuzzy_redis_batch_free (struct rspamd_fuzzy_redis_batch *batch)
+{
+	struct rspamd_fuzzy_redis_add *add;
+	guint i;
+
+	for (i = 0; i < batch->adds->len; i ++) {
+		add = &g_array_index (batch->adds, struct rspamd_fuzzy_redis_add, i);
+		g_string_free (add->key, TRUE);
+	}
+
+	g_array_free (batch->adds, TRUE);
+	g_array_free (batch->counted, TRUE);
+	g_slice_free1 (sizeof (*batch), batch);
+}
+
+static void
+rspamd_fuzzy_redis_script_callback (redisAsyncContext *c, gpointer r,
 		gpointer priv)
 {
 	struct rspamd_fuzzy_redis_session *session = priv;
 	redisReply *reply = r;
 
-	event_del (&session->timeout);
+	if (c->err == 0 && reply != NULL && reply->type == REDIS_REPLY_STRING &&
+			strcmp (reply->str, session->backend->add_sha) == 0) {
+		session->backend->add_loaded = TRUE;
+	}
+	else {
+		/* Adds are repeated with EVAL on NOSCRIPT */
+		msg_warn ("cannot load fuzzy add script: %s",
+				c->err != 0 ? c->errstr :
+				(reply != NULL && reply->type == REDIS_REPLY_ERROR ?
+						reply->str : "unexpected reply"));
+	}
 
-	if (c->err == 0) {
-		rspamd_upstream_ok (session->up);
+	rspamd_fuzzy_redis_reply_done (session);
+}
 
-		if (reply->type == REDIS_REPLY_INTEGER) {
-			if (session->callback.cb_count) {
-				session->callback.cb_count (reply->integer, session->cbdata);
-			}
+static void
+rspamd_fuzzy_redis_add_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_session *session = priv;
+	redisReply *reply = r;
+
+	if (c->err == 0 && reply != NULL && reply->type == REDIS_REPLY_INTEGER) {
+		if (reply->integer > 0) {
+			session->count_delta ++;
 		}
-		else {
-			if (session->callback.cb_count) {
-				session->callback.cb_count (0, session->cbdata);
+	}
+	else {
+		msg_err ("cannot add fuzzy hash: %s",
+				c->err != 0 ? c->errstr :
+				(reply != NULL && reply->type == REDIS_REPLY_ERROR ?
+						reply->str : "unexpected reply"));
+		session->failed = TRUE;
+	}
+
+	rspamd_fuzzy_redis_updates_done (session);
+}
+
+/*
+ * Script cache of a server could have been flushed (e.g. on restart), so
+ * the adds that have got NOSCRIPT are repeated with the script body
+ */
+static void
+rspamd_fuzzy_redis_repeat_adds (struct rspamd_fuzzy_redis_session *session,
+		struct rspamd_fuzzy_redis_batch *batch, redisReply *reply)
+{
+	struct rspamd_fuzzy_redis_add *add;
+	redisReply *cur;
+	const gchar *argv[8];
+	guint i;
+
+	for (i = 0; i < batch->adds->len; i ++) {
+		add = &g_array_index (batch->adds, struct rspamd_fuzzy_redis_add, i);
+
+		if (add->pos > reply->elements) {
+			continue;
+		}
+
+		cur = reply->element[add->pos - 1];
+
+		if (cur->type != REDIS_REPLY_ERROR ||
+				strncmp (cur->str, "NOSCRIPT", sizeof ("NOSCRIPT") - 1) != 0) {
+			continue;
+		}
+
+		if (session->backend->add_loaded) {
+			msg_info ("fuzzy add script is not loaded, repeat with EVAL");
+			session->backend->add_loaded = FALSE;
+		}
+
+		argv[0] = "EVAL";
+		argv[1] = rspamd_fuzzy_redis_add_script;
+		argv[2] = "1";
+		argv[3] = add->key->str;
+		argv[4] = add->time;
+		argv[5] = add->flag;
+		argv[6] = add->value;
+		argv[7] = add->expire;
+
+		if (!rspamd_fuzzy_redis_send_bin (session,
+				rspamd_fuzzy_redis_add_callback, session,
+				G_N_ELEMENTS (argv), argv, 3, add->key->len)) {
+			break;
+		}
+	}
+}
+
+static void
+rspamd_fuzzy_redis_exec_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_batch *batch = priv;
+	struct rspamd_fuzzy_redis_session *session = batch->session;
+	redisReply *reply = r, *cur;
+	gint pos;
+	guint i, idx;
+
+	if (c->err == 0 && reply != NULL && reply->type == REDIS_REPLY_ARRAY) {
+		for (i = 0; i < batch->counted->len; i ++) {
+			pos = g_array_index (batch->counted, gint, i);
+			idx = ABS (pos) - 1;
+
+			if (idx < reply->elements) {
+				cur = reply->element[idx];
+
+				if (cur->type == REDIS_REPLY_INTEGER && cur->integer > 0) {
+					session->count_delta += pos > 0 ? 1 : -1;
+				}
 			}
 		}
+
+		rspamd_fuzzy_redis_repeat_adds (session, batch, reply);
 	}
 	else {
-		if (session->callback.cb_count) {
-			session->callback.cb_count (0, session->cbdata);
+		if (c->err != 0) {
+			msg_err ("cannot apply fuzzy updates: %s", c->errstr);
 		}
-		rspamd_upstream_fail (session->up);
+		else if (reply != NULL && reply->type == REDIS_REPLY_ERROR) {
+			msg_err ("cannot apply fuzzy updates: %s", reply->str);
+		}
+		else {
+			msg_err ("cannot apply fuzzy updates: transaction aborted");
+		}
+
+		session->failed = TRUE;
 	}
 
-	rspamd_fuzzy_redis_session_dtor (session);
+	rspamd_fuzzy_redis_batch_free (batch);
+	rspamd_fuzzy_redis_updates_done (session);
+}
+
+static gboolean
+rspamd_fuzzy_redis_queue_add (struct rspamd_fuzzy_redis_session *session,
+		struct rspamd_fuzzy_redis_batch *batch,
+		const struct rspamd_fuzzy_cmd *cmd,
+		const struct rspamd_shingle *sgl,
+		gint64 expire)
+{
+	const gchar *argv[8];
+	gchar *keys;
+	const gchar *sh_keys[RSPAMD_SHINGLE_SIZE];
+	struct rspamd_fuzzy_redis_add *add;
+	gboolean ret;
+	gint pos;
+	guint i;
+
+	g_array_set_size (batch->adds, batch->adds->len + 1);
+	add = &g_array_index (batch->adds, struct rspamd_fuzzy_redis_add,
+			batch->adds->len - 1);
+	add->key = g_string_new (session->backend->redis_object);
+	g_string_append_len (add->key, cmd->digest, sizeof (cmd->digest));
+	rspamd_snprintf (add->expire, sizeof (add->expire), "%L", expire);
+	rspamd_snprintf (add->time, sizeof (add->time), "%L", (gint64)time (NULL));
+	rspamd_snprintf (add->flag, sizeof (add->flag), "%d", (gint)cmd->flag);
+	rspamd_snprintf (add->value, sizeof (add->value), "%d", (gint)cmd->value);
+
+	/* Script replies 1 if a new digest has been created */
+	argv[0] = "EVALSHA";
+	argv[1] = session->backend->add_sha;
+	argv[2] = "1";
+	argv[3] = add->key->str;
+	argv[4] = add->time;
+	argv[5] = add->flag;
+	argv[6] = add->value;
+	argv[7] = add->expire;
+	pos = ++batch->nqueued;
+	add->pos = pos;
+	g_array_append_val (batch->counted, pos);
+	ret = rspamd_fuzzy_redis_send_bin (session, NULL, NULL, G_N_ELEMENTS (argv),
+			argv, 3, add->key->len);
+
+	if (sgl != NULL && ret) {
+		keys = rspamd_fuzzy_redis_shingle_keys (session->backend, sgl,
+				sh_keys, 0);
+		argv[0] = "SETEX";
+		argv[2] = add->expire;
+		argv[3] = cmd->digest;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE && ret; i ++) {
+			argv[1] = sh_keys[i];
+			batch->nqueued ++;
+			ret = rspamd_fuzzy_redis_send_bin (session, NULL, NULL, 4, argv,
+					3, sizeof (cmd->digest));
+		}
+
+		g_free (keys);
+	}
+
+	return ret;
+}
+
+static gboolean
+rspamd_fuzzy_redis_queue_del (struct rspamd_fuzzy_redis_session *session,
+		struct rspamd_fuzzy_redis_batch *batch,
+		const struct rspamd_fuzzy_cmd *cmd,
+		const struct rspamd_shingle *sgl)
+{
+	const gchar *argv[RSPAMD_SHINGLE_SIZE + 1];
+	gchar *keys;
+	GString *key;
+	gboolean ret;
+	gint pos;
+
+	key = g_string_new (session->backend->redis_object);
+	g_string_append_len (key, cmd->digest, sizeof (cmd->digest));
+	argv[0] = "DEL";
+	argv[1] = key->str;
+	/* DEL replies 1 if the digest has existed */
+	pos = -(++batch->nqueued);
+	g_array_append_val (batch->counted, pos);
+	ret = rspamd_fuzzy_redis_send_bin (session, NULL, NULL, 2, argv,
+			1, key->len);
+	g_string_free (key, TRUE);
+
+	if (sgl != NULL && ret) {
+		keys = rspamd_fuzzy_redis_shingle_keys (session->backend, sgl,
+				argv, 1);
+		batch->nqueued ++;
+		ret = rspamd_fuzzy_redis_send (session, NULL, NULL,
+				G_N_ELEMENTS (argv), argv, NULL);
+		g_free (keys);
+	}
+
+	return ret;
+}
+
+static gboolean
+rspamd_fuzzy_redis_exec_batch (struct rspamd_fuzzy_redis_session *session,
+		struct rspamd_fuzzy_redis_batch *batch)
+{
+	const gchar *argv[1];
+
+	argv[0] = "EXEC";
+
+	if (!rspamd_fuzzy_redis_send (session, rspamd_fuzzy_redis_exec_callback,
+			batch, 1, argv, NULL)) {
+		rspamd_fuzzy_redis_batch_free (batch);
+
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
 void
-rspamd_fuzzy_backend_count_redis (struct rspamd_fuzzy_backend *bk,
-		rspamd_fuzzy_count_cb cb, void *ud,
+rspamd_fuzzy_backend_update_redis (struct rspamd_fuzzy_backend *bk,
+		GQueue *updates, const gchar *src,
+		rspamd_fuzzy_update_cb cb, void *ud,
 		void *subr_ud)
 {
 	struct rspamd_fuzzy_backend_redis *backend = subr_ud;
 	struct rspamd_fuzzy_redis_session *session;
-	struct upstream *up;
-	struct timeval tv;
-	rspamd_inet_addr_t *addr;
+	struct rspamd_fuzzy_redis_batch *batch = NULL;
+	struct fuzzy_peer_cmd *io_cmd;
+	const struct rspamd_fuzzy_cmd *cmd;
+	const struct rspamd_shingle *sgl;
+	const gchar *argv[3];
+	gboolean ret = TRUE;
+	gint64 expire;
+	GString *key;
+	GList *cur;
 
 	g_assert (backend != NULL);
 
-	session = g_slice_alloc0 (sizeof (*session));
-	session->backend = backend;
-	REF_RETAIN (session->backend);
-
-	session->callback.cb_count = cb;
+	session = rspamd_fuzzy_redis_session_new (backend, bk,
+			RSPAMD_FUZZY_REDIS_COMMAND_UPDATES);
+	session->callback.cb_update = cb;
 	session->cbdata = ud;
-	session->command = RSPAMD_FUZZY_REDIS_COMMAND_COUNT;
 
-	session->nargs = 2;
-	session->argv = g_malloc (sizeof (gchar *) * 2);
-	session->argv[0] = g_strdup ("HLEN");
-	session->argv[1] = g_strdup (backend->redis_object);
+	if (!rspamd_fuzzy_redis_session_connect (session,
+			backend->write_servers ?
+					backend->write_servers : backend->read_servers)) {
+		session->failed = TRUE;
+		rspamd_fuzzy_redis_session_fin (session);
 
-	up = rspamd_upstream_get (backend->read_servers,
-			RSPAMD_UPSTREAM_ROUND_ROBIN,
-			NULL,
-			0);
+		return;
+	}
 
-	session->up = up;
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
-	session->ctx = rspamd_redis_pool_connect (backend->pool,
-			backend->dbname, backend->password,
-			rspamd_inet_address_to_string (addr),
-			rspamd_inet_address_get_port (addr));
+	if (!backend->add_loaded) {
+		/* Script is loaded before transactions that call it by EVALSHA */
+		argv[0] = "SCRIPT";
+		argv[1] = "LOAD";
+		argv[2] = rspamd_fuzzy_redis_add_script;
+		rspamd_fuzzy_redis_send (session, rspamd_fuzzy_redis_script_callback,
+				session, G_N_ELEMENTS (argv), argv, NULL);
+	}
+
+	expire = rspamd_fuzzy_backend_get_expire (bk);
 
-	if (session->ctx == NULL) {
-		rspamd_fuzzy_redis_session_dtor (session);
+	for (cur = updates->head; cur != NULL && ret; cur = g_list_next (cur)) {
+		io_cmd = cur->data;
 
-		if (cb) {
-			cb (0, subr_ud);
+		if (io_cmd->is_shingle) {
+			cmd = &io_cmd->cmd.shingle.basic;
+			sgl = &io_cmd->cmd.shingle.sgl;
+		}
+		else {
+			cmd = &io_cmd->cmd.normal;
+			sgl = NULL;
+		}
+
+		if (batch == NULL) {
+			batch = g_slice_alloc0 (sizeof (*batch));
+			batch->session = session;
+			batch->counted = g_array_new (FALSE, FALSE, sizeof (gint));
+			batch->adds = g_array_new (FALSE, FALSE,
+					sizeof (struct rspamd_fuzzy_redis_add));
+			argv[0] = "MULTI";
+
+			if (!rspamd_fuzzy_redis_send (session, NULL, NULL, 1, argv, NULL)) {
+				rspamd_fuzzy_redis_batch_free (batch);
+				batch = NULL;
+				break;
+			}
 		}
+
+		if (cmd->cmd == FUZZY_WRITE) {
+			ret = rspamd_fuzzy_redis_queue_add (session, batch, cmd, sgl,
+					expire);
+		}
+		else {
+			ret = rspamd_fuzzy_redis_queue_del (session, batch, cmd, sgl);
+		}
+
+		if (g_list_next (cur) == NULL && ret) {
+			/* Source revision is increased by the last transaction */
+			key = g_string_new (backend->redis_object);
+			g_string_append (key, src);
+			argv[0] = "INCR";
+			argv[1] = key->str;
+			batch->nqueued ++;
+			ret = rspamd_fuzzy_redis_send (session, NULL, NULL, 2, argv, NULL);
+			g_string_free (key, TRUE);
+		}
+
+		if (batch->nqueued >= backend->updates_batch ||
+				g_list_next (cur) == NULL || !ret) {
+			/* EXEC is sent even on failure to finish the transaction */
+			rspamd_fuzzy_redis_exec_batch (session, batch);
+			batch = NULL;
+		}
+	}
+
+	if (session->nreplies == 0) {
+		rspamd_fuzzy_redis_session_fin (session);
 	}
 	else {
-		if (redisAsyncCommandArgv (session->ctx, rspamd_fuzzy_redis_count_callback,
-				session, session->nargs,
-				(const gchar **)session->argv, NULL) != REDIS_OK) {
-			rspamd_fuzzy_redis_session_dtor (session);
+		rspamd_fuzzy_redis_session_arm (session);
+	}
+}
 
-			if (cb) {
-				cb (0, subr_ud);
-			}
+static void
+rspamd_fuzzy_redis_integer_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_session *session = priv;
+	redisReply *reply = r;
+
+	if (c->err == 0 && reply != NULL) {
+		if (reply->type == REDIS_REPLY_INTEGER) {
+			session->ival = reply->integer;
+		}
+		else if (reply->type == REDIS_REPLY_STRING) {
+			session->ival = strtoull (reply->str, NULL, 10);
 		}
 		else {
-			/* Add timeout */
-			event_set (&session->timeout, -1, EV_TIMEOUT, rspamd_fuzzy_redis_timeout,
-					session);
-			event_base_set (rspamd_fuzzy_backend_event_base (bk),
-					&session->timeout);
-			double_to_tv (backend->timeout, &tv);
-			event_add (&session->timeout, &tv);
+			session->ival = 0;
 		}
 	}
+	else {
+		session->failed = TRUE;
+	}
+
+	rspamd_fuzzy_redis_reply_done (session);
+}
+
+static void
+rspamd_fuzzy_redis_get_integer (struct rspamd_fuzzy_redis_session *session,
+		const gchar *suffix)
+{
+	struct rspamd_fuzzy_backend_redis *backend = session->backend;
+	const gchar *argv[2];
+	GString *key;
+
+	if (!rspamd_fuzzy_redis_session_connect (session, backend->read_servers)) {
+		session->failed = TRUE;
+		rspamd_fuzzy_redis_session_fin (session);
+
+		return;
+	}
+
+	key = g_string_new (backend->redis_object);
+	g_string_append (key, suffix);
+	argv[0] = "GET";
+	argv[1] = key->str;
+	rspamd_fuzzy_redis_send (session, rspamd_fuzzy_redis_integer_callback,
+			session, G_N_ELEMENTS (argv), argv, NULL);
+	g_string_free (key, TRUE);
+
+	if (session->nreplies == 0) {
+		rspamd_fuzzy_redis_session_fin (session);
+	}
+	else {
+		rspamd_fuzzy_redis_session_arm (session);
+	}
+}
+
+void
+rspamd_fuzzy_backend_count_redis (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_count_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_redis *backend = subr_ud;
+	struct rspamd_fuzzy_redis_session *session;
+
+	g_assert (backend != NULL);
+
+	session = rspamd_fuzzy_redis_session_new (backend, bk,
+			RSPAMD_FUZZY_REDIS_COMMAND_COUNT);
+	session->callback.cb_count = cb;
+	session->cbdata = ud;
+	rspamd_fuzzy_redis_get_integer (session, "_count");
 }
 
 void
@@ -400,8 +1434,15 @@ rspamd_fuzzy_backend_version_redis (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud)
 {
 	struct rspamd_fuzzy_backend_redis *backend = subr_ud;
+	struct rspamd_fuzzy_redis_session *session;
 
 	g_assert (backend != NULL);
+
+	session = rspamd_fuzzy_redis_session_new (backend, bk,
+			RSPAMD_FUZZY_REDIS_COMMAND_VERSION);
+	session->callback.cb_version = cb;
+	session->cbdata = ud;
+	rspamd_fuzzy_redis_get_integer (session, src);
 }
 
 const gchar*
@@ -421,6 +1462,63 @@ rspamd_fuzzy_backend_expire_redis (struct rspamd_fuzzy_backend *bk,
 	struct rspamd_fuzzy_backend_redis *backend = subr_ud;
 
 	g_assert (backend != NULL);
+	/* Redis expires keys itself */
+}
+
+ucl_object_t *
+rspamd_fuzzy_backend_stat_redis (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_redis *backend = subr_ud;
+	struct rspamd_fuzzy_redis_latency *lat;
+	ucl_object_t *obj, *elt, *hist;
+	gchar numbuf[32];
+	gdouble lim;
+	guint i, j;
+
+	g_assert (backend != NULL);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < RSPAMD_FUZZY_REDIS_COMMAND_MAX; i ++) {
+		lat = &backend->latency[i];
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt, ucl_object_fromint (lat->count),
+				"count", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromdouble (lat->count > 0 ?
+						lat->total / lat->count * 1000.0 : 0.0),
+				"avg_ms", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromdouble (lat->max * 1000.0),
+				"max_ms", 0, false);
+
+		/* Keys are upper bounds of buckets in milliseconds */
+		hist = ucl_object_typed_new (UCL_OBJECT);
+		lim = REDIS_LATENCY_MIN * 1000.0;
+
+		for (j = 0; j < REDIS_LATENCY_BUCKETS; j ++) {
+			if (lat->hist[j] > 0) {
+				if (j == REDIS_LATENCY_BUCKETS - 1) {
+					rspamd_strlcpy (numbuf, "inf", sizeof (numbuf));
+				}
+				else {
+					rspamd_snprintf (numbuf, sizeof (numbuf), "%.1f", lim);
+				}
+
+				ucl_object_insert_key (hist, ucl_object_fromint (lat->hist[j]),
+						numbuf, 0, true);
+			}
+
+			lim *= 2.0;
+		}
+
+		ucl_object_insert_key (elt, hist, "histogram", 0, false);
+		ucl_object_insert_key (obj, elt, rspamd_fuzzy_redis_command_names[i],
+				0, false);
+	}
+
+	return obj;
 }
 
 void
@@ -431,5 +1529,7 @@ rspamd_fuzzy_backend_close_redis (struct rspamd_fuzzy_backend *bk,
 
 	g_assert (backend != NULL);
 
+	/* Sessions in flight keep their own references */
+	rspamd_fuzzy_redis_flush_checks (backend);
 	REF_RELEASE (backend);
 }
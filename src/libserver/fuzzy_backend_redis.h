@@ -41,8 +41,12 @@ void rspamd_fuzzy_backend_version_redis (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
 const gchar* rspamd_fuzzy_backend_id_redis (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
+void rspamd_fuzzy_backend_flush_redis (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud);
 void rspamd_fuzzy_backend_expire_redis (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
+ucl_object_t* rspamd_fuzzy_backend_stat_redis (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud);
 void rspamd_fuzzy_backend_close_redis (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
 
@@ -34,6 +34,9 @@ struct rspamd_fuzzy_backend_sqlite {
 static const gdouble sql_sleep_time = 0.1;
 static const guint max_retries = 10;
 
+/* Number of digests resolved by a single batched check statement */
+#define RSPAMD_FUZZY_SQLITE_BATCH 16
+
 #define msg_err_fuzzy_backend(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         backend->pool->tag.tagname, backend->pool->tag.uid, \
         G_STRFUNC, \
@@ -89,10 +92,10 @@ enum rspamd_fuzzy_statement_idx {
 	RSPAMD_FUZZY_BACKEND_INSERT,
 	RSPAMD_FUZZY_BACKEND_UPDATE,
 	RSPAMD_FUZZY_BACKEND_UPDATE_FLAG,
-	RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
+	RSPAMD_FUZZY_BACKEND_INSERT_SHINGLES,
 	RSPAMD_FUZZY_BACKEND_CHECK,
-	RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
-	RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID,
+	RSPAMD_FUZZY_BACKEND_CHECK_BATCH,
+	RSPAMD_FUZZY_BACKEND_CHECK_SHINGLES,
 	RSPAMD_FUZZY_BACKEND_DELETE,
 	RSPAMD_FUZZY_BACKEND_COUNT,
 	RSPAMD_FUZZY_BACKEND_EXPIRE,
@@ -157,10 +160,16 @@ static struct rspamd_fuzzy_stmts {
 		.result = SQLITE_DONE
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
-		.sql = "INSERT OR REPLACE INTO shingles(value, number, digest_id) "
-				"VALUES (?1, ?2, ?3);",
-		.args = "III",
+		.idx = RSPAMD_FUZZY_BACKEND_INSERT_SHINGLES,
+		.sql = "INSERT OR REPLACE INTO shingles(value, number, digest_id) VALUES "
+				"(?1,0,?33),(?2,1,?33),(?3,2,?33),(?4,3,?33),(?5,4,?33),(?6,5,?33),"
+				"(?7,6,?33),(?8,7,?33),(?9,8,?33),(?10,9,?33),(?11,10,?33),"
+				"(?12,11,?33),(?13,12,?33),(?14,13,?33),(?15,14,?33),(?16,15,?33),"
+				"(?17,16,?33),(?18,17,?33),(?19,18,?33),(?20,19,?33),(?21,20,?33),"
+				"(?22,21,?33),(?23,22,?33),(?24,23,?33),(?25,24,?33),(?26,25,?33),"
+				"(?27,26,?33),(?28,27,?33),(?29,28,?33),(?30,29,?33),(?31,30,?33),"
+				"(?32,31,?33);",
+		.args = "HI",
 		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
@@ -172,16 +181,27 @@ static struct rspamd_fuzzy_stmts {
 		.result = SQLITE_ROW
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
-		.sql = "SELECT digest_id FROM shingles WHERE value=?1 AND number=?2",
-		.args = "IS",
+		.idx = RSPAMD_FUZZY_BACKEND_CHECK_BATCH,
+		.sql = "SELECT digest, value, time, flag FROM digests WHERE digest IN (?1,?2,"
+				"?3,?4,?5,?6,?7,?8,?9,?10,?11,?12,?13,?14,?15,?16);",
+		.args = "B",
 		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID,
-		.sql = "SELECT digest, value, time, flag FROM digests WHERE id=?1",
-		.args = "I",
+		/* Resolves all shingles of a query at once */
+		.idx = RSPAMD_FUZZY_BACKEND_CHECK_SHINGLES,
+		.sql = "WITH q(value, number) AS (VALUES (?1,0),(?2,1),(?3,2),(?4,3),(?5,4),"
+				"(?6,5),(?7,6),(?8,7),(?9,8),(?10,9),(?11,10),(?12,11),(?13,12),"
+				"(?14,13),(?15,14),(?16,15),(?17,16),(?18,17),(?19,18),(?20,19),"
+				"(?21,20),(?22,21),(?23,22),(?24,23),(?25,24),(?26,25),(?27,26),"
+				"(?28,27),(?29,28),(?30,29),(?31,30),(?32,31)) "
+				"SELECT digests.value, digests.time, digests.flag, "
+				"COUNT(*) AS cnt FROM q "
+				"JOIN shingles ON shingles.value=q.value AND shingles.number=q.number "
+				"JOIN digests ON digests.id=shingles.digest_id "
+				"GROUP BY shingles.digest_id ORDER BY cnt DESC LIMIT 1;",
+		.args = "H",
 		.stmt = NULL,
 		.result = SQLITE_ROW
 	},
@@ -299,8 +319,10 @@ rspamd_fuzzy_backend_sqlite_run_stmt (struct rspamd_fuzzy_backend_sqlite *backen
 	int retcode;
 	va_list ap;
 	sqlite3_stmt *stmt;
-	int i;
+	int i, j, param = 1;
 	const char *argtypes;
+	const guint64 *hashes;
+	const gchar **digests;
 	guint retries = 0;
 	struct timespec ts;
 
@@ -333,20 +355,41 @@ rspamd_fuzzy_backend_sqlite_run_stmt (struct rspamd_fuzzy_backend_sqlite *backen
 	for (i = 0; argtypes[i] != '\0'; i++) {
 		switch (argtypes[i]) {
 		case 'T':
-			sqlite3_bind_text (stmt, i + 1, va_arg (ap, const char*), -1,
+			sqlite3_bind_text (stmt, param++, va_arg (ap, const char*), -1,
 					SQLITE_STATIC);
 			break;
 		case 'I':
-			sqlite3_bind_int64 (stmt, i + 1, va_arg (ap, gint64));
+			sqlite3_bind_int64 (stmt, param++, va_arg (ap, gint64));
 			break;
 		case 'S':
-			sqlite3_bind_int (stmt, i + 1, va_arg (ap, gint));
+			sqlite3_bind_int (stmt, param++, va_arg (ap, gint));
 			break;
 		case 'D':
 			/* Special case for digests variable */
-			sqlite3_bind_text (stmt, i + 1, va_arg (ap, const char*), 64,
+			sqlite3_bind_text (stmt, param++, va_arg (ap, const char*), 64,
 					SQLITE_STATIC);
 			break;
+		case 'H':
+			/* All shingles of a command */
+			hashes = va_arg (ap, const guint64 *);
+
+			for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+				sqlite3_bind_int64 (stmt, param++, hashes[j]);
+			}
+			break;
+		case 'B':
+			/* Batch of digests, missing ones are left as NULL */
+			digests = va_arg (ap, const gchar **);
+
+			for (j = 0; j < RSPAMD_FUZZY_SQLITE_BATCH; j ++) {
+				if (digests[j] != NULL) {
+					sqlite3_bind_text (stmt, param, digests[j], 64,
+							SQLITE_STATIC);
+				}
+
+				param ++;
+			}
+			break;
 		}
 	}
 
@@ -484,149 +527,137 @@ rspamd_fuzzy_backend_sqlite_open (const gchar *path,
 	return backend;
 }
 
-static gint
-rspamd_fuzzy_backend_sqlite_int64_cmp (const void *a, const void *b)
-{
-	gint64 ia = *(gint64 *)a, ib = *(gint64 *)b;
-
-	return (ia - ib);
-}
-
-struct rspamd_fuzzy_reply
-rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
-		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+void
+rspamd_fuzzy_backend_sqlite_check_batch (struct rspamd_fuzzy_backend_sqlite *backend,
+		const struct rspamd_fuzzy_cmd **cmds,
+		struct rspamd_fuzzy_reply *replies,
+		guint ncmds,
+		gint64 expire)
 {
-	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
 	const struct rspamd_fuzzy_shingle_cmd *shcmd;
-	int rc;
-	gint64 timestamp;
-	gint64 shingle_values[RSPAMD_SHINGLE_SIZE], i, sel_id, cur_id,
-		cur_cnt, max_cnt;
+	const gchar *digests[RSPAMD_FUZZY_SQLITE_BATCH];
+	struct rspamd_fuzzy_reply *rep;
+	sqlite3_stmt *stmt;
+	gboolean *matched;
+	const guchar *found;
+	gint rc;
+	guint i, j, start, cnt;
+	gint64 timestamp, now;
 
-	if (backend == NULL) {
-		return rep;
+	memset (replies, 0, sizeof (*replies) * ncmds);
+
+	if (backend == NULL || ncmds == 0) {
+		return;
 	}
 
-	/* Try direct match first of all */
+	matched = g_malloc0 (sizeof (*matched) * ncmds);
+	now = time (NULL);
+
 	rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
 			RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
-	rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
-			RSPAMD_FUZZY_BACKEND_CHECK,
-			cmd->digest);
 
-	if (rc == SQLITE_OK) {
-		timestamp = sqlite3_column_int64 (
-				prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK].stmt, 1);
-		if (time (NULL) - timestamp > expire) {
-			/* Expire element */
-			msg_debug_fuzzy_backend ("requested hash has been expired");
-		}
-		else {
-			rep.value = sqlite3_column_int64 (
-				prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK].stmt, 0);
-			rep.prob = 1.0;
-			rep.flag = sqlite3_column_int (
-					prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK].stmt, 2);
-		}
-	}
-	else if (cmd->shingles_count > 0) {
-		/* Fuzzy match */
+	/* Try direct matches first of all */
+	for (start = 0; start < ncmds; start += RSPAMD_FUZZY_SQLITE_BATCH) {
+		cnt = MIN (RSPAMD_FUZZY_SQLITE_BATCH, ncmds - start);
 
-		rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK);
-		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
-
-		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-			rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
-					RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
-					shcmd->sgl.hashes[i], i);
-			if (rc == SQLITE_OK) {
-				shingle_values[i] = sqlite3_column_int64 (
-						prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE].stmt,
-						0);
-			}
-			else {
-				shingle_values[i] = -1;
-			}
-			msg_debug_fuzzy_backend ("looking for shingle %L -> %L: %d", i,
-					shcmd->sgl.hashes[i], rc);
+		for (i = 0; i < RSPAMD_FUZZY_SQLITE_BATCH; i ++) {
+			digests[i] = i < cnt ? cmds[start + i]->digest : NULL;
 		}
 
-		rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend,
-				RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE);
-
-		qsort (shingle_values, RSPAMD_SHINGLE_SIZE, sizeof (gint64),
-				rspamd_fuzzy_backend_sqlite_int64_cmp);
-		sel_id = -1;
-		cur_id = -1;
-		cur_cnt = 0;
-		max_cnt = 0;
-
-		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-			if (shingle_values[i] == -1) {
-				continue;
-			}
+		rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
+				RSPAMD_FUZZY_BACKEND_CHECK_BATCH, digests);
+		stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK_BATCH].stmt;
+
+		while (rc == SQLITE_OK) {
+			found = sqlite3_column_blob (stmt, 0);
+
+			if (found != NULL && sqlite3_column_bytes (stmt, 0) ==
+					sizeof (cmds[0]->digest)) {
+				/* The same digest might be requested several times */
+				for (j = start; j < start + cnt; j ++) {
+					if (matched[j] || memcmp (cmds[j]->digest, found,
+							sizeof (cmds[j]->digest)) != 0) {
+						continue;
+					}
 
-			/* We have some value here, so we need to check it */
-			if (shingle_values[i] == cur_id) {
-				cur_cnt ++;
-			}
-			else {
-				cur_id = shingle_values[i];
-				if (cur_cnt >= max_cnt) {
-					max_cnt = cur_cnt;
-					sel_id = cur_id;
+					matched[j] = TRUE;
+					rep = &replies[j];
+					timestamp = sqlite3_column_int64 (stmt, 2);
+
+					if (now - timestamp > expire) {
+						/* Expire element */
+						msg_debug_fuzzy_backend ("requested hash has been expired");
+					}
+					else {
+						rep->value = sqlite3_column_int64 (stmt, 1);
+						rep->prob = 1.0;
+						rep->flag = sqlite3_column_int (stmt, 3);
+					}
 				}
-				cur_cnt = 0;
 			}
+
+			rc = sqlite3_step (stmt) == SQLITE_ROW ? SQLITE_OK : SQLITE_DONE;
 		}
 
-		if (cur_cnt > max_cnt) {
-			max_cnt = cur_cnt;
+		rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend,
+				RSPAMD_FUZZY_BACKEND_CHECK_BATCH);
+	}
+
+	/* Fuzzy matches */
+	for (i = 0; i < ncmds; i ++) {
+		if (matched[i] || cmds[i]->shingles_count == 0) {
+			continue;
 		}
 
-		if (sel_id != -1) {
-			/* We have some id selected here */
-			rep.prob = (float)max_cnt / (float)RSPAMD_SHINGLE_SIZE;
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmds[i];
+		rep = &replies[i];
+		rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
+				RSPAMD_FUZZY_BACKEND_CHECK_SHINGLES, shcmd->sgl.hashes);
+		stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_CHECK_SHINGLES].stmt;
 
-			if (rep.prob > 0.5) {
+		if (rc == SQLITE_OK) {
+			/*
+			 * Repeats of a digest are counted after its first match, so at
+			 * least 18 of 32 shingles must match to pass the threshold
+			 */
+			rep->prob = (float)(sqlite3_column_int64 (stmt, 3) - 1) /
+					(float)RSPAMD_SHINGLE_SIZE;
+
+			if (rep->prob > 0.5) {
 				msg_debug_fuzzy_backend (
 						"found fuzzy hash with probability %.2f",
-						rep.prob);
-				rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
-						RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID, sel_id);
-				if (rc == SQLITE_OK) {
-					timestamp = sqlite3_column_int64 (
-							prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt,
-							2);
-					if (time (NULL) - timestamp > expire) {
-						/* Expire element */
-						msg_debug_fuzzy_backend (
-								"requested hash has been expired");
-						rep.prob = 0.0;
-					}
-					else {
-						rep.value = sqlite3_column_int64 (
-								prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt,
-								1);
-						rep.flag = sqlite3_column_int (
-								prepared_stmts[RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID].stmt,
-								3);
-					}
+						rep->prob);
+				timestamp = sqlite3_column_int64 (stmt, 1);
+
+				if (now - timestamp > expire) {
+					/* Expire element */
+					msg_debug_fuzzy_backend (
+							"requested hash has been expired");
+					rep->prob = 0.0;
+				}
+				else {
+					rep->value = sqlite3_column_int64 (stmt, 0);
+					rep->flag = sqlite3_column_int (stmt, 2);
 				}
 			}
-			else {
-				/* Otherwise we assume that as error */
-				rep.value = 0;
-			}
-
-			rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend,
-					RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID);
 		}
+
+		rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend,
+				RSPAMD_FUZZY_BACKEND_CHECK_SHINGLES);
 	}
 
-	rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK);
 	rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
 			RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT);
+	g_free (matched);
+}
+
+struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+{
+	struct rspamd_fuzzy_reply rep;
+
+	rspamd_fuzzy_backend_sqlite_check_batch (backend, &cmd, &rep, 1, expire);
 
 	return rep;
 }
@@ -657,7 +688,7 @@ gboolean
 rspamd_fuzzy_backend_sqlite_add (struct rspamd_fuzzy_backend_sqlite *backend,
 		const struct rspamd_fuzzy_cmd *cmd)
 {
-	int rc, i;
+	int rc;
 	gint64 id, flag;
 	const struct rspamd_fuzzy_shingle_cmd *shcmd;
 
@@ -719,21 +750,17 @@ rspamd_fuzzy_backend_sqlite_add (struct rspamd_fuzzy_backend_sqlite *backend,
 				id = sqlite3_last_insert_rowid (backend->db);
 				shcmd = (const struct rspamd_fuzzy_shingle_cmd *) cmd;
 
-				for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-					rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
-							RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
-							shcmd->sgl.hashes[i], (gint64)i, id);
-					msg_debug_fuzzy_backend ("add shingle %d -> %L: %L",
-							i,
-							shcmd->sgl.hashes[i],
-							id);
-
-					if (rc != SQLITE_OK) {
-						msg_warn_fuzzy_backend ("cannot add shingle %d -> "
-								"%L: %L: %s", i,
-								shcmd->sgl.hashes[i],
-								id, sqlite3_errmsg (backend->db));
-					}
+				/* All shingles are inserted by a single statement */
+				rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+						RSPAMD_FUZZY_BACKEND_INSERT_SHINGLES,
+						shcmd->sgl.hashes, id);
+				msg_debug_fuzzy_backend ("add %d shingles -> %L",
+						RSPAMD_SHINGLE_SIZE, id);
+
+				if (rc != SQLITE_OK) {
+					msg_warn_fuzzy_backend ("cannot add shingles -> "
+							"%L: %s",
+							id, sqlite3_errmsg (backend->db));
 				}
 			}
 		}
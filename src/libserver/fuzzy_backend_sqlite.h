@@ -43,6 +43,22 @@ struct rspamd_fuzzy_reply rspamd_fuzzy_backend_sqlite_check (
 		const struct rspamd_fuzzy_cmd *cmd,
 		gint64 expire);
 
+/**
+ * Check several fuzzy commands within a single read transaction: exact
+ * digests are resolved in groups and all shingles of a command are resolved
+ * by a single statement
+ * @param backend
+ * @param cmds array of commands
+ * @param replies output array of replies of the same length
+ * @param ncmds number of commands
+ */
+void rspamd_fuzzy_backend_sqlite_check_batch (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		const struct rspamd_fuzzy_cmd **cmds,
+		struct rspamd_fuzzy_reply *replies,
+		guint ncmds,
+		gint64 expire);
+
 /**
  * Prepare storage for updates (by starting transaction)
  */
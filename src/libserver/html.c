@@ -874,11 +874,100 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 	return TRUE;
 }
 
+/*
+ * Lightweight version of `rspamd_html_process_tag` that does not build tags
+ * tree: it tracks the currently opened block tags in a stack to propagate
+ * ignore flag and to check balance exactly as the tree does
+ */
+static gboolean
+rspamd_html_process_tag_lean (rspamd_mempool_t *pool, struct html_content *hc,
+		struct html_tag *tag, GPtrArray *stack, gboolean *balanced)
+{
+	struct html_tag *parent;
+	gint i;
+
+	parent = stack->len > 0 ? g_ptr_array_index (stack, stack->len - 1) : NULL;
+
+	if (!(tag->flags & CM_INLINE)) {
+		/* Block tag */
+		if (tag->flags & FL_CLOSING) {
+			for (i = stack->len - 1; i >= 0; i --) {
+				parent = g_ptr_array_index (stack, i);
+
+				if (parent->id == tag->id && (parent->flags & FL_CLOSED) == 0) {
+					parent->flags |= FL_CLOSED;
+					g_ptr_array_set_size (stack, i);
+					*balanced = TRUE;
+
+					return TRUE;
+				}
+			}
+
+			msg_debug_pool (
+					"mark part as unbalanced as it has not pairable closing tags");
+			hc->flags |= RSPAMD_HTML_FLAG_UNBALANCED;
+			*balanced = FALSE;
+		}
+		else {
+			if (parent && (parent->flags & FL_IGNORE)) {
+				tag->flags |= FL_IGNORE;
+			}
+
+			if ((tag->flags & FL_CLOSED) == 0) {
+				g_ptr_array_add (stack, tag);
+			}
+
+			if (tag->flags & (CM_HEAD|CM_UNKNOWN|FL_IGNORE)) {
+				tag->flags |= FL_IGNORE;
+
+				return FALSE;
+			}
+		}
+	}
+	else {
+		/* Inline tag */
+		if (parent && (parent->flags & (CM_HEAD|CM_UNKNOWN|FL_IGNORE))) {
+			tag->flags |= FL_IGNORE;
+
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Returns decoded copy of a string if it has entitles, input is never modified
+ * to allow parsing of the same part once more
+ */
+static const guchar *
+rspamd_html_decode_entitles_copy (rspamd_mempool_t *pool,
+		const guchar *begin, guint *len)
+{
+	gchar *copy;
+
+	if (*len == 0 || memchr (begin, '&', *len) == NULL) {
+		return begin;
+	}
+
+	copy = rspamd_mempool_alloc (pool, *len + 1);
+	memcpy (copy, begin, *len);
+	copy[*len] = '\0';
+	*len = rspamd_html_decode_entitles_inplace (copy, *len);
+
+	return copy;
+}
+
 #define NEW_COMPONENT(comp_type) do {							\
 	comp = rspamd_mempool_alloc (pool, sizeof (*comp));			\
 	comp->type = (comp_type);									\
 	comp->start = NULL;											\
 	comp->len = 0;												\
+	if (tag->params == NULL) {									\
+		tag->params = g_queue_new ();							\
+		rspamd_mempool_add_destructor (pool,					\
+				(rspamd_mempool_destruct_t)g_queue_free, tag->params); \
+	}															\
 	g_queue_push_tail (tag->params, comp);						\
 	ret = TRUE;													\
 } while(0)
@@ -886,14 +975,15 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 static gboolean
 rspamd_html_parse_tag_component (rspamd_mempool_t *pool,
 		const guchar *begin, const guchar *end,
-		struct html_tag *tag)
+		struct html_tag *tag, gboolean build_tree)
 {
 	struct html_tag_component *comp;
-	gint len;
+	guint len;
 	gboolean ret = FALSE;
 
 	g_assert (end >= begin);
-	len = rspamd_html_decode_entitles_inplace ((gchar *)begin, end - begin);
+	len = end - begin;
+	begin = rspamd_html_decode_entitles_copy (pool, begin, &len);
 
 	if (len == 3) {
 		if (g_ascii_strncasecmp (begin, "src", len) == 0) {
@@ -917,7 +1007,8 @@ rspamd_html_parse_tag_component (rspamd_mempool_t *pool,
 			NEW_COMPONENT (RSPAMD_HTML_COMPONENT_STYLE);
 		}
 	}
-	else if (tag->flags & FL_BLOCK) {
+	else if ((tag->flags & FL_BLOCK) && build_tree) {
+		/* Attributes of blocks are used merely to build blocks */
 		if (len == 5){
 			if (g_ascii_strncasecmp (begin, "color", len) == 0) {
 				NEW_COMPONENT (RSPAMD_HTML_COMPONENT_COLOR);
@@ -942,7 +1033,7 @@ rspamd_html_parse_tag_component (rspamd_mempool_t *pool,
 static void
 rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 		struct html_content *hc, struct html_tag *tag, const guchar *in,
-		gint *statep, guchar const **savep)
+		gint *statep, guchar const **savep, gboolean build_tree)
 {
 	enum {
 		parse_start = 0,
@@ -996,10 +1087,8 @@ rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 				state = ignore_bad_tag;
 			}
 			else {
-				/* We can safely modify tag's name here, as it is already parsed */
-				tag->name.len = rspamd_html_decode_entitles_inplace (
-						(gchar *)tag->name.start,
-						tag->name.len);
+				tag->name.start = rspamd_html_decode_entitles_copy (pool,
+						tag->name.start, &tag->name.len);
 
 				found = bsearch (tag, tag_defs, G_N_ELEMENTS (tag_defs),
 					sizeof (tag_defs[0]), tag_find);
@@ -1034,7 +1123,8 @@ rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 				return;
 			}
 
-			if (!rspamd_html_parse_tag_component (pool, *savep, in, tag)) {
+			if (!rspamd_html_parse_tag_component (pool, *savep, in, tag,
+					build_tree)) {
 				/* Ignore unknown params */
 				*savep = NULL;
 			}
@@ -1145,9 +1235,8 @@ rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 				comp = g_queue_peek_tail (tag->params);
 				g_assert (comp != NULL);
 				comp->len = in - *savep;
-				comp->start = *savep;
-				comp->len = rspamd_html_decode_entitles_inplace ((gchar *)*savep,
-						comp->len);
+				comp->start = rspamd_html_decode_entitles_copy (pool, *savep,
+						&comp->len);
 				*savep = NULL;
 			}
 		}
@@ -1164,9 +1253,8 @@ rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 				comp = g_queue_peek_tail (tag->params);
 				g_assert (comp != NULL);
 				comp->len = in - *savep;
-				comp->start = *savep;
-				comp->len = rspamd_html_decode_entitles_inplace ((gchar *)*savep,
-						comp->len);
+				comp->start = rspamd_html_decode_entitles_copy (pool, *savep,
+						&comp->len);
 				*savep = NULL;
 			}
 		}
@@ -1186,9 +1274,8 @@ rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 				comp = g_queue_peek_tail (tag->params);
 				g_assert (comp != NULL);
 				comp->len = in - *savep;
-				comp->start = *savep;
-				comp->len = rspamd_html_decode_entitles_inplace ((gchar *)*savep,
-						comp->len);
+				comp->start = rspamd_html_decode_entitles_copy (pool, *savep,
+						&comp->len);
 				*savep = NULL;
 			}
 		}
@@ -1304,7 +1391,7 @@ rspamd_html_process_url_tag (rspamd_mempool_t *pool, struct html_tag *tag)
 	GList *cur;
 	struct rspamd_url *url;
 
-	cur = tag->params->head;
+	cur = tag->params ? tag->params->head : NULL;
 
 	while (cur) {
 		comp = cur->data;
@@ -1327,7 +1414,7 @@ rspamd_html_process_url_tag (rspamd_mempool_t *pool, struct html_tag *tag)
 
 static void
 rspamd_process_html_url (rspamd_mempool_t *pool, struct rspamd_url *url,
-		GHashTable *target)
+		rspamd_pool_hash_t *target)
 {
 	struct rspamd_url *query_url;
 	gchar *url_str;
@@ -1349,9 +1436,9 @@ rspamd_process_html_url (rspamd_mempool_t *pool, struct rspamd_url *url,
 				msg_debug_pool ("found url %s in query of url"
 						" %*s", url_str, url->querylen, url->query);
 
-				if (!g_hash_table_lookup (target,
+				if (!rspamd_pool_hash_lookup (target,
 						query_url)) {
-					g_hash_table_insert (target,
+					rspamd_pool_hash_insert (target,
 							query_url,
 							query_url);
 				}
@@ -1372,7 +1459,7 @@ rspamd_html_process_img_tag (rspamd_mempool_t *pool, struct html_tag *tag,
 	gulong val;
 	gboolean seen_width = FALSE, seen_height = FALSE;
 
-	cur = tag->params->head;
+	cur = tag->params ? tag->params->head : NULL;
 	img = rspamd_mempool_alloc0 (pool, sizeof (*img));
 	img->tag = tag;
 
@@ -1589,7 +1676,7 @@ rspamd_html_process_block_tag (rspamd_mempool_t *pool, struct html_tag *tag,
 	GNode *parent;
 	struct html_tag *parent_tag;
 
-	cur = tag->params->head;
+	cur = tag->params ? tag->params->head : NULL;
 	bl = rspamd_mempool_alloc0 (pool, sizeof (*bl));
 	bl->tag = tag;
 
@@ -1682,20 +1769,41 @@ rspamd_html_process_block_tag (rspamd_mempool_t *pool, struct html_tag *tag,
 	tag->extra = bl;
 }
 
-GByteArray*
-rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
-		GByteArray *in, GList **exceptions, GHashTable *urls,  GHashTable *emails)
+static void
+rspamd_html_append_content (GByteArray *dest, const guchar *c, guint len,
+		gboolean need_decode)
+{
+	guint olen = dest->len;
+
+	g_byte_array_append (dest, c, len);
+
+	if (need_decode) {
+		/* Decode appended text, so the input is not modified */
+		len = rspamd_html_decode_entitles_inplace ((gchar *)dest->data + olen,
+				len);
+		g_byte_array_set_size (dest, olen + len);
+	}
+}
+
+static GByteArray*
+rspamd_html_process_part_impl (rspamd_mempool_t *pool, struct html_content *hc,
+		const guchar *start, gsize inlen, GList **exceptions,
+		rspamd_pool_hash_t *urls, rspamd_pool_hash_t *emails,
+		gboolean build_tree)
 {
 	const guchar *p, *c, *end, *savep = NULL;
 	guchar t;
 	gboolean closing = FALSE, need_decode = FALSE, save_space = FALSE,
-			balanced, url_text;
+			balanced, url_text, processed;
 	GByteArray *dest;
-	GHashTable *target_tbl;
-	guint obrace = 0, ebrace = 0;
+	GPtrArray *tags_stack = NULL;
+	rspamd_pool_hash_t *target_tbl;
+	guint obrace = 0, ebrace = 0, nimages = 0;
+	gsize tag_offset = 0;
 	GNode *cur_level = NULL;
-	gint substate = 0, len, href_offset = -1;
+	gint substate = 0, href_offset = -1;
 	struct html_tag *cur_tag = NULL, *content_tag = NULL;
+	struct html_image *img;
 	struct rspamd_url *url = NULL, *turl;
 	struct rspamd_process_exception *ex;
 	enum {
@@ -1715,12 +1823,13 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 		content_ignore_sp
 	} state = parse_start;
 
-	g_assert (in != NULL);
-	g_assert (hc != NULL);
-	g_assert (pool != NULL);
-
 	rspamd_html_library_init ();
 	hc->tags_seen = rspamd_mempool_alloc0 (pool, NBYTES (G_N_ELEMENTS (tag_defs)));
+	hc->ntags = 0;
+
+	if (!build_tree) {
+		tags_stack = g_ptr_array_sized_new (32);
+	}
 
 	/* Set white background color by default */
 	hc->bgcolor.d.comp.alpha = 0;
@@ -1729,11 +1838,11 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 	hc->bgcolor.d.comp.b = 255;
 	hc->bgcolor.valid = TRUE;
 
-	dest = g_byte_array_sized_new (in->len / 3 * 2);
+	dest = g_byte_array_sized_new (inlen / 3 * 2);
 
-	p = in->data;
+	p = start;
 	c = p;
-	end = p + in->len;
+	end = p + inlen;
 
 	while (p < end) {
 		t = *p;
@@ -1780,9 +1889,7 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 				substate = 0;
 				savep = NULL;
 				cur_tag = rspamd_mempool_alloc0 (pool, sizeof (*cur_tag));
-				cur_tag->params = g_queue_new ();
-				rspamd_mempool_add_destructor (pool,
-						(rspamd_mempool_destruct_t)g_queue_free, cur_tag->params);
+				tag_offset = p - start;
 				break;
 			}
 
@@ -1887,15 +1994,8 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 					save_space = TRUE;
 
 					if (c != p) {
-						if (need_decode) {
-							len = rspamd_html_decode_entitles_inplace ((gchar *)c,
-									p - c);
-						}
-						else {
-							len = p - c;
-						}
+						rspamd_html_append_content (dest, c, p - c, need_decode);
 
-						g_byte_array_append (dest, c, len);
 						if (content_tag) {
 							if (content_tag->content == NULL) {
 								content_tag->content = c;
@@ -1921,16 +2021,7 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 			}
 			else {
 				if (c != p) {
-
-					if (need_decode) {
-						len = rspamd_html_decode_entitles_inplace ((gchar *)c,
-								p - c);
-					}
-					else {
-						len = p - c;
-					}
-
-					g_byte_array_append (dest, c, len);
+					rspamd_html_append_content (dest, c, p - c, need_decode);
 
 					if (content_tag) {
 						if (content_tag->content == NULL) {
@@ -1975,7 +2066,7 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 
 		case tag_content:
 			rspamd_html_parse_tag_content (pool, hc, cur_tag,
-					p, &substate, &savep);
+					p, &substate, &savep, build_tree);
 			if (t == '>') {
 				if (closing) {
 					cur_tag->flags |= FL_CLOSING;
@@ -2000,9 +2091,18 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 
 			if (cur_tag != NULL) {
 				balanced = TRUE;
+				hc->ntags ++;
+
+				if (build_tree) {
+					processed = rspamd_html_process_tag (pool, hc, cur_tag,
+							&cur_level, &balanced);
+				}
+				else {
+					processed = rspamd_html_process_tag_lean (pool, hc, cur_tag,
+							tags_stack, &balanced);
+				}
 
-				if (rspamd_html_process_tag (pool, hc, cur_tag, &cur_level,
-						&balanced)) {
+				if (processed) {
 					state = content_write;
 					need_decode = FALSE;
 				}
@@ -2055,13 +2155,13 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 							}
 
 							if (target_tbl != NULL) {
-								turl = g_hash_table_lookup (target_tbl, url);
+								turl = rspamd_pool_hash_lookup (target_tbl, url);
 
 								if (turl != NULL && turl->phished_url == NULL) {
-									g_hash_table_insert (target_tbl, url, url);
+									rspamd_pool_hash_insert (target_tbl, url, url);
 								}
 								else if (turl == NULL) {
-									g_hash_table_insert (target_tbl, url, url);
+									rspamd_pool_hash_insert (target_tbl, url, url);
 								}
 								else {
 									url = NULL;
@@ -2102,10 +2202,35 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 				}
 
 				if (cur_tag->id == Tag_IMG && !(cur_tag->flags & FL_CLOSING)) {
-					rspamd_html_process_img_tag (pool, cur_tag, hc);
+					if (build_tree) {
+						/*
+						 * Images are already extracted by the first pass, so
+						 * link them with tags of the tree by their offsets
+						 */
+						while (hc->images && nimages < hc->images->len) {
+							img = g_ptr_array_index (hc->images, nimages);
+
+							if (img->offset > tag_offset) {
+								break;
+							}
+
+							nimages ++;
+
+							if (img->offset == tag_offset) {
+								img->tag = cur_tag;
+								cur_tag->extra = img;
+								break;
+							}
+						}
+					}
+					else {
+						rspamd_html_process_img_tag (pool, cur_tag, hc);
+						img = cur_tag->extra;
+						img->offset = tag_offset;
+					}
 				}
 				else if (!(cur_tag->flags & FL_CLOSING) &&
-						(cur_tag->flags & FL_BLOCK)) {
+						(cur_tag->flags & FL_BLOCK) && build_tree) {
 					rspamd_html_process_block_tag (pool, cur_tag, hc);
 				}
 			}
@@ -2121,6 +2246,32 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 		}
 	}
 
+	if (tags_stack) {
+		g_ptr_array_free (tags_stack, TRUE);
+	}
+
+	return dest;
+}
+
+GByteArray*
+rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
+		GByteArray *in, GList **exceptions, rspamd_pool_hash_t *urls,
+		rspamd_pool_hash_t *emails)
+{
+	GByteArray *dest;
+
+	g_assert (in != NULL);
+	g_assert (hc != NULL);
+	g_assert (pool != NULL);
+
+	dest = rspamd_html_process_part_impl (pool, hc, in->data, in->len,
+			exceptions, urls, emails, FALSE);
+
+	/* Tree is built from the same input when it is requested */
+	hc->pool = pool;
+	hc->unparsed = in->data;
+	hc->unparsed_len = in->len;
+
 	return dest;
 }
 
@@ -2131,3 +2282,26 @@ rspamd_html_process_part (rspamd_mempool_t *pool,
 {
 	return rspamd_html_process_part_full (pool, hc, in, NULL, NULL, NULL);
 }
+
+void
+rspamd_html_build_tree (struct html_content *hc)
+{
+	GByteArray *dest;
+	gint flags;
+
+	g_assert (hc != NULL);
+
+	if (hc->unparsed == NULL) {
+		/* Already built */
+		return;
+	}
+
+	flags = hc->flags;
+	dest = rspamd_html_process_part_impl (hc->pool, hc, hc->unparsed,
+			hc->unparsed_len, NULL, NULL, NULL, TRUE);
+	g_byte_array_free (dest, TRUE);
+	hc->unparsed = NULL;
+
+	/* The first pass sets the same flags, so keep them stable for rules */
+	hc->flags = flags;
+}
@@ -7,6 +7,7 @@
 
 #include "config.h"
 #include "mem_pool.h"
+#include "pool_hash.h"
 
 /*
  * HTML content flags
@@ -47,6 +48,7 @@ struct html_image {
 	guint flags;
 	gchar *src;
 	struct html_tag *tag;
+	gsize offset; /**< offset of the tag in the input */
 };
 
 struct html_color {
@@ -110,6 +112,10 @@ struct html_content {
 	guchar *tags_seen;
 	GPtrArray *images;
 	GPtrArray *blocks;
+	guint ntags; /**< number of tags in a part */
+	rspamd_mempool_t *pool; /**< pool used to build tags tree */
+	const guchar *unparsed; /**< input of a part whose tree is not built yet */
+	gsize unparsed_len;
 };
 
 /*
@@ -121,9 +127,25 @@ GByteArray* rspamd_html_process_part (rspamd_mempool_t *pool,
 		struct html_content *hc,
 		GByteArray *in);
 
+/*
+ * Extracts text, urls, emails and images from HTML part in a single pass.
+ * Tags tree and blocks are not built: the input is saved (it is never
+ * modified by the parser) and `rspamd_html_build_tree` parses it once more
+ * when tree or blocks are requested
+ */
 GByteArray* rspamd_html_process_part_full (rspamd_mempool_t *pool,
 		struct html_content *hc,
-		GByteArray *in, GList **exceptions, GHashTable *urls, GHashTable *emails);
+		GByteArray *in, GList **exceptions, rspamd_pool_hash_t *urls,
+		rspamd_pool_hash_t *emails);
+
+/**
+ * Builds tags tree and style blocks of a part processed by
+ * `rspamd_html_process_part_full`, does nothing if they are already built.
+ * Images found by the first pass are preserved and linked with the new tags
+ * at the same offsets
+ * @param hc
+ */
+void rspamd_html_build_tree (struct html_content *hc);
 
 /*
  * Returns true if a specified tag has been seen in a part
@@ -0,0 +1,342 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "latency.h"
+#include "cfg_file.h"
+#include "task.h"
+#include <math.h>
+
+struct rspamd_latency_stat {
+	struct rspamd_latency_hist stages[RSPAMD_LATENCY_MAX_STAGES];
+	struct rspamd_latency_hist groups[RSPAMD_LATENCY_MAX_GROUPS];
+	gchar group_names[RSPAMD_LATENCY_MAX_GROUPS][RSPAMD_LATENCY_GROUP_NAME_LEN];
+	guint ngroups;
+};
+
+static const struct {
+	guint stage;
+	const gchar *name;
+} latency_stages[] = {
+	{RSPAMD_TASK_STAGE_READ_MESSAGE, "read_message"},
+	{RSPAMD_TASK_STAGE_PRE_FILTERS, "pre_filters"},
+	{RSPAMD_TASK_STAGE_FILTERS, "filters"},
+	{RSPAMD_TASK_STAGE_CLASSIFIERS_PRE, "classifiers_pre"},
+	{RSPAMD_TASK_STAGE_CLASSIFIERS, "classifiers"},
+	{RSPAMD_TASK_STAGE_CLASSIFIERS_POST, "classifiers_post"},
+	{RSPAMD_TASK_STAGE_COMPOSITES, "composites"},
+	{RSPAMD_TASK_STAGE_POST_FILTERS, "post_filters"},
+	{RSPAMD_TASK_STAGE_LEARN_PRE, "learn_pre"},
+	{RSPAMD_TASK_STAGE_LEARN, "learn"},
+	{RSPAMD_TASK_STAGE_LEARN_POST, "learn_post"},
+	{RSPAMD_TASK_STAGE_DONE, "total"},
+};
+
+static const gdouble latency_percentiles[] = {0.5, 0.9, 0.99, 0.999};
+static const gchar *latency_percentiles_names[] = {"p50", "p90", "p99", "p999"};
+
+#ifdef HAVE_ATOMIC_BUILTINS
+#define LATENCY_INC(ptr, val) __atomic_add_fetch ((ptr), (val), __ATOMIC_RELAXED)
+#define LATENCY_GET(ptr) __atomic_load_n ((ptr), __ATOMIC_RELAXED)
+#define LATENCY_SET(ptr, val) __atomic_store_n ((ptr), (val), __ATOMIC_RELAXED)
+#else
+#define LATENCY_INC(ptr, val) (*(ptr) += (val))
+#define LATENCY_GET(ptr) (*(ptr))
+#define LATENCY_SET(ptr, val) (*(ptr) = (val))
+#endif
+
+static inline guint
+rspamd_latency_bucket (guint64 us)
+{
+	gint msb;
+
+	if (us < (1 << RSPAMD_LATENCY_SUB_BITS)) {
+		return us;
+	}
+
+	if (us >= (G_GUINT64_CONSTANT (1) << (RSPAMD_LATENCY_MAX_BIT + 1))) {
+		return RSPAMD_LATENCY_BUCKETS - 1;
+	}
+
+	msb = g_bit_nth_msf ((gulong)us, -1);
+
+	return ((msb - RSPAMD_LATENCY_SUB_BITS + 1) << RSPAMD_LATENCY_SUB_BITS) |
+			((us >> (msb - RSPAMD_LATENCY_SUB_BITS)) &
+			((1 << RSPAMD_LATENCY_SUB_BITS) - 1));
+}
+
+/* Returns the highest value that belongs to the bucket */
+static inline guint64
+rspamd_latency_bucket_value (guint idx)
+{
+	guint shift, sub;
+
+	if (idx < (1 << RSPAMD_LATENCY_SUB_BITS)) {
+		return idx;
+	}
+
+	shift = (idx >> RSPAMD_LATENCY_SUB_BITS) - 1;
+	sub = idx & ((1 << RSPAMD_LATENCY_SUB_BITS) - 1);
+
+	return ((((guint64)1 << RSPAMD_LATENCY_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+static void
+rspamd_latency_hist_add (struct rspamd_latency_hist *h, gdouble seconds)
+{
+	guint64 us, max;
+
+	us = seconds > 0 ? seconds * 1e6 : 0;
+
+	LATENCY_INC (&h->count, 1);
+	LATENCY_INC (&h->sum, us);
+	LATENCY_INC (&h->buckets[rspamd_latency_bucket (us)], 1);
+
+	/* Racy but we do not need precise maximum */
+	max = LATENCY_GET (&h->max);
+
+	if (us > max) {
+		LATENCY_SET (&h->max, us);
+	}
+}
+
+static ucl_object_t *
+rspamd_latency_hist_ucl (struct rspamd_latency_hist *h)
+{
+	struct rspamd_latency_hist copy;
+	ucl_object_t *obj;
+	guint64 seen = 0, target;
+	guint i, j = 0;
+
+	memcpy (&copy, h, sizeof (copy));
+
+	if (copy.count == 0) {
+		return NULL;
+	}
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromint (copy.count), "count",
+			0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble ((gdouble)copy.sum / copy.count / 1000.0),
+			"avg", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble ((gdouble)copy.max / 1000.0),
+			"max", 0, false);
+
+	/* Buckets are updated independently, so use their sum as total count */
+	copy.count = 0;
+
+	for (i = 0; i < RSPAMD_LATENCY_BUCKETS; i ++) {
+		copy.count += copy.buckets[i];
+	}
+
+	for (i = 0; i < RSPAMD_LATENCY_BUCKETS &&
+			j < G_N_ELEMENTS (latency_percentiles); i ++) {
+		seen += copy.buckets[i];
+
+		while (j < G_N_ELEMENTS (latency_percentiles)) {
+			target = ceil (latency_percentiles[j] * copy.count);
+
+			if (seen < target || seen == 0) {
+				break;
+			}
+
+			ucl_object_insert_key (obj,
+					ucl_object_fromdouble (
+							MIN (rspamd_latency_bucket_value (i), copy.max) / 1000.0),
+					latency_percentiles_names[j], 0, false);
+			j ++;
+		}
+	}
+
+	return obj;
+}
+
+struct rspamd_latency_stat *
+rspamd_latency_stat_new (rspamd_mempool_t *pool)
+{
+	return rspamd_mempool_alloc0_shared (pool,
+			sizeof (struct rspamd_latency_stat));
+}
+
+static gint
+rspamd_latency_group_cmp (gconstpointer a, gconstpointer b)
+{
+	const gchar *s1 = *(const gchar **)a, *s2 = *(const gchar **)b;
+
+	return strcmp (s1, s2);
+}
+
+void
+rspamd_latency_stat_set_groups (struct rspamd_latency_stat *st,
+		struct rspamd_config *cfg)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	GPtrArray *names;
+	struct rspamd_symbols_group *gr;
+	gboolean changed = FALSE;
+	guint i;
+
+	if (st == NULL || cfg->default_metric == NULL) {
+		return;
+	}
+
+	names = g_ptr_array_new ();
+	g_hash_table_iter_init (&it, cfg->default_metric->groups);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		gr = v;
+		g_ptr_array_add (names, gr->name);
+	}
+
+	/* Use stable order to keep histograms over reloads */
+	g_ptr_array_sort (names, rspamd_latency_group_cmp);
+
+	if (names->len > RSPAMD_LATENCY_MAX_GROUPS) {
+		msg_warn_config ("too many symbol groups: %d, latencies are collected "
+				"for the first %d groups only", names->len,
+				RSPAMD_LATENCY_MAX_GROUPS);
+		g_ptr_array_set_size (names, RSPAMD_LATENCY_MAX_GROUPS);
+	}
+
+	if (names->len != st->ngroups) {
+		changed = TRUE;
+	}
+
+	for (i = 0; i < names->len && !changed; i ++) {
+		if (strncmp (st->group_names[i], g_ptr_array_index (names, i),
+				RSPAMD_LATENCY_GROUP_NAME_LEN - 1) != 0) {
+			changed = TRUE;
+		}
+	}
+
+	if (changed) {
+		/*
+		 * Workers resolve indices of groups after being spawned, so old
+		 * workers that are still terminating after reload might account
+		 * a few values to the wrong groups, which is acceptable
+		 */
+		memset (st->groups, 0, sizeof (st->groups));
+		memset (st->group_names, 0, sizeof (st->group_names));
+
+		for (i = 0; i < names->len; i ++) {
+			rspamd_strlcpy (st->group_names[i], g_ptr_array_index (names, i),
+					RSPAMD_LATENCY_GROUP_NAME_LEN);
+		}
+
+		st->ngroups = names->len;
+	}
+
+	g_ptr_array_free (names, TRUE);
+}
+
+gint
+rspamd_latency_stat_group_idx (struct rspamd_latency_stat *st,
+		const gchar *name)
+{
+	guint i;
+
+	if (st == NULL || name == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < st->ngroups; i ++) {
+		if (strncmp (st->group_names[i], name,
+				RSPAMD_LATENCY_GROUP_NAME_LEN - 1) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void
+rspamd_latency_stat_add_stage (struct rspamd_latency_stat *st,
+		guint stage, gdouble seconds)
+{
+	gint idx;
+
+	if (st == NULL || stage == 0) {
+		return;
+	}
+
+	idx = g_bit_nth_lsf (stage, -1);
+
+	if (idx >= 0 && idx < RSPAMD_LATENCY_MAX_STAGES) {
+		rspamd_latency_hist_add (&st->stages[idx], seconds);
+	}
+}
+
+void
+rspamd_latency_stat_add_group (struct rspamd_latency_stat *st,
+		gint idx, gdouble seconds)
+{
+	if (st == NULL || idx < 0 || idx >= (gint)st->ngroups) {
+		return;
+	}
+
+	rspamd_latency_hist_add (&st->groups[idx], seconds);
+}
+
+ucl_object_t *
+rspamd_latency_stat_ucl (struct rspamd_latency_stat *st)
+{
+	ucl_object_t *top, *sub, *cur;
+	guint i;
+	gint idx;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+
+	if (st == NULL) {
+		return top;
+	}
+
+	sub = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < G_N_ELEMENTS (latency_stages); i ++) {
+		idx = g_bit_nth_lsf (latency_stages[i].stage, -1);
+		cur = rspamd_latency_hist_ucl (&st->stages[idx]);
+
+		if (cur) {
+			ucl_object_insert_key (sub, cur, latency_stages[i].name, 0, false);
+		}
+	}
+
+	ucl_object_insert_key (top, sub, "stages", 0, false);
+	sub = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < st->ngroups; i ++) {
+		cur = rspamd_latency_hist_ucl (&st->groups[i]);
+
+		if (cur) {
+			ucl_object_insert_key (sub, cur, st->group_names[i], 0, true);
+		}
+	}
+
+	ucl_object_insert_key (top, sub, "groups", 0, false);
+
+	return top;
+}
+
+void
+rspamd_latency_stat_reset (struct rspamd_latency_stat *st)
+{
+	if (st) {
+		memset (st->stages, 0, sizeof (st->stages));
+		memset (st->groups, 0, sizeof (st->groups));
+	}
+}
@@ -0,0 +1,96 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_LATENCY_H_
+#define SRC_LIBSERVER_LATENCY_H_
+
+#include "config.h"
+#include "mem_pool.h"
+#include "ucl.h"
+
+/*
+ * Log-linear (HDR like) histograms of latencies in microseconds: values below
+ * 8 are stored exactly, each power of two above is split to 8 sub-buckets, so
+ * the relative error is below 12.5%. Histograms live in shared memory and are
+ * updated by all workers using atomic increments
+ */
+#define RSPAMD_LATENCY_SUB_BITS 3
+#define RSPAMD_LATENCY_MAX_BIT 31
+#define RSPAMD_LATENCY_BUCKETS \
+	((RSPAMD_LATENCY_MAX_BIT - RSPAMD_LATENCY_SUB_BITS + 2) << RSPAMD_LATENCY_SUB_BITS)
+/* Stages are indexed by the number of bit in enum rspamd_task_stage */
+#define RSPAMD_LATENCY_MAX_STAGES 16
+#define RSPAMD_LATENCY_MAX_GROUPS 64
+#define RSPAMD_LATENCY_GROUP_NAME_LEN 64
+
+struct rspamd_config;
+struct rspamd_latency_stat;
+
+struct rspamd_latency_hist {
+	guint64 count;
+	guint64 sum;
+	guint64 max;
+	guint64 buckets[RSPAMD_LATENCY_BUCKETS];
+};
+
+/**
+ * Allocate latency statistics in the shared memory
+ * @param pool shared pool
+ * @return new statistics
+ */
+struct rspamd_latency_stat * rspamd_latency_stat_new (rspamd_mempool_t *pool);
+
+/**
+ * Register symbol groups from config (called by the main process on start and
+ * on reload), histograms of groups are reset if the set of groups has changed
+ */
+void rspamd_latency_stat_set_groups (struct rspamd_latency_stat *st,
+		struct rspamd_config *cfg);
+
+/**
+ * Find index of group by its name
+ * @return index or -1 if group is not registered
+ */
+gint rspamd_latency_stat_group_idx (struct rspamd_latency_stat *st,
+		const gchar *name);
+
+/**
+ * Add value to the histogram of task stage
+ * @param stage stage (one bit of enum rspamd_task_stage)
+ * @param seconds latency
+ */
+void rspamd_latency_stat_add_stage (struct rspamd_latency_stat *st,
+		guint stage, gdouble seconds);
+
+/**
+ * Add value to the histogram of symbol group
+ * @param idx index of group
+ * @param seconds latency
+ */
+void rspamd_latency_stat_add_group (struct rspamd_latency_stat *st,
+		gint idx, gdouble seconds);
+
+/**
+ * Export histograms to UCL: count, average, maximum and percentiles in
+ * milliseconds for each stage and each symbol group
+ */
+ucl_object_t * rspamd_latency_stat_ucl (struct rspamd_latency_stat *st);
+
+/**
+ * Reset all histograms
+ */
+void rspamd_latency_stat_reset (struct rspamd_latency_stat *st);
+
+#endif /* SRC_LIBSERVER_LATENCY_H_ */
@@ -0,0 +1,302 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "log_pipe.h"
+#include "cfg_file.h"
+#include "filter.h"
+#include "printf.h"
+
+/* Ids above this limit are treated as garbage */
+#define RSPAMD_LOG_PIPE_MAX_ID 65536
+
+struct rspamd_log_pipe_symbol_stat {
+	guint64 hits;
+	guint64 actions[METRIC_ACTION_MAX];
+	gdouble score;
+};
+
+struct rspamd_log_pipe_stat {
+	guint64 count;
+	guint64 unknown_symbols;
+	guint64 actions[METRIC_ACTION_MAX];
+	gdouble score;
+	gdouble time_real;
+	gdouble time_real_max;
+	gdouble time_virtual;
+	guint64 message_len;
+	guint64 headers_len;
+	guint64 nparts;
+	guint64 ntext_parts;
+	guint64 nurls;
+	guint64 nemails;
+	guint64 nreceived;
+	guint64 dns_requests;
+	GArray *symbols;
+};
+
+static GQuark
+rspamd_log_pipe_quark (void)
+{
+	return g_quark_from_static_string ("log-pipe");
+}
+
+const struct rspamd_log_pipe_record *
+rspamd_log_pipe_record_check (const guchar *data, gsize len, GError **err)
+{
+	const struct rspamd_log_pipe_record *rec;
+
+	/* We assume that data is aligned as it is read to a separate buffer */
+	if (len < sizeof (*rec)) {
+		g_set_error (err, rspamd_log_pipe_quark (), EINVAL,
+				"record is too short: %z bytes", len);
+		return NULL;
+	}
+
+	rec = (const struct rspamd_log_pipe_record *)data;
+
+	if (rec->magic != RSPAMD_LOG_PIPE_MAGIC) {
+		g_set_error (err, rspamd_log_pipe_quark (), EINVAL,
+				"invalid magic: %ud", rec->magic);
+		return NULL;
+	}
+
+	if (rec->version != RSPAMD_LOG_PIPE_VERSION) {
+		g_set_error (err, rspamd_log_pipe_quark (), EINVAL,
+				"unsupported version: %d", (gint)rec->version);
+		return NULL;
+	}
+
+	if (rec->hdr_len < sizeof (*rec) || rec->hdr_len % sizeof (gdouble) != 0 ||
+			rec->len > len || rec->len < rec->hdr_len ||
+			rec->len - rec->hdr_len !=
+			(gsize)rec->nsymbols * sizeof (struct rspamd_log_pipe_symbol)) {
+		g_set_error (err, rspamd_log_pipe_quark (), EINVAL,
+				"bad length: %z bytes read, %ud bytes announced, "
+				"%ud symbols", len, rec->len, rec->nsymbols);
+		return NULL;
+	}
+
+	return rec;
+}
+
+const struct rspamd_log_pipe_symbol *
+rspamd_log_pipe_record_symbols (const struct rspamd_log_pipe_record *rec)
+{
+	return (const struct rspamd_log_pipe_symbol *)
+			(((const guchar *)rec) + rec->hdr_len);
+}
+
+struct rspamd_log_pipe_stat *
+rspamd_log_pipe_stat_new (void)
+{
+	struct rspamd_log_pipe_stat *st;
+
+	st = g_slice_alloc0 (sizeof (*st));
+	st->symbols = g_array_new (FALSE, TRUE,
+			sizeof (struct rspamd_log_pipe_symbol_stat));
+
+	return st;
+}
+
+void
+rspamd_log_pipe_stat_add (struct rspamd_log_pipe_stat *st,
+		const struct rspamd_log_pipe_record *rec)
+{
+	const struct rspamd_log_pipe_symbol *syms;
+	struct rspamd_log_pipe_symbol_stat *sst;
+	guint i, action;
+
+	action = MIN (rec->action, METRIC_ACTION_NOACTION);
+	st->count ++;
+	st->actions[action] ++;
+	st->score += rec->score;
+	st->time_real += rec->time_real;
+	st->time_real_max = MAX (st->time_real_max, rec->time_real);
+	st->time_virtual += rec->time_virtual;
+	st->message_len += rec->message_len;
+	st->headers_len += rec->headers_len;
+	st->nparts += rec->nparts;
+	st->ntext_parts += rec->ntext_parts;
+	st->nurls += rec->nurls;
+	st->nemails += rec->nemails;
+	st->nreceived += rec->nreceived;
+	st->dns_requests += rec->dns_requests;
+
+	syms = rspamd_log_pipe_record_symbols (rec);
+
+	for (i = 0; i < rec->nsymbols; i ++) {
+		if (syms[i].id >= RSPAMD_LOG_PIPE_MAX_ID) {
+			st->unknown_symbols ++;
+			continue;
+		}
+
+		if (syms[i].id >= st->symbols->len) {
+			g_array_set_size (st->symbols, syms[i].id + 1);
+		}
+
+		sst = &g_array_index (st->symbols, struct rspamd_log_pipe_symbol_stat,
+				syms[i].id);
+		sst->hits ++;
+		sst->actions[action] ++;
+		sst->score += syms[i].score;
+	}
+}
+
+guint64
+rspamd_log_pipe_stat_count (struct rspamd_log_pipe_stat *st)
+{
+	return st->count;
+}
+
+static ucl_object_t *
+rspamd_log_pipe_actions_ucl (const guint64 *actions)
+{
+	ucl_object_t *obj;
+	gint i;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
+		if (actions[i] > 0) {
+			ucl_object_insert_key (obj, ucl_object_fromint (actions[i]),
+					rspamd_action_to_str_alt (i), 0, false);
+		}
+	}
+
+	return obj;
+}
+
+ucl_object_t *
+rspamd_log_pipe_stat_ucl (struct rspamd_log_pipe_stat *st, GPtrArray *names)
+{
+	ucl_object_t *top, *syms, *cur;
+	struct rspamd_log_pipe_symbol_stat *sst;
+	const gchar *name;
+	gchar numbuf[32];
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromint (st->count), "scanned",
+			0, false);
+	ucl_object_insert_key (top, rspamd_log_pipe_actions_ucl (st->actions),
+			"actions", 0, false);
+
+	if (st->count > 0) {
+		ucl_object_insert_key (top,
+				ucl_object_fromdouble (st->score / st->count),
+				"avg_score", 0, false);
+		ucl_object_insert_key (top,
+				ucl_object_fromdouble (st->time_real / st->count),
+				"avg_time_real", 0, false);
+		ucl_object_insert_key (top,
+				ucl_object_fromdouble (st->time_real_max),
+				"max_time_real", 0, false);
+		ucl_object_insert_key (top,
+				ucl_object_fromdouble (st->time_virtual / st->count),
+				"avg_time_virtual", 0, false);
+
+		cur = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (cur,
+				ucl_object_fromdouble ((gdouble)st->message_len / st->count),
+				"message_len", 0, false);
+		ucl_object_insert_key (cur,
+				ucl_object_fromdouble ((gdouble)st->headers_len / st->count),
+				"headers_len", 0, false);
+		ucl_object_insert_key (cur,
+				ucl_object_fromdouble ((gdouble)st->nparts / st->count),
+				"parts", 0, false);
+		ucl_object_insert_key (cur,
+				ucl_object_fromdouble ((gdouble)st->ntext_parts / st->count),
+				"text_parts", 0, false);
+		ucl_object_insert_key (cur,
+				ucl_object_fromdouble ((gdouble)st->nurls / st->count),
+				"urls", 0, false);
+		ucl_object_insert_key (cur,
+				ucl_object_fromdouble ((gdouble)st->nemails / st->count),
+				"emails", 0, false);
+		ucl_object_insert_key (cur,
+				ucl_object_fromdouble ((gdouble)st->nreceived / st->count),
+				"received", 0, false);
+		ucl_object_insert_key (cur,
+				ucl_object_fromdouble ((gdouble)st->dns_requests / st->count),
+				"dns_requests", 0, false);
+		ucl_object_insert_key (top, cur, "avg_sizes", 0, false);
+	}
+
+	syms = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < st->symbols->len; i ++) {
+		sst = &g_array_index (st->symbols, struct rspamd_log_pipe_symbol_stat,
+				i);
+
+		if (sst->hits == 0) {
+			continue;
+		}
+
+		name = NULL;
+
+		if (names && i < names->len) {
+			name = g_ptr_array_index (names, i);
+		}
+
+		if (name == NULL) {
+			rspamd_snprintf (numbuf, sizeof (numbuf), "%ud", i);
+			name = numbuf;
+		}
+
+		cur = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (cur, ucl_object_fromint (sst->hits), "hits",
+				0, false);
+		ucl_object_insert_key (cur,
+				ucl_object_fromdouble (st->count > 0 ?
+						(gdouble)sst->hits / st->count : 0.0),
+				"frequency", 0, false);
+		ucl_object_insert_key (cur,
+				ucl_object_fromdouble (sst->score / sst->hits),
+				"avg_score", 0, false);
+		ucl_object_insert_key (cur, rspamd_log_pipe_actions_ucl (sst->actions),
+				"actions", 0, false);
+		ucl_object_insert_key (syms, cur, name, 0, true);
+	}
+
+	ucl_object_insert_key (top, syms, "symbols", 0, false);
+
+	if (st->unknown_symbols > 0) {
+		ucl_object_insert_key (top, ucl_object_fromint (st->unknown_symbols),
+				"unknown_symbols", 0, false);
+	}
+
+	return top;
+}
+
+void
+rspamd_log_pipe_stat_reset (struct rspamd_log_pipe_stat *st)
+{
+	GArray *symbols = st->symbols;
+
+	memset (st, 0, sizeof (*st));
+	g_array_set_size (symbols, 0);
+	st->symbols = symbols;
+}
+
+void
+rspamd_log_pipe_stat_destroy (struct rspamd_log_pipe_stat *st)
+{
+	if (st) {
+		g_array_free (st->symbols, TRUE);
+		g_slice_free1 (sizeof (*st), st);
+	}
+}
@@ -0,0 +1,115 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_LOG_PIPE_H_
+#define SRC_LIBSERVER_LOG_PIPE_H_
+
+#include "config.h"
+#include "ucl.h"
+
+/*
+ * Binary log pipe format: each datagram contains exactly one record that
+ * starts with `struct rspamd_log_pipe_record` followed by `nsymbols` elements
+ * of `struct rspamd_log_pipe_symbol` at offset `hdr_len`. New fields can be
+ * appended to the header without changing version, consumers must use
+ * `hdr_len` to find symbols. All values are in host byte order.
+ */
+#define RSPAMD_LOG_PIPE_MAGIC 0x706c7372U /* "rslp" */
+#define RSPAMD_LOG_PIPE_VERSION 1
+#define RSPAMD_LOG_PIPE_UNKNOWN_SYMBOL G_MAXUINT32
+
+struct rspamd_log_pipe_symbol {
+	guint32 id;                 /**< id of symbol in the symbols cache			*/
+	guint32 flags;              /**< reserved									*/
+	gdouble score;              /**< score of symbol							*/
+};
+
+struct rspamd_log_pipe_record {
+	guint32 magic;              /**< RSPAMD_LOG_PIPE_MAGIC						*/
+	guint16 version;            /**< RSPAMD_LOG_PIPE_VERSION					*/
+	guint16 hdr_len;            /**< length of this header						*/
+	guint32 len;                /**< length of header and symbols				*/
+	guint32 nsymbols;           /**< number of symbols							*/
+	guint32 settings_id;        /**< hash of settings id or 0					*/
+	guint32 action;             /**< enum rspamd_metric_action					*/
+	gdouble score;              /**< total score								*/
+	gdouble required_score;     /**< score required for reject					*/
+	gdouble timestamp;          /**< unix time when task has been finished		*/
+	gdouble time_real;          /**< real time of scan in seconds				*/
+	gdouble time_virtual;       /**< CPU time of scan in seconds				*/
+	guint32 message_len;        /**< length of message							*/
+	guint32 headers_len;        /**< length of raw headers						*/
+	guint32 nparts;             /**< number of mime parts						*/
+	guint32 ntext_parts;        /**< number of text parts						*/
+	guint32 nurls;              /**< number of urls								*/
+	guint32 nemails;            /**< number of emails							*/
+	guint32 nreceived;          /**< number of received headers					*/
+	guint32 dns_requests;       /**< number of DNS requests						*/
+};
+
+struct rspamd_log_pipe_stat;
+
+/**
+ * Check record received from the log pipe
+ * @param data data received
+ * @param len length of data
+ * @param err error pointer
+ * @return record or NULL if data is not a valid record
+ */
+const struct rspamd_log_pipe_record * rspamd_log_pipe_record_check (
+		const guchar *data, gsize len, GError **err);
+
+/**
+ * Returns array of symbols for the checked record
+ */
+const struct rspamd_log_pipe_symbol * rspamd_log_pipe_record_symbols (
+		const struct rspamd_log_pipe_record *rec);
+
+/**
+ * Create new aggregated statistics
+ */
+struct rspamd_log_pipe_stat * rspamd_log_pipe_stat_new (void);
+
+/**
+ * Account the checked record in statistics
+ */
+void rspamd_log_pipe_stat_add (struct rspamd_log_pipe_stat *st,
+		const struct rspamd_log_pipe_record *rec);
+
+/**
+ * Returns number of records accounted
+ */
+guint64 rspamd_log_pipe_stat_count (struct rspamd_log_pipe_stat *st);
+
+/**
+ * Export statistics to ucl object
+ * @param st statistics
+ * @param names array of symbols names indexed by id (may be NULL)
+ * @return new ucl object
+ */
+ucl_object_t * rspamd_log_pipe_stat_ucl (struct rspamd_log_pipe_stat *st,
+		GPtrArray *names);
+
+/**
+ * Reset all counters
+ */
+void rspamd_log_pipe_stat_reset (struct rspamd_log_pipe_stat *st);
+
+/**
+ * Destroy statistics
+ */
+void rspamd_log_pipe_stat_destroy (struct rspamd_log_pipe_stat *st);
+
+#endif /* SRC_LIBSERVER_LOG_PIPE_H_ */
@@ -25,6 +25,7 @@
 #include "email_addr.h"
 #include "worker_private.h"
 #include "cryptobox.h"
+#include "log_pipe.h"
 #include <math.h>
 
 /* Max line size */
@@ -709,7 +710,7 @@ urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
 }
 
 static ucl_object_t *
-rspamd_urls_tree_ucl (GHashTable *input, struct rspamd_task *task)
+rspamd_urls_tree_ucl (rspamd_pool_hash_t *input, struct rspamd_task *task)
 {
 	struct tree_cb_data cb;
 	ucl_object_t *obj;
@@ -718,7 +719,7 @@ rspamd_urls_tree_ucl (GHashTable *input, struct rspamd_task *task)
 	cb.top = obj;
 	cb.task = task;
 
-	g_hash_table_foreach (input, urls_protocol_cb, &cb);
+	rspamd_pool_hash_foreach (input, urls_protocol_cb, &cb);
 
 	return obj;
 }
@@ -739,7 +740,7 @@ emails_protocol_cb (gpointer key, gpointer value, gpointer ud)
 }
 
 static ucl_object_t *
-rspamd_emails_tree_ucl (GHashTable *input, struct rspamd_task *task)
+rspamd_emails_tree_ucl (rspamd_pool_hash_t *input, struct rspamd_task *task)
 {
 	struct tree_cb_data cb;
 	ucl_object_t *obj;
@@ -748,7 +749,7 @@ rspamd_emails_tree_ucl (GHashTable *input, struct rspamd_task *task)
 	cb.top = obj;
 	cb.task = task;
 
-	g_hash_table_foreach (input, emails_protocol_cb, &cb);
+	rspamd_pool_hash_foreach (input, emails_protocol_cb, &cb);
 
 	return obj;
 }
@@ -867,6 +868,12 @@ rspamd_metric_result_ucl (struct rspamd_task *task,
 	ucl_object_insert_key (obj,
 			ucl_object_frombool (RSPAMD_TASK_IS_SKIPPED (task)),
 			"is_skipped", 0, false);
+
+	if (RSPAMD_TASK_IS_LARGE (task)) {
+		ucl_object_insert_key (obj,
+				ucl_object_frombool (true),
+				"is_truncated", 0, false);
+	}
 	if (!isnan (mres->score)) {
 		ucl_object_insert_key (obj, ucl_object_fromdouble (mres->score),
 			"score", 0, false);
@@ -1018,11 +1025,11 @@ rspamd_protocol_write_ucl (struct rspamd_task *task)
 	}
 
 	if (task->cfg->log_urls || (task->flags & RSPAMD_TASK_FLAG_EXT_URLS)) {
-		if (g_hash_table_size (task->urls) > 0) {
+		if (rspamd_pool_hash_size (task->urls) > 0) {
 			ucl_object_insert_key (top, rspamd_urls_tree_ucl (task->urls,
 					task), "urls", 0, false);
 		}
-		if (g_hash_table_size (task->emails) > 0) {
+		if (rspamd_pool_hash_size (task->emails) > 0) {
 			ucl_object_insert_key (top, rspamd_emails_tree_ucl (task->emails, task),
 					"emails", 0, false);
 		}
@@ -1063,7 +1070,9 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	gpointer h, v;
 	ucl_object_t *top = NULL;
 	rspamd_fstring_t *reply;
+	GString *classes_stat;
 	gint action;
+	guint i;
 
 	/* Write custom headers */
 	g_hash_table_iter_init (&hiter, task->reply_headers);
@@ -1094,6 +1103,28 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 				restat->regexp_fast_cached,
 				restat->bytes_scanned_pcre,
 				restat->bytes_scanned);
+
+		classes_stat = g_string_sized_new (128);
+
+		for (i = 0; i < RSPAMD_RE_MAX; i ++) {
+			if (restat->classes[i].scans == 0) {
+				continue;
+			}
+
+			rspamd_printf_gstring (classes_stat, "%s%s: %ud scans, %HL, %.3f ms",
+					classes_stat->len > 0 ? "; " : "",
+					rspamd_re_cache_type_to_string (i),
+					restat->classes[i].scans,
+					restat->classes[i].bytes_scanned,
+					restat->classes[i].time_spent * 1000.0);
+		}
+
+		if (classes_stat->len > 0) {
+			msg_info_task ("regexp classes statistics: %ud fused scans; %v",
+					restat->fused_scans, classes_stat);
+		}
+
+		g_string_free (classes_stat, TRUE);
 	}
 
 	reply = rspamd_fstring_sized_new (1000);
@@ -1145,12 +1176,85 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	}
 }
 
+static struct rspamd_log_pipe_record *
+rspamd_protocol_log_pipe_record (struct rspamd_task *task, gsize *psz)
+{
+	struct rspamd_log_pipe_record *rec;
+	struct rspamd_log_pipe_symbol *syms;
+	struct metric_result *mres;
+	GHashTableIter it;
+	gpointer k, v;
+	struct symbol *sym;
+	guint32 *sid;
+	guint nsymbols = 0, i = 0;
+	gint id;
+	gsize sz;
+
+	mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+
+	if (mres) {
+		nsymbols = g_hash_table_size (mres->symbols);
+	}
+
+	sz = sizeof (*rec) + sizeof (*syms) * nsymbols;
+	rec = g_slice_alloc0 (sz);
+	rec->magic = RSPAMD_LOG_PIPE_MAGIC;
+	rec->version = RSPAMD_LOG_PIPE_VERSION;
+	rec->hdr_len = sizeof (*rec);
+	rec->len = sz;
+	rec->nsymbols = nsymbols;
+
+	sid = rspamd_mempool_get_variable (task->task_pool, "settings_hash");
+
+	if (sid) {
+		rec->settings_id = *sid;
+	}
+
+	rec->timestamp = rspamd_get_calendar_ticks ();
+	rec->time_real = rspamd_get_ticks () - task->time_real;
+	rec->time_virtual = rspamd_get_virtual_ticks () - task->time_virtual;
+	rec->message_len = task->msg.len;
+	rec->headers_len = task->raw_headers_content.len;
+	rec->nparts = task->parts ? task->parts->len : 0;
+	rec->ntext_parts = task->text_parts ? task->text_parts->len : 0;
+	rec->nurls = task->urls ? rspamd_pool_hash_size (task->urls) : 0;
+	rec->nemails = task->emails ? rspamd_pool_hash_size (task->emails) : 0;
+	rec->nreceived = task->received ? task->received->len : 0;
+	rec->dns_requests = task->dns_requests;
+
+	if (mres) {
+		rec->action = mres->action;
+		rec->score = mres->score;
+		rec->required_score = rspamd_task_get_required_score (task, mres);
+		syms = (struct rspamd_log_pipe_symbol *)(((guchar *)rec) + sizeof (*rec));
+
+		g_hash_table_iter_init (&it, mres->symbols);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			id = rspamd_symbols_cache_find_symbol (task->cfg->cache, k);
+			sym = v;
+
+			syms[i].id = id >= 0 ? (guint32)id : RSPAMD_LOG_PIPE_UNKNOWN_SYMBOL;
+			syms[i].score = sym->score;
+			i ++;
+		}
+	}
+	else {
+		rec->action = METRIC_ACTION_NOACTION;
+	}
+
+	*psz = sz;
+
+	return rec;
+}
+
 static void
 rspamd_protocol_write_log_pipe (struct rspamd_worker_ctx *ctx,
 		struct rspamd_task *task)
 {
-	struct rspamd_worker_log_pipe *lp;
+	struct rspamd_worker_log_pipe *lp, *tmp;
 	struct rspamd_protocol_log_message_sum *ls;
+	struct rspamd_log_pipe_record *rec;
 	struct metric_result *mres;
 	GHashTableIter it;
 	gpointer k, v;
@@ -1159,7 +1263,7 @@ rspamd_protocol_write_log_pipe (struct rspamd_worker_ctx *ctx,
 	guint32 *sid;
 	gsize sz;
 
-	LL_FOREACH (ctx->log_pipes, lp) {
+	DL_FOREACH_SAFE (ctx->log_pipes, lp, tmp) {
 		if (lp->fd != -1) {
 			switch (lp->type) {
 			case RSPAMD_LOG_PIPE_SYMBOLS:
@@ -1221,6 +1325,21 @@ rspamd_protocol_write_log_pipe (struct rspamd_worker_ctx *ctx,
 
 				g_slice_free1 (sz, ls);
 				break;
+			case RSPAMD_LOG_PIPE_BINARY:
+				rec = rspamd_protocol_log_pipe_record (task, &sz);
+
+				/* Pipe is non-blocking, records are dropped if reader is slow */
+				if (write (lp->fd, rec, sz) == -1 && errno != EAGAIN &&
+						errno != EINTR && errno != ENOBUFS) {
+					msg_info_task ("log pipe has been closed: %s",
+							strerror (errno));
+					DL_DELETE (ctx->log_pipes, lp);
+					close (lp->fd);
+					g_slice_free1 (sizeof (*lp), lp);
+				}
+
+				g_slice_free1 (sz, rec);
+				break;
 			default:
 				msg_err_task ("unknown log format %d", lp->type);
 				break;
@@ -62,6 +62,8 @@ static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '1'}
 		rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '1'};
 #endif
 
+struct rspamd_re_fused;
+
 struct rspamd_re_class {
 	guint64 id;
 	enum rspamd_re_type type;
@@ -70,6 +72,25 @@ struct rspamd_re_class {
 	GHashTable *re;
 	gchar hash[rspamd_cryptobox_HASHBYTES + 1];
 	rspamd_cryptobox_hash_state_t *st;
+	struct rspamd_re_fused *fused;
+#ifdef WITH_HYPERSCAN
+	hs_database_t *hs_db;
+	hs_scratch_t *hs_scratch;
+	gint *hs_ids;
+	guint nhs;
+#endif
+};
+
+/*
+ * Group of classes that are scanned over the same input data, e.g. headers
+ * that differ merely by case or raw mime parts and sa rawbody. When fused
+ * mode is enabled, we build a single database for all classes in a group and
+ * dispatch its matches by the global regexp id
+ */
+struct rspamd_re_fused {
+	guint64 id;
+	GPtrArray *classes;
+	gchar hash[rspamd_cryptobox_HASHBYTES + 1];
 #ifdef WITH_HYPERSCAN
 	hs_database_t *hs_db;
 	hs_scratch_t *hs_scratch;
@@ -92,6 +113,7 @@ struct rspamd_re_cache_elt {
 struct rspamd_re_cache {
 	GHashTable *re_classes;
 	GPtrArray *re;
+	GPtrArray *re_fused;
 	ref_entry_t ref;
 	guint nre;
 	guint max_re_data;
@@ -100,6 +122,7 @@ struct rspamd_re_cache {
 	gboolean hyperscan_loaded;
 	gboolean disable_hyperscan;
 	gboolean vectorized_hyperscan;
+	gboolean fused_hyperscan;
 	hs_platform_info_t plt;
 #endif
 };
@@ -135,12 +158,31 @@ rspamd_re_cache_class_id (enum rspamd_re_type type,
 	return rspamd_cryptobox_fast_hash_final (&st);
 }
 
+static void
+rspamd_re_cache_fused_dtor (struct rspamd_re_fused *fused)
+{
+#ifdef WITH_HYPERSCAN
+	if (fused->hs_db) {
+		hs_free_database (fused->hs_db);
+	}
+	if (fused->hs_scratch) {
+		hs_free_scratch (fused->hs_scratch);
+	}
+	if (fused->hs_ids) {
+		g_free (fused->hs_ids);
+	}
+#endif
+	g_ptr_array_free (fused->classes, TRUE);
+	g_slice_free1 (sizeof (*fused), fused);
+}
+
 static void
 rspamd_re_cache_destroy (struct rspamd_re_cache *cache)
 {
 	GHashTableIter it;
 	gpointer k, v;
 	struct rspamd_re_class *re_class;
+	guint i;
 
 	g_assert (cache != NULL);
 	g_hash_table_iter_init (&it, cache->re_classes);
@@ -163,6 +205,14 @@ rspamd_re_cache_destroy (struct rspamd_re_cache *cache)
 		g_slice_free1 (sizeof (*re_class), re_class);
 	}
 
+	if (cache->re_fused) {
+		for (i = 0; i < cache->re_fused->len; i ++) {
+			rspamd_re_cache_fused_dtor (g_ptr_array_index (cache->re_fused, i));
+		}
+
+		g_ptr_array_free (cache->re_fused, TRUE);
+	}
+
 	g_hash_table_unref (cache->re_classes);
 	g_ptr_array_free (cache->re, TRUE);
 	g_slice_free1 (sizeof (*cache), cache);
@@ -186,8 +236,10 @@ rspamd_re_cache_new (void)
 	cache->re_classes = g_hash_table_new (g_int64_hash, g_int64_equal);
 	cache->nre = 0;
 	cache->re = g_ptr_array_new_full (256, rspamd_re_cache_elt_dtor);
+	cache->re_fused = NULL;
 #ifdef WITH_HYPERSCAN
 	cache->hyperscan_loaded = FALSE;
+	cache->fused_hyperscan = FALSE;
 #endif
 	REF_INIT_RETAIN (cache, rspamd_re_cache_destroy);
 
@@ -307,6 +359,128 @@ rspamd_re_cache_sort_func (gconstpointer a, gconstpointer b)
 			rspamd_regexp_get_id ((*re2)->re));
 }
 
+#ifdef WITH_HYPERSCAN
+static gint
+rspamd_re_cache_class_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_re_class * const *c1 = a, * const *c2 = b;
+
+	if ((*c1)->id < (*c2)->id) {
+		return -1;
+	}
+	else if ((*c1)->id > (*c2)->id) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns identifier of the data scanned by a class: headers are looked up
+ * case insensitively and raw mime class uses the same parts as sa rawbody
+ */
+static guint64
+rspamd_re_cache_input_id (struct rspamd_re_class *re_class)
+{
+	gchar *lc;
+	guint64 ret;
+
+	switch (re_class->type) {
+	case RSPAMD_RE_HEADER:
+	case RSPAMD_RE_RAWHEADER:
+	case RSPAMD_RE_MIMEHEADER:
+		if (re_class->type_len == 0) {
+			return re_class->id;
+		}
+
+		lc = g_malloc (re_class->type_len);
+		memcpy (lc, re_class->type_data, re_class->type_len);
+		rspamd_str_lc (lc, re_class->type_len);
+		ret = rspamd_re_cache_class_id (re_class->type, lc,
+				re_class->type_len);
+		g_free (lc);
+		break;
+	case RSPAMD_RE_RAWMIME:
+	case RSPAMD_RE_SARAWBODY:
+		ret = rspamd_re_cache_class_id (RSPAMD_RE_SARAWBODY, NULL, 0);
+		break;
+	default:
+		ret = re_class->id;
+		break;
+	}
+
+	return ret;
+}
+
+static void
+rspamd_re_cache_init_fused (struct rspamd_re_cache *cache)
+{
+	GHashTable *groups;
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_fused *fused;
+	rspamd_cryptobox_hash_state_t st;
+	guchar hash_out[rspamd_cryptobox_HASHBYTES];
+	guint64 input_id;
+	guint i;
+
+	groups = g_hash_table_new (g_int64_hash, g_int64_equal);
+	g_hash_table_iter_init (&it, cache->re_classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+		re_class->fused = NULL;
+		input_id = rspamd_re_cache_input_id (re_class);
+		fused = g_hash_table_lookup (groups, &input_id);
+
+		if (fused == NULL) {
+			fused = g_slice_alloc0 (sizeof (*fused));
+			fused->id = input_id;
+			fused->classes = g_ptr_array_new ();
+			g_hash_table_insert (groups, &fused->id, fused);
+		}
+
+		g_ptr_array_add (fused->classes, re_class);
+	}
+
+	if (cache->re_fused == NULL) {
+		cache->re_fused = g_ptr_array_new ();
+	}
+
+	g_hash_table_iter_init (&it, groups);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		fused = v;
+
+		if (fused->classes->len < 2) {
+			/* Nothing to fuse */
+			rspamd_re_cache_fused_dtor (fused);
+			continue;
+		}
+
+		/* Make hash independent on the hash table ordering */
+		g_ptr_array_sort (fused->classes, rspamd_re_cache_class_cmp);
+		rspamd_cryptobox_hash_init (&st, NULL, 0);
+		rspamd_cryptobox_hash_update (&st, "fused", sizeof ("fused") - 1);
+
+		for (i = 0; i < fused->classes->len; i ++) {
+			re_class = g_ptr_array_index (fused->classes, i);
+			re_class->fused = fused;
+			rspamd_cryptobox_hash_update (&st, re_class->hash,
+					sizeof (re_class->hash) - 1);
+		}
+
+		rspamd_cryptobox_hash_final (&st, hash_out);
+		rspamd_snprintf (fused->hash, sizeof (fused->hash), "%*xs",
+				(gint) rspamd_cryptobox_HASHBYTES, hash_out);
+		g_ptr_array_add (cache->re_fused, fused);
+	}
+
+	g_hash_table_unref (groups);
+}
+#endif
+
 void
 rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 {
@@ -396,6 +570,18 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 
 	cache->disable_hyperscan = cfg->disable_hyperscan;
 	cache->vectorized_hyperscan = cfg->vectorized_hyperscan;
+	cache->fused_hyperscan = cfg->fused_hyperscan;
+
+	if (cache->fused_hyperscan && cache->vectorized_hyperscan) {
+		/* We need to know the exact input to dispatch matches */
+		msg_warn_re_cache ("fused hyperscan mode is incompatible with "
+				"vectorized mode, disable it");
+		cache->fused_hyperscan = FALSE;
+	}
+
+	if (cache->fused_hyperscan) {
+		rspamd_re_cache_init_fused (cache);
+	}
 
 	g_assert (hs_populate_platform (&cache->plt) == HS_SUCCESS);
 
@@ -534,6 +720,8 @@ struct rspamd_re_hyperscan_cbdata {
 	guint count;
 	rspamd_regexp_t *re;
 	rspamd_mempool_t *pool;
+	/* Ignore matches of classes of this type (fused scan) */
+	enum rspamd_re_type skip_type;
 };
 
 static gint
@@ -546,12 +734,21 @@ rspamd_re_cache_hyperscan_cb (unsigned int id,
 	struct rspamd_re_hyperscan_cbdata *cbdata = ud;
 	struct rspamd_re_runtime *rt;
 	struct rspamd_re_cache_elt *pcre_elt;
+	struct rspamd_re_class *re_class;
 	guint ret, maxhits, i, processed;
 
 	rt = cbdata->rt;
 	pcre_elt = g_ptr_array_index (rt->cache->re, id);
 	maxhits = rspamd_regexp_get_maxhits (pcre_elt->re);
 
+	if (cbdata->skip_type != RSPAMD_RE_MAX) {
+		re_class = rspamd_regexp_get_class (pcre_elt->re);
+
+		if (re_class->type == cbdata->skip_type) {
+			return 0;
+		}
+	}
+
 	if (pcre_elt->match_type == RSPAMD_RE_CACHE_HYPERSCAN) {
 		ret = 1;
 		setbit (rt->checked, id);
@@ -664,6 +861,7 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 				cbdata.lens = &lens[i];
 				cbdata.count = 1;
 				cbdata.pool = pool;
+				cbdata.skip_type = RSPAMD_RE_MAX;
 
 				if ((hs_scan (re_class->hs_db, in[i], lens[i], 0,
 						re_class->hs_scratch,
@@ -682,6 +880,7 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 			cbdata.lens = lens;
 			cbdata.count = 1;
 			cbdata.pool = pool;
+			cbdata.skip_type = RSPAMD_RE_MAX;
 
 			if ((hs_scan_vector (re_class->hs_db, (const char **)in, lens, count, 0,
 					re_class->hs_scratch,
@@ -719,6 +918,161 @@ rspamd_re_cache_finish_class (struct rspamd_re_runtime *rt,
 #endif
 }
 
+static void
+rspamd_re_cache_fill_headers (GPtrArray *headerlist, gboolean raw,
+		const guchar **scvec, guint *lenvec)
+{
+	struct raw_header *rh;
+	const gchar *in, *end;
+	guint i;
+
+	for (i = 0; i < headerlist->len; i ++) {
+		rh = g_ptr_array_index (headerlist, i);
+
+		if (raw) {
+			in = rh->value;
+			lenvec[i] = strlen (rh->value);
+		}
+		else {
+			in = rh->decoded;
+			/* Validate input */
+			if (!in || !g_utf8_validate (in, -1, &end)) {
+				lenvec[i] = 0;
+				scvec[i] = (guchar *)"";
+				continue;
+			}
+			lenvec[i] = end - in;
+		}
+
+		scvec[i] = (guchar *)in;
+	}
+}
+
+static void
+rspamd_re_cache_account_class (struct rspamd_re_runtime *rt,
+		struct rspamd_re_class *re_class,
+		gdouble t1,
+		guint64 bytes_before)
+{
+	struct rspamd_re_cache_class_stat *cst;
+
+	if (re_class->type >= RSPAMD_RE_MAX) {
+		return;
+	}
+
+	cst = &rt->stat.classes[re_class->type];
+	cst->scans ++;
+	cst->time_spent += rspamd_get_ticks () - t1;
+	cst->bytes_scanned += rt->stat.bytes_scanned - bytes_before;
+}
+
+#ifdef WITH_HYPERSCAN
+/*
+ * Scans the input of the class using the fused database of its group, so all
+ * hyperscan regexps of all classes in the group are checked at once
+ */
+static void
+rspamd_re_cache_exec_fused (struct rspamd_task *task,
+		struct rspamd_re_runtime *rt,
+		struct rspamd_re_class *re_class)
+{
+	struct rspamd_re_fused *fused = re_class->fused;
+	struct rspamd_re_hyperscan_cbdata cbdata;
+	struct rspamd_mime_text_part *part;
+	GPtrArray *headerlist = NULL;
+	const guchar **scvec;
+	guint *lenvec;
+	guint i, cnt = 0;
+
+	switch (re_class->type) {
+	case RSPAMD_RE_HEADER:
+	case RSPAMD_RE_RAWHEADER:
+		headerlist = rspamd_message_get_header_array (task,
+				re_class->type_data,
+				FALSE);
+		break;
+	case RSPAMD_RE_MIMEHEADER:
+		headerlist = rspamd_message_get_mime_header_array (task,
+				re_class->type_data,
+				FALSE);
+		break;
+	case RSPAMD_RE_RAWMIME:
+	case RSPAMD_RE_SARAWBODY:
+		cnt = task->text_parts->len;
+		break;
+	default:
+		g_assert_not_reached ();
+		break;
+	}
+
+	if (headerlist) {
+		cnt = headerlist->len;
+	}
+
+	if (cnt > 0) {
+		scvec = g_malloc (sizeof (*scvec) * cnt);
+		lenvec = g_malloc (sizeof (*lenvec) * cnt);
+
+		if (headerlist) {
+			rspamd_re_cache_fill_headers (headerlist,
+					re_class->type == RSPAMD_RE_RAWHEADER, scvec, lenvec);
+		}
+		else {
+			for (i = 0; i < cnt; i++) {
+				part = g_ptr_array_index (task->text_parts, i);
+
+				if (part->orig) {
+					scvec[i] = (guchar *)part->orig->data;
+					lenvec[i] = part->orig->len;
+				}
+				else {
+					scvec[i] = (guchar *)"";
+					lenvec[i] = 0;
+				}
+			}
+		}
+
+		cbdata.re = NULL;
+		cbdata.rt = rt;
+		cbdata.count = 1;
+		cbdata.pool = task->task_pool;
+
+		for (i = 0; i < cnt; i++) {
+			if (rt->cache->max_re_data > 0 && lenvec[i] > rt->cache->max_re_data) {
+				lenvec[i] = rt->cache->max_re_data;
+			}
+
+			rt->stat.bytes_scanned += lenvec[i];
+			cbdata.ins = &scvec[i];
+			cbdata.lens = &lenvec[i];
+			cbdata.skip_type = RSPAMD_RE_MAX;
+
+			if (headerlist == NULL) {
+				part = g_ptr_array_index (task->text_parts, i);
+
+				if (IS_PART_EMPTY (part)) {
+					/* Raw mime class ignores empty parts */
+					cbdata.skip_type = RSPAMD_RE_RAWMIME;
+				}
+			}
+
+			hs_scan (fused->hs_db, scvec[i], lenvec[i], 0,
+					fused->hs_scratch,
+					rspamd_re_cache_hyperscan_cb, &cbdata);
+		}
+
+		rt->stat.fused_scans ++;
+		g_free (scvec);
+		g_free (lenvec);
+	}
+
+	for (i = 0; i < fused->classes->len; i ++) {
+		rspamd_re_cache_finish_class (rt,
+				g_ptr_array_index (fused->classes, i));
+	}
+}
+#endif
+
 /*
  * Calculates the specified regexp for the specified class if it's not calculated
  */
@@ -732,9 +1086,9 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 	guint ret = 0, i, re_id;
 	GPtrArray *headerlist;
 	GList *slist;
-	GHashTableIter it;
+	rspamd_pool_hash_iter_t it;
 	struct raw_header *rh;
-	const gchar *in, *end;
+	const gchar *in;
 	const guchar **scvec;
 	guint *lenvec;
 	gboolean raw = FALSE;
@@ -743,11 +1097,31 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 	struct rspamd_re_cache *cache = rt->cache;
 	gpointer k, v;
 	guint len, cnt;
+	guint64 bytes_before;
+	gdouble t1;
 
 	msg_debug_re_cache ("get to the slow path for re type: %s: %s",
 			rspamd_re_cache_type_to_string (re_class->type),
 			rspamd_regexp_get_pattern (re));
 	re_id = rspamd_regexp_get_cache_id (re);
+	t1 = rspamd_get_ticks ();
+	bytes_before = rt->stat.bytes_scanned;
+
+#ifdef WITH_HYPERSCAN
+	struct rspamd_re_cache_elt *elt;
+
+	elt = g_ptr_array_index (cache->re, re_id);
+
+	if (re_class->fused && re_class->fused->hs_db && rt->has_hs &&
+			!cache->disable_hyperscan && !is_strong &&
+			elt->match_type != RSPAMD_RE_CACHE_PCRE) {
+		rspamd_re_cache_exec_fused (task, rt, re_class);
+		rspamd_re_cache_account_class (rt, re_class, t1, bytes_before);
+		setbit (rt->checked, re_id);
+
+		return rt->results[re_id];
+	}
+#endif
 
 	switch (re_class->type) {
 	case RSPAMD_RE_HEADER:
@@ -760,28 +1134,8 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		if (headerlist && headerlist->len > 0) {
 			scvec = g_malloc (sizeof (*scvec) * headerlist->len);
 			lenvec = g_malloc (sizeof (*lenvec) * headerlist->len);
-
-			for (i = 0; i < headerlist->len; i ++) {
-				rh = g_ptr_array_index (headerlist, i);
-
-				if (re_class->type == RSPAMD_RE_RAWHEADER) {
-					in = rh->value;
-					raw = TRUE;
-					lenvec[i] = strlen (rh->value);
-				}
-				else {
-					in = rh->decoded;
-					/* Validate input */
-					if (!in || !g_utf8_validate (in, -1, &end)) {
-						lenvec[i] = 0;
-						scvec[i] = (guchar *)"";
-						continue;
-					}
-					lenvec[i] = end - in;
-				}
-
-				scvec[i] = (guchar *)in;
-			}
+			raw = (re_class->type == RSPAMD_RE_RAWHEADER);
+			rspamd_re_cache_fill_headers (headerlist, raw, scvec, lenvec);
 
 			ret = rspamd_re_cache_process_regexp_data (rt, re,
 					task->task_pool, scvec, lenvec, headerlist->len, raw);
@@ -809,28 +1163,8 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		if (headerlist && headerlist->len > 0) {
 			scvec = g_malloc (sizeof (*scvec) * headerlist->len);
 			lenvec = g_malloc (sizeof (*lenvec) * headerlist->len);
-
-			for (i = 0; i < headerlist->len; i ++) {
-				rh = g_ptr_array_index (headerlist, i);
-
-				if (re_class->type == RSPAMD_RE_RAWHEADER) {
-					in = rh->value;
-					raw = TRUE;
-					lenvec[i] = strlen (rh->value);
-				}
-				else {
-					in = rh->decoded;
-					/* Validate input */
-					if (!in || !g_utf8_validate (in, -1, &end)) {
-						lenvec[i] = 0;
-						scvec[i] = (guchar *)"";
-						continue;
-					}
-					lenvec[i] = end - in;
-				}
-
-				scvec[i] = (guchar *)in;
-			}
+			raw = (re_class->type == RSPAMD_RE_RAWHEADER);
+			rspamd_re_cache_fill_headers (headerlist, raw, scvec, lenvec);
 
 			ret = rspamd_re_cache_process_regexp_data (rt, re,
 					task->task_pool, scvec, lenvec, headerlist->len, raw);
@@ -887,15 +1221,15 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		}
 		break;
 	case RSPAMD_RE_URL:
-		cnt = g_hash_table_size (task->urls) + g_hash_table_size (task->emails);
+		cnt = rspamd_pool_hash_size (task->urls) + rspamd_pool_hash_size (task->emails);
 
 		if (cnt > 0) {
 			scvec = g_malloc (sizeof (*scvec) * cnt);
 			lenvec = g_malloc (sizeof (*lenvec) * cnt);
-			g_hash_table_iter_init (&it, task->urls);
+			rspamd_pool_hash_iter_init (&it, task->urls);
 			i = 0;
 
-			while (g_hash_table_iter_next (&it, &k, &v)) {
+			while (rspamd_pool_hash_iter_next (&it, &k, &v)) {
 				url = v;
 				in = url->string;
 				len = url->urllen;
@@ -905,9 +1239,9 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 				lenvec[i++] = len;
 			}
 
-			g_hash_table_iter_init (&it, task->emails);
+			rspamd_pool_hash_iter_init (&it, task->emails);
 
-			while (g_hash_table_iter_next (&it, &k, &v)) {
+			while (rspamd_pool_hash_iter_next (&it, &k, &v)) {
 				url = v;
 				in = url->string;
 				len = url->urllen;
@@ -1033,6 +1367,7 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 	}
 #endif
 
+	rspamd_re_cache_account_class (rt, re_class, t1, bytes_before);
 	setbit (rt->checked, re_id);
 
 	return rt->results[re_id];
@@ -1301,46 +1636,303 @@ rspamd_re_cache_is_finite (struct rspamd_re_cache *cache,
 
 	return FALSE;
 }
-#endif
 
-gint
-rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
-		const char *cache_dir, gdouble max_time, gboolean silent,
+static gint
+rspamd_re_cache_write_hs (struct rspamd_re_cache *cache,
+		const char *cache_dir,
+		const gchar *hash,
+		const gchar **hs_pats,
+		guint *hs_flags,
+		gint *hs_ids,
+		gint n,
 		GError **err)
 {
-	g_assert (cache != NULL);
-	g_assert (cache_dir != NULL);
-
-#ifndef WITH_HYPERSCAN
-	g_set_error (err, rspamd_re_cache_quark (), EINVAL, "hyperscan is disabled");
-	return -1;
-#else
-	GHashTableIter it, cit;
-	gpointer k, v;
-	struct rspamd_re_class *re_class;
 	gchar path[PATH_MAX], npath[PATH_MAX];
 	hs_database_t *test_db;
-	gint fd, i, n, *hs_ids = NULL, pcre_flags, re_flags;
+	hs_compile_error_t *hs_errors;
 	rspamd_cryptobox_fast_hash_state_t crc_st;
 	guint64 crc;
-	rspamd_regexp_t *re;
-	hs_compile_error_t *hs_errors;
-	guint *hs_flags = NULL;
-	const gchar **hs_pats = NULL;
 	gchar *hs_serialized;
-	gsize serialized_len, total = 0;
+	gsize serialized_len;
 	struct iovec iov[7];
+	gint fd;
 
-	g_hash_table_iter_init (&it, cache->re_classes);
-
-	while (g_hash_table_iter_next (&it, &k, &v)) {
-		re_class = v;
-		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
-				G_DIR_SEPARATOR, re_class->hash);
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs.new", cache_dir,
+			G_DIR_SEPARATOR, hash);
+	fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
 
-		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, TRUE)) {
+	if (fd == -1) {
+		g_set_error (err, rspamd_re_cache_quark (), errno, "cannot open file "
+				"%s: %s", path, strerror (errno));
+		return -1;
+	}
 
-			fd = open (path, O_RDONLY, 00600);
+	if (n > 0) {
+		/* Create the hs tree */
+		if (hs_compile_multi (hs_pats,
+				hs_flags,
+				(const guint *)hs_ids,
+				n,
+				cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
+				&cache->plt,
+				&test_db,
+				&hs_errors) != HS_SUCCESS) {
+
+			g_set_error (err, rspamd_re_cache_quark (), EINVAL,
+					"cannot create tree of regexp when processing '%s': %s",
+					hs_pats[hs_errors->expression], hs_errors->message);
+			close (fd);
+			unlink (path);
+			hs_free_compile_error (hs_errors);
+
+			return -1;
+		}
+
+		if (hs_serialize_database (test_db, &hs_serialized,
+				&serialized_len) != HS_SUCCESS) {
+			g_set_error (err,
+					rspamd_re_cache_quark (),
+					errno,
+					"cannot serialize tree of regexp for %s",
+					hash);
+
+			close (fd);
+			unlink (path);
+			hs_free_database (test_db);
+
+			return -1;
+		}
+
+		hs_free_database (test_db);
+
+		/*
+		 * Magic - 8 bytes
+		 * Platform - sizeof (platform)
+		 * n - number of regexps
+		 * n * <regexp ids>
+		 * n * <regexp flags>
+		 * crc - 8 bytes checksum
+		 * <hyperscan blob>
+		 */
+		rspamd_cryptobox_fast_hash_init (&crc_st, 0xdeadbabe);
+		/* IDs -> Flags -> Hs blob */
+		rspamd_cryptobox_fast_hash_update (&crc_st,
+				hs_ids, sizeof (*hs_ids) * n);
+		rspamd_cryptobox_fast_hash_update (&crc_st,
+				hs_flags, sizeof (*hs_flags) * n);
+		rspamd_cryptobox_fast_hash_update (&crc_st,
+				hs_serialized, serialized_len);
+		crc = rspamd_cryptobox_fast_hash_final (&crc_st);
+
+		if (cache->vectorized_hyperscan) {
+			iov[0].iov_base = (void *) rspamd_hs_magic_vector;
+		}
+		else {
+			iov[0].iov_base = (void *) rspamd_hs_magic;
+		}
+
+		iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
+		iov[1].iov_base = &cache->plt;
+		iov[1].iov_len = sizeof (cache->plt);
+		iov[2].iov_base = &n;
+		iov[2].iov_len = sizeof (n);
+		iov[3].iov_base = hs_ids;
+		iov[3].iov_len = sizeof (*hs_ids) * n;
+		iov[4].iov_base = hs_flags;
+		iov[4].iov_len = sizeof (*hs_flags) * n;
+		iov[5].iov_base = &crc;
+		iov[5].iov_len = sizeof (crc);
+		iov[6].iov_base = hs_serialized;
+		iov[6].iov_len = serialized_len;
+
+		if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
+			g_set_error (err,
+					rspamd_re_cache_quark (),
+					errno,
+					"cannot serialize tree of regexp to %s: %s",
+					path, strerror (errno));
+			close (fd);
+			unlink (path);
+			g_free (hs_serialized);
+
+			return -1;
+		}
+
+		g_free (hs_serialized);
+	}
+
+	fsync (fd);
+
+	/* Now rename temporary file to the new .hs file */
+	rspamd_snprintf (npath, sizeof (path), "%s%c%s.hs", cache_dir,
+			G_DIR_SEPARATOR, hash);
+
+	if (rename (path, npath) == -1) {
+		g_set_error (err,
+				rspamd_re_cache_quark (),
+				errno,
+				"cannot rename %s to %s: %s",
+				path, npath, strerror (errno));
+		unlink (path);
+		close (fd);
+
+		return -1;
+	}
+
+	close (fd);
+
+	return n;
+}
+
+/*
+ * Reads ids and flags of regexps stored in the specified hs file, returns
+ * number of regexps or -1 on error
+ */
+static gint
+rspamd_re_cache_read_hs_ids (struct rspamd_re_cache *cache,
+		const gchar *path,
+		gint **pids,
+		guint **pflags)
+{
+	gint fd, n;
+	gint *hs_ids;
+	guint *hs_flags;
+
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1) {
+		return -1;
+	}
+
+	if (lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET) == -1 ||
+			read (fd, &n, sizeof (n)) != sizeof (n) || n <= 0) {
+		/* Class with no hyperscan regexps */
+		close (fd);
+
+		return 0;
+	}
+
+	hs_ids = g_malloc (n * sizeof (*hs_ids));
+	hs_flags = g_malloc (n * sizeof (*hs_flags));
+
+	if (read (fd, hs_ids, n * sizeof (*hs_ids)) != (gssize)(n * sizeof (*hs_ids)) ||
+			read (fd, hs_flags, n * sizeof (*hs_flags)) !=
+					(gssize)(n * sizeof (*hs_flags))) {
+		close (fd);
+		g_free (hs_ids);
+		g_free (hs_flags);
+
+		return -1;
+	}
+
+	close (fd);
+	*pids = hs_ids;
+	*pflags = hs_flags;
+
+	return n;
+}
+
+/*
+ * Builds database for a fused group from the already compiled classes, so
+ * we can reuse their decisions about prefilter regexps
+ */
+static gint
+rspamd_re_cache_compile_fused (struct rspamd_re_cache *cache,
+		struct rspamd_re_fused *fused,
+		const char *cache_dir,
+		GError **err)
+{
+	gchar path[PATH_MAX];
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_cache_elt *elt;
+	gint *hs_ids = NULL, *cids, n = 0, cn, i, ret;
+	guint *hs_flags = NULL, *cflags, j;
+	const gchar **hs_pats;
+
+	for (j = 0; j < fused->classes->len; j ++) {
+		re_class = g_ptr_array_index (fused->classes, j);
+		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+				G_DIR_SEPARATOR, re_class->hash);
+		cn = rspamd_re_cache_read_hs_ids (cache, path, &cids, &cflags);
+
+		if (cn == -1) {
+			g_set_error (err, rspamd_re_cache_quark (), errno,
+					"cannot read hyperscan cache file %s: %s",
+					path, strerror (errno));
+			g_free (hs_ids);
+			g_free (hs_flags);
+
+			return -1;
+		}
+
+		if (cn > 0) {
+			hs_ids = g_realloc (hs_ids, (n + cn) * sizeof (*hs_ids));
+			hs_flags = g_realloc (hs_flags, (n + cn) * sizeof (*hs_flags));
+			memcpy (hs_ids + n, cids, cn * sizeof (*hs_ids));
+			memcpy (hs_flags + n, cflags, cn * sizeof (*hs_flags));
+			n += cn;
+			g_free (cids);
+			g_free (cflags);
+		}
+	}
+
+	if (n == 0) {
+		return 0;
+	}
+
+	hs_pats = g_malloc (n * sizeof (*hs_pats));
+
+	for (i = 0; i < n; i ++) {
+		g_assert ((gint)cache->re->len > hs_ids[i] && hs_ids[i] >= 0);
+		elt = g_ptr_array_index (cache->re, hs_ids[i]);
+		hs_pats[i] = rspamd_regexp_get_pattern (elt->re);
+	}
+
+	ret = rspamd_re_cache_write_hs (cache, cache_dir, fused->hash,
+			hs_pats, hs_flags, hs_ids, n, err);
+	g_free (hs_pats);
+	g_free (hs_ids);
+	g_free (hs_flags);
+
+	return ret;
+}
+#endif
+
+gint
+rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
+		const char *cache_dir, gdouble max_time, gboolean silent,
+		GError **err)
+{
+	g_assert (cache != NULL);
+	g_assert (cache_dir != NULL);
+
+#ifndef WITH_HYPERSCAN
+	g_set_error (err, rspamd_re_cache_quark (), EINVAL, "hyperscan is disabled");
+	return -1;
+#else
+	GHashTableIter it, cit;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_fused *fused;
+	gchar path[PATH_MAX];
+	hs_database_t *test_db;
+	gint fd, i, n, ret, *hs_ids = NULL, pcre_flags, re_flags;
+	rspamd_regexp_t *re;
+	hs_compile_error_t *hs_errors;
+	guint *hs_flags = NULL, j;
+	const gchar **hs_pats = NULL;
+	gsize total = 0;
+
+	g_hash_table_iter_init (&it, cache->re_classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+				G_DIR_SEPARATOR, re_class->hash);
+
+		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, TRUE)) {
+
+			fd = open (path, O_RDONLY, 00600);
 
 			/* Read number of regexps */
 			g_assert (fd != -1);
@@ -1372,16 +1964,6 @@ rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 			continue;
 		}
 
-		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs.new", cache_dir,
-						G_DIR_SEPARATOR, re_class->hash);
-		fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
-
-		if (fd == -1) {
-			g_set_error (err, rspamd_re_cache_quark (), errno, "cannot open file "
-					"%s: %s", path, strerror (errno));
-			return -1;
-		}
-
 		g_hash_table_iter_init (&cit, re_class->re);
 		n = g_hash_table_size (re_class->re);
 		hs_flags = g_malloc0 (sizeof (*hs_flags) * n);
@@ -1456,106 +2038,17 @@ rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 		/* Adjust real re number */
 		n = i;
 
-		if (n > 0) {
-			/* Create the hs tree */
-			if (hs_compile_multi (hs_pats,
-					hs_flags,
-					hs_ids,
-					n,
-					cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
-					&cache->plt,
-					&test_db,
-					&hs_errors) != HS_SUCCESS) {
+		ret = rspamd_re_cache_write_hs (cache, cache_dir, re_class->hash,
+				hs_pats, hs_flags, hs_ids, n, err);
+		g_free (hs_pats);
+		g_free (hs_ids);
+		g_free (hs_flags);
 
-				g_set_error (err, rspamd_re_cache_quark (), EINVAL,
-						"cannot create tree of regexp when processing '%s': %s",
-						hs_pats[hs_errors->expression], hs_errors->message);
-				g_free (hs_flags);
-				g_free (hs_ids);
-				g_free (hs_pats);
-				close (fd);
-				unlink (path);
-				hs_free_compile_error (hs_errors);
-
-				return -1;
-			}
-
-			g_free (hs_pats);
-
-			if (hs_serialize_database (test_db, &hs_serialized,
-					&serialized_len) != HS_SUCCESS) {
-				g_set_error (err,
-						rspamd_re_cache_quark (),
-						errno,
-						"cannot serialize tree of regexp for %s",
-						re_class->hash);
-
-				close (fd);
-				unlink (path);
-				g_free (hs_ids);
-				g_free (hs_flags);
-				hs_free_database (test_db);
-
-				return -1;
-			}
-
-			hs_free_database (test_db);
-
-			/*
-			 * Magic - 8 bytes
-			 * Platform - sizeof (platform)
-			 * n - number of regexps
-			 * n * <regexp ids>
-			 * n * <regexp flags>
-			 * crc - 8 bytes checksum
-			 * <hyperscan blob>
-			 */
-			rspamd_cryptobox_fast_hash_init (&crc_st, 0xdeadbabe);
-			/* IDs -> Flags -> Hs blob */
-			rspamd_cryptobox_fast_hash_update (&crc_st,
-					hs_ids, sizeof (*hs_ids) * n);
-			rspamd_cryptobox_fast_hash_update (&crc_st,
-					hs_flags, sizeof (*hs_flags) * n);
-			rspamd_cryptobox_fast_hash_update (&crc_st,
-					hs_serialized, serialized_len);
-			crc = rspamd_cryptobox_fast_hash_final (&crc_st);
-
-			if (cache->vectorized_hyperscan) {
-				iov[0].iov_base = (void *) rspamd_hs_magic_vector;
-			}
-			else {
-				iov[0].iov_base = (void *) rspamd_hs_magic;
-			}
-
-			iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
-			iov[1].iov_base = &cache->plt;
-			iov[1].iov_len = sizeof (cache->plt);
-			iov[2].iov_base = &n;
-			iov[2].iov_len = sizeof (n);
-			iov[3].iov_base = hs_ids;
-			iov[3].iov_len = sizeof (*hs_ids) * n;
-			iov[4].iov_base = hs_flags;
-			iov[4].iov_len = sizeof (*hs_flags) * n;
-			iov[5].iov_base = &crc;
-			iov[5].iov_len = sizeof (crc);
-			iov[6].iov_base = hs_serialized;
-			iov[6].iov_len = serialized_len;
-
-			if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
-				g_set_error (err,
-						rspamd_re_cache_quark (),
-						errno,
-						"cannot serialize tree of regexp to %s: %s",
-						path, strerror (errno));
-				close (fd);
-				unlink (path);
-				g_free (hs_ids);
-				g_free (hs_flags);
-				g_free (hs_serialized);
-
-				return -1;
-			}
+		if (ret == -1) {
+			return -1;
+		}
 
+		if (n > 0) {
 			if (re_class->type_len > 0) {
 				msg_info_re_cache (
 						"compiled class %s(%*s) to cache %6s, %d regexps",
@@ -1574,31 +2067,44 @@ rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 			}
 
 			total += n;
-
-			g_free (hs_serialized);
-			g_free (hs_ids);
-			g_free (hs_flags);
 		}
+	}
 
-		fsync (fd);
+	if (cache->fused_hyperscan && cache->re_fused) {
+		/* Fused groups are built from the per class databases */
+		for (j = 0; j < cache->re_fused->len; j ++) {
+			fused = g_ptr_array_index (cache->re_fused, j);
+			rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+					G_DIR_SEPARATOR, fused->hash);
 
-		/* Now rename temporary file to the new .hs file */
-		rspamd_snprintf (npath, sizeof (path), "%s%c%s.hs", cache_dir,
-				G_DIR_SEPARATOR, re_class->hash);
+			if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE,
+					TRUE)) {
+				if (!silent) {
+					msg_info_re_cache (
+							"skip already valid fused group of %ud classes "
+							"to cache %6s",
+							fused->classes->len,
+							fused->hash);
+				}
 
-		if (rename (path, npath) == -1) {
-			g_set_error (err,
-					rspamd_re_cache_quark (),
-					errno,
-					"cannot rename %s to %s: %s",
-					path, npath, strerror (errno));
-			unlink (path);
-			close (fd);
+				continue;
+			}
 
-			return -1;
-		}
+			n = rspamd_re_cache_compile_fused (cache, fused, cache_dir, err);
 
-		close (fd);
+			if (n == -1) {
+				return -1;
+			}
+
+			if (n > 0) {
+				msg_info_re_cache (
+						"compiled fused group of %ud classes to cache %6s, "
+						"%d regexps",
+						fused->classes->len,
+						fused->hash,
+						n);
+			}
+		}
 	}
 
 	return total;
@@ -1621,7 +2127,10 @@ rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
 	GHashTableIter it;
 	gpointer k, v;
 	struct rspamd_re_class *re_class;
+	struct rspamd_re_fused *fused;
 	gsize len;
+	guint i;
+	gboolean found = FALSE;
 	const gchar *hash_pos;
 	hs_platform_info_t test_plt;
 	hs_database_t *test_db = NULL;
@@ -1646,140 +2155,235 @@ rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
 		re_class = v;
 
 		if (memcmp (hash_pos, re_class->hash, sizeof (re_class->hash) - 1) == 0) {
-			/* Open file and check magic */
-			fd = open (path, O_RDONLY);
+			found = TRUE;
+			break;
+		}
+	}
 
-			if (fd == -1) {
-				if (!silent) {
-					msg_err_re_cache ("cannot open hyperscan cache file %s: %s",
-							path, strerror (errno));
-				}
-				return FALSE;
-			}
+	if (!found && cache->re_fused) {
+		for (i = 0; i < cache->re_fused->len; i ++) {
+			fused = g_ptr_array_index (cache->re_fused, i);
 
-			if (read (fd, magicbuf, sizeof (magicbuf)) != sizeof (magicbuf)) {
-				msg_err_re_cache ("cannot read hyperscan cache file %s: %s",
-						path, strerror (errno));
-				close (fd);
-				return FALSE;
+			if (memcmp (hash_pos, fused->hash, sizeof (fused->hash) - 1) == 0) {
+				found = TRUE;
+				break;
 			}
+		}
+	}
 
-			if (cache->vectorized_hyperscan) {
-				mb = rspamd_hs_magic_vector;
-			}
-			else {
-				mb = rspamd_hs_magic;
-			}
+	if (!found) {
+		if (!silent) {
+			msg_warn_re_cache ("unknown hyperscan cache file %s", path);
+		}
 
-			if (memcmp (magicbuf, mb, sizeof (magicbuf)) != 0) {
-				msg_err_re_cache ("cannot open hyperscan cache file %s: "
-						"bad magic ('%*xs', '%*xs' expected)",
-						path, (int) RSPAMD_HS_MAGIC_LEN, magicbuf,
-						(int) RSPAMD_HS_MAGIC_LEN, mb);
+		return FALSE;
+	}
 
-				close (fd);
-				return FALSE;
-			}
+	/* Open file and check magic */
+	fd = open (path, O_RDONLY);
 
-			if (read (fd, &test_plt, sizeof (test_plt)) != sizeof (test_plt)) {
-				msg_err_re_cache ("cannot read hyperscan cache file %s: %s",
-						path, strerror (errno));
-				close (fd);
-				return FALSE;
-			}
+	if (fd == -1) {
+		if (!silent) {
+			msg_err_re_cache ("cannot open hyperscan cache file %s: %s",
+					path, strerror (errno));
+		}
+		return FALSE;
+	}
 
-			if (memcmp (&test_plt, &cache->plt, sizeof (test_plt)) != 0) {
-				msg_err_re_cache ("cannot open hyperscan cache file %s: "
-						"compiled for a different platform",
-						path);
+	if (read (fd, magicbuf, sizeof (magicbuf)) != sizeof (magicbuf)) {
+		msg_err_re_cache ("cannot read hyperscan cache file %s: %s",
+				path, strerror (errno));
+		close (fd);
+		return FALSE;
+	}
 
-				close (fd);
-				return FALSE;
-			}
+	if (cache->vectorized_hyperscan) {
+		mb = rspamd_hs_magic_vector;
+	}
+	else {
+		mb = rspamd_hs_magic;
+	}
 
-			close (fd);
+	if (memcmp (magicbuf, mb, sizeof (magicbuf)) != 0) {
+		msg_err_re_cache ("cannot open hyperscan cache file %s: "
+				"bad magic ('%*xs', '%*xs' expected)",
+				path, (int) RSPAMD_HS_MAGIC_LEN, magicbuf,
+				(int) RSPAMD_HS_MAGIC_LEN, mb);
 
-			if (try_load) {
-				map = rspamd_file_xmap (path, PROT_READ, &len);
+		close (fd);
+		return FALSE;
+	}
 
-				if (map == NULL) {
-					msg_err_re_cache ("cannot mmap hyperscan cache file %s: "
-							"%s",
-							path, strerror (errno));
-					return FALSE;
-				}
+	if (read (fd, &test_plt, sizeof (test_plt)) != sizeof (test_plt)) {
+		msg_err_re_cache ("cannot read hyperscan cache file %s: %s",
+				path, strerror (errno));
+		close (fd);
+		return FALSE;
+	}
 
-				p = map + RSPAMD_HS_MAGIC_LEN + sizeof (test_plt);
-				end = map + len;
-				n = *(gint *)p;
-				p += sizeof (gint);
-
-				if (n <= 0 || 2 * n * sizeof (gint) + /* IDs + flags */
-						sizeof (guint64) + /* crc */
-						RSPAMD_HS_MAGIC_LEN + /* header */
-						sizeof (cache->plt) > len) {
-					/* Some wrong amount of regexps */
-					msg_err_re_cache ("bad number of expressions in %s: %d",
-							path, n);
-					munmap (map, len);
-					return FALSE;
-				}
+	if (memcmp (&test_plt, &cache->plt, sizeof (test_plt)) != 0) {
+		msg_err_re_cache ("cannot open hyperscan cache file %s: "
+				"compiled for a different platform",
+				path);
 
-				/*
-				 * Magic - 8 bytes
-				 * Platform - sizeof (platform)
-				 * n - number of regexps
-				 * n * <regexp ids>
-				 * n * <regexp flags>
-				 * crc - 8 bytes checksum
-				 * <hyperscan blob>
-				 */
+		close (fd);
+		return FALSE;
+	}
 
-				memcpy (&crc, p + n * 2 * sizeof (gint), sizeof (crc));
-				rspamd_cryptobox_fast_hash_init (&crc_st, 0xdeadbabe);
-				/* IDs */
-				rspamd_cryptobox_fast_hash_update (&crc_st, p, n * sizeof (gint));
-				/* Flags */
-				rspamd_cryptobox_fast_hash_update (&crc_st, p + n * sizeof (gint),
-						n * sizeof (gint));
-				/* HS database */
-				p += n * sizeof (gint) * 2 + sizeof (guint64);
-				rspamd_cryptobox_fast_hash_update (&crc_st, p, end - p);
-				valid_crc = rspamd_cryptobox_fast_hash_final (&crc_st);
-
-				if (crc != valid_crc) {
-					msg_warn_re_cache ("outdated or invalid hs database in %s: "
-							"crc read %xL, crc expected %xL", path, crc, valid_crc);
-					munmap (map, len);
-
-					return FALSE;
-				}
+	close (fd);
 
-				if ((ret = hs_deserialize_database (p, end - p, &test_db))
-						!= HS_SUCCESS) {
-					msg_err_re_cache ("bad hs database in %s: %d", path, ret);
-					munmap (map, len);
+	if (try_load) {
+		map = rspamd_file_xmap (path, PROT_READ, &len);
 
-					return FALSE;
-				}
+		if (map == NULL) {
+			msg_err_re_cache ("cannot mmap hyperscan cache file %s: "
+					"%s",
+					path, strerror (errno));
+			return FALSE;
+		}
 
-				hs_free_database (test_db);
-				munmap (map, len);
-			}
-			/* XXX: add crc check */
+		p = map + RSPAMD_HS_MAGIC_LEN + sizeof (test_plt);
+		end = map + len;
+		n = *(gint *)p;
+		p += sizeof (gint);
+
+		if (n <= 0 || 2 * n * sizeof (gint) + /* IDs + flags */
+				sizeof (guint64) + /* crc */
+				RSPAMD_HS_MAGIC_LEN + /* header */
+				sizeof (cache->plt) > len) {
+			/* Some wrong amount of regexps */
+			msg_err_re_cache ("bad number of expressions in %s: %d",
+					path, n);
+			munmap (map, len);
+			return FALSE;
+		}
+
+		/*
+		 * Magic - 8 bytes
+		 * Platform - sizeof (platform)
+		 * n - number of regexps
+		 * n * <regexp ids>
+		 * n * <regexp flags>
+		 * crc - 8 bytes checksum
+		 * <hyperscan blob>
+		 */
+
+		memcpy (&crc, p + n * 2 * sizeof (gint), sizeof (crc));
+		rspamd_cryptobox_fast_hash_init (&crc_st, 0xdeadbabe);
+		/* IDs */
+		rspamd_cryptobox_fast_hash_update (&crc_st, p, n * sizeof (gint));
+		/* Flags */
+		rspamd_cryptobox_fast_hash_update (&crc_st, p + n * sizeof (gint),
+				n * sizeof (gint));
+		/* HS database */
+		p += n * sizeof (gint) * 2 + sizeof (guint64);
+		rspamd_cryptobox_fast_hash_update (&crc_st, p, end - p);
+		valid_crc = rspamd_cryptobox_fast_hash_final (&crc_st);
+
+		if (crc != valid_crc) {
+			msg_warn_re_cache ("outdated or invalid hs database in %s: "
+					"crc read %xL, crc expected %xL", path, crc, valid_crc);
+			munmap (map, len);
 
-			return TRUE;
+			return FALSE;
 		}
-	}
 
-	if (!silent) {
-		msg_warn_re_cache ("unknown hyperscan cache file %s", path);
+		if ((ret = hs_deserialize_database (p, end - p, &test_db))
+				!= HS_SUCCESS) {
+			msg_err_re_cache ("bad hs database in %s: %d", path, ret);
+			munmap (map, len);
+
+			return FALSE;
+		}
+
+		hs_free_database (test_db);
+		munmap (map, len);
 	}
+	/* XXX: add crc check */
 
-	return FALSE;
+	return TRUE;
 #endif
 }
 
+#ifdef WITH_HYPERSCAN
+static gboolean
+rspamd_re_cache_load_hs_db (struct rspamd_re_cache *cache,
+		const gchar *path,
+		hs_database_t **pdb,
+		hs_scratch_t **pscratch,
+		gint **pids,
+		gint **pflags,
+		gint *pn)
+{
+	gint fd, n, *hs_ids, *hs_flags, ret;
+	guint8 *map, *p, *end;
+	hs_database_t *db = NULL;
+	hs_scratch_t *scratch = NULL;
+	struct stat st;
+
+	fd = open (path, O_RDONLY);
+
+	/* Read number of regexps */
+	g_assert (fd != -1);
+	fstat (fd, &st);
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		msg_err_re_cache ("cannot mmap %s: %s", path, strerror (errno));
+		close (fd);
+		return FALSE;
+	}
+
+	close (fd);
+	end = map + st.st_size;
+	p = map + RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt);
+	n = *(gint *)p;
+
+	if (n <= 0 || 2 * n * sizeof (gint) + /* IDs + flags */
+					sizeof (guint64) + /* crc */
+					RSPAMD_HS_MAGIC_LEN + /* header */
+					sizeof (cache->plt) > (gsize)st.st_size) {
+		/* Some wrong amount of regexps */
+		msg_err_re_cache ("bad number of expressions in %s: %d",
+				path, n);
+		munmap (map, st.st_size);
+		return FALSE;
+	}
+
+	p += sizeof (n);
+	hs_ids = g_malloc (n * sizeof (*hs_ids));
+	memcpy (hs_ids, p, n * sizeof (*hs_ids));
+	p += n * sizeof (*hs_ids);
+	hs_flags = g_malloc (n * sizeof (*hs_flags));
+	memcpy (hs_flags, p, n * sizeof (*hs_flags));
+
+	/* Skip crc */
+	p += n * sizeof (*hs_ids) + sizeof (guint64);
+
+	if ((ret = hs_deserialize_database (p, end - p, &db))
+			!= HS_SUCCESS) {
+		msg_err_re_cache ("bad hs database in %s: %d", path, ret);
+		munmap (map, st.st_size);
+		g_free (hs_ids);
+		g_free (hs_flags);
+
+		return FALSE;
+	}
+
+	munmap (map, st.st_size);
+
+	g_assert (hs_alloc_scratch (db, &scratch) == HS_SUCCESS);
+
+	*pdb = db;
+	*pscratch = scratch;
+	*pids = hs_ids;
+	*pflags = hs_flags;
+	*pn = n;
+
+	return TRUE;
+}
+#endif
 
 gboolean
 rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
@@ -1792,13 +2396,15 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 	return FALSE;
 #else
 	gchar path[PATH_MAX];
-	gint fd, i, n, *hs_ids = NULL, *hs_flags = NULL, total = 0, ret;
+	gint i, n, *hs_ids = NULL, *hs_flags = NULL, total = 0;
+	guint j, nfused = 0;
 	GHashTableIter it;
 	gpointer k, v;
-	guint8 *map, *p, *end;
 	struct rspamd_re_class *re_class;
+	struct rspamd_re_fused *fused;
 	struct rspamd_re_cache_elt *elt;
-	struct stat st;
+	hs_database_t *db;
+	hs_scratch_t *scratch;
 
 	g_hash_table_iter_init (&it, cache->re_classes);
 
@@ -1811,46 +2417,12 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 			msg_debug_re_cache ("load hyperscan database from '%s'",
 					re_class->hash);
 
-			fd = open (path, O_RDONLY);
-
-			/* Read number of regexps */
-			g_assert (fd != -1);
-			fstat (fd, &st);
-
-			map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-
-			if (map == MAP_FAILED) {
-				msg_err_re_cache ("cannot mmap %s: %s", path, strerror (errno));
-				close (fd);
-				return FALSE;
-			}
-
-			close (fd);
-			end = map + st.st_size;
-			p = map + RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt);
-			n = *(gint *)p;
-
-			if (n <= 0 || 2 * n * sizeof (gint) + /* IDs + flags */
-							sizeof (guint64) + /* crc */
-							RSPAMD_HS_MAGIC_LEN + /* header */
-							sizeof (cache->plt) > (gsize)st.st_size) {
-				/* Some wrong amount of regexps */
-				msg_err_re_cache ("bad number of expressions in %s: %d",
-						path, n);
-				munmap (map, st.st_size);
+			if (!rspamd_re_cache_load_hs_db (cache, path, &db, &scratch,
+					&hs_ids, &hs_flags, &n)) {
 				return FALSE;
 			}
 
 			total += n;
-			p += sizeof (n);
-			hs_ids = g_malloc (n * sizeof (*hs_ids));
-			memcpy (hs_ids, p, n * sizeof (*hs_ids));
-			p += n * sizeof (*hs_ids);
-			hs_flags = g_malloc (n * sizeof (*hs_flags));
-			memcpy (hs_flags, p, n * sizeof (*hs_flags));
-
-			/* Skip crc */
-			p += n * sizeof (*hs_ids) + sizeof (guint64);
 
 			/* Cleanup */
 			if (re_class->hs_scratch != NULL) {
@@ -1865,24 +2437,8 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 				g_free (re_class->hs_ids);
 			}
 
-			re_class->hs_ids = NULL;
-			re_class->hs_scratch = NULL;
-			re_class->hs_db = NULL;
-
-			if ((ret = hs_deserialize_database (p, end - p, &re_class->hs_db))
-					!= HS_SUCCESS) {
-				msg_err_re_cache ("bad hs database in %s: %d", path, ret);
-				munmap (map, st.st_size);
-				g_free (hs_ids);
-				g_free (hs_flags);
-
-				return FALSE;
-			}
-
-			munmap (map, st.st_size);
-
-			g_assert (hs_alloc_scratch (re_class->hs_db,
-					&re_class->hs_scratch) == HS_SUCCESS);
+			re_class->hs_db = db;
+			re_class->hs_scratch = scratch;
 
 			/*
 			 * Now find hyperscan elts that are successfully compiled and
@@ -1911,7 +2467,46 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 		}
 	}
 
-	msg_info_re_cache ("hyperscan database of %d regexps has been loaded", total);
+	if (cache->fused_hyperscan && cache->re_fused) {
+		/* Fused databases are optional, classes are scanned separately if absent */
+		for (j = 0; j < cache->re_fused->len; j ++) {
+			fused = g_ptr_array_index (cache->re_fused, j);
+			rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+					G_DIR_SEPARATOR, fused->hash);
+
+			if (access (path, R_OK) == -1 ||
+					!rspamd_re_cache_is_valid_hyperscan_file (cache, path,
+							TRUE, FALSE) ||
+					!rspamd_re_cache_load_hs_db (cache, path, &db, &scratch,
+							&hs_ids, &hs_flags, &n)) {
+				msg_debug_re_cache ("no fused hyperscan database '%s'",
+						fused->hash);
+				continue;
+			}
+
+			if (fused->hs_scratch != NULL) {
+				hs_free_scratch (fused->hs_scratch);
+			}
+
+			if (fused->hs_db != NULL) {
+				hs_free_database (fused->hs_db);
+			}
+
+			if (fused->hs_ids) {
+				g_free (fused->hs_ids);
+			}
+
+			fused->hs_db = db;
+			fused->hs_scratch = scratch;
+			fused->hs_ids = hs_ids;
+			fused->nhs = n;
+			g_free (hs_flags);
+			nfused ++;
+		}
+	}
+
+	msg_info_re_cache ("hyperscan database of %d regexps has been loaded, "
+			"%ud fused groups", total, nfused);
 	cache->hyperscan_loaded = TRUE;
 
 	return TRUE;
@@ -38,6 +38,12 @@ enum rspamd_re_type {
 	RSPAMD_RE_MAX
 };
 
+struct rspamd_re_cache_class_stat {
+	guint64 bytes_scanned;
+	guint scans;
+	gdouble time_spent;
+};
+
 struct rspamd_re_cache_stat {
 	guint64 bytes_scanned;
 	guint64 bytes_scanned_pcre;
@@ -45,6 +51,9 @@ struct rspamd_re_cache_stat {
 	guint regexp_matched;
 	guint regexp_total;
 	guint regexp_fast_cached;
+	guint fused_scans;
+	/* Per re type counters, indexed by enum rspamd_re_type */
+	struct rspamd_re_cache_class_stat classes[RSPAMD_RE_MAX];
 };
 
 /**
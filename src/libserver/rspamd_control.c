@@ -16,6 +16,8 @@
 #include "config.h"
 #include "rspamd.h"
 #include "rspamd_control.h"
+#include "symbols_cache.h"
+#include "log_pipe.h"
 #include "libutil/http.h"
 #include "libutil/http_private.h"
 #include "unix-std.h"
@@ -101,6 +103,13 @@ static const struct rspamd_control_cmd_match {
 				},
 				.type = RSPAMD_CONTROL_FUZZY_SYNC
 		},
+		{
+				.name = {
+						.begin = "/logpipe",
+						.len = sizeof ("/logpipe") - 1
+				},
+				.type = RSPAMD_CONTROL_LOG_PIPE
+		},
 };
 
 void
@@ -182,7 +191,9 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 	gchar tmpbuf[64];
 	gdouble total_utime = 0, total_systime = 0;
 	struct ucl_parser *parser;
-	guint total_conns = 0;
+	struct symbols_cache *cache;
+	const gchar *sym;
+	guint total_conns = 0, nsyms, i;
 
 	rep = ucl_object_typed_new (UCL_OBJECT);
 	workers = ucl_object_typed_new (UCL_OBJECT);
@@ -282,6 +293,10 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 			ucl_object_insert_key (cur, ucl_object_fromint (
 					elt->reply.reply.fuzzy_sync.status), "status", 0, false);
 			break;
+		case RSPAMD_CONTROL_LOG_PIPE:
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.log_pipe.status), "status", 0, false);
+			break;
 		default:
 			break;
 		}
@@ -308,6 +323,22 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 
 		ucl_object_insert_key (rep, cur, "total", 0, false);
 	}
+	else if (session->cmd.type == RSPAMD_CONTROL_LOG_PIPE) {
+		/* Consumer needs names to interpret symbols ids */
+		cur = ucl_object_typed_new (UCL_ARRAY);
+		cache = session->rspamd_main->cfg->cache;
+		nsyms = rspamd_symbols_cache_symbols_count (cache);
+
+		for (i = 0; i < nsyms; i ++) {
+			sym = rspamd_symbols_cache_symbol_by_id (cache, i);
+			ucl_array_append (cur, sym ? ucl_object_fromstring (sym) :
+					ucl_object_typed_new (UCL_NULL));
+		}
+
+		ucl_object_insert_key (rep, cur, "symbols", 0, false);
+		ucl_object_insert_key (rep, ucl_object_fromint (RSPAMD_LOG_PIPE_VERSION),
+				"version", 0, false);
+	}
 
 	rspamd_control_send_ucl (session, rep);
 	ucl_object_unref (rep);
@@ -441,6 +472,65 @@ rspamd_control_broadcast_cmd (struct rspamd_main *rspamd_main,
 	return res;
 }
 
+/*
+ * Creates a binary log pipe: the reading end is passed to the client as a
+ * single byte with the descriptor attached, before the HTTP reply, and the
+ * writing end is broadcasted to the workers
+ */
+static void
+rspamd_control_open_log_pipe (struct rspamd_control_session *session)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	guchar fdspace[CMSG_SPACE(sizeof (int))];
+	struct rspamd_control_reply_elt *cur;
+	gint pair[2];
+	guchar c = 0;
+
+	if (!rspamd_socketpair (pair)) {
+		rspamd_control_send_error (session, 500, "Cannot create socketpair: %s",
+				strerror (errno));
+		return;
+	}
+
+	memset (&msg, 0, sizeof (msg));
+	memset (fdspace, 0, sizeof (fdspace));
+	msg.msg_control = fdspace;
+	msg.msg_controllen = sizeof (fdspace);
+	cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+	memcpy (CMSG_DATA (cmsg), &pair[0], sizeof (int));
+	iov.iov_base = &c;
+	iov.iov_len = sizeof (c);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (sendmsg (session->fd, &msg, 0) != sizeof (c)) {
+		close (pair[0]);
+		close (pair[1]);
+		rspamd_control_send_error (session, 500, "Cannot pass log pipe: %s",
+				strerror (errno));
+		return;
+	}
+
+	/* Workers should never block on a slow reader */
+	rspamd_socket_nonblocking (pair[1]);
+	session->cmd.cmd.log_pipe.type = RSPAMD_LOG_PIPE_BINARY;
+	session->replies = rspamd_control_broadcast_cmd (
+			session->rspamd_main, &session->cmd, pair[1],
+			rspamd_control_wrk_io, session);
+
+	DL_FOREACH (session->replies, cur) {
+		session->replies_remain ++;
+	}
+
+	close (pair[0]);
+	close (pair[1]);
+}
+
 static gint
 rspamd_control_finish_handler (struct rspamd_http_connection *conn,
 		struct rspamd_http_message *msg)
@@ -475,6 +565,9 @@ rspamd_control_finish_handler (struct rspamd_http_connection *conn,
 		if (!found) {
 			rspamd_control_send_error (session, 404, "Command not defined");
 		}
+		else if (session->cmd.type == RSPAMD_CONTROL_LOG_PIPE) {
+			rspamd_control_open_log_pipe (session);
+		}
 		else {
 			/* Send command to all workers */
 			session->replies = rspamd_control_broadcast_cmd (
@@ -43,6 +43,7 @@ enum rspamd_srv_type {
 
 enum rspamd_log_pipe_type {
 	RSPAMD_LOG_PIPE_SYMBOLS = 0,
+	RSPAMD_LOG_PIPE_BINARY,
 };
 
 struct rspamd_control_command {
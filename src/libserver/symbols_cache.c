@@ -21,6 +21,9 @@
 #include "cfg_file.h"
 #include "lua/lua_common.h"
 #include "unix-std.h"
+#include "latency.h"
+#include "composites.h"
+#include "expression.h"
 #include <math.h>
 
 #define msg_err_cache(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
@@ -52,11 +55,58 @@ struct rspamd_symbols_cache_header {
 	guchar unused[128];
 };
 
+/*
+ * Score that could be added by a single item: virtual symbols contribute to
+ * their parents, as they are inserted when the parent callback is executed
+ */
+struct cache_item_bound {
+	gdouble pos;
+	gdouble neg;
+	/* Item could add score that is not limited by its weight */
+	gboolean unbounded;
+};
+
 struct symbols_cache_order {
 	GPtrArray *d;
+	/*
+	 * Bounds are computed by each process for its own order, as items are
+	 * shared between processes, tasks keep bounds together with the order
+	 */
+	struct cache_item_bound *bounds;
+	/* Scores that could be added outside of filters pass */
+	gdouble extra_pos_bound;
+	gdouble extra_neg_bound;
+	gboolean extra_unbounded;
 	ref_entry_t ref;
 };
 
+#define SYMBOLS_CACHE_STAT_SHARDS 32
+#define SYMBOLS_CACHE_LINE_SIZE 64
+#define SYMBOLS_CACHE_ORDER_RETRIES 8
+
+/*
+ * Execution statistics of a single symbol as seen by a single shard, each
+ * worker writes only to its own shard using relaxed atomics. Shards are padded
+ * to the cache line size to avoid false sharing between workers.
+ */
+struct symbols_cache_stat_shard {
+	guint64 hits;
+	guint64 calls;
+	guint64 time_ns;
+	guchar pad[SYMBOLS_CACHE_LINE_SIZE - sizeof (guint64) * 3];
+};
+
+/*
+ * Globally computed execution order shared between all processes, protected
+ * by a sequence lock: generation is odd while the order is being written
+ */
+struct symbols_cache_shared_order {
+	guint64 generation;
+	gdouble last_resort;
+	guint nids;
+	gint ids[];
+};
+
 struct symbols_cache {
 	/* Hash table for fast access */
 	GHashTable *items_by_symbol;
@@ -75,11 +125,13 @@ struct symbols_cache {
 	rspamd_mempool_mutex_t *mtx;
 	gdouble reload_time;
 	struct event resort_ev;
-};
-
-struct counter_data {
-	gdouble value;
-	gint number;
+	struct symbols_cache_stat_shard *stats;
+	struct symbols_cache_shared_order *shared_order;
+	guint stats_items;
+	guint shard;
+	guint64 order_generation;
+	/* Items whose weight could be removed by composites */
+	GPtrArray *removable;
 };
 
 struct cache_item {
@@ -88,9 +140,9 @@ struct cache_item {
 	gdouble weight;
 	guint32 frequency;
 	guint32 avg_counter;
+	/* Item has been inserted with a multiplier above one */
+	gboolean scaled;
 
-	/* Per process counter */
-	struct counter_data *cd;
 	gchar *symbol;
 	enum rspamd_symbol_type type;
 
@@ -106,6 +158,8 @@ struct cache_item {
 	/* Priority */
 	gint priority;
 	gint id;
+	/* Index of symbols group in latency statistics (-2 if not resolved) */
+	gint latency_group;
 
 	/* Dependencies */
 	GPtrArray *deps;
@@ -146,6 +200,17 @@ struct cache_savepoint {
 	gdouble lim;
 	GPtrArray *waitq;
 	struct symbols_cache_order *order;
+	/* Score that could still be added by the unfinished symbols */
+	gdouble pos_remain;
+	gdouble neg_remain;
+	/* Unfinished items with unbounded scores */
+	guchar *unbounded_bits;
+	guint unbounded_remain;
+	guint finished;
+	guint checked_finished;
+	gboolean bounds_ready;
+	gboolean early_exit_enabled;
+	gboolean early_exit;
 };
 
 /* XXX: Maybe make it configurable */
@@ -186,6 +251,7 @@ rspamd_symbols_cache_order_dtor (gpointer p)
 	struct symbols_cache_order *ord = p;
 
 	g_ptr_array_free (ord->d, TRUE);
+	g_free (ord->bounds);
 	g_slice_free1 (sizeof (*ord), ord);
 }
 
@@ -204,6 +270,10 @@ rspamd_symbols_cache_order_new (gsize nelts)
 
 	ord = g_slice_alloc (sizeof (*ord));
 	ord->d = g_ptr_array_sized_new (nelts);
+	ord->bounds = NULL;
+	ord->extra_pos_bound = 0;
+	ord->extra_neg_bound = 0;
+	ord->extra_unbounded = FALSE;
 	REF_INIT_RETAIN (ord, rspamd_symbols_cache_order_dtor);
 
 	return ord;
@@ -308,23 +378,236 @@ cache_logic_cmp (const void *p1, const void *p2, gpointer ud)
 	return 0;
 }
 
+static inline struct symbols_cache_stat_shard *
+rspamd_symbols_cache_item_stat (struct symbols_cache *cache,
+		struct cache_item *item)
+{
+	if (cache->stats == NULL || item->id >= (gint)cache->stats_items) {
+		/* Symbol has been registered after the stats table */
+		return NULL;
+	}
+
+	return &cache->stats[item->id * SYMBOLS_CACHE_STAT_SHARDS + cache->shard];
+}
+
 /**
- * Set counter for a symbol
+ * Account execution time (in microseconds) for a symbol
  */
-static double
-rspamd_set_counter (struct cache_item *item, gdouble value)
+static void
+rspamd_symbols_cache_account_time (struct symbols_cache *cache,
+		struct cache_item *item, gdouble value)
 {
-	struct counter_data *cd;
-	cd = item->cd;
+	struct symbols_cache_stat_shard *st;
+
+	st = rspamd_symbols_cache_item_stat (cache, item);
 
-	/* Cumulative moving average using per-process counter data */
-	if (cd->number == 0) {
-		cd->value = 0;
+	if (st) {
+		__atomic_add_fetch (&st->calls, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch (&st->time_ns, (guint64)(value * 1000.0),
+				__ATOMIC_RELAXED);
 	}
+}
 
-	cd->value = cd->value + (value - cd->value) / (gdouble)(++cd->number);
+static void
+rspamd_symbols_cache_account_hit (struct symbols_cache *cache,
+		struct cache_item *item)
+{
+	struct symbols_cache_stat_shard *st;
 
-	return cd->value;
+	st = rspamd_symbols_cache_item_stat (cache, item);
+
+	if (st) {
+		__atomic_add_fetch (&st->hits, 1, __ATOMIC_RELAXED);
+	}
+	else {
+		item->frequency ++;
+	}
+}
+
+static void
+rspamd_symbols_cache_add_removable (struct symbols_cache *cache,
+		const gchar *sym)
+{
+	struct cache_item *it;
+	guint i;
+
+	it = g_hash_table_lookup (cache->items_by_symbol, sym);
+
+	if (it == NULL) {
+		return;
+	}
+
+	for (i = 0; i < cache->removable->len; i ++) {
+		if (g_ptr_array_index (cache->removable, i) == it) {
+			return;
+		}
+	}
+
+	g_ptr_array_add (cache->removable, it);
+}
+
+/*
+ * Composites atoms that remove weight of their symbols: these are all atoms
+ * of composites with `remove_all` or `remove_weight` policy that are not
+ * prefixed with `~` or `-`
+ */
+static void
+rspamd_symbols_cache_removable_cb (const rspamd_ftok_t *atom, gpointer ud)
+{
+	struct symbols_cache *cache = ud;
+	struct rspamd_symbols_group *gr;
+	struct rspamd_symbol_def *sdef;
+	GHashTableIter it;
+	gpointer k, v;
+	const gchar *p = atom->begin, *end = atom->begin + atom->len;
+	gchar *sym;
+
+	while (p < end && !g_ascii_isalnum (*p)) {
+		if (*p == '~' || *p == '-') {
+			return;
+		}
+
+		p ++;
+	}
+
+	if (p == end) {
+		return;
+	}
+
+	sym = g_malloc (end - p + 1);
+	rspamd_strlcpy (sym, p, end - p + 1);
+
+	if (strncmp (sym, "g:", 2) == 0) {
+		if (cache->cfg->default_metric) {
+			gr = g_hash_table_lookup (cache->cfg->default_metric->groups,
+					sym + 2);
+
+			if (gr != NULL) {
+				g_hash_table_iter_init (&it, gr->symbols);
+
+				while (g_hash_table_iter_next (&it, &k, &v)) {
+					sdef = v;
+					rspamd_symbols_cache_add_removable (cache, sdef->name);
+				}
+			}
+		}
+	}
+	else {
+		rspamd_symbols_cache_add_removable (cache, sym);
+	}
+
+	g_free (sym);
+}
+
+/*
+ * Calculate score bounds for all items of the order.
+ * One shot symbols add at most their weight unless they are known to be
+ * inserted with multipliers above one (lua callbacks, expressions or ones that
+ * have inserted a scaled symbol at runtime). Other symbols could be inserted
+ * many times, so their scores are limited by `max_symbol_mult` weights, if this
+ * limit is disabled such symbols are marked as unbounded
+ */
+static void
+rspamd_symbols_cache_update_bounds (struct symbols_cache *cache,
+		struct symbols_cache_order *ord)
+{
+	struct cache_item *it, *target;
+	struct cache_item_bound *bound;
+	struct rspamd_symbol_def *sdef;
+	struct rspamd_composite *comp;
+	GHashTableIter hit;
+	gpointer k, v;
+	gdouble w, max_mult = cache->cfg->max_symbol_mult;
+	gboolean scaled, unbounded;
+	guint i;
+
+	g_free (ord->bounds);
+	ord->bounds = g_malloc0 (cache->items_by_id->len * sizeof (*ord->bounds));
+	ord->extra_pos_bound = 0;
+	ord->extra_neg_bound = 0;
+	ord->extra_unbounded = FALSE;
+
+	if (cache->removable == NULL) {
+		cache->removable = g_ptr_array_new ();
+	}
+	else {
+		g_ptr_array_set_size (cache->removable, 0);
+	}
+
+	if (cache->cfg->composite_symbols) {
+		g_hash_table_iter_init (&hit, cache->cfg->composite_symbols);
+
+		while (g_hash_table_iter_next (&hit, &k, &v)) {
+			comp = v;
+
+			if (comp->policy == RSPAMD_COMPOSITE_POLICY_REMOVE_ALL ||
+					comp->policy == RSPAMD_COMPOSITE_POLICY_REMOVE_WEIGHT) {
+				rspamd_expression_atom_foreach (comp->expr,
+						rspamd_symbols_cache_removable_cb, cache);
+			}
+		}
+	}
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		it = g_ptr_array_index (cache->items_by_id, i);
+
+		if (!(it->type & (SYMBOL_TYPE_NORMAL|SYMBOL_TYPE_VIRTUAL|
+				SYMBOL_TYPE_COMPOSITE|SYMBOL_TYPE_CLASSIFIER)) ||
+				(it->type & SYMBOL_TYPE_SKIPPED)) {
+			/* Callbacks' own weights are copies of their children's ones */
+			continue;
+		}
+
+		target = it;
+		scaled = it->scaled;
+
+		if ((it->type & SYMBOL_TYPE_VIRTUAL) && it->parent != -1) {
+			target = g_ptr_array_index (cache->items_by_id, it->parent);
+			scaled = scaled || target->scaled;
+		}
+
+		if (target->type & SYMBOL_TYPE_PREFILTER) {
+			/* Prefilters are finished before we start to check bounds */
+			continue;
+		}
+
+		sdef = NULL;
+
+		if (cache->cfg->default_metric) {
+			sdef = g_hash_table_lookup (cache->cfg->default_metric->symbols,
+					it->symbol);
+		}
+
+		/* Negative multiplier turns the sign of weight */
+		w = fabs (it->weight);
+		unbounded = FALSE;
+
+		/* Composites are inserted once with multiplier one */
+		if (sdef != NULL && (scaled || (!cache->cfg->one_shot_mode &&
+				!(sdef->flags & RSPAMD_SYMBOL_FLAG_ONESHOT) &&
+				!(it->type & SYMBOL_TYPE_COMPOSITE)))) {
+			if (max_mult > 0) {
+				w *= MAX (max_mult, 1.0);
+			}
+			else {
+				unbounded = TRUE;
+			}
+		}
+
+		if (target->type & (SYMBOL_TYPE_COMPOSITE|SYMBOL_TYPE_CLASSIFIER|
+				SYMBOL_TYPE_POSTFILTER)) {
+			/* These are processed outside of filters pass */
+			ord->extra_pos_bound += w;
+			ord->extra_neg_bound -= w;
+			ord->extra_unbounded = ord->extra_unbounded || unbounded;
+		}
+		else {
+			bound = &ord->bounds[target->id];
+			bound->pos += w;
+			bound->neg -= w;
+			bound->unbounded = bound->unbounded || unbounded;
+		}
+	}
 }
 
 static void
@@ -345,6 +628,7 @@ rspamd_symbols_cache_resort (struct symbols_cache *cache)
 	}
 
 	g_ptr_array_sort_with_data (ord->d, cache_logic_cmp, cache);
+	rspamd_symbols_cache_update_bounds (cache, ord);
 
 	if (cache->items_by_order) {
 		REF_RELEASE (cache->items_by_order);
@@ -364,6 +648,24 @@ rspamd_symbols_cache_post_init (struct symbols_cache *cache)
 	GList *cur;
 	guint i, j;
 	gint id;
+	gsize shared_size;
+
+	/*
+	 * Statistics and order are allocated in shared memory before workers are
+	 * forked, so all processes write to (and read from) the same tables
+	 */
+	cache->stats_items = cache->items_by_id->len;
+	shared_size = sizeof (struct symbols_cache_stat_shard) *
+			cache->stats_items * SYMBOLS_CACHE_STAT_SHARDS +
+			SYMBOLS_CACHE_LINE_SIZE;
+	cache->stats = rspamd_mempool_alloc0_shared (cache->static_pool,
+			shared_size);
+	cache->stats = (struct symbols_cache_stat_shard *)
+			(((uintptr_t)cache->stats + SYMBOLS_CACHE_LINE_SIZE - 1) &
+					~((uintptr_t)SYMBOLS_CACHE_LINE_SIZE - 1));
+	cache->shared_order = rspamd_mempool_alloc0_shared (cache->static_pool,
+			sizeof (*cache->shared_order) +
+			sizeof (gint) * cache->stats_items);
 
 	rspamd_symbols_cache_resort (cache);
 
@@ -682,12 +984,7 @@ rspamd_symbols_cache_add_symbol (struct symbols_cache *cache,
 	item = rspamd_mempool_alloc0_shared (cache->static_pool,
 			sizeof (struct cache_item));
 	item->condition_cb = -1;
-	/*
-	 * We do not share cd to skip locking, instead we'll just calculate it on
-	 * save or accumulate
-	 */
-	item->cd = rspamd_mempool_alloc0 (cache->static_pool,
-			sizeof (struct counter_data));
+	item->latency_group = -2;
 
 	if (name != NULL) {
 		item->symbol = rspamd_mempool_strdup (cache->static_pool, name);
@@ -707,7 +1004,6 @@ rspamd_symbols_cache_add_symbol (struct symbols_cache *cache,
 	item->parent = parent;
 	cache->used_items ++;
 	msg_debug_cache ("used items: %d, added symbol: %s", cache->used_items, name);
-	rspamd_set_counter (item, 0);
 	g_ptr_array_add (cache->items_by_id, item);
 	item->deps = g_ptr_array_new ();
 	item->rdeps = g_ptr_array_new ();
@@ -847,6 +1143,11 @@ rspamd_symbols_cache_destroy (struct symbols_cache *cache)
 		g_ptr_array_free (cache->prefilters, TRUE);
 		g_ptr_array_free (cache->postfilters, TRUE);
 		g_ptr_array_free (cache->composites, TRUE);
+
+		if (cache->removable) {
+			g_ptr_array_free (cache->removable, TRUE);
+		}
+
 		REF_RELEASE (cache->items_by_order);
 		g_slice_free1 (sizeof (*cache), cache);
 	}
@@ -1066,8 +1367,127 @@ rspamd_symbols_cache_validate (struct symbols_cache *cache,
 }
 
 /* Return true if metric has score that is more than spam score for it */
+/*
+ * Mirrors rspamd_check_action_metric for an arbitrary score
+ */
+static gint
+rspamd_symbols_cache_score_action (struct metric_result *res, gdouble score)
+{
+	gint i, selected = METRIC_ACTION_NOACTION;
+	gdouble sc, max_score = 0;
+
+	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
+		sc = res->actions_limits[i];
+
+		if (isnan (sc)) {
+			continue;
+		}
+
+		if (score >= sc && sc > max_score) {
+			selected = i;
+			max_score = sc;
+		}
+	}
+
+	return selected;
+}
+
+/*
+ * Initialise the score that could be added by the symbols that are not
+ * finished yet, including composites, classifiers and postfilters
+ */
+static void
+rspamd_symbols_cache_init_bounds (struct rspamd_task *task,
+		struct symbols_cache *cache,
+		struct cache_savepoint *cp)
+{
+	struct cache_item *item;
+	struct cache_item_bound *bound;
+	const ucl_object_t *cur;
+	ucl_object_iter_t it = NULL;
+	gdouble corr;
+	guint i;
+
+	cp->bounds_ready = TRUE;
+	cp->early_exit_enabled = task->cfg->early_exit;
+
+	if (task->settings) {
+		cur = ucl_object_lookup (task->settings, "early_exit");
+
+		if (cur) {
+			cp->early_exit_enabled = ucl_object_toboolean (cur);
+		}
+	}
+
+	if (!cp->early_exit_enabled) {
+		return;
+	}
+
+	cp->pos_remain = cp->order->extra_pos_bound;
+	cp->neg_remain = cp->order->extra_neg_bound;
+	cp->unbounded_bits = rspamd_mempool_alloc0 (task->task_pool,
+			NBYTES (cache->items_by_id->len));
+
+	if (cp->order->extra_unbounded) {
+		/* Never finished within filters pass */
+		cp->unbounded_remain ++;
+	}
+
+	for (i = 0; i < cp->version; i ++) {
+		item = g_ptr_array_index (cp->order->d, i);
+
+		if (!isset (cp->processed_bits, item->id * 2 + 1)) {
+			bound = &cp->order->bounds[item->id];
+			cp->pos_remain += bound->pos;
+			cp->neg_remain += bound->neg;
+
+			if (bound->unbounded) {
+				setbit (cp->unbounded_bits, item->id);
+				cp->unbounded_remain ++;
+			}
+		}
+	}
+
+	if (task->settings) {
+		/* Scores redefined by settings can go beyond metric weights */
+		while ((cur = ucl_object_iterate (task->settings, &it, true)) != NULL) {
+			if (ucl_object_todouble_safe (cur, &corr) &&
+					g_hash_table_lookup (cache->items_by_symbol,
+							ucl_object_key (cur)) != NULL) {
+				corr = fabs (corr) * MAX (task->cfg->max_symbol_mult, 1.0);
+				cp->pos_remain += corr;
+				cp->neg_remain -= corr;
+			}
+		}
+	}
+}
+
+static void
+rspamd_symbols_cache_finish_item (struct cache_savepoint *cp,
+		struct cache_item *item)
+{
+	if (!isset (cp->processed_bits, item->id * 2 + 1)) {
+		setbit (cp->processed_bits, item->id * 2 + 1);
+		cp->finished ++;
+
+		if (cp->bounds_ready && cp->early_exit_enabled) {
+			cp->pos_remain -= cp->order->bounds[item->id].pos;
+			cp->neg_remain -= cp->order->bounds[item->id].neg;
+
+			if (isset (cp->unbounded_bits, item->id)) {
+				clrbit (cp->unbounded_bits, item->id);
+				cp->unbounded_remain --;
+			}
+		}
+	}
+}
+
+/*
+ * Old check: returns TRUE if metric has score that is more than reject score
+ * for it
+ */
 static gboolean
-rspamd_symbols_cache_metric_limit (struct rspamd_task *task,
+rspamd_symbols_cache_reject_limit (struct rspamd_task *task,
 		struct cache_savepoint *cp)
 {
 	struct metric_result *res;
@@ -1075,10 +1495,6 @@ rspamd_symbols_cache_metric_limit (struct rspamd_task *task,
 	struct metric *metric;
 	double ms;
 
-	if (task->flags & RSPAMD_TASK_FLAG_PASS_ALL) {
-		return FALSE;
-	}
-
 	cur = task->cfg->metrics_list;
 
 	if (cp->lim == 0.0) {
@@ -1116,6 +1532,117 @@ rspamd_symbols_cache_metric_limit (struct rspamd_task *task,
 	return FALSE;
 }
 
+/*
+ * Returns TRUE if no symbol that is not finished yet can change the final
+ * action of the task
+ */
+static gboolean
+rspamd_symbols_cache_bounds_limit (struct rspamd_task *task,
+		struct cache_savepoint *cp)
+{
+	struct symbols_cache *cache = task->cfg->cache;
+	struct cache_item *item;
+	struct symbol *s;
+	gdouble low, high;
+	guint i;
+
+	if (cp->early_exit) {
+		return TRUE;
+	}
+
+	if (cp->finished == cp->checked_finished && cp->rs != NULL) {
+		/* Nothing has been changed since the last check */
+		return FALSE;
+	}
+
+	cp->checked_finished = cp->finished;
+
+	if (cp->rs == NULL) {
+		cp->rs = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+
+		if (cp->rs == NULL) {
+			return FALSE;
+		}
+	}
+
+	if (task->pre_result.action != METRIC_ACTION_MAX) {
+		/* Action has been already set by a prefilter */
+		cp->early_exit = TRUE;
+	}
+	else if (cp->rs->metric->grow_factor > 1.0 || cp->unbounded_remain > 0) {
+		/* Score that could be added is not bounded */
+		return FALSE;
+	}
+	else {
+		low = cp->rs->score + cp->neg_remain;
+		high = cp->rs->score + cp->pos_remain;
+
+		/* Composites could remove weights of the already inserted symbols */
+		for (i = 0; i < cache->removable->len; i ++) {
+			item = g_ptr_array_index (cache->removable, i);
+			s = g_hash_table_lookup (cp->rs->symbols, item->symbol);
+
+			if (s != NULL) {
+				if (s->score > 0) {
+					low -= s->score;
+				}
+				else {
+					high -= s->score;
+				}
+			}
+		}
+
+		cp->early_exit = rspamd_symbols_cache_score_action (cp->rs, low) ==
+				rspamd_symbols_cache_score_action (cp->rs, high);
+
+		if (cp->early_exit) {
+			msg_info_task ("<%s> cannot change action with score %.2f "
+					"(reachable: %.2f..%.2f), so do not plan more checks",
+					task->message_id, cp->rs->score, low, high);
+		}
+	}
+
+	return cp->early_exit;
+}
+
+/*
+ * Returns TRUE if the item should not be planned as it cannot change the
+ * result of the task. Fine symbols are always checked, as their results are
+ * used by other modules, e.g. SPF and DKIM are required for DMARC, fuzzy
+ * results are required for learning
+ */
+static gboolean
+rspamd_symbols_cache_metric_limit (struct rspamd_task *task,
+		struct cache_savepoint *cp, struct cache_item *item)
+{
+	if ((task->flags & RSPAMD_TASK_FLAG_PASS_ALL) ||
+			(item->type & SYMBOL_TYPE_FINE)) {
+		return FALSE;
+	}
+
+	if (cp->bounds_ready && cp->early_exit_enabled) {
+		if (item->type & (SYMBOL_TYPE_PREFILTER|SYMBOL_TYPE_POSTFILTER|
+				SYMBOL_TYPE_CLASSIFIER)) {
+			return FALSE;
+		}
+
+		return rspamd_symbols_cache_bounds_limit (task, cp);
+	}
+
+	if (rspamd_symbols_cache_reject_limit (task, cp)) {
+		if (!cp->early_exit) {
+			msg_info_task ("<%s> has already scored more than %.2f, so do "
+					"not plan more checks", task->message_id,
+					cp->rs->score);
+			cp->early_exit = TRUE;
+		}
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
 static void
 rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 {
@@ -1130,12 +1657,17 @@ rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 	cache = task->cfg->cache;
 
 	/* Specify that we are done with this item */
-	setbit (checkpoint->processed_bits, item->id * 2 + 1);
+	rspamd_symbols_cache_finish_item (checkpoint, item);
 
 	if (checkpoint->pass > 0) {
 		for (i = 0; i < (gint)checkpoint->waitq->len; i ++) {
 			it = g_ptr_array_index (checkpoint->waitq, i);
 
+			if (checkpoint->bounds_ready && checkpoint->early_exit_enabled &&
+					rspamd_symbols_cache_metric_limit (task, checkpoint, it)) {
+				continue;
+			}
+
 			if (!isset (checkpoint->processed_bits, it->id * 2)) {
 				if (!rspamd_symbols_cache_check_deps (task, cache, it,
 						checkpoint, 0)) {
@@ -1152,6 +1684,45 @@ rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 	msg_debug_task ("finished watcher, %ud symbols waiting", remain);
 }
 
+/*
+ * Callback symbols usually have no definition, so we use the group of the
+ * first virtual symbol registered by the callback
+ */
+static gint
+rspamd_symbols_cache_latency_group (struct symbols_cache *cache,
+		struct cache_item *item, struct rspamd_latency_stat *lat)
+{
+	struct rspamd_symbol_def *def = NULL;
+	struct cache_item *cur;
+	GHashTable *symbols;
+	guint i;
+
+	if (cache->cfg->default_metric == NULL) {
+		return -1;
+	}
+
+	symbols = cache->cfg->default_metric->symbols;
+
+	if (item->symbol) {
+		def = g_hash_table_lookup (symbols, item->symbol);
+	}
+
+	for (i = 0; i < cache->items_by_id->len && (def == NULL || def->gr == NULL);
+			i ++) {
+		cur = g_ptr_array_index (cache->items_by_id, i);
+
+		if (cur->parent == item->id && cur->symbol) {
+			def = g_hash_table_lookup (symbols, cur->symbol);
+		}
+	}
+
+	if (def && def->gr) {
+		return rspamd_latency_stat_group_idx (lat, def->gr->name);
+	}
+
+	return -1;
+}
+
 static gboolean
 rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 		struct symbols_cache *cache,
@@ -1222,14 +1793,25 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 							(gint)(diff / 1000.));
 				}
 
-				rspamd_set_counter (item, diff);
+				rspamd_symbols_cache_account_time (cache, item, diff);
+
+				if (task->worker && task->worker->srv &&
+						task->worker->srv->latency) {
+					if (item->latency_group == -2) {
+						item->latency_group = rspamd_symbols_cache_latency_group (
+								cache, item, task->worker->srv->latency);
+					}
+
+					rspamd_latency_stat_add_group (task->worker->srv->latency,
+							item->latency_group, diff / 1e6);
+				}
 			}
 			rspamd_session_watch_stop (task->s);
 			pending_after = rspamd_session_events_pending (task->s);
 
 			if (pending_before == pending_after) {
 				/* No new events registered */
-				setbit (checkpoint->processed_bits, item->id * 2 + 1);
+				rspamd_symbols_cache_finish_item (checkpoint, item);
 
 				return TRUE;
 			}
@@ -1239,7 +1821,7 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 		else {
 			msg_debug_task ("skipping check of %s as its condition is false",
 					item->symbol);
-			setbit (checkpoint->processed_bits, item->id * 2 + 1);
+			rspamd_symbols_cache_finish_item (checkpoint, item);
 
 			return TRUE;
 		}
@@ -1549,17 +2131,15 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 		 * If we figure out symbol that has no dependencies satisfied, then
 		 * we just save it for another pass
 		 */
+		if (!checkpoint->bounds_ready) {
+			rspamd_symbols_cache_init_bounds (task, cache, checkpoint);
+		}
+
 		for (i = 0; i < (gint)checkpoint->version; i ++) {
 			item = g_ptr_array_index (checkpoint->order->d, i);
 
-			if (!(item->type & SYMBOL_TYPE_FINE)) {
-				if (rspamd_symbols_cache_metric_limit (task, checkpoint)) {
-					msg_info_task ("<%s> has already scored more than %.2f, so do "
-							"not "
-							"plan more checks", task->message_id,
-							checkpoint->rs->score);
-					continue;
-				}
+			if (rspamd_symbols_cache_metric_limit (task, checkpoint, item)) {
+				continue;
 			}
 
 			if (!isset (checkpoint->processed_bits, item->id * 2)) {
@@ -1612,6 +2192,11 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 		for (i = 0; i < (gint)checkpoint->waitq->len; i ++) {
 			item = g_ptr_array_index (checkpoint->waitq, i);
 
+			if (checkpoint->early_exit_enabled &&
+					rspamd_symbols_cache_metric_limit (task, checkpoint, item)) {
+				continue;
+			}
+
 			if (!isset (checkpoint->processed_bits, item->id * 2)) {
 				if (!rspamd_symbols_cache_check_deps (task, cache, item,
 						checkpoint, 0)) {
@@ -1741,40 +2326,52 @@ rspamd_symbols_cache_counters (struct symbols_cache * cache)
 	return top;
 }
 
+/*
+ * Drain all shards into the shared per-item averages, must be called with
+ * cache mutex locked
+ */
 static void
-rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
+rspamd_symbols_cache_aggregate_stats (struct symbols_cache *cache)
 {
-	struct timeval tv;
-	gdouble tm;
-	struct symbols_cache *cache = ud;
+	struct symbols_cache_stat_shard *st;
 	struct cache_item *item, *parent;
-	guint i;
-
-	/* Plan new event */
-	tm = rspamd_time_jitter (cache->reload_time, 0);
-	msg_debug_cache ("resort symbols cache, next reload in %.2f seconds", tm);
-	g_assert (cache != NULL);
-	evtimer_set (&cache->resort_ev, rspamd_symbols_cache_resort_cb, cache);
-	double_to_tv (tm, &tv);
-	event_add (&cache->resort_ev, &tv);
+	guint64 hits, calls, time_ns;
+	guint i, j;
 
-	rspamd_mempool_lock_mutex (cache->mtx);
+	cache->total_freq = 1;
+	cache->total_weight = 1.0;
 
-	/* Gather stats from shared execution times */
 	for (i = 0; i < cache->items_by_id->len; i ++) {
 		item = g_ptr_array_index (cache->items_by_id, i);
 
-		if (item->type & (SYMBOL_TYPE_CALLBACK|SYMBOL_TYPE_NORMAL)) {
-			if (item->cd->number > 0) {
-				item->avg_counter += item->cd->number + 1;
-				item->avg_time = item->avg_time +
-						(item->cd->value - item->avg_time) /
-								(gdouble)item->avg_counter;
-				item->cd->value = item->avg_time;
-				item->cd->number = item->avg_counter;
+		if (i < cache->stats_items) {
+			hits = 0;
+			calls = 0;
+			time_ns = 0;
+			st = &cache->stats[i * SYMBOLS_CACHE_STAT_SHARDS];
+
+			for (j = 0; j < SYMBOLS_CACHE_STAT_SHARDS; j ++) {
+				hits += __atomic_exchange_n (&st[j].hits, 0, __ATOMIC_RELAXED);
+				calls += __atomic_exchange_n (&st[j].calls, 0, __ATOMIC_RELAXED);
+				time_ns += __atomic_exchange_n (&st[j].time_ns, 0,
+						__ATOMIC_RELAXED);
+			}
+
+			item->frequency += hits;
+
+			if (calls > 0 && (item->type &
+					(SYMBOL_TYPE_CALLBACK|SYMBOL_TYPE_NORMAL))) {
+				/* Cumulative moving average over all workers */
+				item->avg_counter += calls;
+				item->avg_time += ((gdouble)time_ns / 1000.0 -
+						item->avg_time * calls) / (gdouble)item->avg_counter;
 			}
 		}
+
+		cache->total_freq += item->frequency;
+		cache->total_weight += fabs (item->weight);
 	}
+
 	/* Sync virtual symbols */
 	for (i = 0; i < cache->items_by_id->len; i ++) {
 		item = g_ptr_array_index (cache->items_by_id, i);
@@ -1788,21 +2385,165 @@ rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
 			}
 		}
 	}
+}
 
-	rspamd_mempool_unlock_mutex (cache->mtx);
+/*
+ * Publish the current order to all processes, must be called with cache mutex
+ * locked
+ */
+static void
+rspamd_symbols_cache_publish_order (struct symbols_cache *cache)
+{
+	struct symbols_cache_shared_order *so = cache->shared_order;
+	struct cache_item *item;
+	guint64 gen;
+	guint i, nids = 0;
 
-	rspamd_symbols_cache_resort (cache);
+	gen = __atomic_load_n (&so->generation, __ATOMIC_RELAXED);
+	__atomic_store_n (&so->generation, gen + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	for (i = 0; i < cache->items_by_order->d->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_order->d, i);
+
+		if (item->id < (gint)cache->stats_items) {
+			so->ids[nids ++] = item->id;
+		}
+	}
+
+	so->nids = nids;
+	__atomic_store_n (&so->generation, gen + 2, __ATOMIC_RELEASE);
+	cache->order_generation = gen + 2;
+}
+
+/*
+ * Load the order published by another process, never blocks: if the order is
+ * being rewritten for too long we just keep the current one
+ */
+static gboolean
+rspamd_symbols_cache_adopt_order (struct symbols_cache *cache)
+{
+	struct symbols_cache_shared_order *so = cache->shared_order;
+	struct symbols_cache_order *ord;
+	guint64 g1, g2;
+	guint i, nids, retries;
+	gint id;
+
+	for (retries = 0; retries < SYMBOLS_CACHE_ORDER_RETRIES; retries ++) {
+		g1 = __atomic_load_n (&so->generation, __ATOMIC_ACQUIRE);
+
+		if (g1 == cache->order_generation) {
+			return FALSE;
+		}
+
+		if (g1 & 1) {
+			continue;
+		}
+
+		nids = MIN (so->nids, cache->stats_items);
+		ord = rspamd_symbols_cache_order_new (nids);
+
+		for (i = 0; i < nids; i ++) {
+			id = so->ids[i];
+
+			if (id >= 0 && id < (gint)cache->items_by_id->len) {
+				g_ptr_array_add (ord->d,
+						g_ptr_array_index (cache->items_by_id, id));
+			}
+		}
+
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		g2 = __atomic_load_n (&so->generation, __ATOMIC_RELAXED);
+
+		if (g1 != g2 || ord->d->len != cache->items_by_order->d->len) {
+			/* Torn read or incompatible set of symbols */
+			REF_RELEASE (ord);
+
+			if (g1 == g2) {
+				cache->order_generation = g1;
+				return FALSE;
+			}
+
+			continue;
+		}
+
+		REF_RELEASE (cache->items_by_order);
+		cache->items_by_order = ord;
+		cache->order_generation = g1;
+		rspamd_symbols_cache_update_bounds (cache, ord);
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
+{
+	struct timeval tv;
+	gdouble tm, now;
+	struct symbols_cache *cache = ud;
+
+	/* Plan new event */
+	tm = rspamd_time_jitter (cache->reload_time, 0);
+	msg_debug_cache ("resort symbols cache, next reload in %.2f seconds", tm);
+	g_assert (cache != NULL);
+	evtimer_set (&cache->resort_ev, rspamd_symbols_cache_resort_cb, cache);
+	double_to_tv (tm, &tv);
+	event_add (&cache->resort_ev, &tv);
+
+	if (cache->shared_order == NULL) {
+		return;
+	}
+
+	now = rspamd_get_calendar_ticks ();
+
+	/*
+	 * Only one process per reload period gathers statistics and computes the
+	 * global order, all others just pick it up
+	 */
+	if (now - cache->shared_order->last_resort >= cache->reload_time) {
+		rspamd_mempool_lock_mutex (cache->mtx);
+
+		if (now - cache->shared_order->last_resort >= cache->reload_time) {
+			rspamd_symbols_cache_aggregate_stats (cache);
+			rspamd_symbols_cache_resort (cache);
+			rspamd_symbols_cache_publish_order (cache);
+			cache->shared_order->last_resort = now;
+			rspamd_mempool_unlock_mutex (cache->mtx);
+			msg_debug_cache ("published new symbols order, generation %uL",
+					cache->order_generation);
+
+			return;
+		}
+
+		rspamd_mempool_unlock_mutex (cache->mtx);
+	}
+
+	if (rspamd_symbols_cache_adopt_order (cache)) {
+		msg_debug_cache ("loaded shared symbols order, generation %uL",
+				cache->order_generation);
+	}
 }
 
 void
 rspamd_symbols_cache_start_refresh (struct symbols_cache * cache,
-		struct event_base *ev_base)
+		struct event_base *ev_base, struct rspamd_worker *worker)
 {
 	struct timeval tv;
 	gdouble tm;
 
 	tm = rspamd_time_jitter (cache->reload_time, 0);
 	g_assert (cache != NULL);
+	g_assert (worker != NULL);
+	/*
+	 * Each process writes statistics to its own shard: workers of the same
+	 * type have sequential indices, so they never share a shard unless there
+	 * are more of them than shards. Type is mixed in to spread other workers
+	 */
+	cache->shard = ((worker->type * 0x9E3779B1U) + worker->index) %
+			SYMBOLS_CACHE_STAT_SHARDS;
 	evtimer_set (&cache->resort_ev, rspamd_symbols_cache_resort_cb, cache);
 	event_base_set (ev_base, &cache->resort_ev);
 	double_to_tv (tm, &tv);
@@ -1820,18 +2561,50 @@ rspamd_symbols_cache_inc_frequency (struct symbols_cache *cache,
 	item = g_hash_table_lookup (cache->items_by_symbol, symbol);
 
 	if (item != NULL) {
-		/* We assume ++ as atomic op */
-		item->frequency ++;
-		cache->total_freq ++;
+		rspamd_symbols_cache_account_hit (cache, item);
 
 		/* For virtual symbols we also increase counter for parent */
 		if (item->parent != -1) {
 			parent = g_ptr_array_index (cache->items_by_id, item->parent);
-			parent->frequency ++;
+			rspamd_symbols_cache_account_hit (cache, parent);
 		}
 	}
 }
 
+void
+rspamd_symbols_cache_set_scaled (struct symbols_cache *cache,
+		const gchar *symbol)
+{
+	struct cache_item *item;
+
+	g_assert (cache != NULL);
+
+	item = g_hash_table_lookup (cache->items_by_symbol, symbol);
+
+	if (item != NULL && !item->scaled) {
+		/* Bounds are updated on the next resort */
+		item->scaled = TRUE;
+		msg_info_cache ("symbol %s is inserted with multiplier above one",
+				symbol);
+	}
+}
+
+void
+rspamd_symbols_cache_set_scaled_id (struct symbols_cache *cache,
+		gint id)
+{
+	struct cache_item *item;
+
+	g_assert (cache != NULL);
+
+	if (id < 0 || id >= (gint)cache->items_by_id->len) {
+		return;
+	}
+
+	item = g_ptr_array_index (cache->items_by_id, id);
+	item->scaled = TRUE;
+}
+
 void
 rspamd_symbols_cache_add_dependency (struct symbols_cache *cache,
 		gint id_from, const gchar *to)
@@ -24,6 +24,7 @@
 struct rspamd_task;
 struct rspamd_config;
 struct symbols_cache;
+struct rspamd_worker;
 
 typedef void (*symbol_func_t)(struct rspamd_task *task, gpointer user_data);
 
@@ -165,9 +166,10 @@ ucl_object_t *rspamd_symbols_cache_counters (struct symbols_cache * cache);
  * Start cache reloading
  * @param cache
  * @param ev_base
+ * @param worker worker that selects its statistics shard
  */
 void rspamd_symbols_cache_start_refresh (struct symbols_cache * cache,
-		struct event_base *ev_base);
+		struct event_base *ev_base, struct rspamd_worker *worker);
 
 /**
  * Increases counter for a specific symbol
@@ -177,6 +179,25 @@ void rspamd_symbols_cache_start_refresh (struct symbols_cache * cache,
 void rspamd_symbols_cache_inc_frequency (struct symbols_cache *cache,
 		const gchar *symbol);
 
+/**
+ * Marks symbol as inserted with multiplier above one, so its score is bounded
+ * by `max_symbol_mult` weights when checking whether scan could be stopped early
+ * @param cache
+ * @param symbol
+ */
+void rspamd_symbols_cache_set_scaled (struct symbols_cache *cache,
+		const gchar *symbol);
+
+/**
+ * Marks item as one that could insert symbols with arbitrary multipliers
+ * (e.g. lua callbacks or expressions), so scores of this item and of its
+ * virtual symbols are bounded by `max_symbol_mult` weights
+ * @param cache
+ * @param id
+ */
+void rspamd_symbols_cache_set_scaled_id (struct symbols_cache *cache,
+		gint id);
+
 /**
  * Add dependency relation between two symbols identified by id (source) and
  * a symbolic name (destination). Destination could be virtual or real symbol.
@@ -22,6 +22,7 @@
 #include "email_addr.h"
 #include "composites.h"
 #include "stat_api.h"
+#include "latency.h"
 #include "unix-std.h"
 #include "utlist.h"
 #include <math.h>
@@ -87,8 +88,8 @@ rspamd_task_new (struct rspamd_worker *worker, struct rspamd_config *cfg)
 		(rspamd_mempool_destruct_t) g_hash_table_unref,
 		new_task->results);
 
-	new_task->raw_headers = g_hash_table_new (rspamd_strcase_hash,
-			rspamd_strcase_equal);
+	new_task->raw_headers = rspamd_pool_hash_new_strcase (new_task->task_pool,
+			32);
 	new_task->request_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
 			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
 			rspamd_request_header_dtor);
@@ -101,17 +102,10 @@ rspamd_task_new (struct rspamd_worker *worker, struct rspamd_config *cfg)
 	rspamd_mempool_add_destructor (new_task->task_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_unref,
 		new_task->reply_headers);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->raw_headers);
-	new_task->emails = g_hash_table_new (rspamd_url_hash, rspamd_emails_cmp);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->emails);
-	new_task->urls = g_hash_table_new (rspamd_url_hash, rspamd_urls_cmp);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->urls);
+	new_task->emails = rspamd_pool_hash_new (new_task->task_pool,
+			rspamd_url_hash, rspamd_emails_cmp, 0);
+	new_task->urls = rspamd_pool_hash_new (new_task->task_pool,
+			rspamd_url_hash, rspamd_urls_cmp, 0);
 	new_task->parts = g_ptr_array_sized_new (4);
 	rspamd_mempool_add_destructor (new_task->task_pool,
 			rspamd_ptr_array_free_hard, new_task->parts);
@@ -197,14 +191,13 @@ rspamd_task_free (struct rspamd_task *task)
 
 		for (i = 0; i < task->parts->len; i ++) {
 			p = g_ptr_array_index (task->parts, i);
-			g_byte_array_free (p->content, TRUE);
 
-			if (p->raw_headers_str) {
-				g_free (p->raw_headers_str);
+			if (p->content) {
+				g_byte_array_free (p->content, TRUE);
 			}
 
-			if (p->raw_headers) {
-				g_hash_table_unref (p->raw_headers);
+			if (p->raw_headers_str) {
+				g_free (p->raw_headers_str);
 			}
 		}
 
@@ -546,6 +539,36 @@ rspamd_task_select_processing_stage (struct rspamd_task *task, guint stages)
 	return RSPAMD_TASK_STAGE_DONE;
 }
 
+/*
+ * Accounts wall clock time of the current stage (including asynchronous
+ * events) and, if the task is finished, the total time of processing
+ */
+static void
+rspamd_task_account_latency (struct rspamd_task *task, gboolean finished)
+{
+	struct rspamd_latency_stat *lat;
+	gdouble now;
+
+	if (task->worker == NULL || task->worker->srv == NULL ||
+			(lat = task->worker->srv->latency) == NULL) {
+		return;
+	}
+
+	now = rspamd_get_ticks ();
+
+	if (task->cur_stage != 0 && task->cur_stage != RSPAMD_TASK_STAGE_DONE) {
+		rspamd_latency_stat_add_stage (lat, task->cur_stage,
+				now - task->stage_start);
+	}
+
+	task->cur_stage = 0;
+
+	if (finished) {
+		rspamd_latency_stat_add_stage (lat, RSPAMD_TASK_STAGE_DONE,
+				now - task->time_real);
+	}
+}
+
 gboolean
 rspamd_task_process (struct rspamd_task *task, guint stages)
 {
@@ -565,6 +588,7 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 	if (task->pre_result.action != METRIC_ACTION_MAX) {
 		/* Skip all if we have result here */
 		task->processed_stages |= RSPAMD_TASK_STAGE_DONE;
+		rspamd_task_account_latency (task, TRUE);
 		msg_info_task ("skip filters, as pre-filter returned %s action",
 				rspamd_action_to_str (task->pre_result.action));
 		return TRUE;
@@ -574,6 +598,11 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 
 	st = rspamd_task_select_processing_stage (task, stages);
 
+	if (task->cur_stage != (guint)st) {
+		task->cur_stage = st;
+		task->stage_start = rspamd_get_ticks ();
+	}
+
 	switch (st) {
 	case RSPAMD_TASK_STAGE_READ_MESSAGE:
 		if (!rspamd_message_parse (task)) {
@@ -670,6 +699,7 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 			task->processed_stages |= RSPAMD_TASK_STAGE_DONE;
 		}
 
+		rspamd_task_account_latency (task, TRUE);
 		msg_debug_task ("task is processed");
 
 		return ret;
@@ -683,6 +713,7 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 		/* Mark the current stage as done and go to the next stage */
 		msg_debug_task ("completed stage %d", st);
 		task->processed_stages |= st;
+		rspamd_task_account_latency (task, FALSE);
 
 		/* Tail recursion */
 		return rspamd_task_process (task, stages);
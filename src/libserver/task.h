@@ -21,6 +21,7 @@
 #include "events.h"
 #include "util.h"
 #include "mem_pool.h"
+#include "pool_hash.h"
 #include "dns.h"
 #include "re_cache.h"
 
@@ -104,6 +105,8 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_FLAG_HAS_HAM_TOKENS (1 << 21)
 #define RSPAMD_TASK_FLAG_EMPTY (1 << 22)
 #define RSPAMD_TASK_FLAG_LOCAL_CLIENT (1 << 23)
+#define RSPAMD_TASK_FLAG_LARGE (1 << 24)
+#define RSPAMD_TASK_FLAG_KEEPALIVE (1 << 25)
 
 #define RSPAMD_TASK_IS_SKIPPED(task) (((task)->flags & RSPAMD_TASK_FLAG_SKIP))
 #define RSPAMD_TASK_IS_JSON(task) (((task)->flags & RSPAMD_TASK_FLAG_JSON))
@@ -111,6 +114,7 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_IS_PROCESSED(task) (((task)->processed_stages & RSPAMD_TASK_STAGE_DONE))
 #define RSPAMD_TASK_IS_CLASSIFIED(task) (((task)->processed_stages & RSPAMD_TASK_STAGE_CLASSIFIERS))
 #define RSPAMD_TASK_IS_EMPTY(task) (((task)->flags & RSPAMD_TASK_FLAG_EMPTY))
+#define RSPAMD_TASK_IS_LARGE(task) (((task)->flags & RSPAMD_TASK_FLAG_LARGE))
 
 struct rspamd_email_address;
 
@@ -149,9 +153,9 @@ struct rspamd_task {
 		const gchar *body_start;
 	} raw_headers_content;				/**< list of raw headers							*/
 	GPtrArray *received;							/**< list of received headers						*/
-	GHashTable *urls;								/**< list of parsed urls							*/
-	GHashTable *emails;								/**< list of parsed emails							*/
-	GHashTable *raw_headers;						/**< list of raw headers							*/
+	rspamd_pool_hash_t *urls;						/**< list of parsed urls							*/
+	rspamd_pool_hash_t *emails;						/**< list of parsed emails							*/
+	rspamd_pool_hash_t *raw_headers;						/**< list of raw headers							*/
 	GHashTable *results;							/**< hash table of metric_result indexed by
 													 *    metric's name									*/
 	GPtrArray *tokens;								/**< statistics tokens */
@@ -169,6 +173,8 @@ struct rspamd_task {
 	rspamd_mempool_t *task_pool;					/**< memory pool for task							*/
 	double time_real;
 	double time_virtual;
+	double stage_start;								/**< time when the current stage has been started	*/
+	guint cur_stage;								/**< stage that is being processed					*/
 	struct timeval tv;
 	gboolean (*fin_callback)(struct rspamd_task *task, void *arg);
 													/**< calback for filters finalizing					*/
@@ -48,6 +48,14 @@
 #include "http.h"
 #include "multipattern.h"
 #include "http_parser.h"
+#include "cryptobox.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 typedef struct url_match_s {
 	const gchar *m_begin;
@@ -171,8 +179,15 @@ struct url_callback_data {
 struct url_match_scanner {
 	GArray *matchers;
 	struct rspamd_multipattern *search_trie;
+	GHashTable *tld_labels;
+	gsize max_patlen;
 };
 
+/* Longer labels are not checked by the fast TLD filter */
+#define URL_TLD_LABEL_MAX 64
+/* Trie windows around anchors that are closer than this are merged */
+#define URL_ANCHOR_MERGE_GAP 64
+
 struct url_match_scanner *url_scanner = NULL;
 
 enum {
@@ -340,6 +355,29 @@ rspamd_url_strerror (enum uri_errno err)
 	return NULL;
 }
 
+/* Remembers the last label of TLD pattern used by the fast TLD filter */
+static void
+rspamd_url_add_tld_label (struct url_match_scanner *scanner,
+		const gchar *pattern)
+{
+	const gchar *label;
+	gchar *key;
+
+	label = strrchr (pattern, '.');
+	label = label ? label + 1 : pattern;
+
+	if (*label == '\0' || *label == '*' ||
+			strlen (label) >= URL_TLD_LABEL_MAX) {
+		return;
+	}
+
+	if (!g_hash_table_lookup (scanner->tld_labels, label)) {
+		key = g_strdup (label);
+		rspamd_str_lc (key, strlen (key));
+		g_hash_table_insert (scanner->tld_labels, key, key);
+	}
+}
+
 static void
 rspamd_url_parse_tld_file (const gchar *fname,
 		struct url_match_scanner *scanner)
@@ -397,11 +435,14 @@ rspamd_url_parse_tld_file (const gchar *fname,
 #endif
 
 		m.flags = flags;
+		rspamd_url_add_tld_label (scanner, linebuf);
 		rspamd_multipattern_add_pattern (url_scanner->search_trie, p,
 				RSPAMD_MULTIPATTERN_TLD | RSPAMD_MULTIPATTERN_ICASE);
 		m.pattern = rspamd_multipattern_get_pattern (url_scanner->search_trie,
 				rspamd_multipattern_get_npatterns (url_scanner->search_trie) - 1);
 		m.patlen = strlen (m.pattern);
+		/* TLD patterns are prefixed with a dot by the trie */
+		scanner->max_patlen = MAX (scanner->max_patlen, m.patlen + 1);
 		g_array_append_val (url_scanner->matchers, m);
 	}
 
@@ -427,6 +468,7 @@ rspamd_url_add_static_matchers (struct url_match_scanner *sc)
 		}
 
 		static_matchers[i].patlen = strlen (static_matchers[i].pattern);
+		sc->max_patlen = MAX (sc->max_patlen, static_matchers[i].patlen);
 	}
 
 	g_array_append_vals (sc->matchers, static_matchers, n);
@@ -443,6 +485,9 @@ rspamd_url_init (const gchar *tld_file)
 				sizeof (struct url_matcher), 512);
 		url_scanner->search_trie = rspamd_multipattern_create_sized (512,
 				RSPAMD_MULTIPATTERN_TLD | RSPAMD_MULTIPATTERN_ICASE);
+		url_scanner->tld_labels = g_hash_table_new_full (rspamd_strcase_hash,
+				rspamd_strcase_equal, g_free, NULL);
+		url_scanner->max_patlen = 0;
 		rspamd_url_add_static_matchers (url_scanner);
 
 		if (tld_file != NULL) {
@@ -455,8 +500,9 @@ rspamd_url_init (const gchar *tld_file)
 			g_error_free (err);
 		}
 
-		msg_debug ("initialized trie of %ud elements",
-				url_scanner->matchers->len);
+		msg_debug ("initialized trie of %ud elements, %ud tld labels",
+				url_scanner->matchers->len,
+				g_hash_table_size (url_scanner->tld_labels));
 	}
 }
 
@@ -1156,6 +1202,79 @@ rspamd_tld_trie_callback (struct rspamd_multipattern *mp,
 	return 0;
 }
 
+/*
+ * Checks if the last label of host is the last label of some known TLD: if it
+ * is not, then the TLD trie cannot match anything and we can skip it
+ */
+static gboolean
+rspamd_url_tld_label_known (const gchar *host, gsize hostlen)
+{
+	gchar label[URL_TLD_LABEL_MAX];
+	const gchar *p, *end;
+
+	if (g_hash_table_size (url_scanner->tld_labels) == 0) {
+		/* No TLD file, so we cannot filter anything */
+		return TRUE;
+	}
+
+	end = host + hostlen;
+
+	if (end > host && *(end - 1) == '.') {
+		/* Dot at the end of domain */
+		end --;
+	}
+
+	p = end;
+
+	while (p > host && *(p - 1) != '.') {
+		p --;
+	}
+
+	if (p == end || p == host) {
+		/* Empty label or host without dots cannot have TLD */
+		return FALSE;
+	}
+
+	if (end - p >= URL_TLD_LABEL_MAX) {
+		return TRUE;
+	}
+
+	memcpy (label, p, end - p);
+	label[end - p] = '\0';
+
+	return g_hash_table_lookup (url_scanner->tld_labels, label) != NULL;
+}
+
+/*
+ * Checks raw host before url components are decoded: returns TRUE if the host
+ * can neither have a known TLD nor be numeric. Hosts that might change after
+ * decoding or could be numeric are left for the full check
+ */
+static gboolean
+rspamd_url_host_tld_unknown (const gchar *host, gsize hostlen)
+{
+	const gchar *p, *end = host + hostlen, *label = host;
+
+	for (p = host; p < end; p ++) {
+		if (*p == '%' || (*p & 0x80)) {
+			return FALSE;
+		}
+		else if (*p == '.' && p + 1 < end) {
+			label = p + 1;
+		}
+	}
+
+	for (p = label; p < end; p ++) {
+		if (!g_ascii_isxdigit (*p) && *p != 'x' && *p != 'X' &&
+				*p != '.' && *p != ':' && *p != '[' && *p != ']') {
+			return !rspamd_url_tld_label_known (host, hostlen);
+		}
+	}
+
+	/* Might be an IP address */
+	return FALSE;
+}
+
 static gboolean
 rspamd_url_is_ip (struct rspamd_url *uri, rspamd_mempool_t *pool)
 {
@@ -1486,6 +1605,13 @@ rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 		return URI_ERRNO_BAD_FORMAT;
 	}
 
+	if ((u.field_set & (1 << UF_HOST)) &&
+			rspamd_url_host_tld_unknown (uristring + u.field_data[UF_HOST].off,
+					u.field_data[UF_HOST].len)) {
+		/* Do not copy and decode url that is rejected anyway */
+		return URI_ERRNO_TLD_MISSING;
+	}
+
 	if (end > uristring && (guint) (end - uristring) != len) {
 		/* We have extra data at the end of uri, so we are ignoring it for now */
 		p = rspamd_mempool_alloc (pool, end - uristring + 1);
@@ -1577,9 +1703,11 @@ rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 	}
 
 	/* Find TLD part */
-	rspamd_multipattern_lookup (url_scanner->search_trie,
+	if (rspamd_url_tld_label_known (uri->host, uri->hostlen)) {
+		rspamd_multipattern_lookup (url_scanner->search_trie,
 				uri->host, uri->hostlen,
 				rspamd_tld_trie_callback, uri, NULL);
+	}
 
 	if (uri->tldlen == 0) {
 		/* Ignore URL's without TLD if it is not a numeric URL */
@@ -1884,13 +2012,21 @@ url_web_end (struct url_callback_data *cb,
 {
 	const gchar *last = NULL;
 	gint len = cb->end - pos;
+	struct http_parser_url u;
 
 	if (match->newline_pos && match->st != '<') {
 		/* We should also limit our match end to the newline */
 		len = MIN (len, match->newline_pos - pos);
 	}
 
-	if (rspamd_web_parse (NULL, pos, len, &last, FALSE) != 0) {
+	if (rspamd_web_parse (&u, pos, len, &last, FALSE) != 0) {
+		return FALSE;
+	}
+
+	if ((u.field_set & (1 << UF_HOST)) &&
+			rspamd_url_host_tld_unknown (pos + u.field_data[UF_HOST].off,
+					u.field_data[UF_HOST].len)) {
+		/* Such url would be rejected by rspamd_url_parse, so skip it early */
 		return FALSE;
 	}
 
@@ -2102,7 +2238,7 @@ rspamd_url_trie_callback (struct rspamd_multipattern *mp,
 	m.prefix = matcher->prefix;
 	m.add_prefix = FALSE;
 	m.newline_pos = newline_pos;
-	pos = cb->begin + match_start;
+	pos = text + match_start;
 
 	if (matcher->start (cb, pos, &m) &&
 			matcher->end (cb, pos, &m)) {
@@ -2134,6 +2270,120 @@ rspamd_url_trie_callback (struct rspamd_multipattern *mp,
 	return 0;
 }
 
+/*
+ * Each url candidate contains at least one of '.', '@' or ':': schemas end
+ * with ':', both `www.` prefix and TLD patterns contain dot and emails contain
+ * '@'. Returns the first such character in [p, end) or NULL
+ */
+static const gchar *
+rspamd_url_next_anchor (const gchar *p, const gchar *end)
+{
+	const guchar *s = (const guchar *)p, *e = (const guchar *)end;
+#ifdef __AVX2__
+	const __m256i dot32 = _mm256_set1_epi8 ('.'), at32 = _mm256_set1_epi8 ('@'),
+			colon32 = _mm256_set1_epi8 (':');
+	__m256i v32;
+#endif
+#ifdef __SSE2__
+	const __m128i dot16 = _mm_set1_epi8 ('.'), at16 = _mm_set1_epi8 ('@'),
+			colon16 = _mm_set1_epi8 (':');
+	__m128i v16;
+#endif
+	guint mask;
+
+#ifdef __AVX2__
+	while (e - s >= 32) {
+		v32 = _mm256_loadu_si256 ((const __m256i *)s);
+		v32 = _mm256_or_si256 (_mm256_or_si256 (
+				_mm256_cmpeq_epi8 (v32, dot32),
+				_mm256_cmpeq_epi8 (v32, at32)),
+				_mm256_cmpeq_epi8 (v32, colon32));
+		mask = _mm256_movemask_epi8 (v32);
+
+		if (mask != 0) {
+			return (const gchar *)(s + __builtin_ctz (mask));
+		}
+
+		s += 32;
+	}
+#endif
+#ifdef __SSE2__
+	while (e - s >= 16) {
+		v16 = _mm_loadu_si128 ((const __m128i *)s);
+		v16 = _mm_or_si128 (_mm_or_si128 (
+				_mm_cmpeq_epi8 (v16, dot16),
+				_mm_cmpeq_epi8 (v16, at16)),
+				_mm_cmpeq_epi8 (v16, colon16));
+		mask = _mm_movemask_epi8 (v16);
+
+		if (mask != 0) {
+			return (const gchar *)(s + __builtin_ctz (mask));
+		}
+
+		s += 16;
+	}
+#endif
+
+	(void)mask;
+
+	while (s < e) {
+		if (*s == '.' || *s == '@' || *s == ':') {
+			return (const gchar *)s;
+		}
+
+		s ++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Runs the trie over windows of text around anchors only: any match contains
+ * an anchor, so it cannot start or end further than the longest pattern from
+ * it. Close windows are merged to avoid too many trie invocations. Callbacks
+ * get window as text, so they must use `cb->begin` and `cb->end` for bounds
+ * and `text + match_start` for positions
+ */
+static gint
+rspamd_url_lookup_anchors (struct url_callback_data *cb,
+		rspamd_multipattern_cb_t func)
+{
+	const gchar *anchor, *wstart, *wend, *prev_end = cb->begin;
+	gsize radius = url_scanner->max_patlen;
+	gint ret;
+
+	anchor = rspamd_url_next_anchor (cb->begin, cb->end);
+
+	while (anchor != NULL) {
+		wstart = anchor - MIN (radius, (gsize)(anchor - prev_end));
+		wend = anchor + MIN (radius, (gsize)(cb->end - anchor));
+
+		for (;;) {
+			/* Anchors before wend - radius are already covered */
+			anchor = rspamd_url_next_anchor (
+					MAX (anchor + 1, wend - radius), cb->end);
+
+			if (anchor == NULL ||
+					anchor - wend > (gssize)(radius + URL_ANCHOR_MERGE_GAP)) {
+				break;
+			}
+
+			wend = anchor + MIN (radius, (gsize)(cb->end - anchor));
+		}
+
+		ret = rspamd_multipattern_lookup (url_scanner->search_trie,
+				wstart, wend - wstart, func, cb, NULL);
+
+		if (ret != 0) {
+			return ret;
+		}
+
+		prev_end = wend;
+	}
+
+	return 0;
+}
+
 gboolean
 rspamd_url_find (rspamd_mempool_t *pool,
 		const gchar *begin,
@@ -2150,8 +2400,7 @@ rspamd_url_find (rspamd_mempool_t *pool,
 	cb.is_html = is_html;
 	cb.pool = pool;
 
-	ret = rspamd_multipattern_lookup (url_scanner->search_trie, begin, len,
-			rspamd_url_trie_callback, &cb, NULL);
+	ret = rspamd_url_lookup_anchors (&cb, rspamd_url_trie_callback);
 
 	if (ret) {
 		if (url_str) {
@@ -2164,6 +2413,74 @@ rspamd_url_find (rspamd_mempool_t *pool,
 	return FALSE;
 }
 
+/*
+ * Url candidates that have been already parsed in the memory pool: the same
+ * link is usually repeated many times in a message, so its next occurrences
+ * are resolved to the already parsed url without copying and parsing it again
+ */
+struct rspamd_url_arena_key {
+	const gchar *prefix;
+	const gchar *str;
+	gsize prefixlen;
+	gsize len;
+	guint64 hash;
+};
+
+/* Marks candidates that cannot be parsed */
+static gchar url_arena_bad;
+
+static guint
+rspamd_url_arena_hash (gconstpointer k)
+{
+	const struct rspamd_url_arena_key *key = k;
+
+	return key->hash;
+}
+
+static gboolean
+rspamd_url_arena_equal (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_url_arena_key *k1 = a, *k2 = b;
+
+	return k1->hash == k2->hash &&
+			k1->len == k2->len && k1->prefixlen == k2->prefixlen &&
+			memcmp (k1->prefix, k2->prefix, k1->prefixlen) == 0 &&
+			memcmp (k1->str, k2->str, k1->len) == 0;
+}
+
+static rspamd_pool_hash_t *
+rspamd_url_arena_get (rspamd_mempool_t *pool)
+{
+	rspamd_pool_hash_t *arena;
+
+	arena = rspamd_mempool_get_variable (pool, "url_arena");
+
+	if (arena == NULL) {
+		arena = rspamd_pool_hash_new (pool, rspamd_url_arena_hash,
+				rspamd_url_arena_equal, 0);
+		rspamd_mempool_set_variable (pool, "url_arena", arena, NULL);
+	}
+
+	return arena;
+}
+
+static void
+rspamd_url_arena_key_init (struct rspamd_url_arena_key *key,
+		const gchar *prefix, const gchar *str, gsize len)
+{
+	rspamd_cryptobox_fast_hash_state_t st;
+
+	key->prefix = prefix;
+	key->prefixlen = strlen (prefix);
+	key->str = str;
+	key->len = len;
+
+	rspamd_cryptobox_fast_hash_init (&st, rspamd_hash_seed ());
+	rspamd_cryptobox_fast_hash_update (&st, prefix, key->prefixlen);
+	rspamd_cryptobox_fast_hash_update (&st, str, len);
+	key->hash = rspamd_cryptobox_fast_hash_final (&st);
+}
+
 static gint
 rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 		guint strnum,
@@ -2176,6 +2493,8 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 {
 	struct rspamd_url *url;
 	struct url_matcher *matcher;
+	struct rspamd_url_arena_key key, *pkey;
+	rspamd_pool_hash_t *arena;
 	url_match_t m;
 	const gchar *pos, *newline_pos = NULL;
 	struct url_callback_data *cb = context;
@@ -2212,11 +2531,11 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 		}
 	}
 
-	if (!rspamd_url_trie_is_match (matcher, pos, text + len, newline_pos)) {
+	if (!rspamd_url_trie_is_match (matcher, pos, cb->end, newline_pos)) {
 		return 0;
 	}
 
-	pos = cb->begin + match_start;
+	pos = text + match_start;
 	m.pattern = matcher->pattern;
 	m.prefix = matcher->prefix;
 	m.add_prefix = FALSE;
@@ -2226,8 +2545,26 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 
 	if (matcher->start (cb, pos, &m) &&
 			matcher->end (cb, pos, &m)) {
-		if (m.add_prefix || matcher->prefix[0] != '\0') {
-			cb->len = m.m_len + strlen (matcher->prefix);
+		cb->start = m.m_begin;
+		cb->fin = m.m_begin + m.m_len;
+		arena = rspamd_url_arena_get (pool);
+		rspamd_url_arena_key_init (&key,
+				(m.add_prefix || matcher->prefix[0] != '\0') ? m.prefix : "",
+				m.m_begin, m.m_len);
+		url = rspamd_pool_hash_lookup (arena, &key);
+
+		if (url != NULL) {
+			/* Already seen in this pool */
+			if (url != (struct rspamd_url *)&url_arena_bad && cb->func) {
+				cb->func (url, cb->start - cb->begin, cb->fin - cb->begin,
+						cb->funcd);
+			}
+
+			return !multiple;
+		}
+
+		if (key.prefixlen > 0) {
+			cb->len = m.m_len + key.prefixlen;
 			cb->url_str = rspamd_mempool_alloc (cb->pool, cb->len + 1);
 			cb->len = rspamd_snprintf (cb->url_str,
 					cb->len + 1,
@@ -2241,21 +2578,32 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 			cb->len = rspamd_strlcpy (cb->url_str, m.m_begin, m.m_len + 1);
 		}
 
-		cb->start = m.m_begin;
-		cb->fin = m.m_begin + m.m_len;
+		/* Key must outlive the text that is being scanned */
+		pkey = rspamd_mempool_alloc (pool, sizeof (*pkey));
+		memcpy (pkey, &key, sizeof (*pkey));
+		pkey->str = rspamd_mempool_alloc (pool, m.m_len);
+		memcpy ((gchar *)pkey->str, m.m_begin, m.m_len);
+
 		url = rspamd_mempool_alloc0 (pool, sizeof (struct rspamd_url));
 		g_strstrip (cb->url_str);
 		rc = rspamd_url_parse (url, cb->url_str, strlen (cb->url_str), pool);
 
 		if (rc == URI_ERRNO_OK && url->hostlen > 0) {
+			rspamd_pool_hash_insert (arena, pkey, url);
+
 			if (cb->func) {
-				cb->func (url, cb->start - text, cb->fin - text, cb->funcd);
+				cb->func (url, cb->start - cb->begin, cb->fin - cb->begin,
+						cb->funcd);
 			}
 		}
-		else if (rc != URI_ERRNO_OK) {
-			msg_debug_pool_check ("extract of url '%s' failed: %s",
-					cb->url_str,
-					rspamd_url_strerror (rc));
+		else {
+			rspamd_pool_hash_insert (arena, pkey, &url_arena_bad);
+
+			if (rc != URI_ERRNO_OK) {
+				msg_debug_pool_check ("extract of url '%s' failed: %s",
+						cb->url_str,
+						rspamd_url_strerror (rc));
+			}
 		}
 	}
 	else {
@@ -2305,7 +2653,7 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 	struct rspamd_process_exception *ex;
 	struct rspamd_task *task;
 	gchar *url_str = NULL;
-	struct rspamd_url *query_url;
+	struct rspamd_url *query_url, *existing = NULL;
 	gint rc;
 
 	task = cbd->task;
@@ -2317,15 +2665,19 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 
 	if (url->protocol == PROTOCOL_MAILTO) {
 		if (url->userlen > 0) {
-			if (!g_hash_table_lookup (task->emails, url)) {
-				g_hash_table_insert (task->emails, url,
+			existing = rspamd_pool_hash_lookup (task->emails, url);
+
+			if (!existing) {
+				rspamd_pool_hash_insert (task->emails, url,
 						url);
 			}
 		}
 	}
 	else {
-		if (!g_hash_table_lookup (task->urls, url)) {
-			g_hash_table_insert (task->urls, url, url);
+		existing = rspamd_pool_hash_lookup (task->urls, url);
+
+		if (!existing) {
+			rspamd_pool_hash_insert (task->urls, url, url);
 		}
 	}
 
@@ -2333,8 +2685,11 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 			cbd->part->exceptions,
 			ex);
 
-	/* We also search the query for additional url inside */
-	if (url->querylen > 0) {
+	/*
+	 * We also search the query for additional url inside, unless the same
+	 * url has been already processed
+	 */
+	if (url->querylen > 0 && existing == NULL) {
 		if (rspamd_url_find (task->task_pool,
 				url->query,
 				url->querylen,
@@ -2353,9 +2708,9 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 				msg_debug_task ("found url %s in query of url"
 						" %*s", url_str, url->querylen, url->query);
 
-				if (!g_hash_table_lookup (task->urls,
+				if (!rspamd_pool_hash_lookup (task->urls,
 						query_url)) {
-					g_hash_table_insert (task->urls,
+					rspamd_pool_hash_insert (task->urls,
 							query_url,
 							query_url);
 				}
@@ -2415,9 +2770,7 @@ rspamd_url_find_multiple (rspamd_mempool_t *pool, const gchar *in,
 	cb.func = func;
 	cb.newlines = nlines;
 
-	rspamd_multipattern_lookup (url_scanner->search_trie, in,
-			inlen,
-			rspamd_url_trie_generic_callback_multiple, &cb, NULL);
+	rspamd_url_lookup_anchors (&cb, rspamd_url_trie_generic_callback_multiple);
 }
 
 void
@@ -2442,9 +2795,7 @@ rspamd_url_find_single (rspamd_mempool_t *pool, const gchar *in,
 	cb.funcd = ud;
 	cb.func = func;
 
-	rspamd_multipattern_lookup (url_scanner->search_trie, in,
-			inlen,
-			rspamd_url_trie_generic_callback_single, &cb, NULL);
+	rspamd_url_lookup_anchors (&cb, rspamd_url_trie_generic_callback_single);
 }
 
 
@@ -2454,25 +2805,32 @@ rspamd_url_task_callback (struct rspamd_url *url, gsize start_offset,
 {
 	struct rspamd_task *task = ud;
 	gchar *url_str = NULL;
-	struct rspamd_url *query_url;
+	struct rspamd_url *query_url, *existing = NULL;
 	gint rc;
 
 	if (url->protocol == PROTOCOL_MAILTO) {
 		if (url->userlen > 0) {
-			if (!g_hash_table_lookup (task->emails, url)) {
-				g_hash_table_insert (task->emails, url,
+			existing = rspamd_pool_hash_lookup (task->emails, url);
+
+			if (!existing) {
+				rspamd_pool_hash_insert (task->emails, url,
 						url);
 			}
 		}
 	}
 	else {
-		if (!g_hash_table_lookup (task->urls, url)) {
-			g_hash_table_insert (task->urls, url, url);
+		existing = rspamd_pool_hash_lookup (task->urls, url);
+
+		if (!existing) {
+			rspamd_pool_hash_insert (task->urls, url, url);
 		}
 	}
 
-	/* We also search the query for additional url inside */
-	if (url->querylen > 0) {
+	/*
+	 * We also search the query for additional url inside, unless the same
+	 * url has been already processed
+	 */
+	if (url->querylen > 0 && existing == NULL) {
 		if (rspamd_url_find (task->task_pool,
 				url->query,
 				url->querylen,
@@ -2491,9 +2849,9 @@ rspamd_url_task_callback (struct rspamd_url *url, gsize start_offset,
 				msg_debug_task ("found url %s in query of url"
 						" %*s", url_str, url->querylen, url->query);
 
-				if (!g_hash_table_lookup (task->urls,
+				if (!rspamd_pool_hash_lookup (task->urls,
 						query_url)) {
-					g_hash_table_insert (task->urls,
+					rspamd_pool_hash_insert (task->urls,
 							query_url,
 							query_url);
 				}
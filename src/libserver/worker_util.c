@@ -538,6 +538,12 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 	wrk->ctx = cf->ctx;
 	wrk->finish_actions = g_ptr_array_new ();
 
+	if (rspamd_main->cfg->log_ring_size > 0 &&
+			rspamd_main->cfg->log_type != RSPAMD_LOG_SYSLOG) {
+		/* Worker's log lines are written by the main process */
+		wrk->log_ring = rspamd_log_ring_new (rspamd_main->cfg->log_ring_size);
+	}
+
 	wrk->pid = fork ();
 
 	switch (wrk->pid) {
@@ -572,6 +578,7 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		/* Do silent log reopen to avoid collisions */
 		rspamd_log_close (rspamd_main->logger);
 		rspamd_log_open (rspamd_main->logger);
+		rspamd_log_set_ring (rspamd_main->logger, wrk->log_ring);
 		wrk->start_time = rspamd_get_calendar_ticks ();
 
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
@@ -19,6 +19,22 @@
 
 #define CHAIN_LENGTH 128
 
+/*
+ * Bucketized cuckoo layout (statfile version 1.3): blocks are grouped into
+ * cache line sized buckets and each token may live in one of two buckets
+ */
+#define STATFILE_BUCKET_SIZE 64
+#define STATFILE_BUCKET_BLOCKS (STATFILE_BUCKET_SIZE / sizeof (struct stat_file_block))
+#define STATFILE_MAX_KICKS 32
+/* How many tokens ahead we prefetch buckets in batched lookups */
+#define STATFILE_PREFETCH_DISTANCE 8
+
+#if defined(__GNUC__)
+# define STATFILE_PREFETCH(p) __builtin_prefetch ((p), 0, 1)
+#else
+# define STATFILE_PREFETCH(p) (void)(p)
+#endif
+
 /* Section types */
 #define STATFILE_SECTION_COMMON 1
 
@@ -79,11 +95,14 @@ typedef struct {
 	off_t seek_pos;                         /**< current seek position				*/
 	struct stat_file_section cur_section;   /**< current section					*/
 	size_t len;                             /**< length of file(in bytes)			*/
+	guint64 nbuckets;                       /**< number of buckets (cuckoo layout)	*/
+	gboolean bucketized;                    /**< file uses cuckoo layout			*/
 	struct rspamd_statfile_config *cf;
 } rspamd_mmaped_file_t;
 
 
-#define RSPAMD_STATFILE_VERSION {'1', '2'}
+#define RSPAMD_STATFILE_VERSION {'1', '3'}
+#define RSPAMD_STATFILE_VERSION_CHAINED {'1', '2'}
 #define BACKUP_SUFFIX ".old"
 
 static void rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
@@ -99,8 +118,45 @@ gint rspamd_mmaped_file_create (const gchar *filename, size_t size,
 gint rspamd_mmaped_file_close_file (rspamd_mempool_t *pool,
 		rspamd_mmaped_file_t * file);
 
-double
-rspamd_mmaped_file_get_block (rspamd_mmaped_file_t * file,
+static inline gsize
+rspamd_mmaped_file_data_offset (gboolean bucketized)
+{
+	gsize off = sizeof (struct stat_file_header) +
+			sizeof (struct stat_file_section);
+
+	if (bucketized) {
+		/* Align buckets to cache lines */
+		off = (off + STATFILE_BUCKET_SIZE - 1) & ~(STATFILE_BUCKET_SIZE - 1);
+	}
+
+	return off;
+}
+
+static inline struct stat_file_block *
+rspamd_mmaped_file_bucket (rspamd_mmaped_file_t *file, guint64 bucket)
+{
+	return (struct stat_file_block *)((u_char *)file->map + file->seek_pos +
+			bucket * STATFILE_BUCKET_SIZE);
+}
+
+static inline void
+rspamd_mmaped_file_buckets_for (rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2, guint64 *b1, guint64 *b2)
+{
+	guint64 alt;
+
+	*b1 = h1 % file->nbuckets;
+	/* Alternative bucket depends on both hashes, so it can be recalculated */
+	alt = ((guint64)h2 ^ ((guint64)h1 << 32)) * 0x9E3779B97F4A7C15ULL;
+	*b2 = (alt >> 16) % file->nbuckets;
+
+	if (*b2 == *b1) {
+		*b2 = (*b1 + 1) % file->nbuckets;
+	}
+}
+
+static double
+rspamd_mmaped_file_get_block_chained (rspamd_mmaped_file_t * file,
 	guint32 h1,
 	guint32 h2)
 {
@@ -108,10 +164,6 @@ rspamd_mmaped_file_get_block (rspamd_mmaped_file_t * file,
 	guint i, blocknum;
 	u_char *c;
 
-	if (!file->map) {
-		return 0;
-	}
-
 	blocknum = h1 % file->cur_section.length;
 	c = (u_char *) file->map + file->seek_pos + blocknum *
 		sizeof (struct stat_file_block);
@@ -132,8 +184,122 @@ rspamd_mmaped_file_get_block (rspamd_mmaped_file_t * file,
 	return 0;
 }
 
+static double
+rspamd_mmaped_file_get_block_bucketized (rspamd_mmaped_file_t * file,
+	guint32 h1,
+	guint32 h2)
+{
+	struct stat_file_block *bucket;
+	guint64 b1, b2;
+	guint i;
+
+	rspamd_mmaped_file_buckets_for (file, h1, h2, &b1, &b2);
+	bucket = rspamd_mmaped_file_bucket (file, b1);
+
+	for (i = 0; i < STATFILE_BUCKET_BLOCKS; i++) {
+		if (bucket[i].hash1 == h1 && bucket[i].hash2 == h2) {
+			return bucket[i].value;
+		}
+	}
+
+	bucket = rspamd_mmaped_file_bucket (file, b2);
+
+	for (i = 0; i < STATFILE_BUCKET_BLOCKS; i++) {
+		if (bucket[i].hash1 == h1 && bucket[i].hash2 == h2) {
+			return bucket[i].value;
+		}
+	}
+
+	return 0;
+}
+
+double
+rspamd_mmaped_file_get_block (rspamd_mmaped_file_t * file,
+	guint32 h1,
+	guint32 h2)
+{
+	if (!file->map) {
+		return 0;
+	}
+
+	if (file->bucketized) {
+		return rspamd_mmaped_file_get_block_bucketized (file, h1, h2);
+	}
+
+	return rspamd_mmaped_file_get_block_chained (file, h1, h2);
+}
+
+static inline void
+rspamd_mmaped_file_prefetch_token (rspamd_mmaped_file_t *file,
+		rspamd_token_t *tok)
+{
+	guint32 h1, h2;
+	guint64 b1, b2;
+
+	memcpy (&h1, tok->data, sizeof (h1));
+	memcpy (&h2, tok->data + sizeof (h1), sizeof (h2));
+
+	if (file->bucketized) {
+		rspamd_mmaped_file_buckets_for (file, h1, h2, &b1, &b2);
+		STATFILE_PREFETCH (rspamd_mmaped_file_bucket (file, b1));
+		STATFILE_PREFETCH (rspamd_mmaped_file_bucket (file, b2));
+	}
+	else {
+		STATFILE_PREFETCH ((u_char *)file->map + file->seek_pos +
+				(h1 % file->cur_section.length) *
+				sizeof (struct stat_file_block));
+	}
+}
+
+/*
+ * Resolves all tokens in a batch: buckets for the next tokens are prefetched
+ * while the current one is being resolved, so cache misses are overlapped
+ */
 static void
-rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
+rspamd_mmaped_file_get_blocks (rspamd_mmaped_file_t *file,
+		GPtrArray *tokens, gint id)
+{
+	rspamd_token_t *tok;
+	guint32 h1, h2;
+	guint i;
+
+	if (!file->map) {
+		for (i = 0; i < tokens->len; i++) {
+			tok = g_ptr_array_index (tokens, i);
+			tok->values[id] = 0;
+		}
+
+		return;
+	}
+
+	for (i = 0; i < MIN (tokens->len, STATFILE_PREFETCH_DISTANCE); i++) {
+		rspamd_mmaped_file_prefetch_token (file,
+				g_ptr_array_index (tokens, i));
+	}
+
+	for (i = 0; i < tokens->len; i++) {
+		if (i + STATFILE_PREFETCH_DISTANCE < tokens->len) {
+			rspamd_mmaped_file_prefetch_token (file,
+					g_ptr_array_index (tokens, i + STATFILE_PREFETCH_DISTANCE));
+		}
+
+		tok = g_ptr_array_index (tokens, i);
+		memcpy (&h1, tok->data, sizeof (h1));
+		memcpy (&h2, tok->data + sizeof (h1), sizeof (h2));
+
+		if (file->bucketized) {
+			tok->values[id] = rspamd_mmaped_file_get_block_bucketized (file,
+					h1, h2);
+		}
+		else {
+			tok->values[id] = rspamd_mmaped_file_get_block_chained (file,
+					h1, h2);
+		}
+	}
+}
+
+static void
+rspamd_mmaped_file_set_block_chained (rspamd_mempool_t *pool,
 		rspamd_mmaped_file_t *file,
 		guint32 h1, guint32 h2, double value)
 {
@@ -143,10 +309,6 @@ rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
 	u_char *c;
 	double min = G_MAXDOUBLE;
 
-	if (!file->map) {
-		return;
-	}
-
 	blocknum = h1 % file->cur_section.length;
 	header = (struct stat_file_header *)file->map;
 	c = (u_char *) file->map + file->seek_pos + blocknum *
@@ -213,6 +375,180 @@ rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
 	block->value = value;
 }
 
+static gboolean
+rspamd_mmaped_file_cuckoo_insert (rspamd_mmaped_file_t *file,
+		guint64 start, guint32 h1, guint32 h2, double value)
+{
+	struct {
+		guint64 bucket;
+		guint slot;
+	} path[STATFILE_MAX_KICKS];
+	struct stat_file_block *bucket, *src, *dst;
+	guint64 cur = start, vb1, vb2, alt;
+	guint depth, i, j, slot;
+	gboolean seen;
+
+	/*
+	 * Find a displacement path first and move blocks backwards from the
+	 * free slot, so every block stays reachable while we are moving them
+	 */
+	for (depth = 0; depth < STATFILE_MAX_KICKS; depth++) {
+		bucket = rspamd_mmaped_file_bucket (file, cur);
+		slot = STATFILE_BUCKET_BLOCKS;
+
+		for (i = 0; i < STATFILE_BUCKET_BLOCKS; i++) {
+			slot = (depth + h2 + i) % STATFILE_BUCKET_BLOCKS;
+			seen = FALSE;
+
+			for (j = 0; j < depth; j++) {
+				if (path[j].bucket == cur && path[j].slot == slot) {
+					seen = TRUE;
+					break;
+				}
+			}
+
+			if (!seen) {
+				break;
+			}
+
+			slot = STATFILE_BUCKET_BLOCKS;
+		}
+
+		if (slot == STATFILE_BUCKET_BLOCKS) {
+			return FALSE;
+		}
+
+		path[depth].bucket = cur;
+		path[depth].slot = slot;
+
+		rspamd_mmaped_file_buckets_for (file, bucket[slot].hash1,
+				bucket[slot].hash2, &vb1, &vb2);
+		alt = (vb1 == cur) ? vb2 : vb1;
+		bucket = rspamd_mmaped_file_bucket (file, alt);
+
+		for (i = 0; i < STATFILE_BUCKET_BLOCKS; i++) {
+			if (bucket[i].hash1 == 0 && bucket[i].hash2 == 0) {
+				dst = &bucket[i];
+
+				for (j = depth + 1; j > 0; j--) {
+					src = rspamd_mmaped_file_bucket (file,
+							path[j - 1].bucket) + path[j - 1].slot;
+					memcpy (dst, src, sizeof (*dst));
+					dst = src;
+				}
+
+				dst->hash1 = h1;
+				dst->hash2 = h2;
+				dst->value = value;
+
+				return TRUE;
+			}
+		}
+
+		cur = alt;
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_mmaped_file_set_block_bucketized (rspamd_mempool_t *pool,
+		rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2, double value)
+{
+	struct stat_file_block *bucket, *block, *free_block = NULL,
+			*to_expire = NULL;
+	struct stat_file_header *header;
+	guint64 b1, b2, buckets[2];
+	guint i, j;
+	double min = G_MAXDOUBLE;
+
+	header = (struct stat_file_header *)file->map;
+	rspamd_mmaped_file_buckets_for (file, h1, h2, &b1, &b2);
+	buckets[0] = b1;
+	buckets[1] = b2;
+
+	for (i = 0; i < G_N_ELEMENTS (buckets); i++) {
+		bucket = rspamd_mmaped_file_bucket (file, buckets[i]);
+
+		for (j = 0; j < STATFILE_BUCKET_BLOCKS; j++) {
+			block = &bucket[j];
+
+			if (block->hash1 == h1 && block->hash2 == h2) {
+				msg_debug_pool ("%s found existing block %ud in bucket %uL, "
+						"value %.2f",
+						file->filename,
+						j,
+						buckets[i],
+						value);
+				block->value = value;
+				return;
+			}
+
+			if (block->hash1 == 0 && block->hash2 == 0) {
+				if (free_block == NULL) {
+					free_block = block;
+				}
+			}
+			else if (block->value < min) {
+				to_expire = block;
+				min = block->value;
+			}
+		}
+	}
+
+	if (free_block) {
+		msg_debug_pool ("%s found free block, set h1=%ud, h2=%ud",
+				file->filename,
+				h1,
+				h2);
+		free_block->hash1 = h1;
+		free_block->hash2 = h2;
+		free_block->value = value;
+		header->used_blocks++;
+
+		return;
+	}
+
+	/* Both buckets are full, try to make room by moving blocks around */
+	if (rspamd_mmaped_file_cuckoo_insert (file, b1, h1, h2, value)) {
+		header->used_blocks++;
+
+		return;
+	}
+
+	msg_info_pool ("buckets %uL and %uL are full in statfile %s, "
+			"starting expire",
+			b1, b2,
+			file->filename);
+
+	/* Expire block with minimum value otherwise */
+	if (to_expire == NULL) {
+		to_expire = rspamd_mmaped_file_bucket (file, b1);
+	}
+
+	to_expire->hash1 = h1;
+	to_expire->hash2 = h2;
+	to_expire->value = value;
+}
+
+static void
+rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
+		rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2, double value)
+{
+	if (!file->map) {
+		return;
+	}
+
+	if (file->bucketized) {
+		rspamd_mmaped_file_set_block_bucketized (pool, file, h1, h2, value);
+	}
+	else {
+		rspamd_mmaped_file_set_block_chained (pool, file, h1, h2, value);
+	}
+}
+
 void
 rspamd_mmaped_file_set_block (rspamd_mempool_t *pool,
 		rspamd_mmaped_file_t * file,
@@ -334,6 +670,7 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	struct stat_file *f;
 	gchar *c;
 	static gchar valid_version[] = RSPAMD_STATFILE_VERSION;
+	static gchar chained_version[] = RSPAMD_STATFILE_VERSION_CHAINED;
 
 
 	if (!file || !file->map) {
@@ -360,7 +697,14 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	if (*c == 1 && *(c + 1) == 0) {
 		return -1;
 	}
-	else if (memcmp (c, valid_version, sizeof (valid_version)) != 0) {
+	else if (memcmp (c, valid_version, sizeof (valid_version)) == 0) {
+		file->bucketized = TRUE;
+	}
+	else if (memcmp (c, chained_version, sizeof (chained_version)) == 0) {
+		/* Old layout with linear chains, still fully supported */
+		file->bucketized = FALSE;
+	}
+	else {
 		/* Unknown version */
 		msg_info_pool ("file %s has invalid version %c.%c",
 			file->filename,
@@ -372,16 +716,28 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	/* Check first section and set new offset */
 	file->cur_section.code = f->section.code;
 	file->cur_section.length = f->section.length;
-	if (file->cur_section.length * sizeof (struct stat_file_block) >
-		file->len) {
+	file->seek_pos = rspamd_mmaped_file_data_offset (file->bucketized);
+
+	if (file->seek_pos + file->cur_section.length *
+			sizeof (struct stat_file_block) > file->len) {
 		msg_info_pool ("file %s is truncated: %z, must be %z",
 			file->filename,
 			file->len,
-			file->cur_section.length * sizeof (struct stat_file_block));
+			file->seek_pos + file->cur_section.length *
+			sizeof (struct stat_file_block));
 		return -1;
 	}
-	file->seek_pos = sizeof (struct stat_file) -
-		sizeof (struct stat_file_block);
+
+	if (file->bucketized) {
+		file->nbuckets = file->cur_section.length / STATFILE_BUCKET_BLOCKS;
+
+		if (file->nbuckets < 2) {
+			msg_info_pool ("file %s has too few buckets: %uL",
+				file->filename,
+				file->nbuckets);
+			return -1;
+		}
+	}
 
 	return 0;
 }
@@ -395,9 +751,10 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 		struct rspamd_statfile_config *stcf)
 {
 	gchar *backup, *lock;
-	gint fd, lock_fd;
+	gint lock_fd;
+	guint64 i;
 	rspamd_mmaped_file_t *new, *old = NULL;
-	u_char *map, *pos;
+	u_char *pos;
 	struct stat_file_block *block;
 	struct stat_file_header *header, *nh;
 	struct timespec sleep_ts = {
@@ -468,54 +825,39 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 	new = rspamd_mmaped_file_open (pool, filename, size, stcf);
 
 	if (old) {
-		/* Now open new file and start copying */
-		fd = open (backup, O_RDONLY);
-		if (fd == -1 || new == NULL) {
-			if (fd != -1) {
-				close (fd);
-			}
-
-			msg_err_pool ("cannot open file: %s", strerror (errno));
-			rspamd_mmaped_file_close (old);
+		if (new == NULL) {
+			msg_err_pool ("cannot open new file %s", filename);
+			rspamd_mmaped_file_close_file (pool, old);
 			g_free (backup);
-			return NULL;
-		}
-
-
 
-		/* Now start reading blocks from old statfile */
-		if ((map =
-				mmap (NULL, old_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
-			msg_err_pool ("cannot mmap file: %s", strerror (errno));
-			close (fd);
-			rspamd_mmaped_file_close (old);
-			g_free (backup);
 			return NULL;
 		}
 
-		pos = map + (sizeof (struct stat_file) - sizeof (struct stat_file_block));
+		/*
+		 * Copy blocks from old statfile, it can use either chained or
+		 * bucketized layout, so we just walk all blocks in its section
+		 */
+		pos = (u_char *)old->map + old->seek_pos;
 
-		if (pos - map < (gssize)old_size) {
-			while ((gssize)old_size - (pos - map) >= (gssize)sizeof (struct stat_file_block)) {
-				block = (struct stat_file_block *)pos;
-				if (block->hash1 != 0 && block->value != 0) {
-					rspamd_mmaped_file_set_block_common (pool,
-							new, block->hash1,
-							block->hash2, block->value);
-				}
-				pos += sizeof (block);
+		for (i = 0; i < old->cur_section.length; i++) {
+			block = (struct stat_file_block *)pos;
+
+			if (block->hash1 != 0 && block->value != 0) {
+				rspamd_mmaped_file_set_block_common (pool,
+						new, block->hash1,
+						block->hash2, block->value);
 			}
+
+			pos += sizeof (*block);
 		}
 
-		header = (struct stat_file_header *)map;
+		header = (struct stat_file_header *)old->map;
 		rspamd_mmaped_file_set_revision (new, header->revision, header->rev_time);
 		nh = new->map;
 		/* Copy tokenizer configuration */
 		memcpy (nh->unused, header->unused, sizeof (header->unused));
 		nh->tokenizer_conf_len = header->tokenizer_conf_len;
 
-		munmap (map, old_size);
-		close (fd);
 		rspamd_mmaped_file_close_file (pool, old);
 	}
 
@@ -699,6 +1041,8 @@ rspamd_mmaped_file_create (const gchar *filename,
 	struct rspamd_stat_tokenizer *tokenizer;
 	gint fd, lock_fd;
 	guint buflen = 0, nblocks;
+	gsize data_off, padlen;
+	guchar padding[STATFILE_BUCKET_SIZE];
 	gchar *buf = NULL, *lock;
 	struct stat sb;
 	gpointer tok_conf;
@@ -744,9 +1088,22 @@ rspamd_mmaped_file_create (const gchar *filename,
 create:
 
 	msg_debug_pool ("create statfile %s of size %l", filename, (long)size);
-	nblocks =
-		(size - sizeof (struct stat_file_header) -
-		sizeof (struct stat_file_section)) / sizeof (struct stat_file_block);
+	data_off = rspamd_mmaped_file_data_offset (TRUE);
+	nblocks = (size - data_off) / sizeof (struct stat_file_block);
+	/* Use only whole buckets */
+	nblocks -= nblocks % STATFILE_BUCKET_BLOCKS;
+
+	if (nblocks < STATFILE_BUCKET_BLOCKS * 2) {
+		msg_err_pool ("file %s is too small to carry any statistic: %z",
+			filename,
+			size);
+		unlink (lock);
+		close (lock_fd);
+		g_free (lock);
+
+		return -1;
+	}
+
 	header.total_blocks = nblocks;
 
 	if ((fd =
@@ -764,7 +1121,7 @@ create:
 
 	rspamd_fallocate (fd,
 		0,
-		sizeof (header) + sizeof (section) + sizeof (block) * nblocks);
+		data_off + sizeof (block) * nblocks);
 
 	header.create_time = (guint64) time (NULL);
 	g_assert (stcf->clcf != NULL);
@@ -803,6 +1160,27 @@ create:
 		return -1;
 	}
 
+	/* Pad section header to the first bucket */
+	padlen = data_off - sizeof (header) - sizeof (section);
+
+	if (padlen > 0) {
+		memset (padding, 0, sizeof (padding));
+		g_assert (padlen <= sizeof (padding));
+
+		if (write (fd, padding, padlen) == -1) {
+			msg_info_pool ("cannot write padding to file %s, error %d, %s",
+				filename,
+				errno,
+				strerror (errno));
+			close (fd);
+			unlink (lock);
+			close (lock_fd);
+			g_free (lock);
+
+			return -1;
+		}
+	}
+
 	/* Buffer for write 256 blocks at once */
 	if (nblocks > 256) {
 		buflen = sizeof (block) * 256;
@@ -958,19 +1336,11 @@ rspamd_mmaped_file_process_tokens (struct rspamd_task *task, GPtrArray *tokens,
 		gpointer p)
 {
 	rspamd_mmaped_file_t *mf = p;
-	guint32 h1, h2;
-	rspamd_token_t *tok;
-	guint i;
 
 	g_assert (tokens != NULL);
 	g_assert (p != NULL);
 
-	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index (tokens, i);
-		memcpy (&h1, tok->data, sizeof (h1));
-		memcpy (&h2, tok->data + sizeof (h1), sizeof (h2));
-		tok->values[id] = rspamd_mmaped_file_get_block (mf, h1, h2);
-	}
+	rspamd_mmaped_file_get_blocks (mf, tokens, id);
 
 	if (mf->cf->is_spam) {
 		task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
@@ -23,6 +23,7 @@
 #include "hiredis.h"
 #include "adapters/libevent.h"
 #include "ref.h"
+#include "hash.h"
 
 
 #define REDIS_CTX(p) (struct redis_stat_ctx *)(p)
@@ -33,6 +34,8 @@
 #define REDIS_DEFAULT_USERS_OBJECT "%s%l%r"
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
+#define REDIS_DEFAULT_CACHE_SIZE 65536
+#define REDIS_DEFAULT_CACHE_TTL 5
 
 struct redis_stat_ctx {
 	struct rspamd_statfile_config *stcf;
@@ -45,6 +48,27 @@ struct redis_stat_ctx {
 	gdouble timeout;
 	gboolean enable_users;
 	gint cbref_user;
+	/* Statfiles with equal conn_key share a connection within a task */
+	guint64 conn_key;
+	/* Per worker cache of recently read tokens */
+	rspamd_lru_hash_t *tokens_cache;
+	guint cache_size;
+	guint cache_ttl;
+	guint64 cache_hits;
+	guint64 cache_misses;
+};
+
+/* Connection that is shared by all statfiles using the same servers */
+struct redis_stat_conn {
+	redisAsyncContext *redis;
+	struct upstream *selected;
+	guint refcount;
+};
+
+struct redis_stat_cache_key {
+	guint64 obj;
+	guint64 token;
+	gboolean learns;
 };
 
 enum rspamd_redis_connection_state {
@@ -63,7 +87,9 @@ struct redis_stat_runtime {
 	GArray *results;
 	struct rspamd_statfile_config *stcf;
 	gchar *redis_object_expanded;
-	redisAsyncContext *redis;
+	struct redis_stat_conn *conn;
+	GPtrArray *misses;
+	guint64 obj_hash;
 	guint64 learned;
 	gint id;
 	gboolean has_event;
@@ -336,6 +362,220 @@ rspamd_redis_maybe_auth (struct redis_stat_ctx *ctx, redisAsyncContext *redis)
 	}
 }
 
+static guint
+rspamd_redis_cache_key_hash (gconstpointer p)
+{
+	const struct redis_stat_cache_key *k = p;
+
+	return (guint)(k->token ^ k->obj ^ (k->obj >> 32));
+}
+
+static gboolean
+rspamd_redis_cache_key_equal (gconstpointer a, gconstpointer b)
+{
+	const struct redis_stat_cache_key *k1 = a, *k2 = b;
+
+	return k1->token == k2->token && k1->obj == k2->obj &&
+			k1->learns == k2->learns;
+}
+
+static void
+rspamd_redis_cache_key_free (gpointer p)
+{
+	g_slice_free1 (sizeof (struct redis_stat_cache_key), p);
+}
+
+static void
+rspamd_redis_cache_value_free (gpointer p)
+{
+	g_slice_free1 (sizeof (gdouble), p);
+}
+
+static gboolean
+rspamd_redis_cache_lookup (struct redis_stat_runtime *rt, guint64 token,
+		gboolean learns, gdouble *val)
+{
+	struct redis_stat_cache_key k;
+	gdouble *res;
+
+	if (rt->ctx->tokens_cache == NULL) {
+		return FALSE;
+	}
+
+	k.obj = rt->obj_hash;
+	k.token = token;
+	k.learns = learns;
+	res = rspamd_lru_hash_lookup (rt->ctx->tokens_cache, &k,
+			rt->task->tv.tv_sec);
+
+	if (res) {
+		*val = *res;
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_redis_cache_insert (struct redis_stat_runtime *rt, guint64 token,
+		gboolean learns, gdouble val)
+{
+	struct redis_stat_cache_key *k;
+	gdouble *pval;
+
+	if (rt->ctx->tokens_cache == NULL) {
+		return;
+	}
+
+	k = g_slice_alloc (sizeof (*k));
+	k->obj = rt->obj_hash;
+	k->token = token;
+	k->learns = learns;
+	pval = g_slice_alloc (sizeof (*pval));
+	*pval = val;
+	rspamd_lru_hash_insert (rt->ctx->tokens_cache, k, pval,
+			rt->task->tv.tv_sec, rt->ctx->cache_ttl);
+}
+
+static void
+rspamd_redis_cache_invalidate (struct redis_stat_runtime *rt, GPtrArray *tokens)
+{
+	struct redis_stat_cache_key k;
+	rspamd_token_t *tok;
+	guint i;
+
+	if (rt->ctx->tokens_cache == NULL) {
+		return;
+	}
+
+	k.obj = rt->obj_hash;
+	k.learns = TRUE;
+	k.token = 0;
+	rspamd_lru_hash_remove (rt->ctx->tokens_cache, &k);
+	k.learns = FALSE;
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+		memcpy (&k.token, tok->data, sizeof (k.token));
+		rspamd_lru_hash_remove (rt->ctx->tokens_cache, &k);
+	}
+}
+
+static void
+rspamd_redis_conn_release (struct redis_stat_runtime *rt)
+{
+	struct redis_stat_conn *conn = rt->conn;
+	redisAsyncContext *redis;
+
+	if (conn) {
+		rt->conn = NULL;
+
+		if (--conn->refcount == 0 && conn->redis) {
+			redis = conn->redis;
+			conn->redis = NULL;
+			/* This calls for all callbacks pending */
+			redisAsyncFree (redis);
+		}
+	}
+}
+
+static void
+rspamd_redis_conn_terminate (struct redis_stat_conn *conn)
+{
+	redisAsyncContext *redis;
+
+	if (conn && conn->redis) {
+		redis = conn->redis;
+		conn->redis = NULL;
+		/* This calls for all callbacks pending */
+		redisAsyncFree (redis);
+	}
+}
+
+static void
+rspamd_redis_conn_dtor (gpointer p)
+{
+	struct redis_stat_conn *conn = p;
+
+	rspamd_redis_conn_terminate (conn);
+}
+
+static struct redis_stat_conn *
+rspamd_redis_conn_new (struct rspamd_task *task, struct redis_stat_ctx *ctx,
+		struct upstream *up)
+{
+	struct redis_stat_conn *conn;
+	rspamd_inet_addr_t *addr;
+
+	addr = rspamd_upstream_addr (up);
+	g_assert (addr != NULL);
+
+	conn = rspamd_mempool_alloc0 (task->task_pool, sizeof (*conn));
+	conn->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+
+	if (conn->redis == NULL) {
+		msg_err_task ("cannot connect redis");
+		return NULL;
+	}
+
+	conn->selected = up;
+	redisLibeventAttach (conn->redis, task->ev_base);
+	rspamd_redis_maybe_auth (ctx, conn->redis);
+	rspamd_mempool_add_destructor (task->task_pool, rspamd_redis_conn_dtor,
+			conn);
+
+	return conn;
+}
+
+/*
+ * Attaches runtime to a read connection: statfiles that are served by the
+ * same servers share one connection, so their requests are pipelined
+ */
+static gboolean
+rspamd_redis_conn_attach_read (struct redis_stat_runtime *rt)
+{
+	struct rspamd_task *task = rt->task;
+	struct redis_stat_conn *conn;
+	struct upstream *up;
+	gchar varname[64];
+
+	if (rt->conn) {
+		return rt->conn->redis != NULL;
+	}
+
+	rspamd_snprintf (varname, sizeof (varname), "redis_stat_conn_%uL",
+			rt->ctx->conn_key);
+	conn = rspamd_mempool_get_variable (task->task_pool, varname);
+
+	if (conn == NULL || conn->redis == NULL) {
+		up = rspamd_upstream_get (rt->ctx->read_servers,
+				RSPAMD_UPSTREAM_ROUND_ROBIN,
+				NULL,
+				0);
+
+		if (up == NULL) {
+			msg_err_task ("no upstreams reachable");
+			return FALSE;
+		}
+
+		conn = rspamd_redis_conn_new (task, rt->ctx, up);
+
+		if (conn == NULL) {
+			return FALSE;
+		}
+
+		rspamd_mempool_set_variable (task->task_pool, varname, conn, NULL);
+	}
+
+	conn->refcount ++;
+	rt->conn = conn;
+	rt->selected = conn->selected;
+
+	return TRUE;
+}
+
 static rspamd_fstring_t *
 rspamd_redis_tokens_to_query (struct rspamd_task *task, GPtrArray *tokens,
 		const gchar *arg0, const gchar *arg1, gboolean learn, gint idx,
@@ -678,7 +918,6 @@ static void
 rspamd_redis_fin (gpointer data)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (data);
-	redisAsyncContext *redis;
 
 	rt->has_event = FALSE;
 	/* Stop timeout */
@@ -686,19 +925,14 @@ rspamd_redis_fin (gpointer data)
 		event_del (&rt->timeout_event);
 	}
 
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		/* This calls for all callbacks pending */
-		redisAsyncFree (redis);
-	}
+	/* Connection is closed when the last statfile releases it */
+	rspamd_redis_conn_release (rt);
 }
 
 static void
 rspamd_redis_fin_learn (gpointer data)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (data);
-	redisAsyncContext *redis;
 
 	rt->has_event = FALSE;
 	/* Stop timeout */
@@ -706,12 +940,7 @@ rspamd_redis_fin_learn (gpointer data)
 		event_del (&rt->timeout_event);
 	}
 
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		/* This calls for all callbacks pending */
-		redisAsyncFree (redis);
-	}
+	rspamd_redis_conn_release (rt);
 }
 
 static void
@@ -719,7 +948,6 @@ rspamd_redis_timeout (gint fd, short what, gpointer d)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (d);
 	struct rspamd_task *task;
-	redisAsyncContext *redis;
 
 	task = rt->task;
 
@@ -727,13 +955,8 @@ rspamd_redis_timeout (gint fd, short what, gpointer d)
 			rspamd_upstream_name (rt->selected));
 
 	rspamd_upstream_fail (rt->selected);
-
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		/* This calls for all callbacks pending */
-		redisAsyncFree (redis);
-	}
+	/* Terminate shared connection, all pending statfiles are failed */
+	rspamd_redis_conn_terminate (rt->conn);
 }
 
 /* Called when we have connected to the redis server and got stats */
@@ -771,6 +994,7 @@ rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
 			}
 
 			rt->learned = val;
+			rspamd_redis_cache_insert (rt, 0, TRUE, val);
 			msg_debug_task ("connected to redis server, tokens learned for %s: %uL",
 					rt->redis_object_expanded, rt->learned);
 			rspamd_upstream_ok (rt->selected);
@@ -793,6 +1017,7 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 	struct rspamd_task *task;
 	rspamd_token_t *tok;
 	guint i, processed = 0, found = 0;
+	guint64 token;
 	gulong val;
 	gdouble float_val;
 
@@ -800,11 +1025,20 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 
 	if (c->err == 0) {
 		if (r != NULL) {
-			if (reply->type == REDIS_REPLY_ARRAY) {
+			if (rt->misses->len == 0) {
+				/* All tokens are cached, we have requested merely learns */
+				if (rt->stcf->is_spam) {
+					task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+				}
+				else {
+					task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+				}
+			}
+			else if (reply->type == REDIS_REPLY_ARRAY) {
 
-				if (reply->elements == task->tokens->len) {
+				if (reply->elements == rt->misses->len) {
 					for (i = 0; i < reply->elements; i ++) {
-						tok = g_ptr_array_index (task->tokens, i);
+						tok = g_ptr_array_index (rt->misses, i);
 						elt = reply->element[i];
 
 						if (G_LIKELY (elt->type == REDIS_REPLY_INTEGER)) {
@@ -828,6 +1062,9 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 							tok->values[rt->id] = 0;
 						}
 
+						memcpy (&token, tok->data, sizeof (token));
+						rspamd_redis_cache_insert (rt, token, FALSE,
+								tok->values[rt->id]);
 						processed ++;
 					}
 
@@ -842,7 +1079,7 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 					msg_err_task_check ("got invalid length of reply vector from redis: "
 							"%d, expected: %d",
 							(gint)reply->elements,
-							(gint)task->tokens->len);
+							(gint)rt->misses->len);
 				}
 			}
 			else {
@@ -859,7 +1096,7 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 		msg_err_task ("error getting reply from redis server %s: %s",
 				rspamd_upstream_name (rt->selected), c->errstr);
 
-		if (rt->redis) {
+		if (rt->conn && rt->conn->redis) {
 			rspamd_upstream_fail (rt->selected);
 		}
 	}
@@ -885,7 +1122,7 @@ rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
 		msg_err_task_check ("error getting reply from redis server %s: %s",
 				rspamd_upstream_name (rt->selected), c->errstr);
 
-		if (rt->redis) {
+		if (rt->conn && rt->conn->redis) {
 			rspamd_upstream_fail (rt->selected);
 		}
 	}
@@ -903,6 +1140,8 @@ rspamd_redis_try_ucl (struct redis_stat_ctx *backend,
 {
 	const ucl_object_t *elt, *relt, *users_enabled;
 	const gchar *lua_script;
+	rspamd_cryptobox_fast_hash_state_t st;
+	gchar *servers;
 
 	elt = ucl_object_lookup_any (obj, "read_servers", "servers", NULL);
 
@@ -1018,6 +1257,39 @@ rspamd_redis_try_ucl (struct redis_stat_ctx *backend,
 		backend->dbname = NULL;
 	}
 
+	elt = ucl_object_lookup (obj, "cache_size");
+	if (elt) {
+		backend->cache_size = ucl_object_toint (elt);
+	}
+	else {
+		backend->cache_size = REDIS_DEFAULT_CACHE_SIZE;
+	}
+
+	elt = ucl_object_lookup (obj, "cache_ttl");
+	if (elt) {
+		backend->cache_ttl = ucl_object_toint (elt);
+	}
+	else {
+		backend->cache_ttl = REDIS_DEFAULT_CACHE_TTL;
+	}
+
+	/* Statfiles with the same servers, db and password can share connection */
+	servers = (gchar *)ucl_object_emit (relt, UCL_EMIT_JSON_COMPACT);
+	rspamd_cryptobox_fast_hash_init (&st, rspamd_hash_seed ());
+	rspamd_cryptobox_fast_hash_update (&st, servers, strlen (servers));
+
+	if (backend->password) {
+		rspamd_cryptobox_fast_hash_update (&st, backend->password,
+				strlen (backend->password));
+	}
+	if (backend->dbname) {
+		rspamd_cryptobox_fast_hash_update (&st, backend->dbname,
+				strlen (backend->dbname));
+	}
+
+	backend->conn_key = rspamd_cryptobox_fast_hash_final (&st);
+	free (servers);
+
 	return TRUE;
 }
 
@@ -1079,6 +1351,12 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx,
 	stf->clcf->flags |= RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
 	backend->stcf = stf;
 
+	if (backend->cache_size > 0 && backend->cache_ttl > 0) {
+		backend->tokens_cache = rspamd_lru_hash_new_full (backend->cache_size,
+				rspamd_redis_cache_key_free, rspamd_redis_cache_value_free,
+				rspamd_redis_cache_key_hash, rspamd_redis_cache_key_equal);
+	}
+
 	st_elt = g_slice_alloc0 (sizeof (*st_elt));
 	st_elt->ev_base = ctx->ev_base;
 	st_elt->ctx = backend;
@@ -1100,7 +1378,7 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	struct redis_stat_ctx *ctx = REDIS_CTX (c);
 	struct redis_stat_runtime *rt;
 	struct upstream *up;
-	rspamd_inet_addr_t *addr;
+	gsize objlen;
 
 	g_assert (ctx != NULL);
 	g_assert (stcf != NULL);
@@ -1110,44 +1388,37 @@ rspamd_redis_runtime (struct rspamd_task *task,
 		return NULL;
 	}
 
+	rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
+	objlen = rspamd_redis_expand_object (ctx->redis_object, ctx, task,
+			&rt->redis_object_expanded);
+	rt->obj_hash = rspamd_cryptobox_fast_hash (rt->redis_object_expanded,
+			objlen, rspamd_hash_seed ());
+	rt->task = task;
+	rt->ctx = ctx;
+	rt->stcf = stcf;
+
 	if (learn) {
 		up = rspamd_upstream_get (ctx->write_servers,
 				RSPAMD_UPSTREAM_MASTER_SLAVE,
 				NULL,
 				0);
-	}
-	else {
-		up = rspamd_upstream_get (ctx->read_servers,
-				RSPAMD_UPSTREAM_ROUND_ROBIN,
-				NULL,
-				0);
-	}
 
-	if (up == NULL) {
-		msg_err_task ("no upstreams reachable");
-		return NULL;
-	}
+		if (up == NULL) {
+			msg_err_task ("no upstreams reachable");
+			return NULL;
+		}
 
-	rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
-	rspamd_redis_expand_object (ctx->redis_object, ctx, task,
-			&rt->redis_object_expanded);
-	rt->selected = up;
-	rt->task = task;
-	rt->ctx = ctx;
-	rt->stcf = stcf;
+		rt->conn = rspamd_redis_conn_new (task, ctx, up);
 
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
-	rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
-			rspamd_inet_address_get_port (addr));
+		if (rt->conn == NULL) {
+			return NULL;
+		}
 
-	if (rt->redis == NULL) {
-		msg_err_task ("cannot connect redis");
-		return NULL;
+		rt->conn->refcount = 1;
+		rt->selected = up;
 	}
 
-	redisLibeventAttach (rt->redis, task->ev_base);
-	rspamd_redis_maybe_auth (ctx, rt->redis);
+	/* Read connections are established lazily on tokens cache misses */
 
 	return rt;
 }
@@ -1165,6 +1436,10 @@ rspamd_redis_close (gpointer p)
 		rspamd_upstreams_destroy (ctx->write_servers);
 	}
 
+	if (ctx->tokens_cache) {
+		rspamd_lru_hash_destroy (ctx->tokens_cache);
+	}
+
 	g_slice_free1 (sizeof (*ctx), ctx);
 }
 
@@ -1175,17 +1450,73 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
 	rspamd_fstring_t *query;
+	rspamd_token_t *tok;
 	struct timeval tv;
+	guint64 token;
+	gdouble val;
+	gboolean learns_cached;
+	guint i;
 	gint ret;
 
-	if (tokens == NULL || tokens->len == 0 || rt->redis == NULL) {
+	if (tokens == NULL || tokens->len == 0) {
 		return FALSE;
 	}
 
 	rt->id = id;
+	rt->misses = g_ptr_array_sized_new (tokens->len);
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_ptr_array_free_hard, rt->misses);
+
+	/* Resolve tokens that have been recently read by this worker */
+	for (i = 0; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+		memcpy (&token, tok->data, sizeof (token));
+
+		if (rspamd_redis_cache_lookup (rt, token, FALSE, &val)) {
+			tok->values[id] = val;
+		}
+		else {
+			g_ptr_array_add (rt->misses, tok);
+		}
+	}
+
+	learns_cached = rspamd_redis_cache_lookup (rt, 0, TRUE, &val);
+
+	if (learns_cached) {
+		rt->learned = val;
+	}
+
+	rt->ctx->cache_hits += tokens->len - rt->misses->len;
+	rt->ctx->cache_misses += rt->misses->len;
+	msg_debug_task ("%s: %ud tokens found in cache, %ud should be requested",
+			rt->redis_object_expanded, tokens->len - rt->misses->len,
+			rt->misses->len);
+
+	if (rt->misses->len == 0 && learns_cached) {
+		if (rt->stcf->is_spam) {
+			task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+		}
+		else {
+			task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+		}
+
+		return TRUE;
+	}
 
-	if (redisAsyncCommand (rt->redis, rspamd_redis_connected, rt, "HGET %s %s",
-			rt->redis_object_expanded, "learns") == REDIS_OK) {
+	if (!rspamd_redis_conn_attach_read (rt)) {
+		return FALSE;
+	}
+
+	if (!learns_cached) {
+		ret = redisAsyncCommand (rt->conn->redis, rspamd_redis_connected, rt,
+				"HGET %s %s",
+				rt->redis_object_expanded, "learns");
+	}
+	else {
+		ret = REDIS_OK;
+	}
+
+	if (ret == REDIS_OK) {
 
 		rspamd_session_add_event (task->s, rspamd_redis_fin, rt,
 				rspamd_redis_stat_quark ());
@@ -1199,21 +1530,29 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 		double_to_tv (rt->ctx->timeout, &tv);
 		event_add (&rt->timeout_event, &tv);
 
-		query = rspamd_redis_tokens_to_query (task, tokens,
-				"HMGET", rt->redis_object_expanded, FALSE, -1,
-				rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
-		g_assert (query != NULL);
-		rspamd_mempool_add_destructor (task->task_pool,
-				(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
-
-		ret = redisAsyncFormattedCommand (rt->redis, rspamd_redis_processed, rt,
-				query->str, query->len);
+		if (rt->misses->len == 0) {
+			/* Send fake command just to finish session event */
+			ret = redisAsyncCommand (rt->conn->redis, rspamd_redis_processed,
+					rt, "PING");
+		}
+		else {
+			query = rspamd_redis_tokens_to_query (task, rt->misses,
+					"HMGET", rt->redis_object_expanded, FALSE, -1,
+					rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
+			g_assert (query != NULL);
+			rspamd_mempool_add_destructor (task->task_pool,
+					(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
+
+			ret = redisAsyncFormattedCommand (rt->conn->redis,
+					rspamd_redis_processed, rt,
+					query->str, query->len);
+		}
 
 		if (ret == REDIS_OK) {
 			return TRUE;
 		}
 		else {
-			msg_err_task ("call to redis failed: %s", rt->redis->errstr);
+			msg_err_task ("call to redis failed: %s", rt->conn->redis->errstr);
 		}
 	}
 
@@ -1225,17 +1564,12 @@ rspamd_redis_finalize_process (struct rspamd_task *task, gpointer runtime,
 		gpointer ctx)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
-	redisAsyncContext *redis;
 
 	if (event_get_base (&rt->timeout_event)) {
 		event_del (&rt->timeout_event);
 	}
 
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		redisAsyncFree (redis);
-	}
+	rspamd_redis_conn_release (rt);
 }
 
 gboolean
@@ -1244,7 +1578,6 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
 	struct upstream *up;
-	rspamd_inet_addr_t *addr;
 	struct timeval tv;
 	rspamd_fstring_t *query;
 	const gchar *redis_cmd;
@@ -1261,21 +1594,20 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 		return FALSE;
 	}
 
+	/* Learning is performed using a separate connection to a write server */
+	rspamd_redis_conn_release (rt);
+	rt->conn = rspamd_redis_conn_new (task, rt->ctx, up);
+	g_assert (rt->conn != NULL);
+	rt->conn->refcount = 1;
 	rt->selected = up;
 
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
-	rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
-			rspamd_inet_address_get_port (addr));
-	g_assert (rt->redis != NULL);
-
-	redisLibeventAttach (rt->redis, task->ev_base);
-	rspamd_redis_maybe_auth (rt->ctx, rt->redis);
+	/* Values of learned tokens are no longer valid in this worker */
+	rspamd_redis_cache_invalidate (rt, tokens);
 
 	/*
 	 * Add the current key to the set of learned keys
 	 */
-	redisAsyncCommand (rt->redis, NULL, NULL, "SADD %s_keys %s",
+	redisAsyncCommand (rt->conn->redis, NULL, NULL, "SADD %s_keys %s",
 			rt->stcf->symbol, rt->redis_object_expanded);
 
 	if (rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER) {
@@ -1331,7 +1663,7 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	rspamd_mempool_add_destructor (task->task_pool,
 				(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
 
-	ret = redisAsyncFormattedCommand (rt->redis, rspamd_redis_learned, rt,
+	ret = redisAsyncFormattedCommand (rt->conn->redis, rspamd_redis_learned, rt,
 			query->str, query->len);
 
 	if (ret == REDIS_OK) {
@@ -1351,7 +1683,7 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 		return TRUE;
 	}
 	else {
-		msg_err_task ("call to redis failed: %s", rt->redis->errstr);
+		msg_err_task ("call to redis failed: %s", rt->conn->redis->errstr);
 	}
 
 	return FALSE;
@@ -1363,17 +1695,12 @@ rspamd_redis_finalize_learn (struct rspamd_task *task, gpointer runtime,
 		gpointer ctx)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
-	redisAsyncContext *redis;
 
 	if (event_get_base (&rt->timeout_event)) {
 		event_del (&rt->timeout_event);
 	}
 
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		redisAsyncFree (redis);
-	}
+	rspamd_redis_conn_release (rt);
 }
 
 gulong
@@ -1420,18 +1747,21 @@ rspamd_redis_get_stat (gpointer runtime,
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
 	struct rspamd_redis_stat_elt *st;
-	redisAsyncContext *redis;
+
+	rspamd_redis_conn_release (rt);
 
 	if (rt->ctx->stat_elt) {
 		st = rt->ctx->stat_elt->ud;
 
-		if (rt->redis) {
-			redis = rt->redis;
-			rt->redis = NULL;
-			redisAsyncFree (redis);
-		}
-
 		if (st->stat) {
+			/* Tokens cache is per worker, so report our own counters */
+			ucl_object_replace_key (st->stat,
+					ucl_object_fromint (rt->ctx->cache_hits),
+					"cache_hits", 0, false);
+			ucl_object_replace_key (st->stat,
+					ucl_object_fromint (rt->ctx->cache_misses),
+					"cache_misses", 0, false);
+
 			return ucl_object_ref (st->stat);
 		}
 	}
@@ -38,7 +38,7 @@ rspamd_stat_tokenize_header (struct rspamd_task *task,
 	struct raw_header *rh, *cur;
 	rspamd_ftok_t str;
 
-	rh = g_hash_table_lookup (task->raw_headers, name);
+	rh = rspamd_pool_hash_lookup (task->raw_headers, name);
 
 	if (rh != NULL) {
 
@@ -920,6 +920,23 @@ rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 	return (ret);
 }
 
+const struct sockaddr *
+rspamd_inet_address_get_sa (const rspamd_inet_addr_t *addr,
+		socklen_t *sz)
+{
+	g_assert (addr != NULL);
+
+	if (sz) {
+		*sz = addr->slen;
+	}
+
+	if (addr->af == AF_UNIX) {
+		return (const struct sockaddr *)&addr->u.un->addr;
+	}
+
+	return &addr->u.in.addr.sa;
+}
+
 gssize
 rspamd_inet_address_sendto (gint fd, const void *buf, gsize len, gint fl,
 		const rspamd_inet_addr_t *addr)
@@ -160,6 +160,15 @@ gssize rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 gssize rspamd_inet_address_sendto (gint fd, const void *buf, gsize len, gint fl,
 		const rspamd_inet_addr_t *addr);
 
+/**
+ * Returns socket address for the specified inet address
+ * @param addr
+ * @param sz length of the socket address
+ * @return
+ */
+const struct sockaddr * rspamd_inet_address_get_sa (const rspamd_inet_addr_t *addr,
+		socklen_t *sz);
+
 /**
  * Set port for inet address
  */
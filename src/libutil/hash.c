@@ -21,66 +21,230 @@
  * LRU hashing
  */
 
-static const guint expire_aggressive_count = 10;
+#define LRU_HASH_MIN_ALLOC 16
+
+typedef struct rspamd_lru_element_s {
+	gpointer key;
+	gpointer data;
+	time_t storage;
+	guint ttl;
+	guint hv;
+	gboolean referenced;
+} rspamd_lru_element_t;
 
 struct rspamd_lru_hash_s {
-	guint maxsize;
+	guint maxsize;					/**< maximum number of elements (0 means unlimited) */
+	guint nelts;					/**< number of stored elements */
+	guint nalloc;					/**< number of allocated elements */
+	guint mask;						/**< size of index minus one */
+	guint hand;						/**< position of the CLOCK hand */
+	guint32 *index;					/**< positions of elements plus one, 0 is empty */
+	rspamd_lru_element_t *elts;		/**< dense array of elements */
+	GHashFunc hfunc;
+	GEqualFunc eqfunc;
 	GDestroyNotify value_destroy;
 	GDestroyNotify key_destroy;
-	struct rspamd_min_heap *heap;
-	GHashTable *tbl;
+	struct rspamd_lru_hash_stat stat;
 };
 
+/* Hash functions used for keys are often weak, so mix bits for probing */
+static inline guint
+rspamd_lru_hash_mix (guint h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static inline gboolean
+rspamd_lru_hash_expired (rspamd_lru_element_t *elt, time_t now)
+{
+	return elt->ttl != 0 && ((guint)now) - elt->storage > elt->ttl;
+}
+
+/*
+ * Returns position of element with the specified key or -1 if it is not found,
+ * `pslot` is set to the index slot of the element or to the empty slot where
+ * it could be inserted
+ */
+static gint
+rspamd_lru_hash_find (rspamd_lru_hash_t *hash, gconstpointer key, guint hv,
+		guint *pslot)
+{
+	rspamd_lru_element_t *elt;
+	guint slot = hv & hash->mask, pos;
+
+	while ((pos = hash->index[slot]) != 0) {
+		elt = &hash->elts[pos - 1];
+
+		if (elt->hv == hv && hash->eqfunc (elt->key, key)) {
+			*pslot = slot;
+
+			return pos - 1;
+		}
+
+		slot = (slot + 1) & hash->mask;
+	}
+
+	*pslot = slot;
+
+	return -1;
+}
+
+static guint
+rspamd_lru_hash_slot_of (rspamd_lru_hash_t *hash, guint pos)
+{
+	guint slot = hash->elts[pos].hv & hash->mask;
+
+	while (hash->index[slot] != pos + 1) {
+		g_assert (hash->index[slot] != 0);
+		slot = (slot + 1) & hash->mask;
+	}
+
+	return slot;
+}
+
+/* Backward shift deletion, so we do not need tombstones */
 static void
-rspamd_lru_destroy_node (gpointer value)
+rspamd_lru_hash_unlink_slot (rspamd_lru_hash_t *hash, guint slot)
 {
-	rspamd_lru_element_t *elt = (rspamd_lru_element_t *)value;
+	guint i = slot, j = slot, home;
+
+	for (;;) {
+		j = (j + 1) & hash->mask;
 
-	if (elt) {
-		if (elt->hash && elt->hash->key_destroy) {
-			elt->hash->key_destroy (elt->key);
+		if (hash->index[j] == 0) {
+			break;
 		}
-		if (elt->hash && elt->hash->value_destroy) {
-			elt->hash->value_destroy (elt->data);
+
+		home = hash->elts[hash->index[j] - 1].hv & hash->mask;
+
+		/* Element can be moved to `i` if its home is not within (i, j] */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+			continue;
 		}
 
-		g_slice_free1 (sizeof (*elt), elt);
+		hash->index[i] = hash->index[j];
+		i = j;
 	}
+
+	hash->index[i] = 0;
 }
 
-static inline guint
-rspamd_lru_priority (guint ttl, guint usages)
+static void
+rspamd_lru_hash_rebuild_index (rspamd_lru_hash_t *hash)
 {
-	/* 1 day */
-	static const  guint max_ttl = 3600 * 24;
+	guint size = 1, i, slot;
 
-	if (ttl > 0 && usages > 0) {
-		return G_MAXUINT / (MIN (max_ttl, ttl) * usages);
+	/* Keep load factor below 0.5 */
+	while (size < hash->nalloc * 2) {
+		size <<= 1;
 	}
 
-	return G_MAXUINT;
+	g_free (hash->index);
+	hash->index = g_malloc0 (size * sizeof (*hash->index));
+	hash->mask = size - 1;
+
+	for (i = 0; i < hash->nelts; i ++) {
+		slot = hash->elts[i].hv & hash->mask;
+
+		while (hash->index[slot] != 0) {
+			slot = (slot + 1) & hash->mask;
+		}
+
+		hash->index[slot] = i + 1;
+	}
 }
 
-static rspamd_lru_element_t *
-rspamd_lru_create_node (rspamd_lru_hash_t *hash,
-	gpointer key,
-	gpointer value,
-	time_t now,
-	guint ttl)
+static void
+rspamd_lru_hash_grow (rspamd_lru_hash_t *hash)
 {
-	rspamd_lru_element_t *node;
+	guint nalloc = hash->nalloc * 2;
 
-	node = g_slice_alloc (sizeof (rspamd_lru_element_t));
-	node->data = value;
-	node->key = key;
-	node->ttl = ttl;
-	node->helt.pri = now;
-	node->hash = hash;
-	node->usages = 1;
-	node->storage = now;
-	node->helt.pri = rspamd_lru_priority (ttl, 1);
+	if (hash->maxsize > 0 && nalloc > hash->maxsize) {
+		nalloc = hash->maxsize;
+	}
+
+	hash->elts = g_realloc (hash->elts, nalloc * sizeof (*hash->elts));
+	hash->nalloc = nalloc;
+	rspamd_lru_hash_rebuild_index (hash);
+}
 
-	return node;
+static void
+rspamd_lru_hash_destroy_elt (rspamd_lru_hash_t *hash, gpointer key,
+		gpointer data)
+{
+	if (hash->key_destroy) {
+		hash->key_destroy (key);
+	}
+	if (hash->value_destroy) {
+		hash->value_destroy (data);
+	}
+}
+
+static void
+rspamd_lru_hash_remove_pos (rspamd_lru_hash_t *hash, guint pos, guint slot)
+{
+	gpointer key, data;
+	guint last;
+
+	key = hash->elts[pos].key;
+	data = hash->elts[pos].data;
+	rspamd_lru_hash_unlink_slot (hash, slot);
+	last = hash->nelts - 1;
+
+	/* Move the last element to the hole to keep array dense */
+	if (pos != last) {
+		hash->index[rspamd_lru_hash_slot_of (hash, last)] = pos + 1;
+		hash->elts[pos] = hash->elts[last];
+	}
+
+	hash->nelts --;
+
+	if (hash->hand >= hash->nelts) {
+		hash->hand = 0;
+	}
+
+	rspamd_lru_hash_destroy_elt (hash, key, data);
+}
+
+/*
+ * Frees an element using CLOCK algorithm and returns its position, the
+ * position is left in the array but it is no longer indexed
+ */
+static guint
+rspamd_lru_hash_evict (rspamd_lru_hash_t *hash, time_t now)
+{
+	rspamd_lru_element_t *elt;
+	guint pos;
+
+	for (;;) {
+		elt = &hash->elts[hash->hand];
+		pos = hash->hand;
+		hash->hand = (hash->hand + 1) % hash->nelts;
+
+		if (rspamd_lru_hash_expired (elt, now)) {
+			hash->stat.expired ++;
+			break;
+		}
+		else if (elt->referenced) {
+			/* Give it the second chance */
+			elt->referenced = FALSE;
+		}
+		else {
+			hash->stat.evictions ++;
+			break;
+		}
+	}
+
+	rspamd_lru_hash_unlink_slot (hash, rspamd_lru_hash_slot_of (hash, pos));
+	rspamd_lru_hash_destroy_elt (hash, elt->key, elt->data);
+
+	return pos;
 }
 
 rspamd_lru_hash_t *
@@ -93,12 +257,20 @@ rspamd_lru_hash_new_full (
 {
 	rspamd_lru_hash_t *new;
 
-	new = g_slice_alloc (sizeof (rspamd_lru_hash_t));
-	new->tbl = g_hash_table_new_full (hf, cmpf, NULL, rspamd_lru_destroy_node);
-	new->heap = rspamd_min_heap_create (maxsize);
-	new->maxsize = maxsize;
+	new = g_slice_alloc0 (sizeof (rspamd_lru_hash_t));
+	new->maxsize = maxsize > 0 ? maxsize : 0;
+	new->nalloc = LRU_HASH_MIN_ALLOC;
+
+	if (new->maxsize > 0 && new->maxsize < new->nalloc) {
+		new->nalloc = new->maxsize;
+	}
+
+	new->elts = g_malloc (new->nalloc * sizeof (*new->elts));
+	new->hfunc = hf;
+	new->eqfunc = cmpf;
 	new->value_destroy = value_destroy;
 	new->key_destroy = key_destroy;
+	rspamd_lru_hash_rebuild_index (new);
 
 	return new;
 }
@@ -118,23 +290,31 @@ gpointer
 rspamd_lru_hash_lookup (rspamd_lru_hash_t *hash, gconstpointer key, time_t now)
 {
 	rspamd_lru_element_t *res;
+	guint slot;
+	gint pos;
+
+	pos = rspamd_lru_hash_find (hash, key,
+			rspamd_lru_hash_mix (hash->hfunc (key)), &slot);
+
+	if (pos != -1) {
+		res = &hash->elts[pos];
 
-	res = g_hash_table_lookup (hash->tbl, key);
-	if (res != NULL) {
-		if (res->ttl != 0) {
-			if (((guint)now) - res->storage > res->ttl) {
-				rspamd_min_heap_remove_elt (hash->heap, &res->helt);
-				g_hash_table_remove (hash->tbl, key);
-				return NULL;
-			}
+		if (rspamd_lru_hash_expired (res, now)) {
+			rspamd_lru_hash_remove_pos (hash, pos, slot);
+			hash->stat.expired ++;
+			hash->stat.misses ++;
+
+			return NULL;
 		}
 
-		rspamd_min_heap_update_elt (hash->heap, &res->helt,
-				rspamd_lru_priority (res->ttl, ++res->usages));
+		res->referenced = TRUE;
+		hash->stat.hits ++;
 
 		return res->data;
 	}
 
+	hash->stat.misses ++;
+
 	return NULL;
 }
 
@@ -143,47 +323,124 @@ rspamd_lru_hash_insert (rspamd_lru_hash_t *hash, gpointer key, gpointer value,
 	time_t now, guint ttl)
 {
 	rspamd_lru_element_t *res;
-	guint i;
+	gpointer old_key, old_value;
+	guint hv, slot;
+	gint pos;
 
-	res = g_hash_table_lookup (hash->tbl, key);
+	hv = rspamd_lru_hash_mix (hash->hfunc (key));
+	pos = rspamd_lru_hash_find (hash, key, hv, &slot);
 
-	if (res != NULL) {
-		rspamd_min_heap_remove_elt (hash->heap, &res->helt);
-		g_hash_table_remove (hash->tbl, key);
+	if (pos != -1) {
+		/* Replace element in place */
+		res = &hash->elts[pos];
+		old_key = res->key;
+		old_value = res->data;
+		res->key = key;
+		res->data = value;
+		res->storage = now;
+		res->ttl = ttl;
+		res->referenced = FALSE;
+
+		if (hash->key_destroy && old_key != key) {
+			hash->key_destroy (old_key);
+		}
+		if (hash->value_destroy && old_value != value) {
+			hash->value_destroy (old_value);
+		}
+
+		return;
+	}
+
+	if (hash->nelts < hash->nalloc) {
+		pos = hash->nelts ++;
+	}
+	else if (hash->maxsize == 0 || hash->nalloc < hash->maxsize) {
+		rspamd_lru_hash_grow (hash);
+		pos = hash->nelts ++;
+		rspamd_lru_hash_find (hash, key, hv, &slot);
 	}
 	else {
-		if (hash->maxsize > 0 &&
-				g_hash_table_size (hash->tbl) >= hash->maxsize) {
-
-			for (i = 0; i < MIN (hash->maxsize, expire_aggressive_count); i ++) {
-				res = (rspamd_lru_element_t *)rspamd_min_heap_pop (hash->heap);
-
-				if (res) {
-					g_hash_table_remove (hash->tbl, res->key);
-				}
-				else {
-					break;
-				}
-			}
-		}
+		pos = rspamd_lru_hash_evict (hash, now);
+		rspamd_lru_hash_find (hash, key, hv, &slot);
+	}
+
+	res = &hash->elts[pos];
+	res->key = key;
+	res->data = value;
+	res->storage = now;
+	res->ttl = ttl;
+	res->hv = hv;
+	res->referenced = FALSE;
+	hash->index[slot] = pos + 1;
+}
+
+gboolean
+rspamd_lru_hash_remove (rspamd_lru_hash_t *hash,
+		gconstpointer key)
+{
+	guint slot;
+	gint pos;
+
+	pos = rspamd_lru_hash_find (hash, key,
+			rspamd_lru_hash_mix (hash->hfunc (key)), &slot);
+
+	if (pos != -1) {
+		rspamd_lru_hash_remove_pos (hash, pos, slot);
+
+		return TRUE;
 	}
 
-	res = rspamd_lru_create_node (hash, key, value, now, ttl);
-	g_hash_table_insert (hash->tbl, key, res);
-	rspamd_min_heap_push (hash->heap, &res->helt);
+	return FALSE;
 }
 
 void
 rspamd_lru_hash_destroy (rspamd_lru_hash_t *hash)
 {
-	rspamd_min_heap_destroy (hash->heap);
-	g_hash_table_unref (hash->tbl);
+	guint i;
+
+	for (i = 0; i < hash->nelts; i ++) {
+		rspamd_lru_hash_destroy_elt (hash, hash->elts[i].key,
+				hash->elts[i].data);
+	}
+
+	g_free (hash->index);
+	g_free (hash->elts);
 	g_slice_free1 (sizeof (rspamd_lru_hash_t), hash);
 }
 
+gint
+rspamd_lru_hash_foreach (rspamd_lru_hash_t *hash, gint it, gpointer *k,
+		gpointer *v)
+{
+	if (it < 0 || (guint)it >= hash->nelts) {
+		return -1;
+	}
+
+	if (k) {
+		*k = hash->elts[it].key;
+	}
+	if (v) {
+		*v = hash->elts[it].data;
+	}
 
-GHashTable *
-rspamd_lru_hash_get_htable (rspamd_lru_hash_t *hash)
+	return it + 1;
+}
+
+guint
+rspamd_lru_hash_size (rspamd_lru_hash_t *hash)
+{
+	return hash->nelts;
+}
+
+guint
+rspamd_lru_hash_capacity (rspamd_lru_hash_t *hash)
+{
+	return hash->maxsize;
+}
+
+void
+rspamd_lru_hash_get_stat (rspamd_lru_hash_t *hash,
+		struct rspamd_lru_hash_stat *st)
 {
-	return hash->tbl;
+	memcpy (st, &hash->stat, sizeof (*st));
 }
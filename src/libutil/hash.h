@@ -8,21 +8,23 @@
 #define RSPAMD_HASH_H
 
 #include "config.h"
-#include "heap.h"
 
+/*
+ * LRU hash is an open addressed table of fixed capacity with CLOCK eviction:
+ * elements are stored in a dense array, each lookup sets the reference bit of
+ * an element and eviction sweeps the array clearing these bits until an
+ * element that has not been referenced since the previous sweep is found.
+ * Both lookup and eviction are O(1) amortized
+ */
 struct rspamd_lru_hash_s;
 typedef struct rspamd_lru_hash_s rspamd_lru_hash_t;
 
-typedef struct rspamd_lru_element_s {
-	struct rspamd_min_heap_elt helt;
-	guint ttl;
-	guint usages;
-	time_t storage;
-	gpointer data;
-	gpointer key;
-	rspamd_lru_hash_t *hash;
-} rspamd_lru_element_t;
-
+struct rspamd_lru_hash_stat {
+	guint64 hits;			/**< lookups that have found a live element */
+	guint64 misses;			/**< lookups that have found no live element */
+	guint64 evictions;		/**< elements evicted to free space for new ones */
+	guint64 expired;		/**< elements removed as their ttl has elapsed */
+};
 
 /**
  * Create new lru hash
@@ -74,6 +76,15 @@ void rspamd_lru_hash_insert (rspamd_lru_hash_t *hash,
 	time_t now,
 	guint ttl);
 
+/**
+ * Remove item from hash
+ * @param hash hash object
+ * @param key key to remove
+ * @return TRUE if an element has been removed
+ */
+gboolean rspamd_lru_hash_remove (rspamd_lru_hash_t *hash,
+	gconstpointer key);
+
 /**
  * Remove lru hash
  * @param hash hash object
@@ -82,9 +93,38 @@ void rspamd_lru_hash_insert (rspamd_lru_hash_t *hash,
 void rspamd_lru_hash_destroy (rspamd_lru_hash_t *hash);
 
 /**
- * Get hash table for this lru hash (use rspamd_lru_element_t as data)
+ * Iterate over elements of lru hash:
+ *
+ * gint it = 0;
+ * while ((it = rspamd_lru_hash_foreach (hash, it, &k, &v)) != -1) {...}
+ *
+ * Hash must not be modified during iteration
+ * @param hash hash object
+ * @param it iterator (0 for the first call)
+ * @param k output key
+ * @param v output value
+ * @return next iterator value or -1 if there are no more elements
+ */
+gint rspamd_lru_hash_foreach (rspamd_lru_hash_t *hash, gint it, gpointer *k,
+	gpointer *v);
+
+/**
+ * Returns number of elements stored in a hash
+ */
+guint rspamd_lru_hash_size (rspamd_lru_hash_t *hash);
+
+/**
+ * Returns maximum number of elements in a hash (0 means unlimited)
+ */
+guint rspamd_lru_hash_capacity (rspamd_lru_hash_t *hash);
+
+/**
+ * Get counters of lru hash
+ * @param hash hash object
+ * @param st output structure
  */
-GHashTable *rspamd_lru_hash_get_htable (rspamd_lru_hash_t *hash);
+void rspamd_lru_hash_get_stat (rspamd_lru_hash_t *hash,
+	struct rspamd_lru_hash_stat *st);
 #endif
 
 /*
@@ -26,9 +26,17 @@
 #include "cryptobox.h"
 #include "unix-std.h"
 #include "libutil/ssl_util.h"
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #define ENCRYPTED_VERSION " HTTP/1.0"
 
+/* We use Linux semantic of sendfile to write bodies stored in shmem */
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+#define RSPAMD_HTTP_SENDFILE 1
+#endif
+
 struct _rspamd_http_privbuf {
 	rspamd_fstring_t *data;
 	const gchar *zc_buf;
@@ -41,6 +49,7 @@ enum rspamd_http_priv_flags {
 	RSPAMD_HTTP_CONN_FLAG_NEW_HEADER = 1 << 1,
 	RSPAMD_HTTP_CONN_FLAG_RESETED = 1 << 2,
 	RSPAMD_HTTP_CONN_FLAG_TOO_LARGE = 1 << 3,
+	RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE = 1 << 4,
 };
 
 #define IS_CONN_ENCRYPTED(c) ((c)->flags & RSPAMD_HTTP_CONN_FLAG_ENCRYPTED)
@@ -64,6 +73,10 @@ struct rspamd_http_connection_private {
 	enum rspamd_http_priv_flags flags;
 	gsize wr_pos;
 	gsize wr_total;
+	/* Body written by sendfile after all iov (if body_fd != -1) */
+	gint body_fd;
+	off_t body_off;
+	gsize body_len;
 };
 
 enum http_magic_type {
@@ -863,6 +876,14 @@ rspamd_http_on_message_complete (http_parser * parser)
 
 	priv = conn->priv;
 
+	/* Legacy protocols have no way to delimit replies */
+	if (http_should_keep_alive (parser) && priv->msg->method < HTTP_SYMBOLS) {
+		priv->flags |= RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE;
+	}
+	else {
+		priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE;
+	}
+
 	if ((conn->opts & RSPAMD_HTTP_BODY_PARTIAL) == 0 && IS_CONN_ENCRYPTED (priv)) {
 		mode = rspamd_keypair_alg (priv->local_key);
 
@@ -957,6 +978,25 @@ rspamd_http_write_helper (struct rspamd_http_connection *conn)
 		goto call_finish_handler;
 	}
 
+#ifdef RSPAMD_HTTP_SENDFILE
+	if (priv->body_fd != -1 &&
+			priv->wr_pos >= priv->wr_total - priv->body_len) {
+		off_t off;
+
+		/* Headers are written, so send body directly from the segment */
+		off = priv->body_off + priv->body_len -
+				(priv->wr_total - priv->wr_pos);
+		r = sendfile (conn->fd, priv->body_fd, &off,
+				priv->wr_total - priv->wr_pos);
+
+		if (r == -1 && errno == EAGAIN) {
+			r = 0;
+		}
+
+		goto written;
+	}
+#endif
+
 	start = &priv->out[0];
 	niov = priv->outlen;
 	remain = priv->wr_pos;
@@ -993,6 +1033,9 @@ rspamd_http_write_helper (struct rspamd_http_connection *conn)
 		r = sendmsg (conn->fd, &msg, flags);
 	}
 
+#ifdef RSPAMD_HTTP_SENDFILE
+written:
+#endif
 	if (r == -1) {
 		if (!priv->ssl) {
 			err = g_error_new (HTTP_ERROR, errno, "IO write error: %s", strerror (errno));
@@ -1020,6 +1063,8 @@ rspamd_http_write_helper (struct rspamd_http_connection *conn)
 	return;
 
 call_finish_handler:
+	priv->body_fd = -1;
+
 	if ((conn->opts & RSPAMD_HTTP_CLIENT_SIMPLE) == 0) {
 		rspamd_http_connection_ref (conn);
 		conn->finished = TRUE;
@@ -1272,6 +1317,7 @@ rspamd_http_connection_new (
 	priv = g_slice_alloc0 (sizeof (struct rspamd_http_connection_private));
 	conn->priv = priv;
 	priv->ssl_ctx = ssl_ctx;
+	priv->body_fd = -1;
 
 	rspamd_http_parser_reset (conn);
 	priv->parser.data = conn;
@@ -1316,6 +1362,7 @@ rspamd_http_connection_reset (struct rspamd_http_connection *conn)
 		priv->out = NULL;
 	}
 
+	priv->body_fd = -1;
 	priv->flags |= RSPAMD_HTTP_CONN_FLAG_RESETED;
 }
 
@@ -1347,7 +1394,6 @@ rspamd_http_connection_copy_msg (struct rspamd_http_message *msg)
 	struct rspamd_http_header *hdr, *nhdr, *nhdrs, *thdr, *hcur;
 	const gchar *old_body;
 	gsize old_len;
-	struct stat st;
 	union _rspamd_storage_u *storage;
 
 	new_msg = rspamd_http_new_message (msg->type);
@@ -1356,42 +1402,28 @@ rspamd_http_connection_copy_msg (struct rspamd_http_message *msg)
 	if (msg->body_buf.len > 0) {
 
 		if (msg->flags & RSPAMD_HTTP_FLAG_SHMEM) {
-			/* Avoid copying by just maping a shared segment */
+			/*
+			 * Avoid copying by referencing the mapping of the original
+			 * message, so all copies share a single mapping of the segment
+			 */
 			new_msg->flags |= RSPAMD_HTTP_FLAG_SHMEM_IMMUTABLE;
 
 			storage = &new_msg->body_buf.c;
-			storage->shared.shm_fd = dup (msg->body_buf.c.shared.shm_fd);
-
-			if (storage->shared.shm_fd == -1) {
-				rspamd_http_message_unref (new_msg);
-				return NULL;
-			}
-
-			if (fstat (storage->shared.shm_fd, &st) == -1) {
-				rspamd_http_message_unref (new_msg);
-				return NULL;
-			}
+			storage->shared.shm_fd = -1;
+			storage->shared.owner = msg->body_buf.c.shared.owner ?
+					msg->body_buf.c.shared.owner : msg;
+			REF_RETAIN (storage->shared.owner);
 
 			/* We don't own segment, so do not try to touch it */
-
 			if (msg->body_buf.c.shared.name) {
 				storage->shared.name = msg->body_buf.c.shared.name;
 				REF_RETAIN (storage->shared.name);
 			}
 
-			new_msg->body_buf.str = mmap (NULL, st.st_size,
-					PROT_READ, MAP_SHARED,
-					storage->shared.shm_fd, 0);
-
-			if (new_msg->body_buf.str == MAP_FAILED) {
-				rspamd_http_message_unref (new_msg);
-				return NULL;
-			}
-
-			new_msg->body_buf.begin = new_msg->body_buf.str;
+			new_msg->body_buf.str = msg->body_buf.str;
+			new_msg->body_buf.begin = msg->body_buf.begin;
 			new_msg->body_buf.len = msg->body_buf.len;
-			new_msg->body_buf.begin = new_msg->body_buf.str +
-					(msg->body_buf.begin - msg->body_buf.str);
+			new_msg->body_buf.allocated_len = msg->body_buf.allocated_len;
 		}
 		else {
 			old_body = rspamd_http_message_get_body (msg, &old_len);
@@ -1491,6 +1523,7 @@ rspamd_http_connection_read_message_common (struct rspamd_http_connection *conn,
 		conn->type == RSPAMD_HTTP_SERVER ? HTTP_REQUEST : HTTP_RESPONSE);
 	priv->msg = req;
 	req->flags = flags;
+	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE;
 
 	if (flags & RSPAMD_HTTP_FLAG_SHMEM) {
 		req->body_buf.c.shared.shm_fd = -1;
@@ -1649,16 +1682,39 @@ rspamd_http_connection_encrypt_message (
 	g_free (segments);
 }
 
+static gboolean
+rspamd_http_message_body_fd (struct rspamd_http_message *msg, gint *pfd,
+		off_t *poff)
+{
+#ifdef RSPAMD_HTTP_SENDFILE
+	struct rspamd_http_message *owner;
+
+	if (!(msg->flags & RSPAMD_HTTP_FLAG_SHMEM) ||
+			msg->body_buf.str == MAP_FAILED) {
+		return FALSE;
+	}
+
+	owner = msg->body_buf.c.shared.owner ? msg->body_buf.c.shared.owner : msg;
+
+	if (owner->body_buf.c.shared.shm_fd == -1) {
+		return FALSE;
+	}
+
+	*pfd = owner->body_buf.c.shared.shm_fd;
+	*poff = msg->body_buf.begin - msg->body_buf.str;
+
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
 static void
 rspamd_http_detach_shared (struct rspamd_http_message *msg)
 {
 	rspamd_fstring_t *cpy_str;
 
-	if (msg->body_buf.c.shared.shm_fd != -1) {
-		close (msg->body_buf.c.shared.shm_fd);
-		msg->body_buf.c.shared.shm_fd = -1;
-	}
-
+	/* Storage cleanup unmaps the segment (or releases its owner) */
 	cpy_str = rspamd_fstring_new_init (msg->body_buf.begin, msg->body_buf.len);
 	rspamd_http_message_set_body_from_fstring_steal (msg, cpy_str);
 }
@@ -1674,6 +1730,16 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 	gchar datebuf[64];
 	gint meth_len = 0;
 	struct tm t, *ptm;
+	const gchar *conn_type;
+
+	if (conn->type == RSPAMD_HTTP_SERVER) {
+		conn_type = rspamd_http_connection_is_keepalive (conn) ?
+				"keep-alive" : "close";
+	}
+	else {
+		conn_type = (conn->opts & RSPAMD_HTTP_CLIENT_KEEP_ALIVE) ?
+				"keep-alive" : "close";
+	}
 
 	if (conn->type == RSPAMD_HTTP_SERVER) {
 		/* Format reply */
@@ -1693,34 +1759,36 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 				meth_len =
 						rspamd_snprintf (repbuf, replen,
 								"HTTP/1.1 %d %V\r\n"
-								"Connection: close\r\n"
+								"Connection: %s\r\n"
 								"Server: %s\r\n"
 								"Date: %s\r\n"
 								"Content-Length: %z\r\n"
 								"Content-Type: %s", /* NO \r\n at the end ! */
-								msg->code, msg->status, "rspamd/" RVERSION, datebuf,
+								msg->code, msg->status, conn_type,
+								"rspamd/" RVERSION, datebuf,
 								bodylen, mime_type);
 				enclen += meth_len;
 				/* External reply */
 				rspamd_printf_fstring (buf,
 						"HTTP/1.1 200 OK\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: rspamd\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: application/octet-stream\r\n",
-						datebuf, enclen);
+						conn_type, datebuf, enclen);
 			}
 			else {
 				meth_len =
 						rspamd_printf_fstring (buf,
 								"HTTP/1.1 %d %V\r\n"
-								"Connection: close\r\n"
+								"Connection: %s\r\n"
 								"Server: %s\r\n"
 								"Date: %s\r\n"
 								"Content-Length: %z\r\n"
 								"Content-Type: %s\r\n",
-								msg->code, msg->status, "rspamd/" RVERSION, datebuf,
+								msg->code, msg->status, conn_type,
+								"rspamd/" RVERSION, datebuf,
 								bodylen, mime_type);
 			}
 		}
@@ -1745,13 +1813,18 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 			/* Fallback to HTTP/1.0 */
 			if (encrypted) {
 				rspamd_printf_fstring (buf,
-						"%s %s HTTP/1.0\r\nContent-Length: %z\r\n", "POST",
-						"/post", enclen);
+						"%s %s HTTP/1.0\r\n"
+						"Connection: %s\r\n"
+						"Content-Length: %z\r\n", "POST",
+						"/post", conn_type, enclen);
 			}
 			else {
 				rspamd_printf_fstring (buf,
-						"%s %V HTTP/1.0\r\nContent-Length: %z\r\n",
-						http_method_str (msg->method), msg->url, bodylen);
+						"%s %V HTTP/1.0\r\n"
+						"Connection: %s\r\n"
+						"Content-Length: %z\r\n",
+						http_method_str (msg->method), msg->url, conn_type,
+						bodylen);
 			}
 		}
 		else {
@@ -1759,35 +1832,35 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 				if (host != NULL) {
 					rspamd_printf_fstring (buf,
 							"%s %s HTTP/1.1\r\n"
-							"Connection: close\r\n"
+							"Connection: %s\r\n"
 							"Host: %s\r\n"
 							"Content-Length: %z\r\n",
-							"POST", "/post", host, enclen);
+							"POST", "/post", conn_type, host, enclen);
 				}
 				else {
 					rspamd_printf_fstring (buf,
 							"%s %s HTTP/1.1\r\n"
-							"Connection: close\r\n"
+							"Connection: %s\r\n"
 							"Host: %V\r\n"
 							"Content-Length: %z\r\n",
-							"POST", "/post", msg->host, enclen);
+							"POST", "/post", conn_type, msg->host, enclen);
 				}
 			}
 			else {
 				if (host != NULL) {
 					rspamd_printf_fstring (buf,
-							"%s %V HTTP/1.1\r\nConnection: close\r\nHost: %s\r\nContent-Length: %z\r\n",
-							http_method_str (msg->method), msg->url, host,
-							bodylen);
+							"%s %V HTTP/1.1\r\nConnection: %s\r\nHost: %s\r\nContent-Length: %z\r\n",
+							http_method_str (msg->method), msg->url, conn_type,
+							host, bodylen);
 				}
 				else {
 					rspamd_printf_fstring (buf,
 							"%s %V HTTP/1.1\r\n"
-							"Connection: close\r\n"
+							"Connection: %s\r\n"
 							"Host: %V\r\n"
 							"Content-Length: %z\r\n",
-							http_method_str (msg->method), msg->url, msg->host,
-							bodylen);
+							http_method_str (msg->method), msg->url, conn_type,
+							msg->host, bodylen);
 				}
 			}
 		}
@@ -1830,6 +1903,7 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 	conn->fd = fd;
 	conn->ud = ud;
 	priv->msg = msg;
+	priv->body_fd = -1;
 
 	if (timeout == NULL) {
 		priv->ptv = NULL;
@@ -1967,6 +2041,15 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 				bodylen = msg->body_buf.len;
 				priv->outlen = 3;
 				msg->method = HTTP_POST;
+
+				if (!(msg->flags & RSPAMD_HTTP_FLAG_SSL) &&
+						rspamd_http_message_body_fd (msg,
+								&priv->body_fd, &priv->body_off)) {
+					/* Body is written by sendfile from the shared segment */
+					priv->body_len = bodylen;
+					pbody = NULL;
+					priv->outlen = 2;
+				}
 			}
 		}
 		else if (msg->body_buf.len > 0) {
@@ -2307,6 +2390,7 @@ rspamd_http_message_set_body (struct rspamd_http_message *msg,
 	if (msg->flags & RSPAMD_HTTP_FLAG_SHMEM) {
 		storage->shared.name = g_slice_alloc (sizeof (*storage->shared.name));
 		REF_INIT_RETAIN (storage->shared.name, rspamd_http_shname_dtor);
+		storage->shared.owner = NULL;
 #ifdef HAVE_SANE_SHMEM
 		storage->shared.name->shm_name = g_strdup ("/rhm.XXXXXXXXXXXXXXXXXXXX");
 		storage->shared.shm_fd = rspamd_shmem_mkstemp (storage->shared.name->shm_name);
@@ -2386,6 +2470,7 @@ rspamd_http_message_set_body_from_fd (struct rspamd_http_message *msg,
 	msg->flags |= RSPAMD_HTTP_FLAG_SHMEM|RSPAMD_HTTP_FLAG_SHMEM_IMMUTABLE;
 
 	storage->shared.shm_fd = dup (fd);
+	storage->shared.owner = NULL;
 	msg->body_buf.str = MAP_FAILED;
 
 	if (storage->shared.shm_fd == -1) {
@@ -2546,7 +2631,11 @@ rspamd_http_message_storage_cleanup (struct rspamd_http_message *msg)
 	if (msg->flags & RSPAMD_HTTP_FLAG_SHMEM) {
 		storage = &msg->body_buf.c;
 
-		if (storage->shared.shm_fd != -1) {
+		if (storage->shared.owner != NULL) {
+			/* Mapping belongs to the owner message */
+			rspamd_http_message_unref (storage->shared.owner);
+		}
+		else if (storage->shared.shm_fd != -1) {
 			g_assert (fstat (storage->shared.shm_fd, &st) != -1);
 
 			if (msg->body_buf.str != MAP_FAILED) {
@@ -2561,6 +2650,7 @@ rspamd_http_message_storage_cleanup (struct rspamd_http_message *msg)
 		}
 
 		storage->shared.shm_fd = -1;
+		storage->shared.owner = NULL;
 		msg->body_buf.str = MAP_FAILED;
 	}
 	else {
@@ -3126,6 +3216,16 @@ rspamd_http_connection_get_peer_key (struct rspamd_http_connection *conn)
 	return NULL;
 }
 
+gboolean
+rspamd_http_connection_is_keepalive (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	return (conn->opts & RSPAMD_HTTP_CLIENT_KEEP_ALIVE) &&
+			(priv->flags & RSPAMD_HTTP_CONN_FLAG_KEEP_ALIVE) &&
+			priv->ssl == NULL;
+}
+
 gboolean
 rspamd_http_connection_is_encrypted (struct rspamd_http_connection *conn)
 {
@@ -76,6 +76,7 @@ enum rspamd_http_options {
 	RSPAMD_HTTP_CLIENT_SIMPLE = 0x2, /**< Read HTTP client reply automatically */
 	RSPAMD_HTTP_CLIENT_ENCRYPTED = 0x4, /**< Encrypt data for client */
 	RSPAMD_HTTP_CLIENT_SHARED = 0x8, /**< Store reply in shared memory */
+	RSPAMD_HTTP_CLIENT_KEEP_ALIVE = 0x10, /**< Allow to reuse connection for the next message */
 };
 
 typedef int (*rspamd_http_body_handler_t) (struct rspamd_http_connection *conn,
@@ -176,6 +177,14 @@ const struct rspamd_cryptobox_pubkey* rspamd_http_connection_get_peer_key (
  */
 gboolean rspamd_http_connection_is_encrypted (struct rspamd_http_connection *conn);
 
+/**
+ * Returns TRUE if the last message on a connection allows to reuse it
+ * for the next one (both peers have agreed to keep connection alive)
+ * @param conn
+ * @return
+ */
+gboolean rspamd_http_connection_is_keepalive (struct rspamd_http_connection *conn);
+
 /**
  * Handle a request using socket fd and user data ud
  * @param conn connection structure
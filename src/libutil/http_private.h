@@ -58,6 +58,8 @@ struct rspamd_http_message {
 			struct _rspamd_storage_shared_s {
 				struct rspamd_storage_shmem *name;
 				gint shm_fd;
+				/* Message which owns the segment mapping for copies */
+				struct rspamd_http_message *owner;
 			} shared;
 		} c;
 	} body_buf;
@@ -32,6 +32,52 @@
 #define REPEATS_MAX 300
 #define LOG_ID 6
 #define RSPAMD_LOGBUF_SIZE 8192
+/* Ring buffer limits */
+#define RSPAMD_LOG_RING_MIN 4096
+#define RSPAMD_LOG_RING_BATCH 64
+#define RSPAMD_LOG_RING_ALIGN(len) (((len) + 7) & ~7)
+#define RSPAMD_LOG_RING_CACHELINE 64
+
+/**
+ * Shared memory ring that is filled by a single worker and drained by the
+ * main process. Both counters grow monotonically and are wrapped by the
+ * mask on access, so the ring is empty when they are equal
+ */
+struct rspamd_log_ring {
+	guint head;                                  /**< written by producer only	*/
+	guchar head_pad[RSPAMD_LOG_RING_CACHELINE - sizeof (guint)];
+	guint tail;                                  /**< written by consumer only	*/
+	guchar tail_pad[RSPAMD_LOG_RING_CACHELINE - sizeof (guint)];
+	guint dropped;                               /**< records lost on overflow	*/
+	guint reported;                              /**< dropped already reported	*/
+	pid_t pid;                                   /**< pid of producer			*/
+	guint size;                                  /**< size of data (power of 2)	*/
+	gsize mapped;                                /**< size of the whole mapping	*/
+	guchar data[];
+};
+
+/*
+ * Record header, followed by process type, module, id, function and message,
+ * each of them is zero terminated. Zero length means NULL string
+ */
+struct rspamd_log_ring_rec {
+	guint32 len;
+	gint32 level_flags;
+	gint64 ts;
+	guint32 pid;
+	guint16 ptype_len;
+	guint16 module_len;
+	guint16 id_len;
+	guint16 function_len;
+	guint32 message_len;
+};
+
+/* Storage for a single formatted line */
+struct rspamd_log_line_buf {
+	gchar tmpbuf[256];
+	gchar timebuf[32];
+	gchar modulebuf[64];
+};
 
 /**
  * Static structure that store logging parameters
@@ -66,6 +112,7 @@ struct rspamd_logger_s {
 	gchar *saved_id;
 	guint saved_loglevel;
 	guint64 log_cnt[4];
+	struct rspamd_log_ring *ring;
 };
 
 static const gchar lf_chr = '\n';
@@ -693,6 +740,220 @@ syslog_log_function (const gchar *module, const gchar *id,
 #endif
 }
 
+/*
+ * Format log line to iov (at most 5 elements), lb is used as a storage for
+ * the line prefix
+ */
+static guint
+rspamd_log_fill_iov (rspamd_logger_t *rspamd_log,
+		struct iovec *iov,
+		struct rspamd_log_line_buf *lb,
+		time_t now,
+		pid_t pid,
+		const gchar *cptype,
+		const gchar *module, const gchar *id,
+		const gchar *function,
+		gint level_flags,
+		const gchar *message,
+		gsize mlen)
+{
+	gchar *m;
+	struct tm *tms;
+	gulong r = 0, mr = 0;
+	gsize mremain;
+	guint iovcnt;
+
+	if (rspamd_log->cfg->log_extended) {
+		/* Format time */
+		if (!rspamd_log->cfg->log_systemd) {
+			tms = localtime (&now);
+
+			strftime (lb->timebuf, sizeof (lb->timebuf), "%F %H:%M:%S", tms);
+		}
+
+		if (rspamd_log->cfg->log_color) {
+			if (level_flags & G_LOG_LEVEL_INFO) {
+				/* White */
+				r = rspamd_snprintf (lb->tmpbuf, sizeof (lb->tmpbuf), "\033[0;37m");
+			}
+			else if (level_flags & G_LOG_LEVEL_WARNING) {
+				/* Magenta */
+				r = rspamd_snprintf (lb->tmpbuf, sizeof (lb->tmpbuf), "\033[0;32m");
+			}
+			else if (level_flags & G_LOG_LEVEL_CRITICAL) {
+				/* Red */
+				r = rspamd_snprintf (lb->tmpbuf, sizeof (lb->tmpbuf), "\033[1;31m");
+			}
+		}
+
+		if (!rspamd_log->cfg->log_systemd) {
+			r += rspamd_snprintf (lb->tmpbuf + r,
+					sizeof (lb->tmpbuf) - r,
+					"%s #%P(%s) ",
+					lb->timebuf,
+					pid,
+					cptype);
+		}
+		else {
+			r += rspamd_snprintf (lb->tmpbuf + r,
+					sizeof (lb->tmpbuf) - r,
+					"(%s) ",
+					cptype);
+		}
+
+		lb->modulebuf[0] = '\0';
+		mremain = sizeof (lb->modulebuf);
+		m = lb->modulebuf;
+
+		if (id != NULL) {
+			mr = rspamd_snprintf (m, mremain, "<%*.s>; ", LOG_ID,
+					id);
+			m += mr;
+			mremain -= mr;
+		}
+		if (module != NULL) {
+			mr = rspamd_snprintf (m, mremain, "%s; ", module);
+			m += mr;
+			mremain -= mr;
+		}
+		if (function != NULL) {
+			mr = rspamd_snprintf (m, mremain, "%s: ", function);
+			m += mr;
+			mremain -= mr;
+		}
+		else {
+			mr = rspamd_snprintf (m, mremain, ": ");
+			m += mr;
+			mremain -= mr;
+		}
+
+		/* Construct IOV for log line */
+		iov[0].iov_base = lb->tmpbuf;
+		iov[0].iov_len = r;
+		iov[1].iov_base = lb->modulebuf;
+		iov[1].iov_len = m - lb->modulebuf;
+		iov[2].iov_base = (void *) message;
+		iov[2].iov_len = mlen;
+		iov[3].iov_base = (void *) &lf_chr;
+		iov[3].iov_len = 1;
+		iovcnt = 4;
+	}
+	else {
+		iov[0].iov_base = (void *) message;
+		iov[0].iov_len = mlen;
+		iov[1].iov_base = (void *) &lf_chr;
+		iov[1].iov_len = 1;
+		iovcnt = 2;
+	}
+
+	if (rspamd_log->cfg->log_color) {
+		iov[iovcnt].iov_base = "\033[0m";
+		iov[iovcnt].iov_len = sizeof ("\033[0m") - 1;
+		iovcnt ++;
+	}
+
+	return iovcnt;
+}
+
+/*
+ * Copy data to the ring at the specified (unwrapped) position
+ */
+static inline void
+rspamd_log_ring_write (struct rspamd_log_ring *ring, guint pos,
+		const void *data, gsize len)
+{
+	guint off = pos & (ring->size - 1), part;
+
+	part = MIN (len, ring->size - off);
+	memcpy (ring->data + off, data, part);
+
+	if (part < len) {
+		memcpy (ring->data, ((const guchar *)data) + part, len - part);
+	}
+}
+
+static inline void
+rspamd_log_ring_read (struct rspamd_log_ring *ring, guint pos,
+		void *data, gsize len)
+{
+	guint off = pos & (ring->size - 1), part;
+
+	part = MIN (len, ring->size - off);
+	memcpy (data, ring->data + off, part);
+
+	if (part < len) {
+		memcpy (((guchar *)data) + part, ring->data, len - part);
+	}
+}
+
+static inline guint
+rspamd_log_ring_write_str (struct rspamd_log_ring *ring, guint pos,
+		const gchar *str, gsize len)
+{
+	if (len > 0) {
+		rspamd_log_ring_write (ring, pos, str, len - 1);
+		rspamd_log_ring_write (ring, pos + len - 1, "", 1);
+	}
+
+	return pos + len;
+}
+
+/*
+ * Append record to the ring, drop it if there is not enough space
+ */
+static gboolean
+rspamd_log_ring_push (struct rspamd_log_ring *ring,
+		time_t now,
+		pid_t pid,
+		const gchar *cptype,
+		const gchar *module, const gchar *id,
+		const gchar *function,
+		gint level_flags,
+		const gchar *message,
+		gsize mlen)
+{
+	struct rspamd_log_ring_rec rec;
+	guint head, tail, pos;
+	gsize len;
+
+	rec.ptype_len = cptype ? MIN (strlen (cptype), G_MAXUINT16 - 1) + 1 : 0;
+	rec.module_len = module ? MIN (strlen (module), G_MAXUINT16 - 1) + 1 : 0;
+	rec.id_len = id ? MIN (strlen (id), G_MAXUINT16 - 1) + 1 : 0;
+	rec.function_len = function ?
+			MIN (strlen (function), G_MAXUINT16 - 1) + 1 : 0;
+	rec.message_len = mlen + 1;
+	rec.level_flags = level_flags;
+	rec.ts = now;
+	rec.pid = pid;
+
+	len = RSPAMD_LOG_RING_ALIGN (sizeof (rec) + rec.ptype_len +
+			rec.module_len + rec.id_len + rec.function_len +
+			(gsize)rec.message_len);
+
+	head = ring->head;
+	tail = g_atomic_int_get (&ring->tail);
+
+	if (len > ring->size - (head - tail)) {
+		g_atomic_int_inc (&ring->dropped);
+
+		return FALSE;
+	}
+
+	rec.len = len;
+	rspamd_log_ring_write (ring, head, &rec, sizeof (rec));
+	pos = head + sizeof (rec);
+	pos = rspamd_log_ring_write_str (ring, pos, cptype, rec.ptype_len);
+	pos = rspamd_log_ring_write_str (ring, pos, module, rec.module_len);
+	pos = rspamd_log_ring_write_str (ring, pos, id, rec.id_len);
+	pos = rspamd_log_ring_write_str (ring, pos, function, rec.function_len);
+	rspamd_log_ring_write_str (ring, pos, message, rec.message_len);
+
+	/* Publish record */
+	g_atomic_int_set (&ring->head, head + len);
+
+	return TRUE;
+}
+
 /**
  * Main file interface for logging
  */
@@ -703,15 +964,13 @@ file_log_function (const gchar *module, const gchar *id,
 		const gchar *message,
 		gpointer arg)
 {
-	gchar tmpbuf[256], timebuf[32], modulebuf[64];
-	gchar *m;
-	time_t now;
-	struct tm *tms;
+	gchar tmpbuf[256];
+	struct rspamd_log_line_buf lb;
+	time_t now = 0;
 	struct iovec iov[5];
-	gulong r = 0, mr = 0;
+	guint iovcnt;
 	guint64 cksum;
-	size_t mlen, mremain;
-	const gchar *cptype = NULL;
+	size_t mlen;
 	gboolean got_time = FALSE;
 	rspamd_logger_t *rspamd_log = arg;
 
@@ -841,116 +1100,28 @@ file_log_function (const gchar *module, const gchar *id,
 		}
 	}
 
-	if (rspamd_log->cfg->log_extended) {
-		if (!got_time) {
-			now = time (NULL);
-		}
+	if (rspamd_log->ring) {
+		/* Formatting and writing is done by the main process */
+		rspamd_log_ring_push (rspamd_log->ring,
+				got_time ? now : time (NULL),
+				rspamd_log->pid,
+				g_quark_to_string (rspamd_log->process_type),
+				module, id, function, level_flags,
+				message, mlen);
 
-		/* Format time */
-		if (!rspamd_log->cfg->log_systemd) {
-			tms = localtime (&now);
-
-			strftime (timebuf, sizeof (timebuf), "%F %H:%M:%S", tms);
-		}
-
-		cptype = g_quark_to_string (rspamd_log->process_type);
-
-		if (rspamd_log->cfg->log_color) {
-			if (level_flags & G_LOG_LEVEL_INFO) {
-				/* White */
-				r = rspamd_snprintf (tmpbuf, sizeof (tmpbuf), "\033[0;37m");
-			}
-			else if (level_flags & G_LOG_LEVEL_WARNING) {
-				/* Magenta */
-				r = rspamd_snprintf (tmpbuf, sizeof (tmpbuf), "\033[0;32m");
-			}
-			else if (level_flags & G_LOG_LEVEL_CRITICAL) {
-				/* Red */
-				r = rspamd_snprintf (tmpbuf, sizeof (tmpbuf), "\033[1;31m");
-			}
-		}
-		else {
-			r = 0;
-		}
-
-		if (!rspamd_log->cfg->log_systemd) {
-			r += rspamd_snprintf (tmpbuf + r,
-					sizeof (tmpbuf) - r,
-					"%s #%P(%s) ",
-					timebuf,
-					rspamd_log->pid,
-					cptype);
-		}
-		else {
-			r += rspamd_snprintf (tmpbuf + r,
-					sizeof (tmpbuf) - r,
-					"(%s) ",
-					cptype);
-		}
-
-		modulebuf[0] = '\0';
-		mremain = sizeof (modulebuf);
-		m = modulebuf;
-
-		if (id != NULL) {
-			mr = rspamd_snprintf (m, mremain, "<%*.s>; ", LOG_ID,
-					id);
-			m += mr;
-			mremain -= mr;
-		}
-		if (module != NULL) {
-			mr = rspamd_snprintf (m, mremain, "%s; ", module);
-			m += mr;
-			mremain -= mr;
-		}
-		if (function != NULL) {
-			mr = rspamd_snprintf (m, mremain, "%s: ", function);
-			m += mr;
-			mremain -= mr;
-		}
-		else {
-			mr = rspamd_snprintf (m, mremain, ": ");
-			m += mr;
-			mremain -= mr;
-		}
-
-		/* Construct IOV for log line */
-		iov[0].iov_base = tmpbuf;
-		iov[0].iov_len = r;
-		iov[1].iov_base = modulebuf;
-		iov[1].iov_len = m - modulebuf;
-		iov[2].iov_base = (void *) message;
-		iov[2].iov_len = mlen;
-		iov[3].iov_base = (void *) &lf_chr;
-		iov[3].iov_len = 1;
-
-		if (rspamd_log->cfg->log_color) {
-			iov[4].iov_base = "\033[0m";
-			iov[4].iov_len = sizeof ("\033[0m") - 1;
-			/* Call helper (for buffering) */
-			file_log_helper (rspamd_log, iov, 5);
-		}
-		else {
-			/* Call helper (for buffering) */
-			file_log_helper (rspamd_log, iov, 4);
-		}
+		return;
 	}
-	else {
-		iov[0].iov_base = (void *) message;
-		iov[0].iov_len = mlen;
-		iov[1].iov_base = (void *) &lf_chr;
-		iov[1].iov_len = 1;
-		if (rspamd_log->cfg->log_color) {
-			iov[2].iov_base = "\033[0m";
-			iov[2].iov_len = sizeof ("\033[0m") - 1;
-			/* Call helper (for buffering) */
-			file_log_helper (rspamd_log, iov, 3);
-		}
-		else {
-			/* Call helper (for buffering) */
-			file_log_helper (rspamd_log, iov, 2);
-		}
+
+	if (rspamd_log->cfg->log_extended && !got_time) {
+		now = time (NULL);
 	}
+
+	iovcnt = rspamd_log_fill_iov (rspamd_log, iov, &lb, now, rspamd_log->pid,
+			g_quark_to_string (rspamd_log->process_type),
+			module, id, function, level_flags,
+			message, mlen);
+	/* Call helper (for buffering) */
+	file_log_helper (rspamd_log, iov, iovcnt);
 }
 
 /**
@@ -1062,3 +1233,168 @@ rspamd_log_lock (rspamd_logger_t *logger)
 		logger->no_lock = FALSE;
 	}
 }
+
+struct rspamd_log_ring *
+rspamd_log_ring_new (gsize size)
+{
+	struct rspamd_log_ring *ring;
+	gsize rsize = RSPAMD_LOG_RING_MIN, total;
+	void *map;
+
+	while (rsize < size && rsize < G_MAXINT / 2 + 1) {
+		rsize <<= 1;
+	}
+
+	total = sizeof (*ring) + rsize;
+#if defined(HAVE_MMAP_ANON)
+	map = mmap (NULL,
+			total,
+			PROT_READ | PROT_WRITE,
+			MAP_ANON | MAP_SHARED,
+			-1,
+			0);
+#elif defined(HAVE_MMAP_ZERO)
+	gint fd;
+
+	fd = open ("/dev/zero", O_RDWR);
+
+	if (fd == -1) {
+		return NULL;
+	}
+
+	map = mmap (NULL,
+			total,
+			PROT_READ | PROT_WRITE,
+			MAP_SHARED,
+			fd,
+			0);
+	close (fd);
+#else
+#       error No mmap methods are defined
+#endif
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes of shared memory for log ring: %s",
+				total, strerror (errno));
+
+		return NULL;
+	}
+
+	ring = map;
+	memset (ring, 0, sizeof (*ring));
+	ring->size = rsize;
+	ring->mapped = total;
+
+	return ring;
+}
+
+void
+rspamd_log_ring_destroy (struct rspamd_log_ring *ring)
+{
+	if (ring) {
+		munmap (ring, ring->mapped);
+	}
+}
+
+void
+rspamd_log_set_ring (rspamd_logger_t *logger, struct rspamd_log_ring *ring)
+{
+	if (logger) {
+		/* Buffered data must be written before switching to the ring */
+		rspamd_log_flush (logger);
+
+		if (ring) {
+			ring->pid = getpid ();
+		}
+
+		logger->ring = ring;
+	}
+}
+
+guint
+rspamd_log_ring_drain (rspamd_logger_t *rspamd_log,
+		struct rspamd_log_ring *ring)
+{
+	static struct rspamd_log_line_buf lbufs[RSPAMD_LOG_RING_BATCH];
+	struct iovec iov[RSPAMD_LOG_RING_BATCH * 5];
+	guchar *copies[RSPAMD_LOG_RING_BATCH], *p;
+	struct rspamd_log_ring_rec rec;
+	const gchar *cptype, *module, *id, *function, *message;
+	guint head, tail, pos, off, niov, nrec, i, ndrained = 0, dropped;
+
+	if (ring == NULL || rspamd_log == NULL) {
+		return 0;
+	}
+
+	tail = ring->tail;
+	head = g_atomic_int_get (&ring->head);
+
+	if (tail != head) {
+		/* Keep order with lines buffered by this process */
+		rspamd_log_flush (rspamd_log);
+	}
+
+	while (tail != head) {
+		niov = 0;
+		nrec = 0;
+		pos = tail;
+
+		while (pos != head && nrec < RSPAMD_LOG_RING_BATCH) {
+			off = pos & (ring->size - 1);
+			rspamd_log_ring_read (ring, pos, &rec, sizeof (rec));
+
+			if (off + rec.len <= ring->size) {
+				p = ring->data + off;
+				copies[nrec] = NULL;
+			}
+			else {
+				/* Wrapped record */
+				p = g_malloc (rec.len);
+				rspamd_log_ring_read (ring, pos, p, rec.len);
+				copies[nrec] = p;
+			}
+
+			p += sizeof (rec);
+			cptype = rec.ptype_len ? (const gchar *)p : NULL;
+			p += rec.ptype_len;
+			module = rec.module_len ? (const gchar *)p : NULL;
+			p += rec.module_len;
+			id = rec.id_len ? (const gchar *)p : NULL;
+			p += rec.id_len;
+			function = rec.function_len ? (const gchar *)p : NULL;
+			p += rec.function_len;
+			message = (const gchar *)p;
+
+			niov += rspamd_log_fill_iov (rspamd_log, &iov[niov], &lbufs[nrec],
+					rec.ts, rec.pid, cptype, module, id, function,
+					rec.level_flags, message, rec.message_len - 1);
+			pos += rec.len;
+			nrec ++;
+		}
+
+		direct_write_log_line (rspamd_log, iov, niov, TRUE);
+
+		for (i = 0; i < nrec; i ++) {
+			if (copies[i]) {
+				g_free (copies[i]);
+			}
+		}
+
+		g_atomic_int_set (&ring->tail, pos);
+		tail = pos;
+		ndrained += nrec;
+	}
+
+	dropped = g_atomic_int_get (&ring->dropped);
+
+	if (dropped != ring->reported) {
+		rspamd_common_log_function (rspamd_log, G_LOG_LEVEL_WARNING,
+				"logger", NULL, G_STRFUNC,
+				"%ud log messages have been dropped by process %P: "
+				"log ring is full",
+				dropped - ring->reported, ring->pid);
+		ring->reported = dropped;
+	}
+
+	return ndrained;
+}
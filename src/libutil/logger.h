@@ -21,6 +21,7 @@ typedef void (*rspamd_log_func_t) (const gchar *module, const gchar *id,
 		gint level_flags, const gchar *message, gpointer arg);
 
 typedef struct rspamd_logger_s rspamd_logger_t;
+struct rspamd_log_ring;
 
 /**
  * Init logger
@@ -150,6 +151,32 @@ void rspamd_log_lock (rspamd_logger_t *logger);
  */
 const guint64* rspamd_log_counters (rspamd_logger_t *logger);
 
+/**
+ * Allocate shared memory ring for log records, must be called before fork
+ * @param size size of ring (rounded to the power of 2)
+ * @return new ring or NULL
+ */
+struct rspamd_log_ring* rspamd_log_ring_new (gsize size);
+
+/**
+ * Unmap log ring
+ */
+void rspamd_log_ring_destroy (struct rspamd_log_ring *ring);
+
+/**
+ * Make logger append records to the ring instead of writing them directly
+ * (used by workers after fork), NULL restores direct writing
+ */
+void rspamd_log_set_ring (rspamd_logger_t *logger,
+		struct rspamd_log_ring *ring);
+
+/**
+ * Format and write all records pending in the ring using batched writev
+ * @return number of records written
+ */
+guint rspamd_log_ring_drain (rspamd_logger_t *logger,
+		struct rspamd_log_ring *ring);
+
 /* Typical functions */
 
 /* Logging in postfix style */
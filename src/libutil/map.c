@@ -1923,6 +1923,11 @@ rspamd_radix_fin (struct map_cb_data *data)
 	}
 }
 
+/* Time after which an unfinished compilation by another process is stale */
+#define RSPAMD_REGEXP_MAP_COMPILE_TIMEOUT 300.0
+/* Interval to check whether another process has compiled the database */
+#define RSPAMD_REGEXP_MAP_LOAD_INTERVAL 1.0
+
 struct rspamd_regexp_map {
 	struct rspamd_map *map;
 	GPtrArray *regexps;
@@ -1934,6 +1939,10 @@ struct rspamd_regexp_map {
 	const gchar **patterns;
 	gint *flags;
 	gint *ids;
+	guchar re_digest[rspamd_cryptobox_HASHBYTES];
+	struct event hs_load_ev;
+	gboolean hs_load_pending;
+	gint hs_fd; /* Locked file of the loaded database, marks it as used */
 #endif
 };
 
@@ -1946,6 +1955,9 @@ rspamd_regexp_map_create (struct rspamd_map *map)
 	re_map->values = g_ptr_array_new ();
 	re_map->regexps = g_ptr_array_new ();
 	re_map->map = map;
+#ifdef WITH_HYPERSCAN
+	re_map->hs_fd = -1;
+#endif
 
 	return re_map;
 }
@@ -1970,6 +1982,12 @@ rspamd_regexp_map_destroy (struct rspamd_regexp_map *re_map)
 	g_ptr_array_free (re_map->values, TRUE);
 
 #ifdef WITH_HYPERSCAN
+	if (re_map->hs_load_pending) {
+		event_del (&re_map->hs_load_ev);
+	}
+	if (re_map->hs_fd != -1) {
+		close (re_map->hs_fd);
+	}
 	if (re_map->hs_scratch) {
 		hs_free_scratch (re_map->hs_scratch);
 	}
@@ -2028,16 +2046,292 @@ rspamd_re_map_insert_helper (gpointer st, gconstpointer key, gconstpointer value
 	g_ptr_array_add (re_map->values, g_strdup (value));
 }
 
+#ifdef WITH_HYPERSCAN
+static gboolean
+rspamd_re_map_cache_path (struct rspamd_regexp_map *re_map,
+		gchar *buf, gsize buflen, const gchar *suffix)
+{
+	const gchar *cache_dir = re_map->map->cfg->hs_cache_dir;
+
+	if (cache_dir == NULL) {
+		return FALSE;
+	}
+
+	rspamd_snprintf (buf, buflen, "%s%c%*xs.hsmap%s", cache_dir,
+			G_DIR_SEPARATOR,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, re_map->re_digest,
+			suffix);
+
+	return TRUE;
+}
+
+/*
+ * Opens the database file and takes a shared lock on it: hs_helper removes
+ * only databases that are not locked by any process
+ */
+static gint
+rspamd_re_map_ref_hs (const gchar *fp, struct stat *st)
+{
+	gint fd;
+
+	if ((fd = rspamd_file_xopen (fp, O_RDONLY, 0)) == -1) {
+		return -1;
+	}
+
+	if (!rspamd_file_lock_shared (fd, FALSE) || fstat (fd, st) == -1 ||
+			!S_ISREG (st->st_mode) || st->st_nlink == 0) {
+		/* File has been removed before we have locked it */
+		close (fd);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+static gboolean
+rspamd_re_map_try_load_hs (struct rspamd_regexp_map *re_map)
+{
+	gchar fp[PATH_MAX];
+	hs_database_t *db = NULL;
+	hs_scratch_t *scratch = NULL;
+	struct rspamd_map *map;
+	struct stat st;
+	gpointer data;
+	gint fd;
+
+	map = re_map->map;
+
+	if (!rspamd_re_map_cache_path (re_map, fp, sizeof (fp), "")) {
+		return FALSE;
+	}
+
+	if ((fd = rspamd_re_map_ref_hs (fp, &st)) == -1) {
+		return FALSE;
+	}
+
+	data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (data == MAP_FAILED) {
+		close (fd);
+
+		return FALSE;
+	}
+
+	if (hs_deserialize_database (data, st.st_size, &db) != HS_SUCCESS) {
+		munmap (data, st.st_size);
+		msg_warn_map ("cannot deserialize hyperscan database from %s, "
+				"remove stale file", fp);
+		(void)unlink (fp);
+		close (fd);
+
+		return FALSE;
+	}
+
+	munmap (data, st.st_size);
+
+	if (hs_alloc_scratch (db, &scratch) != HS_SUCCESS) {
+		msg_err_map ("cannot allocate scratch space for hyperscan");
+		hs_free_database (db);
+		close (fd);
+
+		return FALSE;
+	}
+
+	if (re_map->hs_fd != -1) {
+		close (re_map->hs_fd);
+	}
+
+	re_map->hs_fd = fd;
+
+	/* Swap databases: we are single threaded, so no locking is needed */
+	if (re_map->hs_scratch) {
+		hs_free_scratch (re_map->hs_scratch);
+	}
+	if (re_map->hs_db) {
+		hs_free_database (re_map->hs_db);
+	}
+
+	re_map->hs_db = db;
+	re_map->hs_scratch = scratch;
+	msg_info_map ("loaded precompiled hyperscan database from %s", fp);
+
+	return TRUE;
+}
+
+static void
+rspamd_re_map_try_save_hs (struct rspamd_regexp_map *re_map, gint fd,
+		const gchar *tmp_path)
+{
+	gchar np[PATH_MAX];
+	struct rspamd_map *map;
+	char *bytes = NULL;
+	gsize len;
+
+	map = re_map->map;
+
+	if (hs_serialize_database (re_map->hs_db, &bytes, &len) != HS_SUCCESS) {
+		msg_warn_map ("cannot serialize hyperscan database to %s", tmp_path);
+		unlink (tmp_path);
+
+		return;
+	}
+
+	if (write (fd, bytes, len) == -1) {
+		msg_warn_map ("cannot write hyperscan database to %s: %s",
+				tmp_path, strerror (errno));
+		unlink (tmp_path);
+		free (bytes);
+
+		return;
+	}
+
+	free (bytes);
+	fsync (fd);
+	rspamd_re_map_cache_path (re_map, np, sizeof (np), "");
+
+	if (rename (tmp_path, np) == -1) {
+		msg_warn_map ("cannot rename hyperscan database from %s to %s: %s",
+				tmp_path, np, strerror (errno));
+		unlink (tmp_path);
+	}
+}
+
+static void
+rspamd_re_map_ref_saved_hs (struct rspamd_regexp_map *re_map)
+{
+	gchar np[PATH_MAX];
+	struct stat st;
+
+	if (re_map->hs_fd != -1) {
+		close (re_map->hs_fd);
+	}
+
+	rspamd_re_map_cache_path (re_map, np, sizeof (np), "");
+	re_map->hs_fd = rspamd_re_map_ref_hs (np, &st);
+}
+
+static gboolean
+rspamd_re_map_compile_hs (struct rspamd_regexp_map *re_map,
+		hs_platform_info_t *plt)
+{
+	hs_compile_error_t *err;
+	struct rspamd_map *map;
+
+	map = re_map->map;
+
+	if (hs_compile_multi (re_map->patterns,
+			re_map->flags,
+			re_map->ids,
+			re_map->regexps->len,
+			HS_MODE_BLOCK,
+			plt,
+			&re_map->hs_db,
+			&err) != HS_SUCCESS) {
+
+		msg_err_map ("cannot create tree of regexp when processing '%s': %s",
+				err->expression >= 0 ?
+						re_map->patterns[err->expression] :
+						"unknown regexp", err->message);
+		re_map->hs_db = NULL;
+		hs_free_compile_error (err);
+
+		return FALSE;
+	}
+
+	if (hs_alloc_scratch (re_map->hs_db, &re_map->hs_scratch) != HS_SUCCESS) {
+		msg_err_map ("cannot allocate scratch space for hyperscan");
+		hs_free_database (re_map->hs_db);
+		re_map->hs_db = NULL;
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Compile database unless another process is already doing it. Returns TRUE
+ * if the database is ready or FALSE if we need to wait for another process
+ */
+static gboolean
+rspamd_re_map_compile_or_wait (struct rspamd_regexp_map *re_map,
+		hs_platform_info_t *plt)
+{
+	gchar tmp_path[PATH_MAX];
+	struct stat st;
+	gint fd = -1;
+
+	if (rspamd_re_map_cache_path (re_map, tmp_path, sizeof (tmp_path), ".tmp")) {
+		fd = rspamd_file_xopen (tmp_path, O_WRONLY|O_CREAT|O_EXCL, 00644);
+
+		if (fd == -1 && errno == EEXIST) {
+			if (stat (tmp_path, &st) != -1 &&
+					rspamd_get_calendar_ticks () - st.st_mtime <
+					RSPAMD_REGEXP_MAP_COMPILE_TIMEOUT) {
+				/* Another process is compiling the same database */
+				if (re_map->map->ev_base != NULL) {
+					return FALSE;
+				}
+
+				/* We cannot wait without event loop, so compile it in place */
+			}
+			else {
+				/* Stale compilation, take it over */
+				unlink (tmp_path);
+				fd = rspamd_file_xopen (tmp_path, O_WRONLY|O_CREAT|O_EXCL,
+						00644);
+			}
+		}
+	}
+
+	if (rspamd_re_map_compile_hs (re_map, plt) && fd != -1) {
+		rspamd_re_map_try_save_hs (re_map, fd, tmp_path);
+		/* Lock is taken after close to keep fcntl locks valid */
+		close (fd);
+		rspamd_re_map_ref_saved_hs (re_map);
+	}
+	else if (fd != -1) {
+		unlink (tmp_path);
+		close (fd);
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_re_map_hs_load_cb (gint fd, short what, gpointer ud)
+{
+	struct rspamd_regexp_map *re_map = ud;
+	hs_platform_info_t plt;
+	struct timeval tv;
+
+	re_map->hs_load_pending = FALSE;
+
+	if (rspamd_re_map_try_load_hs (re_map)) {
+		return;
+	}
+
+	if (hs_populate_platform (&plt) == HS_SUCCESS &&
+			!rspamd_re_map_compile_or_wait (re_map, &plt)) {
+		double_to_tv (RSPAMD_REGEXP_MAP_LOAD_INTERVAL, &tv);
+		event_add (&re_map->hs_load_ev, &tv);
+		re_map->hs_load_pending = TRUE;
+	}
+}
+#endif
+
 static void
 rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 {
 #ifdef WITH_HYPERSCAN
 	guint i;
 	hs_platform_info_t plt;
-	hs_compile_error_t *err;
 	struct rspamd_map *map;
 	rspamd_regexp_t *re;
 	gint pcre_flags;
+	rspamd_cryptobox_hash_state_t st;
+	struct timeval tv;
 
 	map = re_map->map;
 
@@ -2049,6 +2343,7 @@ rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 	re_map->patterns = g_new (const gchar *, re_map->regexps->len);
 	re_map->flags = g_new (gint, re_map->regexps->len);
 	re_map->ids = g_new (gint, re_map->regexps->len);
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
 
 	for (i = 0; i < re_map->regexps->len; i ++) {
 		re = g_ptr_array_index (re_map->regexps, i);
@@ -2079,32 +2374,36 @@ rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 		}
 
 		re_map->ids[i] = i;
+		/* Pattern with its terminating zero, flags and id are all hashed */
+		rspamd_cryptobox_hash_update (&st, re_map->patterns[i],
+				strlen (re_map->patterns[i]) + 1);
+		rspamd_cryptobox_hash_update (&st, (const guchar *)&re_map->flags[i],
+				sizeof (re_map->flags[i]));
 	}
 
-	if (re_map->regexps->len > 0 && re_map->patterns) {
-		if (hs_compile_multi (re_map->patterns,
-				re_map->flags,
-				re_map->ids,
-				re_map->regexps->len,
-				HS_MODE_BLOCK,
-				&plt,
-				&re_map->hs_db,
-				&err) != HS_SUCCESS) {
-
-			msg_err_map ("cannot create tree of regexp when processing '%s': %s",
-					err->expression >= 0 ?
-							re_map->patterns[err->expression] :
-							"unknown regexp", err->message);
-			re_map->hs_db = NULL;
-			hs_free_compile_error (err);
+	rspamd_cryptobox_hash_update (&st, (const guchar *)&plt, sizeof (plt));
+	rspamd_cryptobox_hash_final (&st, re_map->re_digest);
 
+	if (re_map->regexps->len > 0 && re_map->patterns) {
+		/*
+		 * Databases are stored in the hyperscan cache dir keyed by the map
+		 * content hash, so only one process compiles each version of a map
+		 * and all others load it
+		 */
+		if (rspamd_re_map_try_load_hs (re_map)) {
 			return;
 		}
 
-		if (hs_alloc_scratch (re_map->hs_db, &re_map->hs_scratch) != HS_SUCCESS) {
-			msg_err_map ("cannot allocate scratch space for hyperscan");
-			hs_free_database (re_map->hs_db);
-			re_map->hs_db = NULL;
+		if (!rspamd_re_map_compile_or_wait (re_map, &plt)) {
+			/* Use PCRE until the database is ready */
+			msg_info_map ("hyperscan database is being compiled by another "
+					"process, use pcre meanwhile");
+			event_set (&re_map->hs_load_ev, -1, EV_TIMEOUT,
+					rspamd_re_map_hs_load_cb, re_map);
+			event_base_set (map->ev_base, &re_map->hs_load_ev);
+			double_to_tv (RSPAMD_REGEXP_MAP_LOAD_INTERVAL, &tv);
+			event_add (&re_map->hs_load_ev, &tv);
+			re_map->hs_load_pending = TRUE;
 		}
 	}
 	else {
@@ -42,8 +42,30 @@
  */
 #undef MEMORY_GREEDY
 
+/* Histogram has 4 buckets per power of 2 starting from 1Kb */
+#define MEMPOOL_HIST_MIN_ORDER 10
+#define MEMPOOL_HIST_STEPS 4
+/* Number of pools for a tag required to suggest the first chain size */
+#define MEMPOOL_LEARN_MIN 16
+/* Histogram counters are halved when this number of samples is reached */
+#define MEMPOOL_HIST_DECAY 1024
+#define MEMPOOL_EWMA_ALPHA 0.1
+/* States of tag slots */
+#define MEMPOOL_TAG_FREE 0
+#define MEMPOOL_TAG_CLAIMING 1
+#define MEMPOOL_TAG_READY 2
+/* Number of attempts to wait for the tag name being written by another process */
+#define MEMPOOL_TAG_SPINS 1024
+#define MEMPOOL_SUGGESTED_MAX (32 * 1024 * 1024)
+
+struct rspamd_mempool_shared_stat {
+	rspamd_mempool_stat_t st;
+	rspamd_mempool_tag_stat_t tags[MEMPOOL_TAGS_MAX];
+};
+
 /* Internal statistic */
 static rspamd_mempool_stat_t *mem_pool_stat = NULL;
+static rspamd_mempool_tag_stat_t *mem_pool_tags = NULL;
 /* Environment variable */
 static gboolean env_checked = FALSE;
 static gboolean always_malloc = FALSE;
@@ -187,6 +209,140 @@ rspamd_mempool_append_chain (rspamd_mempool_t * pool,
 	g_ptr_array_add (pool->pools[pool_type], chain);
 }
 
+static guint
+rspamd_mempool_size_bucket (gsize size)
+{
+	guint order = MEMPOOL_HIST_MIN_ORDER, max_order;
+
+	max_order = MEMPOOL_HIST_MIN_ORDER +
+			MEMPOOL_HIST_BUCKETS / MEMPOOL_HIST_STEPS;
+
+	if (size < (1ULL << order)) {
+		return 0;
+	}
+
+	while (order < max_order && size >= (1ULL << (order + 1))) {
+		order ++;
+	}
+
+	if (order == max_order) {
+		return MEMPOOL_HIST_BUCKETS - 1;
+	}
+
+	return (order - MEMPOOL_HIST_MIN_ORDER) * MEMPOOL_HIST_STEPS +
+			((size - (1ULL << order)) >> (order - 2));
+}
+
+gsize
+rspamd_mempool_hist_bucket_size (guint bucket)
+{
+	guint order, step;
+
+	order = MEMPOOL_HIST_MIN_ORDER + bucket / MEMPOOL_HIST_STEPS;
+	step = bucket % MEMPOOL_HIST_STEPS;
+
+	return (1ULL << order) + ((gsize)(step + 1) << (order - 2));
+}
+
+/*
+ * Tags are stored in the shared memory, so all processes learn together
+ */
+static rspamd_mempool_tag_stat_t *
+rspamd_mempool_get_tag_stat (const gchar *tag)
+{
+	rspamd_mempool_tag_stat_t *st;
+	guint i, spins;
+	gint state;
+
+	for (i = 0; i < MEMPOOL_TAGS_MAX; i ++) {
+		st = &mem_pool_tags[i];
+		state = __atomic_load_n (&st->used, __ATOMIC_ACQUIRE);
+
+		if (state == MEMPOOL_TAG_FREE) {
+			if (__atomic_compare_exchange_n (&st->used, &state,
+					MEMPOOL_TAG_CLAIMING, FALSE,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				rspamd_strlcpy (st->tagname, tag, sizeof (st->tagname));
+				/* Name must be visible before the slot is marked as ready */
+				__atomic_store_n (&st->used, MEMPOOL_TAG_READY,
+						__ATOMIC_RELEASE);
+
+				return st;
+			}
+			/* Otherwise state is updated with the current value */
+		}
+
+		/* Another process is writing the tag name, it is a short copy */
+		for (spins = 0; state == MEMPOOL_TAG_CLAIMING &&
+				spins < MEMPOOL_TAG_SPINS; spins ++) {
+			state = __atomic_load_n (&st->used, __ATOMIC_ACQUIRE);
+		}
+
+		if (state == MEMPOOL_TAG_READY && strcmp (st->tagname, tag) == 0) {
+			return st;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Statistics are shared between processes that update them concurrently, so
+ * all fields are accessed atomically. Updates of averages and histogram decay
+ * could be lost in races, which is fine for statistics
+ */
+static void
+rspamd_mempool_learn (rspamd_mempool_tag_stat_t *st, gsize size, guint chains)
+{
+	guint i, cur = 0, bucket, samples, pools, v;
+	gdouble avg_size, avg_chains;
+
+	pools = __atomic_fetch_add (&st->pools, 1, __ATOMIC_RELAXED);
+
+	if (pools == 0) {
+		avg_size = size;
+		avg_chains = chains;
+	}
+	else {
+		__atomic_load (&st->avg_size, &avg_size, __ATOMIC_RELAXED);
+		__atomic_load (&st->avg_chains, &avg_chains, __ATOMIC_RELAXED);
+		avg_size += MEMPOOL_EWMA_ALPHA * (size - avg_size);
+		avg_chains += MEMPOOL_EWMA_ALPHA * (chains - avg_chains);
+	}
+
+	__atomic_store (&st->avg_size, &avg_size, __ATOMIC_RELAXED);
+	__atomic_store (&st->avg_chains, &avg_chains, __ATOMIC_RELAXED);
+
+	bucket = rspamd_mempool_size_bucket (size);
+	__atomic_add_fetch (&st->hist[bucket], 1, __ATOMIC_RELAXED);
+	samples = __atomic_add_fetch (&st->samples, 1, __ATOMIC_RELAXED);
+
+	if (samples >= MEMPOOL_HIST_DECAY &&
+			__atomic_compare_exchange_n (&st->samples, &samples, 0, FALSE,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		/* Forget old samples exponentially, only one process does it */
+		for (i = 0; i < MEMPOOL_HIST_BUCKETS; i ++) {
+			v = __atomic_load_n (&st->hist[i], __ATOMIC_RELAXED) / 2;
+			__atomic_store_n (&st->hist[i], v, __ATOMIC_RELAXED);
+			__atomic_add_fetch (&st->samples, v, __ATOMIC_RELAXED);
+		}
+	}
+
+	samples = __atomic_load_n (&st->samples, __ATOMIC_RELAXED);
+
+	/* Select 90th percentile */
+	for (i = 0; i < MEMPOOL_HIST_BUCKETS; i ++) {
+		cur += __atomic_load_n (&st->hist[i], __ATOMIC_RELAXED);
+
+		if (cur * 10 >= samples * 9) {
+			break;
+		}
+	}
+
+	__atomic_store_n (&st->suggested_size, rspamd_mempool_hist_bucket_size (
+			MIN (i, MEMPOOL_HIST_BUCKETS - 1)), __ATOMIC_RELAXED);
+}
+
 /**
  * Allocate new memory poll
  * @param size size of pool's page
@@ -196,48 +352,50 @@ rspamd_mempool_t *
 rspamd_mempool_new (gsize size, const gchar *tag)
 {
 	rspamd_mempool_t *new;
+	struct _pool_chain *chain;
 	gpointer map;
 	unsigned char uidbuf[10];
 	const gchar hexdigits[] = "0123456789abcdef";
 	unsigned i;
+	guint suggested;
 
 	g_return_val_if_fail (size > 0, NULL);
 	/* Allocate statistic structure if it is not allocated before */
 	if (mem_pool_stat == NULL) {
 #if defined(HAVE_MMAP_ANON)
 		map = mmap (NULL,
-				sizeof (rspamd_mempool_stat_t),
+				sizeof (struct rspamd_mempool_shared_stat),
 				PROT_READ | PROT_WRITE,
 				MAP_ANON | MAP_SHARED,
 				-1,
 				0);
 		if (map == MAP_FAILED) {
 			msg_err ("cannot allocate %z bytes, aborting",
-				sizeof (rspamd_mempool_stat_t));
+				sizeof (struct rspamd_mempool_shared_stat));
 			abort ();
 		}
-		mem_pool_stat = (rspamd_mempool_stat_t *)map;
 #elif defined(HAVE_MMAP_ZERO)
 		gint fd;
 
 		fd = open ("/dev/zero", O_RDWR);
 		g_assert (fd != -1);
 		map = mmap (NULL,
-				sizeof (rspamd_mempool_stat_t),
+				sizeof (struct rspamd_mempool_shared_stat),
 				PROT_READ | PROT_WRITE,
 				MAP_SHARED,
 				fd,
 				0);
 		if (map == MAP_FAILED) {
 			msg_err ("cannot allocate %z bytes, aborting",
-				sizeof (rspamd_mempool_stat_t));
+				sizeof (struct rspamd_mempool_shared_stat));
 			abort ();
 		}
-		mem_pool_stat = (rspamd_mempool_stat_t *)map;
 #else
 #       error No mmap methods are defined
 #endif
-		memset (map, 0, sizeof (rspamd_mempool_stat_t));
+		memset (map, 0, sizeof (struct rspamd_mempool_shared_stat));
+		mem_pool_stat = &((struct rspamd_mempool_shared_stat *)map)->st;
+		mem_pool_tags = ((struct rspamd_mempool_shared_stat *)map)->tags;
 	}
 
 	if (!env_checked) {
@@ -273,6 +431,23 @@ rspamd_mempool_new (gsize size, const gchar *tag)
 	}
 	new->tag.uid[19] = '\0';
 
+	if (new->tag.tagname[0] != '\0') {
+		new->tag_stat = rspamd_mempool_get_tag_stat (new->tag.tagname);
+
+		if (new->tag_stat && !always_malloc &&
+				__atomic_load_n (&new->tag_stat->pools, __ATOMIC_RELAXED) >=
+						MEMPOOL_LEARN_MIN &&
+				(suggested = __atomic_load_n (&new->tag_stat->suggested_size,
+						__ATOMIC_RELAXED)) > size) {
+			/* Preallocate the first chain to fit the most of pools with this tag */
+			chain = rspamd_mempool_chain_new (
+					MIN (suggested, MEMPOOL_SUGGESTED_MAX) +
+					MEM_ALIGNMENT,
+					RSPAMD_MEMPOOL_NORMAL);
+			rspamd_mempool_append_chain (new, chain, RSPAMD_MEMPOOL_NORMAL);
+		}
+	}
+
 	mem_pool_stat->pools_allocated++;
 
 	return new;
@@ -522,6 +697,18 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 
 	g_array_free (pool->destructors, TRUE);
 
+	if (pool->tag_stat && pool->pools[RSPAMD_MEMPOOL_NORMAL]) {
+		len = 0;
+
+		for (j = 0; j < pool->pools[RSPAMD_MEMPOOL_NORMAL]->len; j++) {
+			cur = g_ptr_array_index (pool->pools[RSPAMD_MEMPOOL_NORMAL], j);
+			len += cur->pos - cur->begin;
+		}
+
+		rspamd_mempool_learn (pool->tag_stat, len,
+				pool->pools[RSPAMD_MEMPOOL_NORMAL]->len);
+	}
+
 	for (i = 0; i < G_N_ELEMENTS (pool->pools); i ++) {
 		if (pool->pools[i]) {
 			for (j = 0; j < pool->pools[i]->len; j++) {
@@ -605,6 +792,43 @@ rspamd_mempool_stat (rspamd_mempool_stat_t * st)
 	}
 }
 
+guint
+rspamd_mempool_tags_stat (rspamd_mempool_tag_stat_t *st, guint max)
+{
+	rspamd_mempool_tag_stat_t *src, *dst;
+	guint i, j, n = 0;
+
+	if (mem_pool_tags != NULL) {
+		for (i = 0; i < MEMPOOL_TAGS_MAX && n < max; i ++) {
+			src = &mem_pool_tags[i];
+
+			if (__atomic_load_n (&src->used, __ATOMIC_ACQUIRE) ==
+					MEMPOOL_TAG_READY &&
+					__atomic_load_n (&src->pools, __ATOMIC_RELAXED) > 0) {
+				dst = &st[n ++];
+				memcpy (dst->tagname, src->tagname, sizeof (dst->tagname));
+				dst->used = MEMPOOL_TAG_READY;
+				dst->pools = __atomic_load_n (&src->pools, __ATOMIC_RELAXED);
+				dst->samples = __atomic_load_n (&src->samples,
+						__ATOMIC_RELAXED);
+				dst->suggested_size = __atomic_load_n (&src->suggested_size,
+						__ATOMIC_RELAXED);
+				__atomic_load (&src->avg_size, &dst->avg_size,
+						__ATOMIC_RELAXED);
+				__atomic_load (&src->avg_chains, &dst->avg_chains,
+						__ATOMIC_RELAXED);
+
+				for (j = 0; j < MEMPOOL_HIST_BUCKETS; j ++) {
+					dst->hist[j] = __atomic_load_n (&src->hist[j],
+							__ATOMIC_RELAXED);
+				}
+			}
+		}
+	}
+
+	return n;
+}
+
 void
 rspamd_mempool_stat_reset (void)
 {
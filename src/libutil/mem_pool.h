@@ -21,6 +21,8 @@ struct f_str_s;
 
 #define MEMPOOL_TAG_LEN 20
 #define MEMPOOL_UID_LEN 20
+#define MEMPOOL_TAGS_MAX 64
+#define MEMPOOL_HIST_BUCKETS 64
 #define MEM_ALIGNMENT   16    /* Better for SSE */
 #define align_ptr(p, a)                                                   \
     (guint8 *) (((uintptr_t) (p) + ((uintptr_t) a - 1)) & ~((uintptr_t) a - 1))
@@ -86,6 +88,20 @@ struct rspamd_mempool_tag {
 	gchar uid[MEMPOOL_UID_LEN];             /**< unique id								*/
 };
 
+/**
+ * Per-tag history of pools sizes
+ */
+typedef struct memory_pool_tag_stat_s {
+	gchar tagname[MEMPOOL_TAG_LEN];         /**< tag of pools						*/
+	gint used;                              /**< slot state: free, claiming or ready	*/
+	guint pools;                            /**< number of pools destroyed			*/
+	guint samples;                          /**< number of samples in histogram		*/
+	guint suggested_size;                   /**< size of the first chain for new pools	*/
+	gdouble avg_size;                       /**< weighted average of peak size		*/
+	gdouble avg_chains;                     /**< weighted average of chains count	*/
+	guint hist[MEMPOOL_HIST_BUCKETS];       /**< histogram of peak sizes			*/
+} rspamd_mempool_tag_stat_t;
+
 /**
  * Memory pool type
  */
@@ -97,6 +113,7 @@ typedef struct memory_pool_s {
 	GHashTable *variables;                  /**< private memory pool variables			*/
 	gsize elt_len;							/**< size of an element						*/
 	struct rspamd_mempool_tag tag;          /**< memory pool tag						*/
+	rspamd_mempool_tag_stat_t *tag_stat;    /**< history for this tag					*/
 } rspamd_mempool_t;
 
 /**
@@ -288,6 +305,21 @@ void rspamd_mempool_stat (rspamd_mempool_stat_t *st);
  */
 void rspamd_mempool_stat_reset (void);
 
+/**
+ * Get history of pools for each tag
+ * @param st array of stat structures
+ * @param max number of elements in `st`
+ * @return number of tags written
+ */
+guint rspamd_mempool_tags_stat (rspamd_mempool_tag_stat_t *st, guint max);
+
+/**
+ * Get upper bound of the specified histogram bucket
+ * @param bucket index of bucket
+ * @return size in bytes
+ */
+gsize rspamd_mempool_hist_bucket_size (guint bucket);
+
 /**
  * Get optimal pool size based on page size for this system
  * @return size of memory page in system
@@ -0,0 +1,316 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "pool_hash.h"
+#include "str_util.h"
+
+#define POOL_HASH_MIN_SIZE 8
+#define POOL_HASH_INLINE_KEY 16
+
+/* Elements are stored densely in the order of insertion */
+struct rspamd_pool_hash_entry {
+	gpointer key;
+	gpointer value;
+};
+
+struct rspamd_pool_hash_slot {
+	guint32 hash;
+	guint32 keylen;
+	/* Position of element plus one, zero means empty slot */
+	guint32 pos;
+	/* Prefix of a string key to compare without following the pointer */
+	gchar inl[POOL_HASH_INLINE_KEY];
+};
+
+struct rspamd_pool_hash_s {
+	rspamd_mempool_t *pool;
+	struct rspamd_pool_hash_slot *slots;
+	struct rspamd_pool_hash_entry *entries;
+	GHashFunc hash_func;
+	GEqualFunc equal_func;
+	guint nelts;
+	guint nalloc;
+	guint mask;
+	gboolean strcase;
+};
+
+static struct rspamd_pool_hash_slot *
+rspamd_pool_hash_alloc_slots (rspamd_mempool_t *pool, guint nslots)
+{
+	return rspamd_mempool_alloc0 (pool,
+			sizeof (struct rspamd_pool_hash_slot) * nslots);
+}
+
+static rspamd_pool_hash_t *
+rspamd_pool_hash_new_common (rspamd_mempool_t *pool, guint size_hint)
+{
+	rspamd_pool_hash_t *hash;
+	guint nslots = POOL_HASH_MIN_SIZE;
+
+	g_assert (pool != NULL);
+
+	/* Keep load factor below 3/4 */
+	while (nslots * 3 < size_hint * 4) {
+		nslots <<= 1;
+	}
+
+	hash = rspamd_mempool_alloc0 (pool, sizeof (*hash));
+	hash->pool = pool;
+	hash->slots = rspamd_pool_hash_alloc_slots (pool, nslots);
+	hash->mask = nslots - 1;
+	hash->nalloc = MAX (size_hint, POOL_HASH_MIN_SIZE);
+	hash->entries = rspamd_mempool_alloc (pool,
+			sizeof (struct rspamd_pool_hash_entry) * hash->nalloc);
+
+	return hash;
+}
+
+rspamd_pool_hash_t *
+rspamd_pool_hash_new (rspamd_mempool_t *pool,
+		GHashFunc hash_func,
+		GEqualFunc equal_func,
+		guint size_hint)
+{
+	rspamd_pool_hash_t *hash;
+
+	g_assert (hash_func != NULL && equal_func != NULL);
+
+	hash = rspamd_pool_hash_new_common (pool, size_hint);
+	hash->hash_func = hash_func;
+	hash->equal_func = equal_func;
+
+	return hash;
+}
+
+rspamd_pool_hash_t *
+rspamd_pool_hash_new_strcase (rspamd_mempool_t *pool, guint size_hint)
+{
+	rspamd_pool_hash_t *hash;
+
+	hash = rspamd_pool_hash_new_common (pool, size_hint);
+	hash->hash_func = rspamd_strcase_hash;
+	hash->strcase = TRUE;
+
+	return hash;
+}
+
+static inline gboolean
+rspamd_pool_hash_slot_match (rspamd_pool_hash_t *hash,
+		struct rspamd_pool_hash_slot *slot,
+		gconstpointer key, guint32 h, guint32 keylen)
+{
+	if (slot->hash != h) {
+		return FALSE;
+	}
+
+	if (hash->strcase) {
+		if (slot->keylen != keylen) {
+			return FALSE;
+		}
+
+		if (keylen < POOL_HASH_INLINE_KEY) {
+			return g_ascii_strncasecmp (slot->inl, key, keylen) == 0;
+		}
+
+		if (g_ascii_strncasecmp (slot->inl, key,
+				POOL_HASH_INLINE_KEY) != 0) {
+			return FALSE;
+		}
+
+		return g_ascii_strncasecmp (hash->entries[slot->pos - 1].key, key,
+				keylen) == 0;
+	}
+
+	return hash->equal_func (hash->entries[slot->pos - 1].key, key);
+}
+
+static struct rspamd_pool_hash_slot *
+rspamd_pool_hash_find_slot (rspamd_pool_hash_t *hash,
+		gconstpointer key, guint32 h, guint32 keylen)
+{
+	struct rspamd_pool_hash_slot *slot;
+	guint i;
+
+	/* Linear probing, table is never full */
+	for (i = h & hash->mask; ; i = (i + 1) & hash->mask) {
+		slot = &hash->slots[i];
+
+		if (slot->pos == 0 ||
+				rspamd_pool_hash_slot_match (hash, slot, key, h, keylen)) {
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Old slots and entries are left in the pool, as they are freed with it anyway
+ */
+static void
+rspamd_pool_hash_grow (rspamd_pool_hash_t *hash)
+{
+	struct rspamd_pool_hash_slot *old_slots, *slot;
+	guint i, j, old_size, mask;
+
+	old_slots = hash->slots;
+	old_size = hash->mask + 1;
+	mask = old_size * 2 - 1;
+	hash->slots = rspamd_pool_hash_alloc_slots (hash->pool, old_size * 2);
+	hash->mask = mask;
+
+	for (i = 0; i < old_size; i ++) {
+		if (old_slots[i].pos != 0) {
+			for (j = old_slots[i].hash & mask; ; j = (j + 1) & mask) {
+				slot = &hash->slots[j];
+
+				if (slot->pos == 0) {
+					memcpy (slot, &old_slots[i], sizeof (*slot));
+					break;
+				}
+			}
+		}
+	}
+}
+
+static void
+rspamd_pool_hash_grow_entries (rspamd_pool_hash_t *hash)
+{
+	struct rspamd_pool_hash_entry *old_entries = hash->entries;
+
+	hash->nalloc *= 2;
+	hash->entries = rspamd_mempool_alloc (hash->pool,
+			sizeof (struct rspamd_pool_hash_entry) * hash->nalloc);
+	memcpy (hash->entries, old_entries,
+			sizeof (struct rspamd_pool_hash_entry) * hash->nelts);
+}
+
+gpointer
+rspamd_pool_hash_lookup (rspamd_pool_hash_t *hash, gconstpointer key)
+{
+	struct rspamd_pool_hash_slot *slot;
+	guint32 keylen = 0;
+
+	g_assert (hash != NULL);
+
+	if (key == NULL) {
+		return NULL;
+	}
+
+	if (hash->strcase) {
+		keylen = strlen (key);
+	}
+
+	slot = rspamd_pool_hash_find_slot (hash, key, hash->hash_func (key),
+			keylen);
+
+	return slot->pos ? hash->entries[slot->pos - 1].value : NULL;
+}
+
+void
+rspamd_pool_hash_insert (rspamd_pool_hash_t *hash,
+		gpointer key,
+		gpointer value)
+{
+	struct rspamd_pool_hash_slot *slot;
+	guint32 h, keylen = 0;
+
+	g_assert (hash != NULL && key != NULL);
+
+	if ((hash->nelts + 1) * 4 > (hash->mask + 1) * 3) {
+		rspamd_pool_hash_grow (hash);
+	}
+
+	h = hash->hash_func (key);
+
+	if (hash->strcase) {
+		keylen = strlen (key);
+	}
+
+	slot = rspamd_pool_hash_find_slot (hash, key, h, keylen);
+
+	if (slot->pos == 0) {
+		if (hash->nelts == hash->nalloc) {
+			rspamd_pool_hash_grow_entries (hash);
+		}
+
+		hash->entries[hash->nelts].key = key;
+		slot->pos = ++hash->nelts;
+		slot->hash = h;
+		slot->keylen = keylen;
+
+		if (hash->strcase) {
+			memcpy (slot->inl, key, MIN (keylen, sizeof (slot->inl)));
+		}
+	}
+
+	hash->entries[slot->pos - 1].value = value;
+}
+
+guint
+rspamd_pool_hash_size (rspamd_pool_hash_t *hash)
+{
+	g_assert (hash != NULL);
+
+	return hash->nelts;
+}
+
+void
+rspamd_pool_hash_foreach (rspamd_pool_hash_t *hash,
+		GHFunc func,
+		gpointer ud)
+{
+	guint i;
+
+	g_assert (hash != NULL);
+
+	for (i = 0; i < hash->nelts; i ++) {
+		func (hash->entries[i].key, hash->entries[i].value, ud);
+	}
+}
+
+void
+rspamd_pool_hash_iter_init (rspamd_pool_hash_iter_t *it,
+		rspamd_pool_hash_t *hash)
+{
+	g_assert (it != NULL && hash != NULL);
+
+	it->hash = hash;
+	it->idx = 0;
+}
+
+gboolean
+rspamd_pool_hash_iter_next (rspamd_pool_hash_iter_t *it,
+		gpointer *key,
+		gpointer *value)
+{
+	struct rspamd_pool_hash_entry *entry;
+
+	if (it->idx < it->hash->nelts) {
+		entry = &it->hash->entries[it->idx ++];
+
+		if (key) {
+			*key = entry->key;
+		}
+		if (value) {
+			*value = entry->value;
+		}
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
@@ -0,0 +1,115 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * @file pool_hash.h
+ * Open addressing hash table that is allocated in a memory pool and is
+ * destroyed with that pool. Elements cannot be removed, keys and values are
+ * not copied so they must live at least as long as the pool. Elements are
+ * stored in a flat array, so iteration follows the order of insertion.
+ */
+#ifndef SRC_LIBUTIL_POOL_HASH_H_
+#define SRC_LIBUTIL_POOL_HASH_H_
+
+#include "config.h"
+#include "mem_pool.h"
+
+struct rspamd_pool_hash_s;
+typedef struct rspamd_pool_hash_s rspamd_pool_hash_t;
+
+typedef struct rspamd_pool_hash_iter_s {
+	rspamd_pool_hash_t *hash;
+	guint idx;
+} rspamd_pool_hash_iter_t;
+
+/**
+ * Create new hash table with the specified hash and equal functions
+ * @param pool memory pool
+ * @param hash_func hash function
+ * @param equal_func keys comparison function
+ * @param size_hint expected number of elements
+ * @return new hash table
+ */
+rspamd_pool_hash_t *rspamd_pool_hash_new (rspamd_mempool_t *pool,
+		GHashFunc hash_func,
+		GEqualFunc equal_func,
+		guint size_hint);
+
+/**
+ * Create new hash table for case insensitive string keys, short keys are
+ * compared inline without dereferencing key pointers
+ * @param pool memory pool
+ * @param size_hint expected number of elements
+ * @return new hash table
+ */
+rspamd_pool_hash_t *rspamd_pool_hash_new_strcase (rspamd_mempool_t *pool,
+		guint size_hint);
+
+/**
+ * Lookup value by key
+ * @param hash hash table
+ * @param key key to find
+ * @return value or NULL if key is not found
+ */
+gpointer rspamd_pool_hash_lookup (rspamd_pool_hash_t *hash,
+		gconstpointer key);
+
+/**
+ * Insert value to the hash table replacing the existing value for the same key
+ * @param hash hash table
+ * @param key key (not copied)
+ * @param value value
+ */
+void rspamd_pool_hash_insert (rspamd_pool_hash_t *hash,
+		gpointer key,
+		gpointer value);
+
+/**
+ * Returns number of elements in the hash table
+ * @param hash hash table
+ * @return
+ */
+guint rspamd_pool_hash_size (rspamd_pool_hash_t *hash);
+
+/**
+ * Call function for each element in the hash table
+ * @param hash hash table
+ * @param func callback
+ * @param ud opaque data for the callback
+ */
+void rspamd_pool_hash_foreach (rspamd_pool_hash_t *hash,
+		GHFunc func,
+		gpointer ud);
+
+/**
+ * Init iterator over the hash table
+ * @param it iterator
+ * @param hash hash table
+ */
+void rspamd_pool_hash_iter_init (rspamd_pool_hash_iter_t *it,
+		rspamd_pool_hash_t *hash);
+
+/**
+ * Get the next element from the hash table
+ * @param it iterator
+ * @param key output key (may be NULL)
+ * @param value output value (may be NULL)
+ * @return FALSE if there are no more elements
+ */
+gboolean rspamd_pool_hash_iter_next (rspamd_pool_hash_iter_t *it,
+		gpointer *key,
+		gpointer *value);
+
+#endif /* SRC_LIBUTIL_POOL_HASH_H_ */
@@ -16,9 +16,259 @@
 #include "shingles.h"
 #include "fstring.h"
 #include "cryptobox.h"
+#include "platform_config.h"
 
 #define SHINGLES_WINDOW 3
 
+/* Constants for the per-pipe mixing in the vector algorithm */
+#define SHINGLES_MIX_C1 0x9E3779B1U
+#define SHINGLES_MIX_C2 0x85EBCA77U
+
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__has_attribute)
+# if __has_attribute(target)
+#  define SHINGLES_HAVE_TARGET_ATTR 1
+#  include <immintrin.h>
+# endif
+#endif
+
+/*
+ * Mixing kernel for the vector algorithm: derives all RSPAMD_SHINGLE_SIZE
+ * keyed values from a single window hash. It uses only 32x32->64
+ * multiplications, so it maps directly to pmuludq lanes.
+ */
+typedef struct rspamd_shingles_impl_s {
+	unsigned long cpu_flags;
+	const gchar *desc;
+
+	void (*mix) (guint64 h, const guint64 *keys, guint64 *out);
+} rspamd_shingles_impl_t;
+
+static inline guint64
+rspamd_shingles_mix_one (guint64 h, guint64 k)
+{
+	guint64 x;
+
+	x = h ^ k;
+	x += (x & 0xffffffffULL) * (x >> 32);
+	x ^= x >> 31;
+	x *= SHINGLES_MIX_C1;
+	x ^= x >> 29;
+	x *= SHINGLES_MIX_C2;
+	x ^= x >> 32;
+
+	return x;
+}
+
+static void
+rspamd_shingles_mix_ref (guint64 h, const guint64 *keys, guint64 *out)
+{
+	guint i;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		out[i] = rspamd_shingles_mix_one (h, keys[i]);
+	}
+}
+
+#ifdef SHINGLES_HAVE_TARGET_ATTR
+/* 64x32 multiplication emulated by two pmuludq */
+#define SHINGLES_MUL32_SSE2(x, c) _mm_add_epi64 (_mm_mul_epu32 ((x), (c)), \
+		_mm_slli_epi64 (_mm_mul_epu32 (_mm_srli_epi64 ((x), 32), (c)), 32))
+
+static void __attribute__((target("sse2")))
+rspamd_shingles_mix_sse2 (guint64 h, const guint64 *keys, guint64 *out)
+{
+	__m128i hv, x, c1, c2;
+	guint i;
+
+	hv = _mm_set1_epi64x (h);
+	c1 = _mm_set1_epi64x (SHINGLES_MIX_C1);
+	c2 = _mm_set1_epi64x (SHINGLES_MIX_C2);
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i += 2) {
+		x = _mm_xor_si128 (hv, _mm_loadu_si128 ((const __m128i *)&keys[i]));
+		x = _mm_add_epi64 (x, _mm_mul_epu32 (x, _mm_srli_epi64 (x, 32)));
+		x = _mm_xor_si128 (x, _mm_srli_epi64 (x, 31));
+		x = SHINGLES_MUL32_SSE2 (x, c1);
+		x = _mm_xor_si128 (x, _mm_srli_epi64 (x, 29));
+		x = SHINGLES_MUL32_SSE2 (x, c2);
+		x = _mm_xor_si128 (x, _mm_srli_epi64 (x, 32));
+		_mm_storeu_si128 ((__m128i *)&out[i], x);
+	}
+}
+
+#if defined(HAVE_AVX2)
+#define SHINGLES_MUL32_AVX2(x, c) _mm256_add_epi64 (_mm256_mul_epu32 ((x), (c)), \
+		_mm256_slli_epi64 (_mm256_mul_epu32 (_mm256_srli_epi64 ((x), 32), (c)), 32))
+
+static void __attribute__((target("avx2")))
+rspamd_shingles_mix_avx2 (guint64 h, const guint64 *keys, guint64 *out)
+{
+	__m256i hv, x, c1, c2;
+	guint i;
+
+	hv = _mm256_set1_epi64x (h);
+	c1 = _mm256_set1_epi64x (SHINGLES_MIX_C1);
+	c2 = _mm256_set1_epi64x (SHINGLES_MIX_C2);
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i += 4) {
+		x = _mm256_xor_si256 (hv,
+				_mm256_loadu_si256 ((const __m256i *)&keys[i]));
+		x = _mm256_add_epi64 (x,
+				_mm256_mul_epu32 (x, _mm256_srli_epi64 (x, 32)));
+		x = _mm256_xor_si256 (x, _mm256_srli_epi64 (x, 31));
+		x = SHINGLES_MUL32_AVX2 (x, c1);
+		x = _mm256_xor_si256 (x, _mm256_srli_epi64 (x, 29));
+		x = SHINGLES_MUL32_AVX2 (x, c2);
+		x = _mm256_xor_si256 (x, _mm256_srli_epi64 (x, 32));
+		_mm256_storeu_si256 ((__m256i *)&out[i], x);
+	}
+}
+#endif
+#endif
+
+/* List implementations from most optimized to least, generic is the last */
+static const rspamd_shingles_impl_t shingles_list[] = {
+#if defined(SHINGLES_HAVE_TARGET_ATTR) && defined(HAVE_AVX2)
+		{CPUID_AVX2, "avx2", rspamd_shingles_mix_avx2},
+#endif
+#if defined(SHINGLES_HAVE_TARGET_ATTR)
+		{CPUID_SSE2, "sse2", rspamd_shingles_mix_sse2},
+#endif
+		{0, "generic", rspamd_shingles_mix_ref},
+};
+
+static const rspamd_shingles_impl_t *shingles_opt =
+		&shingles_list[G_N_ELEMENTS (shingles_list) - 1];
+
+static gboolean
+rspamd_shingles_test_impl (const rspamd_shingles_impl_t *impl)
+{
+	guint64 keys[RSPAMD_SHINGLE_SIZE], expected[RSPAMD_SHINGLE_SIZE],
+		got[RSPAMD_SHINGLE_SIZE], h = 0xcbf29ce484222325ULL;
+	guint i, j;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		keys[i] = rspamd_shingles_mix_one (i, G_MAXUINT64 - i);
+	}
+
+	for (i = 0; i < 16; i ++) {
+		rspamd_shingles_mix_ref (h, keys, expected);
+		impl->mix (h, keys, got);
+
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			if (expected[j] != got[j]) {
+				return FALSE;
+			}
+		}
+
+		h = expected[i];
+	}
+
+	return TRUE;
+}
+
+const gchar *
+rspamd_shingles_load (unsigned long cpu_flags)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (shingles_list); i ++) {
+		if (shingles_list[i].cpu_flags == 0 ||
+				(shingles_list[i].cpu_flags & cpu_flags)) {
+			shingles_opt = &shingles_list[i];
+			g_assert (rspamd_shingles_test_impl (shingles_opt));
+			break;
+		}
+	}
+
+	return shingles_opt->desc;
+}
+
+static inline guint64
+rspamd_shingles_rotl (guint64 x, guint bits)
+{
+	return bits == 0 ? x : (x << bits) | (x >> (64 - bits));
+}
+
+static inline void
+rspamd_shingles_vector_emit (const guint64 *win,
+		const guint64 *lane_keys,
+		guint64 *hashes,
+		gsize hlen,
+		gsize pos,
+		guint64 *mins)
+{
+	guint64 out[RSPAMD_SHINGLE_SIZE], h = 0;
+	gint j, k;
+
+	for (k = 0; k < SHINGLES_WINDOW; k ++) {
+		h ^= rspamd_shingles_rotl (win[k], 8 * (SHINGLES_WINDOW - k - 1));
+	}
+
+	shingles_opt->mix (h, lane_keys, out);
+
+	if (mins) {
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			mins[j] = MIN (mins[j], out[j]);
+		}
+	}
+	else {
+		g_assert (hlen > pos);
+
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			hashes[j * hlen + pos] = out[j];
+		}
+	}
+}
+
+/*
+ * Vector algorithm: each word is hashed exactly once, the window is folded
+ * into a single value and then all pipes are derived by the mixing kernel.
+ * When the default filter is used, minimums are maintained on the fly and
+ * no per-pipe storage is needed at all.
+ */
+static void
+rspamd_shingles_generate_vector (GArray *input,
+		const rspamd_sipkey_t *keys,
+		guint64 *hashes,
+		gsize hlen,
+		guint64 *mins)
+{
+	guint64 lane_keys[RSPAMD_SHINGLE_SIZE], win[SHINGLES_WINDOW], seed;
+	rspamd_ftok_t *word;
+	gsize i;
+	gint k;
+
+	for (k = 0; k < RSPAMD_SHINGLE_SIZE; k ++) {
+		memcpy (&lane_keys[k], keys[k], sizeof (guint64));
+	}
+
+	memcpy (&seed, &keys[0][sizeof (guint64)], sizeof (seed));
+	memset (win, 0, sizeof (win));
+
+	for (i = 0; i < input->len; i ++) {
+		word = &g_array_index (input, rspamd_ftok_t, i);
+
+		for (k = 0; k < SHINGLES_WINDOW - 1; k ++) {
+			win[k] = win[k + 1];
+		}
+
+		win[SHINGLES_WINDOW - 1] = rspamd_cryptobox_fast_hash_specific (
+				RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT,
+				word->begin, word->len, seed);
+
+		if (i + 1 >= SHINGLES_WINDOW) {
+			rspamd_shingles_vector_emit (win, lane_keys, hashes, hlen,
+					i + 1 - SHINGLES_WINDOW, mins);
+		}
+	}
+
+	if (input->len < SHINGLES_WINDOW) {
+		/* Short input produces a single partial window */
+		rspamd_shingles_vector_emit (win, lane_keys, hashes, hlen, 0, mins);
+	}
+}
+
 struct rspamd_shingle* RSPAMD_OPTIMIZE("unroll-loops")
 rspamd_shingles_generate (GArray *input,
 		const guchar key[16],
@@ -28,7 +278,7 @@ rspamd_shingles_generate (GArray *input,
 		enum rspamd_shingle_alg alg)
 {
 	struct rspamd_shingle *res;
-	guint64 **hashes;
+	guint64 *hashes = NULL, *mins = NULL;
 	rspamd_sipkey_t keys[RSPAMD_SHINGLE_SIZE];
 	guchar shabuf[rspamd_cryptobox_HASHBYTES], *out_key;
 	const guchar *cur_key;
@@ -48,16 +298,28 @@ rspamd_shingles_generate (GArray *input,
 	}
 
 	rspamd_cryptobox_hash_init (&bs, NULL, 0);
-	row = rspamd_fstring_sized_new (256);
+	row = NULL;
 	cur_key = key;
 	out_key = (guchar *)&keys[0];
 
 	/* Init hashes pipes and keys */
-	hashes = g_slice_alloc (sizeof (*hashes) * RSPAMD_SHINGLE_SIZE);
 	hlen = input->len > SHINGLES_WINDOW ? (input->len - SHINGLES_WINDOW + 1) : 1;
 
+	if (alg == RSPAMD_SHINGLES_VECTOR &&
+			filter == rspamd_shingles_default_filter) {
+		/* Minimums are collected directly into the result */
+		mins = res->hashes;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			mins[i] = G_MAXUINT64;
+		}
+	}
+	else {
+		/* All pipes are stored in a single block, pipe by pipe */
+		hashes = g_malloc0 (hlen * sizeof (guint64) * RSPAMD_SHINGLE_SIZE);
+	}
+
 	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-		hashes[i] = g_slice_alloc (hlen * sizeof (guint64));
 		/*
 		 * To generate a set of hashes we just apply sha256 to the
 		 * initial key as many times as many hashes are required and
@@ -76,7 +338,12 @@ rspamd_shingles_generate (GArray *input,
 	}
 
 	/* Now parse input words into a vector of hashes using rolling window */
-	if (alg == RSPAMD_SHINGLES_OLD) {
+	if (alg == RSPAMD_SHINGLES_VECTOR) {
+		rspamd_shingles_generate_vector (input, keys, hashes, hlen, mins);
+	}
+	else if (alg == RSPAMD_SHINGLES_OLD) {
+		row = rspamd_fstring_sized_new (256);
+
 		for (i = 0; i <= (gint)input->len; i ++) {
 			if (i - beg >= SHINGLES_WINDOW || i == (gint)input->len) {
 				for (j = beg; j < i; j ++) {
@@ -89,7 +356,7 @@ rspamd_shingles_generate (GArray *input,
 					rspamd_cryptobox_siphash ((guchar *)&val, row->str, row->len,
 							keys[j]);
 					g_assert (hlen > beg);
-					hashes[j][beg] = val;
+					hashes[j * hlen + beg] = val;
 				}
 
 				beg++;
@@ -139,7 +406,7 @@ rspamd_shingles_generate (GArray *input,
 					}
 
 					g_assert (hlen > beg);
-					hashes[j][beg] = val;
+					hashes[j * hlen + beg] = val;
 				}
 				beg++;
 			}
@@ -147,15 +414,18 @@ rspamd_shingles_generate (GArray *input,
 	}
 
 	/* Now we need to filter all hashes and make a shingles result */
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-		res->hashes[i] = filter (hashes[i], hlen,
-				i, key, filterd);
-		g_slice_free1 (hlen * sizeof (guint64), hashes[i]);
-	}
+	if (hashes != NULL) {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			res->hashes[i] = filter (&hashes[i * hlen], hlen,
+					i, key, filterd);
+		}
 
-	g_slice_free1 (sizeof (*hashes) * RSPAMD_SHINGLE_SIZE, hashes);
+		g_free (hashes);
+	}
 
-	rspamd_fstring_free (row);
+	if (row != NULL) {
+		rspamd_fstring_free (row);
+	}
 
 	return res;
 }
@@ -29,7 +29,8 @@ enum rspamd_shingle_alg {
 	RSPAMD_SHINGLES_OLD = 0,
 	RSPAMD_SHINGLES_XXHASH,
 	RSPAMD_SHINGLES_MUMHASH,
-	RSPAMD_SHINGLES_FAST
+	RSPAMD_SHINGLES_FAST,
+	RSPAMD_SHINGLES_VECTOR
 };
 
 /**
@@ -68,6 +69,13 @@ struct rspamd_shingle* rspamd_shingles_generate (GArray *input,
 gdouble rspamd_shingles_compare (const struct rspamd_shingle *a,
 		const struct rspamd_shingle *b);
 
+/**
+ * Select the best mixing kernel for the vector algorithm
+ * @param cpu_flags cpu features as detected by cryptobox
+ * @return name of the selected implementation
+ */
+const gchar *rspamd_shingles_load (unsigned long cpu_flags);
+
 /**
  * Default filtering function
  */
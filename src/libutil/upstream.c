@@ -32,6 +32,15 @@ struct upstream_addr_elt {
 	guint errors;
 };
 
+struct upstream_keepalive_elt {
+	gint fd;
+	guint nrequests;
+	gconstpointer key;
+	struct upstream *up;
+	GList *link;
+	struct event ev;
+};
+
 struct upstream {
 	guint weight;
 	guint cur_weight;
@@ -53,6 +62,7 @@ struct upstream {
 	} addrs;
 
 	struct upstream_inet_addr_entry *new_addrs;
+	GQueue keepalive; /* struct upstream_keepalive_elt, most recent first */
 	rspamd_mutex_t *lock;
 	gpointer data;
 	ref_entry_t ref;
@@ -78,6 +88,9 @@ struct upstream_ctx {
 	gdouble error_time;
 	gdouble dns_timeout;
 	guint dns_retransmits;
+	gdouble keepalive_timeout;
+	guint keepalive_requests;
+	guint keepalive_connections;
 	GQueue *upstreams;
 	gboolean configured;
 	ref_entry_t ref;
@@ -98,6 +111,9 @@ static gdouble default_revive_jitter = 0.4;
 static gdouble default_error_time = 10;
 static gdouble default_dns_timeout = 1.0;
 static guint default_dns_retransmits = 2;
+static gdouble default_keepalive_timeout = 10.0;
+static guint default_keepalive_requests = 1000;
+static guint default_keepalive_connections = 16;
 
 void
 rspamd_upstreams_library_config (struct rspamd_config *cfg,
@@ -122,6 +138,15 @@ rspamd_upstreams_library_config (struct rspamd_config *cfg,
 	if (cfg->dns_timeout) {
 		ctx->dns_timeout = cfg->dns_timeout;
 	}
+	if (cfg->upstream_keepalive_timeout) {
+		ctx->keepalive_timeout = cfg->upstream_keepalive_timeout;
+	}
+	if (cfg->upstream_keepalive_requests) {
+		ctx->keepalive_requests = cfg->upstream_keepalive_requests;
+	}
+	if (cfg->upstream_keepalive_connections) {
+		ctx->keepalive_connections = cfg->upstream_keepalive_connections;
+	}
 
 	ctx->ev_base = ev_base;
 	ctx->res = resolver;
@@ -165,6 +190,9 @@ rspamd_upstreams_library_init (void)
 	ctx->dns_timeout = default_dns_timeout;
 	ctx->revive_jitter = default_revive_jitter;
 	ctx->revive_time = default_revive_time;
+	ctx->keepalive_timeout = default_keepalive_timeout;
+	ctx->keepalive_requests = default_keepalive_requests;
+	ctx->keepalive_connections = default_keepalive_connections;
 
 	ctx->upstreams = g_queue_new ();
 	REF_INIT_RETAIN (ctx, rspamd_upstream_ctx_dtor);
@@ -333,6 +361,38 @@ rspamd_upstream_revive_cb (int fd, short what, void *arg)
 	REF_RELEASE (up);
 }
 
+static void
+rspamd_upstream_keepalive_elt_free (struct upstream_keepalive_elt *elt)
+{
+	event_del (&elt->ev);
+	close (elt->fd);
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+static void
+rspamd_upstream_keepalive_flush (struct upstream *up)
+{
+	struct upstream_keepalive_elt *elt;
+
+	while ((elt = g_queue_pop_head (&up->keepalive)) != NULL) {
+		rspamd_upstream_keepalive_elt_free (elt);
+	}
+}
+
+static void
+rspamd_upstream_keepalive_cb (gint fd, short what, gpointer ud)
+{
+	struct upstream_keepalive_elt *elt = ud;
+
+	/*
+	 * Idle connection should never become readable: the peer has either
+	 * closed it or sent something unexpected, so we just drop it as well
+	 * as the connections that have reached idle timeout
+	 */
+	g_queue_delete_link (&elt->up->keepalive, elt->link);
+	rspamd_upstream_keepalive_elt_free (elt);
+}
+
 static void
 rspamd_upstream_set_inactive (struct upstream_list *ls, struct upstream *up)
 {
@@ -431,6 +491,9 @@ rspamd_upstream_fail (struct upstream *up)
 			addr_elt->errors ++;
 		}
 
+		/* Idle connections are likely broken as well */
+		rspamd_upstream_keepalive_flush (up);
+
 		RSPAMD_UPSTREAM_UNLOCK (up->lock);
 	}
 }
@@ -502,6 +565,7 @@ rspamd_upstream_dtor (struct upstream *up)
 		g_ptr_array_free (up->addrs.addr, TRUE);
 	}
 
+	rspamd_upstream_keepalive_flush (up);
 	rspamd_mutex_free (up->lock);
 	g_free (up->name);
 
@@ -536,6 +600,79 @@ rspamd_upstream_name (struct upstream *up)
 	return up->name;
 }
 
+gint
+rspamd_upstream_keepalive_get (struct upstream *up, gconstpointer key,
+		guint *nrequests)
+{
+	GList *cur;
+	struct upstream_keepalive_elt *elt;
+	gint fd = -1;
+
+	RSPAMD_UPSTREAM_LOCK (up->lock);
+
+	for (cur = up->keepalive.head; cur != NULL; cur = g_list_next (cur)) {
+		elt = cur->data;
+
+		if (elt->key == key) {
+			g_queue_delete_link (&up->keepalive, cur);
+			event_del (&elt->ev);
+			fd = elt->fd;
+
+			if (nrequests) {
+				*nrequests = elt->nrequests;
+			}
+
+			g_slice_free1 (sizeof (*elt), elt);
+			break;
+		}
+	}
+
+	RSPAMD_UPSTREAM_UNLOCK (up->lock);
+
+	return fd;
+}
+
+void
+rspamd_upstream_keepalive_put (struct upstream *up, gconstpointer key,
+		gint fd, guint nrequests)
+{
+	struct upstream_keepalive_elt *elt;
+	struct upstream_ctx *ctx = up->ctx;
+	struct timeval tv;
+
+	if (ctx == NULL || ctx->ev_base == NULL || !ctx->configured ||
+			up->active_idx == -1 ||
+			ctx->keepalive_connections == 0 ||
+			nrequests >= ctx->keepalive_requests) {
+		close (fd);
+
+		return;
+	}
+
+	RSPAMD_UPSTREAM_LOCK (up->lock);
+
+	if (up->keepalive.length >= ctx->keepalive_connections) {
+		/* Drop the least recently used connection */
+		elt = g_queue_pop_tail (&up->keepalive);
+		rspamd_upstream_keepalive_elt_free (elt);
+	}
+
+	elt = g_slice_alloc0 (sizeof (*elt));
+	elt->fd = fd;
+	elt->key = key;
+	elt->nrequests = nrequests;
+	elt->up = up;
+	g_queue_push_head (&up->keepalive, elt);
+	elt->link = up->keepalive.head;
+
+	event_set (&elt->ev, fd, EV_READ, rspamd_upstream_keepalive_cb, elt);
+	event_base_set (ctx->ev_base, &elt->ev);
+	double_to_tv (ctx->keepalive_timeout, &tv);
+	event_add (&elt->ev, &tv);
+
+	RSPAMD_UPSTREAM_UNLOCK (up->lock);
+}
+
 gboolean
 rspamd_upstreams_add_upstream (struct upstream_list *ups,
 		const gchar *str, guint16 def_port, void *data)
@@ -165,6 +165,27 @@ gboolean rspamd_upstream_add_addr (struct upstream *up,
  */
 const gchar* rspamd_upstream_name (struct upstream *up);
 
+/**
+ * Gets an idle connection to the upstream from its keep-alive pool
+ * @param up upstream
+ * @param key opaque key that the connection has been stored with (e.g. a peer key)
+ * @param nrequests number of requests already served by the connection
+ * @return connected socket or -1 if there are no idle connections
+ */
+gint rspamd_upstream_keepalive_get (struct upstream *up, gconstpointer key,
+		guint *nrequests);
+
+/**
+ * Returns connection to the keep-alive pool of the upstream (ownership of fd
+ * is transferred to upstream, it is closed if it cannot be reused)
+ * @param up upstream
+ * @param key opaque key for the connection
+ * @param fd connected socket
+ * @param nrequests number of requests served by the connection
+ */
+void rspamd_upstream_keepalive_put (struct upstream *up, gconstpointer key,
+		gint fd, guint nrequests);
+
 /**
  * Sets opaque user data associated with this upstream
  * @param up
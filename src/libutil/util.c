@@ -23,6 +23,7 @@
 #include "ottery.h"
 #include "cryptobox.h"
 #include "libutil/map.h"
+#include "shingles.h"
 
 #ifdef HAVE_OPENSSL
 #include <openssl/rand.h>
@@ -1282,6 +1283,33 @@ rspamd_file_lock (gint fd, gboolean async)
 	return TRUE;
 }
 
+gboolean
+rspamd_file_lock_shared (gint fd, gboolean async)
+{
+	gint flags;
+
+	if (async) {
+		flags = LOCK_SH | LOCK_NB;
+	}
+	else {
+		flags = LOCK_SH;
+	}
+
+	if (flock (fd, flags) == -1) {
+		if (async && errno == EAGAIN) {
+			return FALSE;
+		}
+
+		if (errno != ENOTSUP) {
+			msg_warn ("shared lock on file failed: %s", strerror (errno));
+		}
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 gboolean
 rspamd_file_unlock (gint fd, gboolean async)
 {
@@ -1335,6 +1363,30 @@ rspamd_file_lock (gint fd, gboolean async)
 	return TRUE;
 }
 
+gboolean
+rspamd_file_lock_shared (gint fd, gboolean async)
+{
+	struct flock fl = {
+		.l_type = F_RDLCK,
+		.l_whence = SEEK_SET,
+		.l_start = 0,
+		.l_len = 0
+	};
+
+	if (fcntl (fd, async ? F_SETLK : F_SETLKW, &fl) == -1) {
+		if (async && (errno == EAGAIN || errno == EACCES)) {
+			return FALSE;
+		}
+		if (errno != ENOTSUP) {
+			msg_warn ("shared lock on file failed: %s", strerror (errno));
+		}
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 gboolean
 rspamd_file_unlock (gint fd, gboolean async)
 {
@@ -1995,6 +2047,7 @@ rspamd_init_libs (void)
 
 	ctx = g_slice_alloc0 (sizeof (*ctx));
 	ctx->crypto_ctx = rspamd_cryptobox_init ();
+	ctx->shingles_impl = rspamd_shingles_load (ctx->crypto_ctx->cpu_config);
 	ottery_cfg = g_malloc0 (ottery_get_sizeof_config ());
 	ottery_config_init (ottery_cfg);
 	ctx->ottery_cfg = ottery_cfg;
@@ -164,6 +164,7 @@ rspamd_log_check_time (gdouble start, gdouble end, gint resolution);
  * File locking functions
  */
 gboolean rspamd_file_lock (gint fd, gboolean async);
+gboolean rspamd_file_lock_shared (gint fd, gboolean async);
 gboolean rspamd_file_unlock (gint fd, gboolean async);
 
 /*
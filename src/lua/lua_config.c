@@ -853,6 +853,8 @@ rspamd_register_symbol_fromlua (lua_State *L,
 				cd,
 				type,
 				parent);
+		/* Lua callbacks can insert any symbols with any multipliers */
+		rspamd_symbols_cache_set_scaled_id (cfg->cache, ret);
 	}
 	else {
 		ret = rspamd_symbols_cache_add_symbol (cfg->cache,
@@ -292,6 +292,8 @@ lua_html_get_images (lua_State *L)
 
 	if (hc != NULL) {
 		lua_newtable (L);
+		/* Rules check parents of image tags, so tree is required */
+		rspamd_html_build_tree (hc);
 
 		if (hc->images && hc->images->len > 0) {
 			for (i = 0; i < hc->images->len; i ++) {
@@ -369,7 +371,8 @@ lua_html_get_blocks (lua_State *L)
 	guint i;
 
 	if (hc != NULL) {
-		lua_createtable (L, hc->blocks->len, 0);
+		rspamd_html_build_tree (hc);
+		lua_createtable (L, hc->blocks ? hc->blocks->len : 0, 0);
 
 		if (hc->blocks && hc->blocks->len > 0) {
 			for (i = 0; i < hc->blocks->len; i ++) {
@@ -438,6 +441,8 @@ lua_html_foreach_tag (lua_State *L)
 	tagname = luaL_checkstring (L, 2);
 
 	if (hc && tagname && lua_isfunction (L, 3)) {
+		rspamd_html_build_tree (hc);
+
 		if (hc->html_tags) {
 			if (strcmp (tagname, "any") == 0) {
 				id = -1;
@@ -599,16 +599,18 @@ lua_mimepart_get_content (lua_State * L)
 {
 	struct rspamd_mime_part *part = lua_check_mimepart (L);
 	struct rspamd_lua_text *t;
+	GByteArray *content;
 
 	if (part == NULL) {
 		lua_pushnil (L);
 		return 1;
 	}
 
+	content = rspamd_mime_part_get_content (part->task, part);
 	t = lua_newuserdata (L, sizeof (*t));
 	rspamd_lua_setclass (L, "rspamd{text}", -1);
-	t->start = part->content->data;
-	t->len = part->content->len;
+	t->start = content->data;
+	t->len = content->len;
 	t->own = FALSE;
 
 	return 1;
@@ -624,7 +626,7 @@ lua_mimepart_get_length (lua_State * L)
 		return 1;
 	}
 
-	lua_pushinteger (L, part->content->len);
+	lua_pushinteger (L, rspamd_mime_part_get_length (part->task, part));
 
 	return 1;
 }
@@ -821,7 +823,8 @@ lua_mimepart_get_digest (lua_State * L)
 	}
 
 	memset (digestbuf, 0, sizeof (digestbuf));
-	rspamd_encode_hex_buf (part->digest, sizeof (part->digest),
+	rspamd_encode_hex_buf (rspamd_mime_part_get_digest (part->task, part),
+			sizeof (part->digest),
 			digestbuf, sizeof (digestbuf));
 	lua_pushstring (L, digestbuf);
 
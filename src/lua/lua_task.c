@@ -1113,19 +1113,27 @@ lua_task_get_urls (lua_State * L)
 	struct rspamd_task *task = lua_check_task (L, 1);
 	struct lua_tree_cb_data cb;
 	gboolean need_emails = FALSE;
+	guint sz;
 
 	if (task) {
 		if (lua_gettop (L) >= 2) {
 			need_emails = lua_toboolean (L, 2);
 		}
 
-		lua_newtable (L);
+		sz = rspamd_pool_hash_size (task->urls);
+
+		if (need_emails) {
+			sz += rspamd_pool_hash_size (task->emails);
+		}
+
+		/* Urls are stored in a flat array, so we know the size in advance */
+		lua_createtable (L, sz, 0);
 		cb.i = 1;
 		cb.L = L;
-		g_hash_table_foreach (task->urls, lua_tree_url_callback, &cb);
+		rspamd_pool_hash_foreach (task->urls, lua_tree_url_callback, &cb);
 
 		if (need_emails) {
-			g_hash_table_foreach (task->emails, lua_tree_url_callback, &cb);
+			rspamd_pool_hash_foreach (task->emails, lua_tree_url_callback, &cb);
 		}
 	}
 	else {
@@ -1146,11 +1154,11 @@ lua_task_has_urls (lua_State * L)
 			need_emails = lua_toboolean (L, 2);
 		}
 
-		if (g_hash_table_size (task->urls) > 0) {
+		if (rspamd_pool_hash_size (task->urls) > 0) {
 			ret = TRUE;
 		}
 
-		if (need_emails && g_hash_table_size (task->emails) > 0) {
+		if (need_emails && rspamd_pool_hash_size (task->emails) > 0) {
 			ret = TRUE;
 		}
 	}
@@ -1219,10 +1227,10 @@ lua_task_get_emails (lua_State * L)
 	struct lua_tree_cb_data cb;
 
 	if (task) {
-		lua_newtable (L);
+		lua_createtable (L, rspamd_pool_hash_size (task->emails), 0);
 		cb.i = 1;
 		cb.L = L;
-		g_hash_table_foreach (task->emails, lua_tree_url_callback, &cb);
+		rspamd_pool_hash_foreach (task->emails, lua_tree_url_callback, &cb);
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
@@ -1361,7 +1369,7 @@ lua_task_set_request_header (lua_State *L)
 
 gint
 rspamd_lua_push_header (lua_State * L,
-		GHashTable *hdrs,
+		rspamd_pool_hash_t *hdrs,
 		const gchar *name,
 		gboolean strong,
 		gboolean full,
@@ -1372,7 +1380,7 @@ rspamd_lua_push_header (lua_State * L,
 	gint i = 1;
 	const gchar *val;
 
-	rh = g_hash_table_lookup (hdrs, name);
+	rh = rspamd_pool_hash_lookup (hdrs, name);
 
 	if (rh == NULL) {
 		lua_pushnil (L);
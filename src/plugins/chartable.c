@@ -93,7 +93,7 @@ gint
 chartable_module_config (struct rspamd_config *cfg)
 {
 	const ucl_object_t *value;
-	gint res = TRUE;
+	gint res = TRUE, id;
 
 	if (!rspamd_config_is_module_enabled (cfg, "chartable")) {
 		return TRUE;
@@ -131,20 +131,23 @@ chartable_module_config (struct rspamd_config *cfg)
 		chartable_module_ctx->threshold = DEFAULT_THRESHOLD;
 	}
 
-	rspamd_symbols_cache_add_symbol (cfg->cache,
+	id = rspamd_symbols_cache_add_symbol (cfg->cache,
 			chartable_module_ctx->symbol,
 			0,
 			chartable_symbol_callback,
 			NULL,
 			SYMBOL_TYPE_NORMAL,
 			-1);
-	rspamd_symbols_cache_add_symbol (cfg->cache,
+	/* Score of chartable symbols is used as multiplier */
+	rspamd_symbols_cache_set_scaled_id (cfg->cache, id);
+	id = rspamd_symbols_cache_add_symbol (cfg->cache,
 			chartable_module_ctx->url_symbol,
 			0,
 			chartable_url_symbol_callback,
 			NULL,
 			SYMBOL_TYPE_NORMAL,
 			-1);
+	rspamd_symbols_cache_set_scaled_id (cfg->cache, id);
 
 	msg_info_config ("init internal chartable module");
 
@@ -393,14 +396,14 @@ static void
 chartable_url_symbol_callback (struct rspamd_task *task, void *unused)
 {
 	struct rspamd_url *u;
-	GHashTableIter it;
+	rspamd_pool_hash_iter_t it;
 	gpointer k, v;
 	rspamd_ftok_t w;
 	gdouble cur_score = 0.0;
 
-	g_hash_table_iter_init (&it, task->urls);
+	rspamd_pool_hash_iter_init (&it, task->urls);
 
-	while (g_hash_table_iter_next (&it, &k, &v)) {
+	while (rspamd_pool_hash_iter_next (&it, &k, &v)) {
 		u = v;
 
 		if (cur_score > 2.0) {
@@ -421,9 +424,9 @@ chartable_url_symbol_callback (struct rspamd_task *task, void *unused)
 		}
 	}
 
-	g_hash_table_iter_init (&it, task->emails);
+	rspamd_pool_hash_iter_init (&it, task->emails);
 
-	while (g_hash_table_iter_next (&it, &k, &v)) {
+	while (rspamd_pool_hash_iter_next (&it, &k, &v)) {
 		u = v;
 
 		if (cur_score > 2.0) {
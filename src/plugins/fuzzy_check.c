@@ -451,6 +451,9 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj,
 					g_ascii_strcasecmp (rule->algorithm_str, "fast") == 0) {
 				rule->alg = RSPAMD_SHINGLES_FAST;
 			}
+			else if (g_ascii_strcasecmp (rule->algorithm_str, "vector") == 0) {
+				rule->alg = RSPAMD_SHINGLES_VECTOR;
+			}
 			else {
 				msg_warn_config ("unknown algorithm: %s, use siphash by default");
 			}
@@ -471,6 +474,9 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj,
 	case RSPAMD_SHINGLES_FAST:
 		rule->algorithm_str = "fast";
 		break;
+	case RSPAMD_SHINGLES_VECTOR:
+		rule->algorithm_str = "vec";
+		break;
 	}
 
 	if ((value = ucl_object_lookup (obj, "servers")) != NULL) {
@@ -1053,7 +1059,7 @@ fuzzy_cmd_from_task_meta (struct fuzzy_rule *rule,
 	struct fuzzy_cmd_io *io;
 	rspamd_cryptobox_hash_state_t st;
 
-	GHashTableIter it;
+	rspamd_pool_hash_iter_t it;
 	gpointer k, v;
 	struct rspamd_url *u;
 	struct raw_header *rh;
@@ -1078,9 +1084,9 @@ fuzzy_cmd_from_task_meta (struct fuzzy_rule *rule,
 	/* Use blake2b for digest */
 	rspamd_cryptobox_hash_init (&st, rule->hash_key->str, rule->hash_key->len);
 	/* Hash URL's */
-	g_hash_table_iter_init (&it, task->urls);
+	rspamd_pool_hash_iter_init (&it, task->urls);
 
-	while (g_hash_table_iter_next (&it, &k, &v)) {
+	while (rspamd_pool_hash_iter_next (&it, &k, &v)) {
 		u = v;
 		if (u->hostlen > 0) {
 			rspamd_cryptobox_hash_update (&st, u->host, u->hostlen);
@@ -1094,7 +1100,7 @@ fuzzy_cmd_from_task_meta (struct fuzzy_rule *rule,
 	cur = rule->fuzzy_headers;
 
 	while (cur) {
-		rh = g_hash_table_lookup (task->raw_headers, cur->data);
+		rh = rspamd_pool_hash_lookup (task->raw_headers, cur->data);
 
 		while (rh) {
 			if (rh->decoded) {
@@ -1300,7 +1306,7 @@ fuzzy_cmd_from_data_part (struct fuzzy_rule *rule,
 		gint flag,
 		guint32 weight,
 		rspamd_mempool_t *pool,
-		guchar digest[rspamd_cryptobox_HASHBYTES])
+		const guchar digest[rspamd_cryptobox_HASHBYTES])
 {
 	struct rspamd_fuzzy_cmd *cmd;
 	struct rspamd_fuzzy_encrypted_cmd *enccmd = NULL;
@@ -2066,7 +2072,8 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 							fuzzy_module_ctx->min_width) {
 						io = fuzzy_cmd_from_data_part (rule, c, flag, value,
 								task->task_pool,
-								image->parent->digest);
+								rspamd_mime_part_get_digest (task,
+										image->parent));
 						if (io) {
 							g_ptr_array_add (res, io);
 						}
@@ -2075,13 +2082,14 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 			}
 		}
 
-		if (mime_part->content->len > 0 &&
-			fuzzy_check_content_type (rule, mime_part->type)) {
-			if (fuzzy_module_ctx->min_bytes <= 0 || mime_part->content->len >=
+		if (fuzzy_check_content_type (rule, mime_part->type) &&
+			rspamd_mime_part_get_length (task, mime_part) > 0) {
+			if (fuzzy_module_ctx->min_bytes <= 0 ||
+				rspamd_mime_part_get_length (task, mime_part) >=
 				fuzzy_module_ctx->min_bytes) {
 				io = fuzzy_cmd_from_data_part (rule, c, flag, value,
 						task->task_pool,
-						mime_part->digest);
+						rspamd_mime_part_get_digest (task, mime_part));
 				if (io) {
 					g_ptr_array_add (res, io);
 				}
@@ -162,12 +162,14 @@ regexp_module_config (struct rspamd_config *cfg)
 				res = FALSE;
 			}
 			else {
-				rspamd_symbols_cache_add_symbol (cfg->cache,
+				id = rspamd_symbols_cache_add_symbol (cfg->cache,
 						cur_item->symbol,
 						0,
 						process_regexp_item,
 						cur_item,
 						SYMBOL_TYPE_NORMAL, -1);
+				/* Expression result is used as multiplier */
+				rspamd_symbols_cache_set_scaled_id (cfg->cache, id);
 				nre ++;
 			}
 		}
@@ -179,12 +181,13 @@ regexp_module_config (struct rspamd_config *cfg)
 			cur_item->symbol = ucl_object_key (value);
 			cur_item->lua_function = ucl_object_toclosure (value);
 
-			rspamd_symbols_cache_add_symbol (cfg->cache,
+			id = rspamd_symbols_cache_add_symbol (cfg->cache,
 				cur_item->symbol,
 				0,
 				process_regexp_item,
 				cur_item,
 				SYMBOL_TYPE_NORMAL, -1);
+			rspamd_symbols_cache_set_scaled_id (cfg->cache, id);
 			nlua ++;
 		}
 		else if (value->type == UCL_OBJECT) {
@@ -242,6 +245,7 @@ regexp_module_config (struct rspamd_config *cfg)
 						process_regexp_item,
 						cur_item,
 						SYMBOL_TYPE_NORMAL, -1);
+				rspamd_symbols_cache_set_scaled_id (cfg->cache, id);
 
 				elt = ucl_object_lookup (value, "condition");
 
@@ -1279,8 +1279,8 @@ surbl_redirector_finish (struct rspamd_http_connection *conn,
 					task->task_pool);
 
 			if (r == URI_ERRNO_OK) {
-				if (!g_hash_table_lookup (task->urls, redirected_url)) {
-					g_hash_table_insert (task->urls, redirected_url,
+				if (!rspamd_pool_hash_lookup (task->urls, redirected_url)) {
+					rspamd_pool_hash_insert (task->urls, redirected_url,
 							redirected_url);
 					redirected_url->phished_url = param->url;
 					redirected_url->flags |= RSPAMD_URL_FLAG_REDIRECTED;
@@ -1458,7 +1458,7 @@ surbl_test_url (struct rspamd_task *task, void *user_data)
 	rspamd_mempool_add_destructor (task->task_pool,
 		(rspamd_mempool_destruct_t)g_hash_table_unref,
 		param.tree);
-	g_hash_table_foreach (task->urls, surbl_tree_url_callback, &param);
+	rspamd_pool_hash_foreach (task->urls, surbl_tree_url_callback, &param);
 
 	/* We also need to check and process img URLs */
 	if (suffix->options & SURBL_OPTION_CHECKIMAGES) {
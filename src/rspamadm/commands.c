@@ -26,6 +26,7 @@ extern struct rspamadm_command statconvert_command;
 extern struct rspamadm_command signtool_command;
 extern struct rspamadm_command lua_command;
 extern struct rspamadm_command dkim_keygen_command;
+extern struct rspamadm_command logstat_command;
 
 const struct rspamadm_command *commands[] = {
 	&help_command,
@@ -40,6 +41,7 @@ const struct rspamadm_command *commands[] = {
 	&signtool_command,
 	&lua_command,
 	&dkim_keygen_command,
+	&logstat_command,
 	NULL
 };
 
@@ -0,0 +1,344 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "printf.h"
+#include "addr.h"
+#include "unix-std.h"
+#include "libutil/util.h"
+#include "libserver/log_pipe.h"
+#include <poll.h>
+
+static gchar *control_path = RSPAMD_DBDIR "/rspamd.sock";
+static gboolean json = FALSE;
+static gboolean compact = FALSE;
+static gboolean reset = FALSE;
+static gdouble interval = 10.0;
+static gint64 max_records = 0;
+static volatile sig_atomic_t wanna_die = 0;
+
+static void rspamadm_logstat (gint argc, gchar **argv);
+static const char *rspamadm_logstat_help (gboolean full_help);
+
+struct rspamadm_command logstat_command = {
+		.name = "logstat",
+		.flags = 0,
+		.help = rspamadm_logstat_help,
+		.run = rspamadm_logstat
+};
+
+static GOptionEntry entries[] = {
+		{"json", 'j', 0, G_OPTION_ARG_NONE, &json,
+				"Output json",                    NULL},
+		{"compact", 'c', 0, G_OPTION_ARG_NONE, &compact,
+				"Output compacted", NULL},
+		{"socket", 's', 0, G_OPTION_ARG_STRING, &control_path,
+				"Use the following socket path", NULL},
+		{"interval", 'i', 0, G_OPTION_ARG_DOUBLE, &interval,
+				"Print statistics each N seconds (10s by default)", NULL},
+		{"count", 'n', 0, G_OPTION_ARG_INT64, &max_records,
+				"Exit after N messages", NULL},
+		{"reset", 'r', 0, G_OPTION_ARG_NONE, &reset,
+				"Reset statistics after printing", NULL},
+		{NULL,  0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const char *
+rspamadm_logstat_help (gboolean full_help)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Aggregate per symbol statistics from rspamd log pipe\n\n"
+				"Usage: rspamadm logstat [-c] [-j] [-r] [-s path] [-i interval] "
+				"[-n count]\n"
+				"Where options are:\n\n"
+				"-c: output compacted json\n"
+				"-j: output linted json\n"
+				"-r: reset statistics after each output\n"
+				"-s: use the following socket instead of " RSPAMD_DBDIR "/rspamd.sock\n"
+				"-i: print statistics each N seconds (10.0 seconds default)\n"
+				"-n: exit after N messages\n"
+				"--help: shows available options and commands\n\n"
+				"Log pipe is attached to the currently running workers, "
+				"so it should be reopened after workers are restarted\n";
+	}
+	else {
+		help_str = "Aggregate per symbol statistics from rspamd log pipe";
+	}
+
+	return help_str;
+}
+
+static void
+rspamadm_logstat_sig (gint signo)
+{
+	wanna_die = 1;
+}
+
+/*
+ * Sends request to the control socket and receives the log pipe that is
+ * passed before HTTP reply
+ */
+static gint
+rspamadm_logstat_open (gint sock, GPtrArray *names)
+{
+	static const gchar req[] = "GET /logpipe HTTP/1.0\r\n\r\n";
+	guchar fdspace[CMSG_SPACE(sizeof (int))], c;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct ucl_parser *parser;
+	const ucl_object_t *syms, *cur;
+	ucl_object_t *top;
+	ucl_object_iter_t it = NULL;
+	GString *reply;
+	gchar buf[BUFSIZ];
+	const gchar *body;
+	gint fd = -1;
+	gssize r;
+
+	if (write (sock, req, sizeof (req) - 1) != sizeof (req) - 1) {
+		rspamd_fprintf (stderr, "cannot write request: %s\n", strerror (errno));
+		return -1;
+	}
+
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_control = fdspace;
+	msg.msg_controllen = sizeof (fdspace);
+	iov.iov_base = &c;
+	iov.iov_len = sizeof (c);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	r = recvmsg (sock, &msg, 0);
+
+	if (r == -1) {
+		rspamd_fprintf (stderr, "cannot read reply: %s\n", strerror (errno));
+		return -1;
+	}
+
+	if (msg.msg_controllen >= CMSG_LEN (sizeof (int))) {
+		cmsg = CMSG_FIRSTHDR (&msg);
+
+		if (cmsg && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy (&fd, CMSG_DATA (cmsg), sizeof (int));
+		}
+	}
+
+	reply = g_string_new (NULL);
+
+	if (fd == -1 && r > 0) {
+		/* Unsupported command, the first byte is a part of reply */
+		g_string_append_c (reply, c);
+	}
+
+	while ((r = read (sock, buf, sizeof (buf))) > 0) {
+		g_string_append_len (reply, buf, r);
+	}
+
+	body = strstr (reply->str, "\r\n\r\n");
+
+	if (fd == -1 || body == NULL || strncmp (reply->str, "HTTP/1.", 7) != 0 ||
+			reply->len < 12 || strncmp (reply->str + 9, "200", 3) != 0) {
+		rspamd_fprintf (stderr, "cannot open log pipe: %s\n",
+				body ? body + 4 : reply->str);
+		g_string_free (reply, TRUE);
+
+		if (fd != -1) {
+			close (fd);
+		}
+
+		return -1;
+	}
+
+	parser = ucl_parser_new (0);
+
+	if (!ucl_parser_add_string (parser, body + 4, 0)) {
+		rspamd_fprintf (stderr, "cannot parse server's reply: %s\n",
+				ucl_parser_get_error (parser));
+	}
+	else {
+		top = ucl_parser_get_object (parser);
+		syms = ucl_object_lookup (top, "symbols");
+
+		while (syms && (cur = ucl_object_iterate (syms, &it, true)) != NULL) {
+			g_ptr_array_add (names, ucl_object_type (cur) == UCL_STRING ?
+					g_strdup (ucl_object_tostring (cur)) : NULL);
+		}
+
+		ucl_object_unref (top);
+	}
+
+	ucl_parser_free (parser);
+	g_string_free (reply, TRUE);
+
+	return fd;
+}
+
+static void
+rspamadm_logstat_print (struct rspamd_log_pipe_stat *st, GPtrArray *names)
+{
+	ucl_object_t *obj;
+	rspamd_fstring_t *out;
+
+	obj = rspamd_log_pipe_stat_ucl (st, names);
+	out = rspamd_fstring_new ();
+
+	if (json) {
+		rspamd_ucl_emit_fstring (obj, UCL_EMIT_JSON, &out);
+	}
+	else if (compact) {
+		rspamd_ucl_emit_fstring (obj, UCL_EMIT_JSON_COMPACT, &out);
+	}
+	else {
+		rspamd_ucl_emit_fstring (obj, UCL_EMIT_CONFIG, &out);
+	}
+
+	rspamd_fprintf (stdout, "%V\n", out);
+	fflush (stdout);
+	rspamd_fstring_free (out);
+	ucl_object_unref (obj);
+
+	if (reset) {
+		rspamd_log_pipe_stat_reset (st);
+	}
+}
+
+static void
+rspamadm_logstat (gint argc, gchar **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	rspamd_inet_addr_t *addr;
+	struct rspamd_log_pipe_stat *st;
+	const struct rspamd_log_pipe_record *rec;
+	GPtrArray *names;
+	struct pollfd pfd;
+	/* Records contain doubles, so keep buffer aligned */
+	guint64 buf[65536 / sizeof (guint64)];
+	gdouble next_print, now;
+	guint64 nrecords = 0;
+	gint sock, fd, timeout;
+	gssize r;
+
+	context = g_option_context_new (
+			"logstat - aggregate statistics from rspamd log pipe");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (!rspamd_parse_inet_address (&addr, control_path, 0)) {
+		rspamd_fprintf (stderr, "bad control path: %s\n", control_path);
+		exit (1);
+	}
+
+	sock = rspamd_inet_address_connect (addr, SOCK_STREAM, FALSE);
+
+	if (sock == -1) {
+		rspamd_fprintf (stderr, "cannot connect to: %s\n", control_path);
+		rspamd_inet_address_destroy (addr);
+		exit (1);
+	}
+
+	names = g_ptr_array_new_with_free_func (g_free);
+	fd = rspamadm_logstat_open (sock, names);
+	close (sock);
+	rspamd_inet_address_destroy (addr);
+
+	if (fd == -1) {
+		g_ptr_array_free (names, TRUE);
+		exit (1);
+	}
+
+	signal (SIGINT, rspamadm_logstat_sig);
+	signal (SIGTERM, rspamadm_logstat_sig);
+
+	st = rspamd_log_pipe_stat_new ();
+	next_print = rspamd_get_ticks () + interval;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (!wanna_die) {
+		now = rspamd_get_ticks ();
+
+		if (now >= next_print) {
+			rspamadm_logstat_print (st, names);
+			next_print = now + interval;
+		}
+
+		timeout = (next_print - now) * 1000.0;
+		r = poll (&pfd, 1, MAX (timeout, 1));
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			rspamd_fprintf (stderr, "poll failed: %s\n", strerror (errno));
+			break;
+		}
+		else if (r == 0) {
+			continue;
+		}
+
+		r = recv (fd, buf, sizeof (buf), 0);
+
+		if (r == -1) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+
+			rspamd_fprintf (stderr, "cannot read log pipe: %s\n",
+					strerror (errno));
+			break;
+		}
+		else if (r == 0) {
+			rspamd_fprintf (stderr, "log pipe has been closed by workers\n");
+			break;
+		}
+
+		rec = rspamd_log_pipe_record_check ((const guchar *)buf, r, &error);
+
+		if (rec == NULL) {
+			rspamd_fprintf (stderr, "skip invalid record: %e\n", error);
+			g_error_free (error);
+			error = NULL;
+			continue;
+		}
+
+		rspamd_log_pipe_stat_add (st, rec);
+		nrecords ++;
+
+		if (max_records > 0 && nrecords >= (guint64)max_records) {
+			break;
+		}
+	}
+
+	rspamadm_logstat_print (st, names);
+	rspamd_log_pipe_stat_destroy (st);
+	g_ptr_array_free (names, TRUE);
+	close (fd);
+}
@@ -19,6 +19,8 @@
 #include "lua/lua_common.h"
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
+#include "libserver/latency.h"
+#include "libserver/dns_cache.h"
 #include "ottery.h"
 #include "cryptobox.h"
 #include "utlist.h"
@@ -92,6 +94,10 @@ static GHashTable *ucl_vars = NULL;
 
 static gint term_attempts = 0;
 
+/* Workers' log rings are drained by this timer */
+static struct event log_ring_ev;
+static gboolean log_ring_ev_active = FALSE;
+
 /* List of unrelated forked processes */
 static GArray *other_workers = NULL;
 
@@ -691,6 +697,12 @@ wait_for_workers (gpointer key, gpointer value, gpointer unused)
 			g_quark_to_string (w->type), w->pid,
 			WTERMSIG (res) == SIGKILL ? "hardly" : "softly");
 	event_del (&w->srv_ev);
+
+	if (w->log_ring) {
+		rspamd_log_ring_drain (rspamd_main->logger, w->log_ring);
+		rspamd_log_ring_destroy (w->log_ring);
+	}
+
 	g_ptr_array_free (w->finish_actions, TRUE);
 	g_free (w->cf);
 	g_free (w);
@@ -788,6 +800,44 @@ rspamd_check_core_limits (struct rspamd_main *rspamd_main)
 #endif
 }
 
+static void
+drain_log_handler (gpointer key, gpointer value, gpointer unused)
+{
+	struct rspamd_worker *w = value;
+
+	if (w->log_ring) {
+		rspamd_log_ring_drain (w->srv->logger, w->log_ring);
+	}
+}
+
+static void
+rspamd_log_ring_timer_handler (gint fd, short what, gpointer arg)
+{
+	struct rspamd_main *rspamd_main = arg;
+
+	g_hash_table_foreach (rspamd_main->workers, drain_log_handler, NULL);
+}
+
+static void
+rspamd_log_ring_timer_start (struct rspamd_main *rspamd_main)
+{
+	struct timeval tv;
+
+	if (log_ring_ev_active || rspamd_main->cfg->log_ring_size == 0 ||
+			rspamd_main->cfg->log_type == RSPAMD_LOG_SYSLOG) {
+		return;
+	}
+
+	/* Drain each 100 ms */
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+	event_set (&log_ring_ev, -1, EV_TIMEOUT|EV_PERSIST,
+			rspamd_log_ring_timer_handler, rspamd_main);
+	event_base_set (rspamd_main->ev_base, &log_ring_ev);
+	event_add (&log_ring_ev, &tv);
+	log_ring_ev_active = TRUE;
+}
+
 static void
 reopen_log_handler (gpointer key, gpointer value, gpointer unused)
 {
@@ -880,6 +930,8 @@ rspamd_usr1_handler (gint signo, short what, gpointer arg)
 {
 	struct rspamd_main *rspamd_main = arg;
 
+	/* Write pending lines to the old file */
+	g_hash_table_foreach (rspamd_main->workers, drain_log_handler, NULL);
 	rspamd_log_reopen_priv (rspamd_main->logger,
 			rspamd_main->workers_uid,
 			rspamd_main->workers_gid);
@@ -901,8 +953,10 @@ rspamd_hup_handler (gint signo, short what, gpointer arg)
 	g_hash_table_foreach (rspamd_main->workers, kill_old_workers, NULL);
 	rspamd_map_remove_all (rspamd_main->cfg);
 	reread_config (rspamd_main);
+	rspamd_latency_stat_set_groups (rspamd_main->latency, rspamd_main->cfg);
 	rspamd_check_core_limits (rspamd_main);
 	spawn_workers (rspamd_main, rspamd_main->ev_base);
+	rspamd_log_ring_timer_start (rspamd_main);
 }
 
 static void
@@ -977,6 +1031,13 @@ rspamd_cld_handler (gint signo, short what, gpointer arg)
 			/* We also need to clean descriptors left */
 			close (cur->control_pipe[0]);
 			close (cur->srv_pipe[0]);
+
+			if (cur->log_ring) {
+				/* Write the last words of the worker */
+				rspamd_log_ring_drain (rspamd_main->logger, cur->log_ring);
+				rspamd_log_ring_destroy (cur->log_ring);
+			}
+
 			g_free (cur);
 		}
 		else {
@@ -1084,6 +1145,7 @@ main (gint argc, gchar **argv, gchar **env)
 			"main");
 	rspamd_main->stat = rspamd_mempool_alloc0_shared (rspamd_main->server_pool,
 			sizeof (struct rspamd_stat));
+	rspamd_main->latency = rspamd_latency_stat_new (rspamd_main->server_pool);
 	rspamd_main->cfg = rspamd_config_new ();
 	rspamd_main->spairs = g_hash_table_new_full (rspamd_spair_hash,
 			rspamd_spair_equal, g_free, rspamd_spair_close);
@@ -1219,6 +1281,10 @@ main (gint argc, gchar **argv, gchar **env)
 	/* Create rolling history */
 	rspamd_main->history = rspamd_roll_history_new (rspamd_main->server_pool,
 			rspamd_main->cfg->history_rows);
+	/* Create DNS cache shared by all workers */
+	rspamd_main->dns_cache = rspamd_dns_cache_new (rspamd_main->server_pool,
+			rspamd_main->cfg->dns_cache_size,
+			rspamd_main->cfg->dns_cache_max_ttl);
 
 	gperf_profiler_init (rspamd_main->cfg, "main");
 
@@ -1238,6 +1304,8 @@ main (gint argc, gchar **argv, gchar **env)
 			rspamd_main->cfg->libs_ctx->crypto_ctx->poly1305_impl,
 			rspamd_main->cfg->libs_ctx->crypto_ctx->siphash_impl,
 			rspamd_main->cfg->libs_ctx->crypto_ctx->blake2_impl);
+	msg_info_main ("shingles configuration: %s",
+			rspamd_main->cfg->libs_ctx->shingles_impl);
 
 	/* Daemonize */
 	if (!no_fork && daemon (0, 0) == -1) {
@@ -1330,9 +1398,11 @@ main (gint argc, gchar **argv, gchar **env)
 	event_add (&usr1_ev, NULL);
 
 	rspamd_check_core_limits (rspamd_main);
+	rspamd_latency_stat_set_groups (rspamd_main->latency, rspamd_main->cfg);
 	rspamd_mempool_lock_mutex (rspamd_main->start_mtx);
 	spawn_workers (rspamd_main, ev_base);
 	rspamd_mempool_unlock_mutex (rspamd_main->start_mtx);
+	rspamd_log_ring_timer_start (rspamd_main);
 
 	if (control_fd != -1) {
 		msg_info_main ("listening for control commands on %s",
@@ -1381,6 +1451,10 @@ main (gint argc, gchar **argv, gchar **env)
 	event_base_loop (ev_base, 0);
 	event_del (&term_ev);
 
+	if (log_ring_ev_active) {
+		event_del (&log_ring_ev);
+	}
+
 	/* Maybe save roll history */
 	if (rspamd_main->cfg->history_file) {
 		rspamd_roll_history_save (rspamd_main->history,
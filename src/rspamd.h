@@ -64,6 +64,7 @@ struct rspamd_worker {
 	struct event srv_ev;            /**< used by main for read workers' requests		*/
 	gpointer control_data;          /**< used by control protocol to handle commands	*/
 	GPtrArray *finish_actions;      /**< called when worker is terminated				*/
+	struct rspamd_log_ring *log_ring; /**< shared ring for log records drained by main	*/
 };
 
 struct rspamd_abstract_worker_ctx {
@@ -264,6 +265,8 @@ struct rspamd_main {
 	gboolean is_privilleged;                                    /**< true if run in privilleged mode                */
 	gboolean cores_throttling;                                  /**< turn off cores when limits are exceeded		*/
 	struct roll_history *history;                               /**< rolling history								*/
+	struct rspamd_latency_stat *latency;                        /**< latency histograms								*/
+	struct rspamd_dns_cache *dns_cache;                         /**< shared cache of DNS replies					*/
 	struct event_base *ev_base;
 };
 
@@ -303,6 +306,7 @@ struct rspamd_external_libs_ctx {
 	magic_t libmagic;
 	radix_compressed_t **local_addrs;
 	struct rspamd_cryptobox_library_ctx *crypto_ctx;
+	const gchar *shingles_impl;
 	struct ottery_config *ottery_cfg;
 	SSL_CTX *ssl_ctx;
 	ref_entry_t ref;
@@ -118,12 +118,15 @@ struct rspamd_proxy_ctx {
 	GArray *cmp_refs;
 	/* Maximum count for retries */
 	guint max_retries;
+	/* Reuse connections to backends */
+	gboolean keepalive;
 };
 
 enum rspamd_backend_flags {
 	RSPAMD_BACKEND_REPLIED = 1 << 0,
 	RSPAMD_BACKEND_CLOSED = 1 << 1,
 	RSPAMD_BACKEND_PARSED = 1 << 2,
+	RSPAMD_BACKEND_RETRIED = 1 << 3,
 };
 
 struct rspamd_proxy_session;
@@ -137,8 +140,10 @@ struct rspamd_proxy_backend_connection {
 	ucl_object_t *results;
 	const gchar *err;
 	struct rspamd_proxy_session *s;
+	struct rspamd_http_mirror *mirror;
 	struct timeval *io_tv;
 	gint backend_sock;
+	guint nrequests;
 	enum rspamd_backend_flags flags;
 	gint parser_from_ref;
 	gint parser_to_ref;
@@ -161,7 +166,8 @@ struct rspamd_proxy_session {
 	ref_entry_t ref;
 };
 
-static gboolean proxy_send_master_message (struct rspamd_proxy_session *session);
+static gboolean proxy_send_master_message (struct rspamd_proxy_session *session,
+		gboolean reuse);
 
 static GQuark
 rspamd_proxy_quark (void)
@@ -629,6 +635,7 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 	ctx->lua_state = cfg->lua_state;
 	ctx->cmp_refs = g_array_new (FALSE, FALSE, sizeof (gint));
 	ctx->max_retries = DEFAULT_RETRIES;
+	ctx->keepalive = TRUE;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -691,6 +698,14 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, max_retries),
 			RSPAMD_CL_FLAG_UINT,
 			"Maximum number of retries for master connection");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, keepalive),
+			0,
+			"Keep connections to backends alive between requests (default: true)");
 
 	return ctx;
 }
@@ -698,18 +713,50 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 static void
 proxy_backend_close_connection (struct rspamd_proxy_backend_connection *conn)
 {
+	gboolean keepalive = FALSE;
+
 	if (conn && !(conn->flags & RSPAMD_BACKEND_CLOSED)) {
 		if (conn->backend_conn) {
+			keepalive = (conn->flags & RSPAMD_BACKEND_REPLIED) &&
+					rspamd_http_connection_is_keepalive (conn->backend_conn);
 			rspamd_http_connection_reset (conn->backend_conn);
 			rspamd_http_connection_unref (conn->backend_conn);
 		}
 
-		close (conn->backend_sock);
+		if (keepalive) {
+			rspamd_upstream_keepalive_put (conn->up, conn->remote_key,
+					conn->backend_sock, conn->nrequests + 1);
+		}
+		else {
+			close (conn->backend_sock);
+		}
 
 		conn->flags |= RSPAMD_BACKEND_CLOSED;
 	}
 }
 
+static gint
+proxy_backend_connect (struct rspamd_proxy_session *session,
+		struct rspamd_proxy_backend_connection *conn,
+		gboolean reuse)
+{
+	gint fd;
+
+	conn->nrequests = 0;
+
+	if (session->ctx->keepalive && reuse) {
+		fd = rspamd_upstream_keepalive_get (conn->up, conn->remote_key,
+				&conn->nrequests);
+
+		if (fd != -1) {
+			return fd;
+		}
+	}
+
+	return rspamd_inet_address_connect (rspamd_upstream_addr (conn->up),
+			SOCK_STREAM, TRUE);
+}
+
 static gboolean
 proxy_backend_parse_results (struct rspamd_proxy_session *session,
 		struct rspamd_proxy_backend_connection *conn,
@@ -956,11 +1003,17 @@ proxy_check_file (struct rspamd_http_message *msg,
 	return TRUE;
 }
 
+static gboolean proxy_send_mirror_message (
+		struct rspamd_proxy_session *session,
+		struct rspamd_proxy_backend_connection *bk_conn,
+		gboolean reuse);
+
 static void
 proxy_backend_mirror_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
 	struct rspamd_proxy_backend_connection *bk_conn = conn->ud;
 	struct rspamd_proxy_session *session;
+	gboolean retry;
 
 	session = bk_conn->s;
 	msg_info_session ("abnormally closing connection from backend: %s:%s, "
@@ -973,9 +1026,32 @@ proxy_backend_mirror_error_handler (struct rspamd_http_connection *conn, GError
 		bk_conn->err = rspamd_mempool_strdup (session->pool, err->message);
 	}
 
-	rspamd_upstream_fail (bk_conn->up);
+	/* Failure of a pooled connection says nothing about the upstream */
+	if (bk_conn->nrequests == 0) {
+		rspamd_upstream_fail (bk_conn->up);
+	}
 
+	retry = bk_conn->nrequests > 0 && !(bk_conn->flags & RSPAMD_BACKEND_RETRIED);
 	proxy_backend_close_connection (bk_conn);
+
+	if (retry) {
+		/*
+		 * Idle connection might have been closed by a backend in the meantime,
+		 * so try once more using a fresh connection
+		 */
+		bk_conn->flags = RSPAMD_BACKEND_RETRIED;
+		bk_conn->err = NULL;
+
+		if (proxy_send_mirror_message (session, bk_conn, FALSE)) {
+			msg_info_session ("retry connection to %s using a new connection",
+					bk_conn->name);
+
+			return;
+		}
+
+		bk_conn->flags |= RSPAMD_BACKEND_CLOSED;
+	}
+
 	REF_RELEASE (bk_conn->s);
 }
 
@@ -998,6 +1074,7 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 
 	msg_info_session ("finished mirror connection to %s", bk_conn->name);
 	rspamd_upstream_ok (bk_conn->up);
+	bk_conn->flags |= RSPAMD_BACKEND_REPLIED;
 
 	proxy_backend_close_connection (bk_conn);
 	REF_RELEASE (bk_conn->s);
@@ -1005,6 +1082,74 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 	return 0;
 }
 
+static gboolean
+proxy_send_mirror_message (struct rspamd_proxy_session *session,
+		struct rspamd_proxy_backend_connection *bk_conn,
+		gboolean reuse)
+{
+	struct rspamd_http_mirror *m = bk_conn->mirror;
+	struct rspamd_http_message *msg;
+
+	bk_conn->backend_sock = proxy_backend_connect (session, bk_conn, reuse);
+
+	if (bk_conn->backend_sock == -1) {
+		msg_err_session ("cannot connect upstream for %s", m->name);
+		rspamd_upstream_fail (bk_conn->up);
+
+		return FALSE;
+	}
+
+	msg = rspamd_http_connection_copy_msg (session->client_message);
+
+	if (msg == NULL) {
+		msg_err_session ("cannot copy message to send to a mirror %s: %s",
+				m->name, strerror (errno));
+		close (bk_conn->backend_sock);
+
+		return FALSE;
+	}
+
+	msg->method = HTTP_GET;
+
+	if (msg->url->len == 0) {
+		msg->url = rspamd_fstring_append (msg->url, "/check", strlen ("/check"));
+	}
+
+	if (m->settings_id != NULL) {
+		rspamd_http_message_remove_header (msg, "Settings-ID");
+		rspamd_http_message_add_header (msg, "Settings-ID", m->settings_id);
+	}
+
+	bk_conn->backend_conn = rspamd_http_connection_new (NULL,
+			proxy_backend_mirror_error_handler,
+			proxy_backend_mirror_finish_handler,
+			RSPAMD_HTTP_CLIENT_SIMPLE |
+			(session->ctx->keepalive ? RSPAMD_HTTP_CLIENT_KEEP_ALIVE : 0),
+			RSPAMD_HTTP_CLIENT,
+			session->ctx->keys_cache,
+			NULL);
+
+	rspamd_http_connection_set_key (bk_conn->backend_conn,
+			session->ctx->local_key);
+	msg->peer_key = rspamd_pubkey_ref (m->key);
+
+	if (m->local ||
+			rspamd_inet_address_is_local (rspamd_upstream_addr (bk_conn->up))) {
+		rspamd_http_connection_write_message_shared (bk_conn->backend_conn,
+				msg, NULL, NULL, bk_conn,
+				bk_conn->backend_sock,
+				bk_conn->io_tv, session->ctx->ev_base);
+	}
+	else {
+		rspamd_http_connection_write_message (bk_conn->backend_conn,
+				msg, NULL, NULL, bk_conn,
+				bk_conn->backend_sock,
+				bk_conn->io_tv, session->ctx->ev_base);
+	}
+
+	return TRUE;
+}
+
 static void
 proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 {
@@ -1012,7 +1157,6 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 	struct rspamd_http_mirror *m;
 	guint i;
 	struct rspamd_proxy_backend_connection *bk_conn;
-	struct rspamd_http_message *msg;
 
 	coin = rspamd_random_double ();
 
@@ -1028,73 +1172,24 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 				sizeof (*bk_conn));
 		bk_conn->s = session;
 		bk_conn->name = m->name;
+		bk_conn->mirror = m;
 		bk_conn->io_tv = &m->io_tv;
 
 		bk_conn->up = rspamd_upstream_get (m->u,
 				RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
 		bk_conn->parser_from_ref = m->parser_from_ref;
 		bk_conn->parser_to_ref = m->parser_to_ref;
+		bk_conn->remote_key = m->key;
 
 		if (bk_conn->up == NULL) {
 			msg_err_session ("cannot select upstream for %s", m->name);
 			continue;
 		}
 
-		bk_conn->backend_sock = rspamd_inet_address_connect (
-				rspamd_upstream_addr (bk_conn->up),
-				SOCK_STREAM, TRUE);
-
-		if (bk_conn->backend_sock == -1) {
-			msg_err_session ("cannot connect upstream for %s", m->name);
-			rspamd_upstream_fail (bk_conn->up);
+		if (!proxy_send_mirror_message (session, bk_conn, TRUE)) {
 			continue;
 		}
 
-		msg = rspamd_http_connection_copy_msg (session->client_message);
-
-		if (msg == NULL) {
-			msg_err_session ("cannot copy message to send to a mirror %s: %s",
-					m->name, strerror (errno));
-			continue;
-		}
-
-		msg->method = HTTP_GET;
-
-		if (msg->url->len == 0) {
-			msg->url = rspamd_fstring_append (msg->url, "/check", strlen ("/check"));
-		}
-
-		if (m->settings_id != NULL) {
-			rspamd_http_message_remove_header (msg, "Settings-ID");
-			rspamd_http_message_add_header (msg, "Settings-ID", m->settings_id);
-		}
-
-		bk_conn->backend_conn = rspamd_http_connection_new (NULL,
-				proxy_backend_mirror_error_handler,
-				proxy_backend_mirror_finish_handler,
-				RSPAMD_HTTP_CLIENT_SIMPLE,
-				RSPAMD_HTTP_CLIENT,
-				session->ctx->keys_cache,
-				NULL);
-
-		rspamd_http_connection_set_key (bk_conn->backend_conn,
-				session->ctx->local_key);
-		msg->peer_key = rspamd_pubkey_ref (m->key);
-
-		if (m->local ||
-				rspamd_inet_address_is_local (rspamd_upstream_addr (bk_conn->up))) {
-			rspamd_http_connection_write_message_shared (bk_conn->backend_conn,
-					msg, NULL, NULL, bk_conn,
-					bk_conn->backend_sock,
-					bk_conn->io_tv, session->ctx->ev_base);
-		}
-		else {
-			rspamd_http_connection_write_message (bk_conn->backend_conn,
-					msg, NULL, NULL, bk_conn,
-					bk_conn->backend_sock,
-					bk_conn->io_tv, session->ctx->ev_base);
-		}
-
 		g_ptr_array_add (session->mirror_conns, bk_conn);
 		REF_RETAIN (session);
 		msg_info_session ("send request to %s", m->name);
@@ -1120,6 +1215,7 @@ proxy_backend_master_error_handler (struct rspamd_http_connection *conn, GError
 {
 	struct rspamd_proxy_backend_connection *bk_conn = conn->ud;
 	struct rspamd_proxy_session *session;
+	gboolean retry;
 
 	session = bk_conn->s;
 	msg_info_session ("abnormally closing connection from backend: %s, error: %s,"
@@ -1127,11 +1223,32 @@ proxy_backend_master_error_handler (struct rspamd_http_connection *conn, GError
 		rspamd_inet_address_to_string (rspamd_upstream_addr (session->master_conn->up)),
 		err->message,
 		session->ctx->max_retries - session->retries);
-	session->retries ++;
-	rspamd_upstream_fail (bk_conn->up);
+	retry = bk_conn->nrequests > 0 && !(bk_conn->flags & RSPAMD_BACKEND_RETRIED);
+
+	/* Stale pooled connection does not count as a failure of the upstream */
+	if (bk_conn->nrequests == 0) {
+		session->retries ++;
+		rspamd_upstream_fail (bk_conn->up);
+	}
+
 	proxy_backend_close_connection (session->master_conn);
 
-	if (session->ctx->max_retries &&
+	if (retry) {
+		/*
+		 * Idle connection might have been closed by a backend in the meantime,
+		 * so try once more using a fresh connection
+		 */
+		bk_conn->flags |= RSPAMD_BACKEND_RETRIED;
+
+		if (!proxy_send_master_message (session, FALSE)) {
+			proxy_client_write_error (session, err->code, err->message);
+		}
+		else {
+			msg_info_session ("retry connection to %s using a new connection",
+					bk_conn->name);
+		}
+	}
+	else if (session->ctx->max_retries &&
 			session->retries > session->ctx->max_retries) {
 		msg_err_session ("cannot connect to upstream, maximum retries "
 				"has been reached: %d", session->retries);
@@ -1139,7 +1256,7 @@ proxy_backend_master_error_handler (struct rspamd_http_connection *conn, GError
 		proxy_client_write_error (session, err->code, err->message);
 	}
 	else {
-		if (!proxy_send_master_message (session)) {
+		if (!proxy_send_master_message (session, TRUE)) {
 			proxy_client_write_error (session, err->code, err->message);
 		}
 		else {
@@ -1187,6 +1304,8 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 	}
 
 	rspamd_upstream_ok (bk_conn->up);
+	bk_conn->flags |= RSPAMD_BACKEND_REPLIED;
+	bk_conn->flags &= ~RSPAMD_BACKEND_RETRIED;
 
 	rspamd_http_connection_write_message (session->client_conn,
 			msg, NULL, NULL, session, session->client_sock,
@@ -1196,7 +1315,8 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 }
 
 static gboolean
-proxy_send_master_message (struct rspamd_proxy_session *session)
+proxy_send_master_message (struct rspamd_proxy_session *session,
+		gboolean reuse)
 {
 	struct rspamd_http_message *msg;
 	struct rspamd_http_upstream *backend = NULL;
@@ -1234,6 +1354,7 @@ retry:
 		session->master_conn->up = rspamd_upstream_get (backend->u,
 				RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
 		session->master_conn->io_tv = &backend->io_tv;
+		session->master_conn->remote_key = backend->key;
 
 		if (session->master_conn->up == NULL) {
 			msg_err_session ("cannot select upstream for %s",
@@ -1241,9 +1362,8 @@ retry:
 			goto err;
 		}
 
-		session->master_conn->backend_sock = rspamd_inet_address_connect (
-				rspamd_upstream_addr (session->master_conn->up),
-				SOCK_STREAM, TRUE);
+		session->master_conn->backend_sock = proxy_backend_connect (session,
+				session->master_conn, reuse);
 
 		if (session->master_conn->backend_sock == -1) {
 			msg_err_session ("cannot connect upstream: %s(%s)",
@@ -1259,11 +1379,12 @@ retry:
 				NULL,
 				proxy_backend_master_error_handler,
 				proxy_backend_master_finish_handler,
-				RSPAMD_HTTP_CLIENT_SIMPLE,
+				RSPAMD_HTTP_CLIENT_SIMPLE |
+				(session->ctx->keepalive ? RSPAMD_HTTP_CLIENT_KEEP_ALIVE : 0),
 				RSPAMD_HTTP_CLIENT,
 				session->ctx->keys_cache,
 				NULL);
-		session->master_conn->flags &= ~RSPAMD_BACKEND_CLOSED;
+		session->master_conn->flags &= ~(RSPAMD_BACKEND_CLOSED|RSPAMD_BACKEND_REPLIED);
 		session->master_conn->parser_from_ref = backend->parser_from_ref;
 		session->master_conn->parser_to_ref = backend->parser_to_ref;
 
@@ -1348,7 +1469,7 @@ proxy_client_finish_handler (struct rspamd_http_connection *conn,
 		proxy_open_mirror_connections (session);
 		rspamd_http_connection_reset (session->client_conn);
 
-		proxy_send_master_message (session);
+		proxy_send_master_message (session, TRUE);
 	}
 	else {
 		msg_info_session ("finished master connection");
@@ -1450,6 +1571,7 @@ start_rspamd_proxy (struct rspamd_worker *worker)
 	ctx->resolver = dns_resolver_init (worker->srv->logger,
 			ctx->ev_base,
 			worker->srv->cfg);
+	rspamd_dns_resolver_set_cache (ctx->resolver, worker->srv->dns_cache);
 	double_to_tv (ctx->timeout, &ctx->io_tv);
 	rspamd_map_watch (worker->srv->cfg, ctx->ev_base, ctx->resolver);
 
@@ -255,6 +255,16 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 	struct rspamd_http_message *msg;
 	rspamd_fstring_t *reply;
 
+	if ((task->flags & RSPAMD_TASK_FLAG_KEEPALIVE) &&
+			task->processed_stages == 0) {
+		/* Client has closed idle connection or it has timed out */
+		msg_debug_task ("closing keep-alive connection from: %s, error: %e",
+				rspamd_inet_address_to_string (task->client_addr), err);
+		rspamd_session_destroy (task->s);
+
+		return;
+	}
+
 	msg_info_task ("abnormally closing connection from: %s, error: %e",
 		rspamd_inet_address_to_string (task->client_addr), err);
 	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
@@ -293,6 +303,49 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 	}
 }
 
+static struct rspamd_task * rspamd_worker_new_task (
+		struct rspamd_worker *worker, gint nfd, rspamd_inet_addr_t *addr);
+
+/*
+ * Starts a new task reading the next request from the connection of a
+ * finished task
+ */
+static void
+rspamd_worker_keepalive (struct rspamd_task *task)
+{
+	struct rspamd_worker *worker = task->worker;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct rspamd_task *new_task;
+	gint nfd;
+
+	if (worker->wanna_die ||
+			(ctx->max_tasks != 0 && worker->nconns > ctx->max_tasks)) {
+		msg_debug_task ("do not keep connection from %s alive",
+				rspamd_inet_address_to_string (task->client_addr));
+		return;
+	}
+
+	/* Old socket is closed when the finished task is freed */
+	nfd = dup (task->sock);
+
+	if (nfd == -1) {
+		msg_warn_task ("cannot duplicate socket: %s", strerror (errno));
+		return;
+	}
+
+	new_task = rspamd_worker_new_task (worker, nfd,
+			rspamd_inet_address_copy (task->client_addr));
+	new_task->flags |= RSPAMD_TASK_FLAG_KEEPALIVE;
+	msg_debug_task ("keep connection from %s alive, new task ptr: %p",
+			rspamd_inet_address_to_string (task->client_addr), new_task);
+
+	rspamd_http_connection_read_message (new_task->http_conn,
+			new_task,
+			nfd,
+			&ctx->io_tv,
+			ctx->ev_base);
+}
+
 static gint
 rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
@@ -301,8 +354,14 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 
 	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
 		/* We are done here */
-		msg_debug_task ("normally closing connection from: %s",
-			rspamd_inet_address_to_string (task->client_addr));
+		if (rspamd_http_connection_is_keepalive (conn)) {
+			rspamd_worker_keepalive (task);
+		}
+		else {
+			msg_debug_task ("normally closing connection from: %s",
+				rspamd_inet_address_to_string (task->client_addr));
+		}
+
 		rspamd_session_destroy (task->s);
 	}
 	else if (task->processed_stages & RSPAMD_TASK_STAGE_DONE) {
@@ -313,43 +372,17 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 }
 
 /*
- * Accept new connection and construct task
+ * Construct task for a connected socket
  */
-static void
-accept_socket (gint fd, short what, void *arg)
+static struct rspamd_task *
+rspamd_worker_new_task (struct rspamd_worker *worker, gint nfd,
+		rspamd_inet_addr_t *addr)
 {
-	struct rspamd_worker *worker = (struct rspamd_worker *) arg;
-	struct rspamd_worker_ctx *ctx;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
 	struct rspamd_task *task;
-	rspamd_inet_addr_t *addr;
-	gint nfd;
-
-	ctx = worker->ctx;
-
-	if (ctx->max_tasks != 0 && worker->nconns > ctx->max_tasks) {
-		msg_info_ctx ("current tasks is now: %uD while maximum is: %uD",
-				worker->nconns,
-			ctx->max_tasks);
-		return;
-	}
-
-	if ((nfd =
-		rspamd_accept_from_socket (fd, &addr, worker->accept_events)) == -1) {
-		msg_warn_ctx ("accept failed: %s", strerror (errno));
-		return;
-	}
-	/* Check for EAGAIN */
-	if (nfd == 0) {
-		return;
-	}
 
 	task = rspamd_task_new (worker, ctx->cfg);
 
-	msg_info_task ("accepted connection from %s port %d, task ptr: %p",
-		rspamd_inet_address_to_string (addr),
-		rspamd_inet_address_get_port (addr),
-		task);
-
 	/* Copy some variables */
 	if (ctx->is_mime) {
 		task->flags |= RSPAMD_TASK_FLAG_MIME;
@@ -361,7 +394,6 @@ accept_socket (gint fd, short what, void *arg)
 	task->sock = nfd;
 	task->client_addr = addr;
 
-	worker->srv->stat->connections_count++;
 	task->resolver = ctx->resolver;
 	/* TODO: allow to disable autolearn in protocol */
 	task->flags |= RSPAMD_TASK_FLAG_LEARN_AUTO;
@@ -369,7 +401,7 @@ accept_socket (gint fd, short what, void *arg)
 	task->http_conn = rspamd_http_connection_new (rspamd_worker_body_handler,
 			rspamd_worker_error_handler,
 			rspamd_worker_finish_handler,
-			0,
+			ctx->keepalive ? RSPAMD_HTTP_CLIENT_KEEP_ALIVE : 0,
 			RSPAMD_HTTP_SERVER,
 			ctx->keys_cache,
 			NULL);
@@ -387,6 +419,49 @@ accept_socket (gint fd, short what, void *arg)
 		rspamd_http_connection_set_key (task->http_conn, ctx->key);
 	}
 
+	return task;
+}
+
+/*
+ * Accept new connection and construct task
+ */
+static void
+accept_socket (gint fd, short what, void *arg)
+{
+	struct rspamd_worker *worker = (struct rspamd_worker *) arg;
+	struct rspamd_worker_ctx *ctx;
+	struct rspamd_task *task;
+	rspamd_inet_addr_t *addr;
+	gint nfd;
+
+	ctx = worker->ctx;
+
+	if (ctx->max_tasks != 0 && worker->nconns > ctx->max_tasks) {
+		msg_info_ctx ("current tasks is now: %uD while maximum is: %uD",
+				worker->nconns,
+			ctx->max_tasks);
+		return;
+	}
+
+	if ((nfd =
+		rspamd_accept_from_socket (fd, &addr, worker->accept_events)) == -1) {
+		msg_warn_ctx ("accept failed: %s", strerror (errno));
+		return;
+	}
+	/* Check for EAGAIN */
+	if (nfd == 0) {
+		return;
+	}
+
+	task = rspamd_worker_new_task (worker, nfd, addr);
+
+	msg_info_task ("accepted connection from %s port %d, task ptr: %p",
+		rspamd_inet_address_to_string (addr),
+		rspamd_inet_address_get_port (addr),
+		task);
+
+	worker->srv->stat->connections_count++;
+
 	rspamd_http_connection_read_message (task->http_conn,
 			task,
 			nfd,
@@ -476,6 +551,7 @@ init_worker (struct rspamd_config *cfg)
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
 	ctx->cfg = cfg;
 	ctx->task_timeout = DEFAULT_TASK_TIMEOUT;
+	ctx->keepalive = FALSE;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -555,6 +631,16 @@ init_worker (struct rspamd_config *cfg)
 			0,
 			"Encryption keypair");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+						keepalive),
+			0,
+			"Allow clients to send several requests over a single connection (default: false)");
+
 	return ctx;
 }
 
@@ -578,11 +664,13 @@ start_worker (struct rspamd_worker *worker)
 
 	ctx->ev_base = rspamd_prepare_worker (worker, "normal", accept_socket);
 	msec_to_tv (ctx->timeout, &ctx->io_tv);
-	rspamd_symbols_cache_start_refresh (worker->srv->cfg->cache, ctx->ev_base);
+	rspamd_symbols_cache_start_refresh (worker->srv->cfg->cache, ctx->ev_base,
+			worker);
 
 	ctx->resolver = dns_resolver_init (worker->srv->logger,
 			ctx->ev_base,
 			worker->srv->cfg);
+	rspamd_dns_resolver_set_cache (ctx->resolver, worker->srv->dns_cache);
 	rspamd_map_watch (worker->srv->cfg, ctx->ev_base, ctx->resolver);
 
 	rspamd_upstreams_library_config (worker->srv->cfg, ctx->cfg->ups_ctx,
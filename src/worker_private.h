@@ -46,6 +46,8 @@ struct rspamd_worker_ctx {
 	gboolean is_json;
 	/* Allow learning throught worker				*/
 	gboolean allow_learn;
+	/* Keep client connections alive between requests */
+	gboolean keepalive;
 	/* DNS resolver */
 	struct rspamd_dns_resolver *resolver;
 	/* Limit of tasks */
@@ -0,0 +1,54 @@
+-- Early exit must not change verdict: scores of symbols inserted with
+-- multipliers are limited by max_symbol_mult weights, fine symbols should
+-- still be checked after the reject action cannot change
+
+rspamd_config:register_symbol({
+  type = 'prefilter',
+  name = 'EE_SETTINGS',
+  callback = function(task)
+    task:set_settings({
+      early_exit = not task:get_request_header('X-Early-Exit'),
+      actions = {
+        reject = 10,
+      }
+    })
+  end
+})
+
+rspamd_config:register_symbol({
+  name = 'EE_HIGH',
+  priority = 10,
+  callback = function(task)
+    return true
+  end
+})
+rspamd_config:set_metric_symbol({
+  name = 'EE_HIGH',
+  score = 100.0,
+  one_shot = true
+})
+
+rspamd_config:register_symbol({
+  name = 'EE_NEG',
+  callback = function(task)
+    return true, 15.0
+  end
+})
+rspamd_config:set_metric_symbol({
+  name = 'EE_NEG',
+  score = -1.0,
+  one_shot = true
+})
+
+rspamd_config:register_symbol({
+  name = 'EE_FINE',
+  flags = 'fine',
+  callback = function(task)
+    return true
+  end
+})
+rspamd_config:set_metric_symbol({
+  name = 'EE_FINE',
+  score = -0.1,
+  one_shot = true
+})
@@ -0,0 +1,27 @@
+-- Symbol that makes the reject action final from the very beginning, so
+-- network checks of the stock config should not be planned
+
+rspamd_config:register_symbol({
+  type = 'prefilter',
+  name = 'EE_STOCK_SETTINGS',
+  callback = function(task)
+    if task:get_request_header('X-Early-Exit') then
+      task:set_settings({
+        early_exit = false,
+      })
+    end
+  end
+})
+
+rspamd_config:register_symbol({
+  name = 'EE_STOCK_SPAM',
+  priority = 10,
+  callback = function(task)
+    return true
+  end
+})
+rspamd_config:set_metric_symbol({
+  name = 'EE_STOCK_SPAM',
+  score = 10000.0,
+  one_shot = true
+})
@@ -0,0 +1,8 @@
+-- Loads stock html rules that check parents of image tags
+if not config['regexp'] then
+  config['regexp'] = {}
+end
+
+local rules_dir = string.gsub(debug.getinfo(1).source, "^@(.+/)[^/]+$", "%1") ..
+  '../../../rules/'
+dofile(rules_dir .. 'html.lua')
@@ -0,0 +1,29 @@
+-- Checks that message checksum is built from digests of all mime parts
+local rspamd_cryptobox_hash = require "rspamd_cryptobox_hash"
+
+rspamd_config:register_symbol({
+  name = 'MIME_DIGEST',
+  score = 1.0,
+  callback = function(task)
+    local h = rspamd_cryptobox_hash.create()
+
+    for _,p in ipairs(task:get_parts()) do
+      local digest = p:get_digest():gsub('..', function(c)
+        return string.char(tonumber(c, 16))
+      end)
+      h:update(digest)
+
+      -- Length of the part is known before its content is decoded
+      local len = p:get_length()
+      if len ~= #p:get_content() then
+        return true, 'length mismatch'
+      end
+    end
+
+    if string.sub(h:hex(), 1, 32) == task:get_digest() then
+      return true, 'matched'
+    end
+
+    return true, 'mismatch'
+  end
+})
@@ -50,6 +50,28 @@ context("URL check functions", function()
     pool:destroy()
   end)
 
+  test("Extract urls from long texts", function()
+    local pool = mpool.create()
+    local pad = string.rep("word ", 100)
+    local cases = {
+      {pad .. "test.com" .. pad, "test.com"},
+      {"end. " .. pad .. "http://test.com/path " .. pad, "test.com"},
+      {pad .. pad .. "mailto:user@test.com", "test.com"},
+    }
+
+    for _,c in ipairs(cases) do
+      local res = url.create(pool, c[1])
+
+      assert_not_nil(res, "cannot parse " .. c[1])
+      local t = res:to_table()
+      assert_equal(c[2], t['host'])
+    end
+
+    assert_nil(url.create(pool, pad .. "http://example.unknowntld/" .. pad))
+    assert_nil(url.create(pool, pad .. pad))
+    pool:destroy()
+  end)
+
   -- Some cases from https://code.google.com/p/google-url/source/browse/trunk/src/url_canon_unittest.cc
   test("Parse urls", function()
     local pool = mpool.create()
@@ -0,0 +1,474 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "fuzzy_backend.h"
+#include "fuzzy_backend_sqlite.h"
+#include "tests.h"
+#include "unix-std.h"
+
+extern struct event_base *base;
+
+static const gint64 expire = 86400;
+/* Enough records in the journal to trigger compaction */
+static const guint nbulk = 2048;
+
+static void
+rspamd_fuzzy_test_make_cmd (struct rspamd_fuzzy_shingle_cmd *cmd, guint8 c,
+		guint nmatched)
+{
+	guint i;
+
+	memset (cmd, 0, sizeof (*cmd));
+	cmd->basic.version = RSPAMD_FUZZY_VERSION;
+	cmd->basic.cmd = FUZZY_WRITE;
+	cmd->basic.shingles_count = RSPAMD_SHINGLE_SIZE;
+	cmd->basic.flag = 1;
+	cmd->basic.value = 1;
+	memset (cmd->basic.digest, c, sizeof (cmd->basic.digest));
+
+	/* First `nmatched` shingles are the same as for the learned digest */
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		cmd->sgl.hashes[i] = i < nmatched ? 0xdeadbeefULL + i :
+				0xbadcafeULL + ((guint64)c << 8) + i;
+	}
+}
+
+static struct rspamd_fuzzy_reply
+rspamd_fuzzy_test_check (struct rspamd_fuzzy_backend_sqlite *backend,
+		guint8 c, guint nmatched)
+{
+	struct rspamd_fuzzy_shingle_cmd cmd;
+
+	rspamd_fuzzy_test_make_cmd (&cmd, c, nmatched);
+	cmd.basic.cmd = FUZZY_CHECK;
+
+	return rspamd_fuzzy_backend_sqlite_check (backend,
+			(const struct rspamd_fuzzy_cmd *)&cmd, expire);
+}
+
+static void
+rspamd_fuzzy_sqlite_test (void)
+{
+	struct rspamd_fuzzy_backend_sqlite *backend;
+	struct rspamd_fuzzy_shingle_cmd cmd;
+	struct rspamd_fuzzy_reply rep;
+	GError *err = NULL;
+	gchar path[PATH_MAX];
+	gint fd;
+
+	rspamd_snprintf (path, sizeof (path), "/tmp/fuzzy-test-XXXXXX");
+	g_assert ((fd = mkstemp (path)) != -1);
+	close (fd);
+
+	backend = rspamd_fuzzy_backend_sqlite_open (path, FALSE, &err);
+	g_assert (backend != NULL);
+
+	rspamd_fuzzy_test_make_cmd (&cmd, 'a', RSPAMD_SHINGLE_SIZE);
+	g_assert (rspamd_fuzzy_backend_sqlite_prepare_update (backend, "test"));
+	g_assert (rspamd_fuzzy_backend_sqlite_add (backend,
+			(const struct rspamd_fuzzy_cmd *)&cmd));
+	g_assert (rspamd_fuzzy_backend_sqlite_finish_update (backend, "test",
+			TRUE));
+
+	/* Exact match */
+	rep = rspamd_fuzzy_test_check (backend, 'a', RSPAMD_SHINGLE_SIZE);
+	g_assert (rep.prob == 1.0);
+	g_assert (rep.value == 1);
+	g_assert (rep.flag == 1);
+
+	/* 18 of 32 shingles is the minimal fuzzy match */
+	rep = rspamd_fuzzy_test_check (backend, 'b', 18);
+	g_assert (rep.prob > 0.5);
+	g_assert (rep.value == 1);
+	g_assert (rep.flag == 1);
+
+	/* 17 of 32 shingles is not enough */
+	rep = rspamd_fuzzy_test_check (backend, 'c', 17);
+	g_assert (rep.prob <= 0.5);
+	g_assert (rep.value == 0);
+
+	rspamd_fuzzy_backend_sqlite_close (backend);
+	unlink (path);
+}
+
+static struct rspamd_fuzzy_backend *
+rspamd_fuzzy_test_memory_open (const gchar *path, gdouble exp)
+{
+	struct rspamd_fuzzy_backend *bk;
+	ucl_object_t *obj;
+	GError *err = NULL;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromstring ("memory"),
+			"backend", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromstring (path),
+			"hashfile", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (exp),
+			"expire", 0, false);
+	ucl_object_insert_key (obj, ucl_object_frombool (false),
+			"fsync", 0, false);
+
+	bk = rspamd_fuzzy_backend_create (base, obj, NULL, &err);
+	ucl_object_unref (obj);
+
+	if (bk == NULL) {
+		msg_err ("cannot open memory backend: %e", err);
+		g_error_free (err);
+	}
+
+	g_assert (bk != NULL);
+
+	return bk;
+}
+
+static void
+rspamd_fuzzy_test_memory_update_cb (gboolean success, void *ud)
+{
+	gboolean *res = ud;
+
+	*res = success;
+}
+
+static void
+rspamd_fuzzy_test_memory_check_cb (struct rspamd_fuzzy_reply *rep, void *ud)
+{
+	struct rspamd_fuzzy_reply *res = ud;
+
+	memcpy (res, rep, sizeof (*res));
+}
+
+static void
+rspamd_fuzzy_test_memory_count_cb (guint64 count, void *ud)
+{
+	guint64 *res = ud;
+
+	*res = count;
+}
+
+static void
+rspamd_fuzzy_test_memory_update (struct rspamd_fuzzy_backend *bk,
+		struct fuzzy_peer_cmd *cmds, guint ncmds)
+{
+	GQueue updates = G_QUEUE_INIT;
+	gboolean success = FALSE;
+	guint i;
+
+	for (i = 0; i < ncmds; i ++) {
+		g_queue_push_tail (&updates, &cmds[i]);
+	}
+
+	rspamd_fuzzy_backend_process_updates (bk, &updates, "test",
+			rspamd_fuzzy_test_memory_update_cb, &success);
+	g_queue_clear (&updates);
+	g_assert (success);
+}
+
+static void
+rspamd_fuzzy_test_memory_learn (struct rspamd_fuzzy_backend *bk,
+		guint8 c, guint nmatched, guint8 op)
+{
+	struct fuzzy_peer_cmd io_cmd;
+
+	memset (&io_cmd, 0, sizeof (io_cmd));
+	io_cmd.is_shingle = TRUE;
+	rspamd_fuzzy_test_make_cmd (&io_cmd.cmd.shingle, c, nmatched);
+	io_cmd.cmd.shingle.basic.cmd = op;
+	rspamd_fuzzy_test_memory_update (bk, &io_cmd, 1);
+}
+
+static struct rspamd_fuzzy_reply
+rspamd_fuzzy_test_memory_check_cmd (struct rspamd_fuzzy_backend *bk,
+		struct rspamd_fuzzy_shingle_cmd *cmd)
+{
+	struct rspamd_fuzzy_reply rep;
+
+	memset (&rep, 0, sizeof (rep));
+	rep.value = -1;
+	cmd->basic.cmd = FUZZY_CHECK;
+	rspamd_fuzzy_backend_check (bk, (const struct rspamd_fuzzy_cmd *)cmd,
+			rspamd_fuzzy_test_memory_check_cb, &rep);
+	/* Memory backend replies immediately */
+	g_assert (rep.value != -1);
+
+	return rep;
+}
+
+static struct rspamd_fuzzy_reply
+rspamd_fuzzy_test_memory_check (struct rspamd_fuzzy_backend *bk,
+		guint8 c, guint nmatched)
+{
+	struct rspamd_fuzzy_shingle_cmd cmd;
+
+	rspamd_fuzzy_test_make_cmd (&cmd, c, nmatched);
+
+	return rspamd_fuzzy_test_memory_check_cmd (bk, &cmd);
+}
+
+static guint64
+rspamd_fuzzy_test_memory_count (struct rspamd_fuzzy_backend *bk)
+{
+	guint64 count = G_MAXUINT64;
+
+	rspamd_fuzzy_backend_count (bk, rspamd_fuzzy_test_memory_count_cb, &count);
+	g_assert (count != G_MAXUINT64);
+
+	return count;
+}
+
+/* Digests that differ in the bytes used for sharding and hashing */
+static void
+rspamd_fuzzy_test_bulk_digest (guchar *digest, guint32 n)
+{
+	memset (digest, 0, rspamd_cryptobox_HASHBYTES);
+	memcpy (digest, &n, sizeof (n));
+	memcpy (digest + sizeof (guint64), &n, sizeof (n));
+}
+
+static void
+rspamd_fuzzy_test_memory_basic (const gchar *path)
+{
+	struct rspamd_fuzzy_backend *bk;
+	struct rspamd_fuzzy_shingle_cmd cmd;
+	struct rspamd_fuzzy_reply rep;
+
+	bk = rspamd_fuzzy_test_memory_open (path, expire);
+
+	rspamd_fuzzy_test_memory_learn (bk, 'a', RSPAMD_SHINGLE_SIZE, FUZZY_WRITE);
+	g_assert (rspamd_fuzzy_test_memory_count (bk) == 1);
+
+	rep = rspamd_fuzzy_test_memory_check (bk, 'a', RSPAMD_SHINGLE_SIZE);
+	g_assert (rep.prob == 1.0);
+	g_assert (rep.value == 1);
+	g_assert (rep.flag == 1);
+
+	/* Learning the same digest again increases its weight */
+	rspamd_fuzzy_test_memory_learn (bk, 'a', RSPAMD_SHINGLE_SIZE, FUZZY_WRITE);
+	g_assert (rspamd_fuzzy_test_memory_count (bk) == 1);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'a', RSPAMD_SHINGLE_SIZE);
+	g_assert (rep.value == 2);
+
+	/* 18 of 32 shingles is the minimal fuzzy match */
+	rep = rspamd_fuzzy_test_memory_check (bk, 'b', 18);
+	g_assert (rep.prob > 0.5);
+	g_assert (rep.value == 2);
+	g_assert (rep.flag == 1);
+
+	/* 17 of 32 shingles is not enough */
+	rep = rspamd_fuzzy_test_memory_check (bk, 'c', 17);
+	g_assert (rep.prob <= 0.5);
+	g_assert (rep.value == 0);
+
+	rspamd_fuzzy_test_memory_learn (bk, 'a', 0, FUZZY_DEL);
+	g_assert (rspamd_fuzzy_test_memory_count (bk) == 0);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'a', RSPAMD_SHINGLE_SIZE);
+	g_assert (rep.value == 0);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'b', 18);
+	g_assert (rep.value == 0);
+
+	/* Digest learned again with other shingles starts from scratch */
+	rspamd_fuzzy_test_memory_learn (bk, 'a', 0, FUZZY_WRITE);
+	g_assert (rspamd_fuzzy_test_memory_count (bk) == 1);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'a', 0);
+	g_assert (rep.prob == 1.0);
+	g_assert (rep.value == 1);
+
+	/* Shingles of the deleted digest must not match the new one */
+	rep = rspamd_fuzzy_test_memory_check (bk, 'b', RSPAMD_SHINGLE_SIZE);
+	g_assert (rep.value == 0);
+
+	rspamd_fuzzy_test_make_cmd (&cmd, 'a', 0);
+	memset (cmd.basic.digest, 'e', sizeof (cmd.basic.digest));
+	rep = rspamd_fuzzy_test_memory_check_cmd (bk, &cmd);
+	g_assert (rep.prob > 0.5);
+	g_assert (rep.value == 1);
+
+	rspamd_fuzzy_backend_close (bk);
+}
+
+static void
+rspamd_fuzzy_test_memory_expire (const gchar *path)
+{
+	struct rspamd_fuzzy_backend *bk;
+	struct rspamd_fuzzy_reply rep;
+
+	/* Everything is expired immediately */
+	bk = rspamd_fuzzy_test_memory_open (path, -1);
+
+	rspamd_fuzzy_test_memory_learn (bk, 'a', RSPAMD_SHINGLE_SIZE, FUZZY_WRITE);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'a', RSPAMD_SHINGLE_SIZE);
+	g_assert (rep.value == 0);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'b', RSPAMD_SHINGLE_SIZE);
+	g_assert (rep.value == 0);
+	g_assert (rspamd_fuzzy_test_memory_count (bk) == 1);
+
+	/* Expire pass is executed on start */
+	rspamd_fuzzy_backend_start_update (bk, 3600.0, NULL, NULL);
+	g_assert (rspamd_fuzzy_test_memory_count (bk) == 0);
+
+	rspamd_fuzzy_backend_close (bk);
+}
+
+static void
+rspamd_fuzzy_test_memory_journal (const gchar *path)
+{
+	struct rspamd_fuzzy_backend *bk;
+	struct rspamd_fuzzy_reply rep;
+	guchar garbage[100];
+	gchar *journal;
+	gint fd;
+
+	bk = rspamd_fuzzy_test_memory_open (path, expire);
+	rspamd_fuzzy_test_memory_learn (bk, 'a', RSPAMD_SHINGLE_SIZE, FUZZY_WRITE);
+	rspamd_fuzzy_test_memory_learn (bk, 'b', 0, FUZZY_WRITE);
+	rspamd_fuzzy_test_memory_learn (bk, 'b', 0, FUZZY_DEL);
+	rspamd_fuzzy_test_memory_learn (bk, 'c', 0, FUZZY_WRITE);
+	rspamd_fuzzy_backend_close (bk);
+
+	/* Journal is replayed on open */
+	bk = rspamd_fuzzy_test_memory_open (path, expire);
+	g_assert (rspamd_fuzzy_test_memory_count (bk) == 2);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'a', RSPAMD_SHINGLE_SIZE);
+	g_assert (rep.prob == 1.0);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'd', 18);
+	g_assert (rep.prob > 0.5);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'b', 0);
+	g_assert (rep.value == 0);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'c', 0);
+	g_assert (rep.prob == 1.0);
+	rspamd_fuzzy_backend_close (bk);
+
+	/* Emulate writer that has crashed in the middle of a record */
+	journal = g_strconcat (path, ".journal", NULL);
+	fd = open (journal, O_WRONLY | O_APPEND);
+	g_assert (fd != -1);
+	memset (garbage, 0xff, sizeof (garbage));
+	g_assert (write (fd, garbage, sizeof (garbage)) == sizeof (garbage));
+	close (fd);
+	g_free (journal);
+
+	bk = rspamd_fuzzy_test_memory_open (path, expire);
+	g_assert (rspamd_fuzzy_test_memory_count (bk) == 2);
+
+	/* Records appended after the dropped tail are aligned */
+	rspamd_fuzzy_test_memory_learn (bk, 'f', 0, FUZZY_WRITE);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'f', 0);
+	g_assert (rep.prob == 1.0);
+	rspamd_fuzzy_backend_close (bk);
+
+	bk = rspamd_fuzzy_test_memory_open (path, expire);
+	g_assert (rspamd_fuzzy_test_memory_count (bk) == 3);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'f', 0);
+	g_assert (rep.prob == 1.0);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'a', RSPAMD_SHINGLE_SIZE);
+	g_assert (rep.prob == 1.0);
+	rspamd_fuzzy_backend_close (bk);
+}
+
+static void
+rspamd_fuzzy_test_memory_snapshot (const gchar *path)
+{
+	struct rspamd_fuzzy_backend *bk;
+	struct rspamd_fuzzy_shingle_cmd cmd;
+	struct rspamd_fuzzy_reply rep;
+	struct fuzzy_peer_cmd *cmds;
+	struct stat st;
+	guint i;
+
+	bk = rspamd_fuzzy_test_memory_open (path, expire);
+	cmds = g_malloc0 (nbulk * sizeof (*cmds));
+
+	for (i = 0; i < nbulk; i ++) {
+		cmds[i].cmd.normal.version = RSPAMD_FUZZY_VERSION;
+		cmds[i].cmd.normal.cmd = FUZZY_WRITE;
+		cmds[i].cmd.normal.flag = 2;
+		cmds[i].cmd.normal.value = 1;
+		rspamd_fuzzy_test_bulk_digest ((guchar *)cmds[i].cmd.normal.digest, i);
+	}
+
+	rspamd_fuzzy_test_memory_update (bk, cmds, nbulk);
+	rspamd_fuzzy_test_memory_learn (bk, 'a', RSPAMD_SHINGLE_SIZE, FUZZY_WRITE);
+	g_free (cmds);
+
+	/* Long journal is compacted to a snapshot */
+	g_assert (stat (path, &st) == -1);
+	rspamd_fuzzy_backend_start_update (bk, 3600.0, NULL, NULL);
+	g_assert (stat (path, &st) != -1);
+	g_assert (rspamd_fuzzy_test_memory_count (bk) == nbulk + 1);
+
+	/* These go to the new journal */
+	rspamd_fuzzy_test_memory_learn (bk, 'b', 0, FUZZY_WRITE);
+	rspamd_fuzzy_test_memory_learn (bk, 'a', 0, FUZZY_DEL);
+	rspamd_fuzzy_backend_close (bk);
+
+	/* Snapshot is loaded and then the journal is replayed */
+	bk = rspamd_fuzzy_test_memory_open (path, expire);
+	g_assert (rspamd_fuzzy_test_memory_count (bk) == nbulk + 1);
+	rspamd_fuzzy_test_make_cmd (&cmd, 0, 0);
+
+	for (i = 0; i < nbulk; i ++) {
+		rspamd_fuzzy_test_bulk_digest ((guchar *)cmd.basic.digest, i);
+		rep = rspamd_fuzzy_test_memory_check_cmd (bk, &cmd);
+		g_assert (rep.prob == 1.0);
+		g_assert (rep.flag == 2);
+	}
+
+	rep = rspamd_fuzzy_test_memory_check (bk, 'b', 0);
+	g_assert (rep.prob == 1.0);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'a', RSPAMD_SHINGLE_SIZE);
+	g_assert (rep.value == 0);
+	rep = rspamd_fuzzy_test_memory_check (bk, 'd', 18);
+	g_assert (rep.value == 0);
+
+	rspamd_fuzzy_backend_close (bk);
+}
+
+static void
+rspamd_fuzzy_memory_test (void)
+{
+	void (*tests[]) (const gchar *) = {
+		rspamd_fuzzy_test_memory_basic,
+		rspamd_fuzzy_test_memory_expire,
+		rspamd_fuzzy_test_memory_journal,
+		rspamd_fuzzy_test_memory_snapshot,
+	};
+	const gchar *suffixes[] = {"", ".journal", ".lock", ".new"};
+	gchar dir[PATH_MAX], path[PATH_MAX], fname[PATH_MAX];
+	guint i, j;
+
+	rspamd_snprintf (dir, sizeof (dir), "/tmp/fuzzy-test-XXXXXX");
+	g_assert (mkdtemp (dir) != NULL);
+	rspamd_snprintf (path, sizeof (path), "%s/fuzzy.db", dir);
+
+	for (i = 0; i < G_N_ELEMENTS (tests); i ++) {
+		tests[i] (path);
+
+		for (j = 0; j < G_N_ELEMENTS (suffixes); j ++) {
+			rspamd_snprintf (fname, sizeof (fname), "%s%s", path, suffixes[j]);
+			unlink (fname);
+		}
+	}
+
+	rmdir (dir);
+}
+
+void
+rspamd_fuzzy_backend_test_func (void)
+{
+	rspamd_fuzzy_sqlite_test ();
+	rspamd_fuzzy_memory_test ();
+}
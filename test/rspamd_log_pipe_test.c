@@ -0,0 +1,211 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "log_pipe.h"
+#include "tests.h"
+
+/* Records are read to aligned buffers */
+static guint64 recbuf[64];
+
+static struct rspamd_log_pipe_record *
+rspamd_log_pipe_test_make (guint extra_hdr, guint nsymbols)
+{
+	struct rspamd_log_pipe_record *rec = (struct rspamd_log_pipe_record *)recbuf;
+
+	memset (recbuf, 0, sizeof (recbuf));
+	rec->magic = RSPAMD_LOG_PIPE_MAGIC;
+	rec->version = RSPAMD_LOG_PIPE_VERSION;
+	rec->hdr_len = sizeof (*rec) + extra_hdr;
+	rec->nsymbols = nsymbols;
+	rec->len = rec->hdr_len + nsymbols * sizeof (struct rspamd_log_pipe_symbol);
+
+	g_assert (rec->len <= sizeof (recbuf));
+
+	return rec;
+}
+
+static struct rspamd_log_pipe_symbol *
+rspamd_log_pipe_test_symbols (struct rspamd_log_pipe_record *rec)
+{
+	return (struct rspamd_log_pipe_symbol *)(((guchar *)rec) + rec->hdr_len);
+}
+
+static gboolean
+rspamd_log_pipe_test_valid (gsize len)
+{
+	GError *err = NULL;
+	const struct rspamd_log_pipe_record *rec;
+
+	rec = rspamd_log_pipe_record_check ((const guchar *)recbuf, len, &err);
+
+	if (rec == NULL) {
+		g_assert (err != NULL);
+		g_error_free (err);
+
+		return FALSE;
+	}
+
+	g_assert (err == NULL);
+	g_assert ((gconstpointer)rec == (gconstpointer)recbuf);
+
+	return TRUE;
+}
+
+static void
+rspamd_log_pipe_test_check (void)
+{
+	struct rspamd_log_pipe_record *rec;
+	const struct rspamd_log_pipe_symbol *syms;
+
+	rec = rspamd_log_pipe_test_make (0, 1);
+	g_assert (rspamd_log_pipe_test_valid (rec->len));
+
+	/* Datagram is larger than the record */
+	g_assert (rspamd_log_pipe_test_valid (rec->len + 8));
+
+	/* Short records */
+	g_assert (!rspamd_log_pipe_test_valid (sizeof (*rec) - 1));
+	g_assert (!rspamd_log_pipe_test_valid (rec->len - 1));
+
+	rec->magic = 0xdeadbeef;
+	g_assert (!rspamd_log_pipe_test_valid (rec->len));
+
+	rec = rspamd_log_pipe_test_make (0, 1);
+	rec->version = RSPAMD_LOG_PIPE_VERSION + 1;
+	g_assert (!rspamd_log_pipe_test_valid (rec->len));
+
+	/* Number of symbols does not match length */
+	rec = rspamd_log_pipe_test_make (0, 2);
+	rec->nsymbols = 3;
+	g_assert (!rspamd_log_pipe_test_valid (sizeof (recbuf)));
+	rec->nsymbols = 1;
+	g_assert (!rspamd_log_pipe_test_valid (sizeof (recbuf)));
+
+	/* Header is shorter than known fields or misaligned */
+	rec = rspamd_log_pipe_test_make (0, 0);
+	rec->hdr_len = sizeof (*rec) - sizeof (gdouble);
+	g_assert (!rspamd_log_pipe_test_valid (rec->len));
+	rec = rspamd_log_pipe_test_make (4, 0);
+	g_assert (!rspamd_log_pipe_test_valid (rec->len));
+
+	/* Header with unknown fields appended by a newer version */
+	rec = rspamd_log_pipe_test_make (2 * sizeof (gdouble), 2);
+	memset (((guchar *)rec) + sizeof (*rec), 0xff, 2 * sizeof (gdouble));
+	rspamd_log_pipe_test_symbols (rec)[0].id = 1;
+	rspamd_log_pipe_test_symbols (rec)[0].score = 1.5;
+	rspamd_log_pipe_test_symbols (rec)[1].id = 2;
+	rspamd_log_pipe_test_symbols (rec)[1].score = -2.0;
+	g_assert (rspamd_log_pipe_test_valid (rec->len));
+
+	syms = rspamd_log_pipe_record_symbols (rec);
+	g_assert (syms[0].id == 1);
+	g_assert (syms[0].score == 1.5);
+	g_assert (syms[1].id == 2);
+	g_assert (syms[1].score == -2.0);
+}
+
+static void
+rspamd_log_pipe_test_stat (void)
+{
+	struct rspamd_log_pipe_stat *st;
+	struct rspamd_log_pipe_record *rec;
+	struct rspamd_log_pipe_symbol *syms;
+	ucl_object_t *top;
+	const ucl_object_t *elt, *sym;
+
+	st = rspamd_log_pipe_stat_new ();
+
+	rec = rspamd_log_pipe_test_make (0, 2);
+	rec->action = METRIC_ACTION_REJECT;
+	rec->score = 10.0;
+	rec->time_real = 0.5;
+	rec->message_len = 100;
+	rec->nurls = 3;
+	syms = rspamd_log_pipe_test_symbols (rec);
+	syms[0].id = 1;
+	syms[0].score = 5.0;
+	syms[1].id = 2;
+	syms[1].score = 5.0;
+	rspamd_log_pipe_stat_add (st, rec);
+
+	/* Unknown action is accounted as no action */
+	rec = rspamd_log_pipe_test_make (sizeof (gdouble), 2);
+	rec->action = METRIC_ACTION_MAX + 10;
+	rec->score = 0.0;
+	rec->time_real = 1.5;
+	rec->message_len = 300;
+	rec->nurls = 1;
+	syms = rspamd_log_pipe_test_symbols (rec);
+	syms[0].id = 1;
+	syms[0].score = 1.0;
+	syms[1].id = RSPAMD_LOG_PIPE_UNKNOWN_SYMBOL;
+	syms[1].score = 1.0;
+	rspamd_log_pipe_stat_add (st, rec);
+
+	g_assert (rspamd_log_pipe_stat_count (st) == 2);
+	top = rspamd_log_pipe_stat_ucl (st, NULL);
+
+	g_assert (ucl_object_toint (ucl_object_lookup (top, "scanned")) == 2);
+	elt = ucl_object_lookup (top, "actions");
+	g_assert (ucl_object_toint (ucl_object_lookup (elt, "reject")) == 1);
+	g_assert (ucl_object_toint (ucl_object_lookup (elt, "no action")) == 1);
+	g_assert (ucl_object_lookup (elt, "greylist") == NULL);
+
+	g_assert (ucl_object_todouble (ucl_object_lookup (top, "avg_score")) == 5.0);
+	g_assert (ucl_object_todouble (ucl_object_lookup (top,
+			"avg_time_real")) == 1.0);
+	g_assert (ucl_object_todouble (ucl_object_lookup (top,
+			"max_time_real")) == 1.5);
+	elt = ucl_object_lookup (top, "avg_sizes");
+	g_assert (ucl_object_todouble (ucl_object_lookup (elt,
+			"message_len")) == 200.0);
+	g_assert (ucl_object_todouble (ucl_object_lookup (elt, "urls")) == 2.0);
+
+	elt = ucl_object_lookup (top, "symbols");
+	g_assert (ucl_object_lookup (elt, "0") == NULL);
+	sym = ucl_object_lookup (elt, "1");
+	g_assert (sym != NULL);
+	g_assert (ucl_object_toint (ucl_object_lookup (sym, "hits")) == 2);
+	g_assert (ucl_object_todouble (ucl_object_lookup (sym, "frequency")) == 1.0);
+	g_assert (ucl_object_todouble (ucl_object_lookup (sym, "avg_score")) == 3.0);
+	g_assert (ucl_object_toint (ucl_object_lookup (
+			ucl_object_lookup (sym, "actions"), "reject")) == 1);
+	sym = ucl_object_lookup (elt, "2");
+	g_assert (sym != NULL);
+	g_assert (ucl_object_toint (ucl_object_lookup (sym, "hits")) == 1);
+	g_assert (ucl_object_todouble (ucl_object_lookup (sym, "frequency")) == 0.5);
+	g_assert (ucl_object_toint (ucl_object_lookup (top,
+			"unknown_symbols")) == 1);
+	ucl_object_unref (top);
+
+	rspamd_log_pipe_stat_reset (st);
+	g_assert (rspamd_log_pipe_stat_count (st) == 0);
+	top = rspamd_log_pipe_stat_ucl (st, NULL);
+	g_assert (ucl_object_lookup (top, "avg_score") == NULL);
+	g_assert (ucl_object_lookup (ucl_object_lookup (top, "symbols"), "1") == NULL);
+	ucl_object_unref (top);
+
+	rspamd_log_pipe_stat_destroy (st);
+}
+
+void
+rspamd_log_pipe_test_func (void)
+{
+	rspamd_log_pipe_test_check ();
+	rspamd_log_pipe_test_stat ();
+}
@@ -0,0 +1,293 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "hash.h"
+#include "tests.h"
+
+static const guint niter = 10000;
+static GArray *destroyed = NULL;
+
+static void
+rspamd_lru_test_destroy (gpointer p)
+{
+	guint v = GPOINTER_TO_UINT (p);
+
+	g_array_append_val (destroyed, v);
+}
+
+/* Makes all keys collide to check probing and deletion */
+static guint
+rspamd_lru_test_const_hash (gconstpointer p)
+{
+	return 42;
+}
+
+static gboolean
+rspamd_lru_test_contains (rspamd_lru_hash_t *hash, guint key)
+{
+	gpointer k;
+	gint it = 0;
+
+	/* Unlike lookup, iteration does not touch reference bits */
+	while ((it = rspamd_lru_hash_foreach (hash, it, &k, NULL)) != -1) {
+		if (GPOINTER_TO_UINT (k) == key) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static rspamd_lru_hash_t *
+rspamd_lru_test_new (gint maxsize, GHashFunc hfunc)
+{
+	g_array_set_size (destroyed, 0);
+
+	return rspamd_lru_hash_new_full (maxsize, NULL, rspamd_lru_test_destroy,
+			hfunc, g_direct_equal);
+}
+
+static void
+rspamd_lru_test_eviction (void)
+{
+	rspamd_lru_hash_t *hash;
+	struct rspamd_lru_hash_stat st;
+	guint i;
+
+	hash = rspamd_lru_test_new (4, g_direct_hash);
+
+	for (i = 1; i <= 4; i ++) {
+		rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (i),
+				GUINT_TO_POINTER (i), 0, 0);
+	}
+
+	g_assert (rspamd_lru_hash_size (hash) == 4);
+	g_assert (rspamd_lru_hash_capacity (hash) == 4);
+
+	/* Referenced elements get the second chance */
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (1), 0) != NULL);
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (3), 0) != NULL);
+
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (5),
+			GUINT_TO_POINTER (5), 0, 0);
+	g_assert (destroyed->len == 1);
+	g_assert (g_array_index (destroyed, guint, 0) == 2);
+
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (6),
+			GUINT_TO_POINTER (6), 0, 0);
+	g_assert (destroyed->len == 2);
+	g_assert (g_array_index (destroyed, guint, 1) == 4);
+
+	/* Reference bits have been cleared by the previous sweeps */
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (7),
+			GUINT_TO_POINTER (7), 0, 0);
+	g_assert (destroyed->len == 3);
+	g_assert (g_array_index (destroyed, guint, 2) == 1);
+
+	g_assert (rspamd_lru_hash_size (hash) == 4);
+	g_assert (rspamd_lru_test_contains (hash, 3));
+	g_assert (rspamd_lru_test_contains (hash, 5));
+	g_assert (rspamd_lru_test_contains (hash, 6));
+	g_assert (rspamd_lru_test_contains (hash, 7));
+
+	rspamd_lru_hash_get_stat (hash, &st);
+	g_assert (st.evictions == 3);
+	g_assert (st.expired == 0);
+	g_assert (st.hits == 2);
+
+	rspamd_lru_hash_destroy (hash);
+	g_assert (destroyed->len == 7);
+}
+
+static void
+rspamd_lru_test_expire (void)
+{
+	rspamd_lru_hash_t *hash;
+	struct rspamd_lru_hash_stat st;
+
+	hash = rspamd_lru_test_new (2, g_direct_hash);
+
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (1),
+			GUINT_TO_POINTER (1), 100, 10);
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (1), 110) != NULL);
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (1), 111) == NULL);
+	g_assert (rspamd_lru_hash_size (hash) == 0);
+	g_assert (destroyed->len == 1);
+
+	rspamd_lru_hash_get_stat (hash, &st);
+	g_assert (st.expired == 1);
+	g_assert (st.hits == 1);
+	g_assert (st.misses == 1);
+
+	/* Expired elements are evicted even if they are referenced */
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (2),
+			GUINT_TO_POINTER (2), 100, 0);
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (3),
+			GUINT_TO_POINTER (3), 100, 1);
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (2), 100) != NULL);
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (3), 100) != NULL);
+
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (4),
+			GUINT_TO_POINTER (4), 200, 0);
+	g_assert (destroyed->len == 2);
+	g_assert (g_array_index (destroyed, guint, 1) == 3);
+	g_assert (rspamd_lru_test_contains (hash, 2));
+	g_assert (rspamd_lru_test_contains (hash, 4));
+
+	rspamd_lru_hash_get_stat (hash, &st);
+	g_assert (st.expired == 2);
+	g_assert (st.evictions == 0);
+
+	/* Element with no ttl never expires */
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (2),
+			G_MAXINT32) != NULL);
+
+	rspamd_lru_hash_destroy (hash);
+}
+
+static void
+rspamd_lru_test_delete (void)
+{
+	rspamd_lru_hash_t *hash;
+	guint i;
+
+	/* All elements share the same probe sequence */
+	hash = rspamd_lru_test_new (0, rspamd_lru_test_const_hash);
+
+	for (i = 1; i <= 8; i ++) {
+		rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (i),
+				GUINT_TO_POINTER (i), 0, 0);
+	}
+
+	g_assert (rspamd_lru_hash_remove (hash, GUINT_TO_POINTER (3)));
+	g_assert (!rspamd_lru_hash_remove (hash, GUINT_TO_POINTER (3)));
+	g_assert (rspamd_lru_hash_remove (hash, GUINT_TO_POINTER (1)));
+	g_assert (rspamd_lru_hash_size (hash) == 6);
+	g_assert (destroyed->len == 2);
+
+	/* Elements after the removed ones in the chain are still reachable */
+	for (i = 1; i <= 8; i ++) {
+		if (i == 1 || i == 3) {
+			g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (i),
+					0) == NULL);
+		}
+		else {
+			g_assert (GPOINTER_TO_UINT (rspamd_lru_hash_lookup (hash,
+					GUINT_TO_POINTER (i), 0)) == i);
+		}
+	}
+
+	/* Freed space is reused without growing */
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (3),
+			GUINT_TO_POINTER (33), 0, 0);
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (9),
+			GUINT_TO_POINTER (9), 0, 0);
+	g_assert (rspamd_lru_hash_size (hash) == 8);
+
+	for (i = 2; i <= 9; i ++) {
+		g_assert (GPOINTER_TO_UINT (rspamd_lru_hash_lookup (hash,
+				GUINT_TO_POINTER (i), 0)) == (i == 3 ? 33 : i));
+	}
+
+	/* Replace value of the existing key */
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (9),
+			GUINT_TO_POINTER (99), 0, 0);
+	g_assert (rspamd_lru_hash_size (hash) == 8);
+	g_assert (g_array_index (destroyed, guint, destroyed->len - 1) == 9);
+	g_assert (GPOINTER_TO_UINT (rspamd_lru_hash_lookup (hash,
+			GUINT_TO_POINTER (9), 0)) == 99);
+
+	for (i = 2; i <= 9; i ++) {
+		g_assert (rspamd_lru_hash_remove (hash, GUINT_TO_POINTER (i)));
+	}
+
+	g_assert (rspamd_lru_hash_size (hash) == 0);
+	g_assert (rspamd_lru_hash_foreach (hash, 0, NULL, NULL) == -1);
+
+	rspamd_lru_hash_destroy (hash);
+}
+
+static void
+rspamd_lru_test_resize (void)
+{
+	rspamd_lru_hash_t *hash;
+	struct rspamd_lru_hash_stat st;
+	gpointer k, v;
+	gint it = 0;
+	guint i, cnt = 0;
+
+	/* Unlimited hash grows on demand */
+	hash = rspamd_lru_test_new (0, g_direct_hash);
+
+	for (i = 1; i <= niter; i ++) {
+		rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (i),
+				GUINT_TO_POINTER (i * 2), 0, 0);
+	}
+
+	g_assert (rspamd_lru_hash_size (hash) == niter);
+	g_assert (rspamd_lru_hash_capacity (hash) == 0);
+	g_assert (destroyed->len == 0);
+
+	for (i = 1; i <= niter; i += 2) {
+		g_assert (rspamd_lru_hash_remove (hash, GUINT_TO_POINTER (i)));
+	}
+
+	for (i = 1; i <= niter; i ++) {
+		v = rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (i), 0);
+		g_assert (GPOINTER_TO_UINT (v) == (i % 2 ? 0 : i * 2));
+	}
+
+	while ((it = rspamd_lru_hash_foreach (hash, it, &k, &v)) != -1) {
+		g_assert (GPOINTER_TO_UINT (v) == GPOINTER_TO_UINT (k) * 2);
+		cnt ++;
+	}
+
+	g_assert (cnt == niter / 2);
+	rspamd_lru_hash_destroy (hash);
+
+	/* Limited hash grows up to its capacity and then evicts */
+	hash = rspamd_lru_test_new (100, g_direct_hash);
+
+	for (i = 1; i <= niter; i ++) {
+		rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (i),
+				GUINT_TO_POINTER (i), 0, 0);
+		g_assert (GPOINTER_TO_UINT (rspamd_lru_hash_lookup (hash,
+				GUINT_TO_POINTER (i), 0)) == i);
+	}
+
+	g_assert (rspamd_lru_hash_size (hash) == 100);
+	rspamd_lru_hash_get_stat (hash, &st);
+	g_assert (st.evictions == niter - 100);
+	g_assert (destroyed->len == niter - 100);
+
+	rspamd_lru_hash_destroy (hash);
+}
+
+void
+rspamd_lru_hash_test_func (void)
+{
+	destroyed = g_array_new (FALSE, FALSE, sizeof (guint));
+
+	rspamd_lru_test_eviction ();
+	rspamd_lru_test_expire ();
+	rspamd_lru_test_delete ();
+	rspamd_lru_test_resize ();
+
+	g_array_free (destroyed, TRUE);
+	destroyed = NULL;
+}
@@ -16,7 +16,9 @@ rspamd_mem_pool_test_func ()
 {
 	rspamd_mempool_t *pool;
 	rspamd_mempool_stat_t st;
+	rspamd_mempool_tag_stat_t tags_st[MEMPOOL_TAGS_MAX];
 	char *tmp, *tmp2, *tmp3;
+	guint i, ntags;
 	pid_t pid;
 	int ret;
 
@@ -35,5 +37,31 @@ rspamd_mem_pool_test_func ()
 	
 	rspamd_mempool_delete (pool);
 	rspamd_mempool_stat (&st);
-	
+
+	/* Pools with the same tag should learn the size of the first chain */
+	for (i = 0; i < 32; i ++) {
+		pool = rspamd_mempool_new (1024, "test_learn");
+		tmp = rspamd_mempool_alloc (pool, 100000);
+		memset (tmp, 0, 100000);
+		rspamd_mempool_delete (pool);
+	}
+
+	ntags = rspamd_mempool_tags_stat (tags_st, G_N_ELEMENTS (tags_st));
+	g_assert (ntags > 0);
+
+	for (i = 0; i < ntags; i ++) {
+		if (strcmp (tags_st[i].tagname, "test_learn") == 0) {
+			g_assert (tags_st[i].pools == 32);
+			g_assert (tags_st[i].suggested_size >= 100000);
+			break;
+		}
+	}
+
+	g_assert (i < ntags);
+
+	pool = rspamd_mempool_new (1024, "test_learn");
+	g_assert (pool->pools[RSPAMD_MEMPOOL_NORMAL]->len == 1);
+	tmp = rspamd_mempool_alloc (pool, 100000);
+	g_assert (pool->pools[RSPAMD_MEMPOOL_NORMAL]->len == 1);
+	rspamd_mempool_delete (pool);
 }
@@ -0,0 +1,82 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "pool_hash.h"
+#include "tests.h"
+
+static const guint niter = 10000;
+
+void
+rspamd_pool_hash_test_func (void)
+{
+	rspamd_mempool_t *pool;
+	rspamd_pool_hash_t *hash;
+	rspamd_pool_hash_iter_t it;
+	gchar *key, upper[64];
+	gpointer k, v;
+	guint i, cnt;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+
+	/* Case insensitive string keys, both short and long ones */
+	hash = rspamd_pool_hash_new_strcase (pool, 0);
+
+	for (i = 0; i < niter; i ++) {
+		key = rspamd_mempool_alloc (pool, 64);
+		rspamd_snprintf (key, 64, (i % 2) ? "x-header-%ud" :
+				"very-long-header-name-that-is-not-inlined-%ud", i);
+		rspamd_pool_hash_insert (hash, key, GUINT_TO_POINTER (i + 1));
+	}
+
+	g_assert (rspamd_pool_hash_size (hash) == niter);
+
+	for (i = 0; i < niter; i ++) {
+		rspamd_snprintf (upper, sizeof (upper), (i % 2) ? "X-HEADER-%ud" :
+				"Very-Long-Header-Name-That-Is-Not-Inlined-%ud", i);
+		g_assert (GPOINTER_TO_UINT (
+				rspamd_pool_hash_lookup (hash, upper)) == i + 1);
+	}
+
+	g_assert (rspamd_pool_hash_lookup (hash, "x-header") == NULL);
+
+	/* Replace value for the existing key */
+	rspamd_pool_hash_insert (hash, "X-Header-1", GUINT_TO_POINTER (niter + 1));
+	g_assert (rspamd_pool_hash_size (hash) == niter);
+	g_assert (GPOINTER_TO_UINT (
+			rspamd_pool_hash_lookup (hash, "x-header-1")) == niter + 1);
+
+	/* Generic keys */
+	hash = rspamd_pool_hash_new (pool, g_direct_hash, g_direct_equal, 16);
+
+	for (i = 1; i <= niter; i ++) {
+		rspamd_pool_hash_insert (hash, GUINT_TO_POINTER (i),
+				GUINT_TO_POINTER (i * 2));
+	}
+
+	cnt = 0;
+	rspamd_pool_hash_iter_init (&it, hash);
+
+	while (rspamd_pool_hash_iter_next (&it, &k, &v)) {
+		g_assert (GPOINTER_TO_UINT (v) == GPOINTER_TO_UINT (k) * 2);
+		cnt ++;
+	}
+
+	g_assert (cnt == niter);
+
+	rspamd_mempool_delete (pool);
+}
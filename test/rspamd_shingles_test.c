@@ -37,6 +37,9 @@ algorithm_to_string (enum rspamd_shingle_alg alg)
 	case RSPAMD_SHINGLES_FAST:
 		ret = "fasthash";
 		break;
+	case RSPAMD_SHINGLES_VECTOR:
+		ret = "vector";
+		break;
 	}
 
 	return ret;
@@ -231,7 +234,7 @@ rspamd_shingles_test_func (void)
 	}
 	g_free (sgl);
 
-	for (alg = RSPAMD_SHINGLES_OLD; alg <= RSPAMD_SHINGLES_FAST; alg ++) {
+	for (alg = RSPAMD_SHINGLES_OLD; alg <= RSPAMD_SHINGLES_VECTOR; alg ++) {
 		test_case (200, 10, 0.1, alg);
 		test_case (500, 20, 0.01, alg);
 		test_case (5000, 20, 0.01, alg);
@@ -50,6 +50,10 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func ("/rspamd/cryptobox", rspamd_cryptobox_test_func);
 	g_test_add_func ("/rspamd/heap", rspamd_heap_test_func);
+	g_test_add_func ("/rspamd/pool_hash", rspamd_pool_hash_test_func);
+	g_test_add_func ("/rspamd/fuzzy_backend", rspamd_fuzzy_backend_test_func);
+	g_test_add_func ("/rspamd/lru_hash", rspamd_lru_hash_test_func);
+	g_test_add_func ("/rspamd/log_pipe", rspamd_log_pipe_test_func);
 
 #if 0
 	g_test_add_func ("/rspamd/url", rspamd_url_test_func);
@@ -41,4 +41,12 @@ void rspamd_cryptobox_test_func (void);
 
 void rspamd_heap_test_func (void);
 
+void rspamd_pool_hash_test_func (void);
+
+void rspamd_fuzzy_backend_test_func (void);
+
+void rspamd_lru_hash_test_func (void);
+
+void rspamd_log_pipe_test_func (void);
+
 #endif